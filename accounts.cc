@@ -0,0 +1,517 @@
+// Index of disabled and locked-out accounts. See accounts.h.
+
+#include "accounts.h"
+#include "servers.h"
+#include "hash.h"
+#include "strcase.h"
+
+#include <ldap.h>
+#include <uv.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include <map>
+#include <set>
+#include <vector>
+#include <algorithm>
+
+#define NS_PER_MS 1000000ULL
+
+// userAccountControl ACCOUNTDISABLE
+#define UF_ACCOUNTDISABLE 0x2
+
+// msDS-User-Account-Control-Computed LOCKOUT: lockoutTime is set and the
+// domain's lockout duration has not yet passed.
+#define UF_LOCKOUT 0x10
+
+// Poll a little further back than the last poll, for clock skew between
+// us and the directory.
+#define POLL_OVERLAP_MS 300000
+
+// lockoutTime is a FILETIME: 100 ns ticks since 1601.
+#define FILETIME_UNIX_EPOCH_MS 11644473600000LL
+#define FILETIME_TICKS_PER_MS 10000LL
+
+struct account_entry
+{
+  uint64_t key;
+  int state;
+  int64_t locked_until;   // unix ms; 0 locks until cleared
+  uint32_t owner;         // the entry's number within its load
+};
+
+struct account_index
+{
+  std::vector<uint64_t> keys;                 // sorted; position is the id
+  std::vector<uint8_t> states;                // 2 bits per id
+  std::map<uint64_t, int64_t> locked_until;   // by key, locked ids only
+  std::map<uint64_t, account_entry> recent;   // polled, refused, not in keys
+  std::set<uint64_t> shared;                  // names of several entries
+  uint64_t accounts;
+  uint64_t disabled;
+  uint64_t locked;
+};
+
+static uv_once_t accounts_once = UV_ONCE_INIT;
+static uv_mutex_t accounts_lock;     // config and thread state
+static uv_cond_t accounts_cond;
+static uv_rwlock_t index_lock;       // the index
+
+static account_index *current_index = NULL;
+
+static accounts_config config;
+static bool enabled = false;
+static bool reload = false;          // config changed since the last load
+static bool refresher_running = false;
+static uv_thread_t refresher;
+
+static uint64_t rejected = 0;
+static uint64_t refreshes = 0;
+static uint64_t polls = 0;
+static int64_t last_refresh = 0;
+static int last_error = LDAP_SUCCESS;
+
+static void InitAccounts()
+{
+  uv_mutex_init(&accounts_lock);
+  uv_cond_init(&accounts_cond);
+  uv_rwlock_init(&index_lock);
+}
+
+static int64_t WallClockMs()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+// Lowercases, and reduces DOMAIN\user to user. DNs are only lowercased.
+static uint64_t AccountKey(const char *name)
+{
+  if (strchr(name, '=') == NULL) {
+    const char *slash = strrchr(name, '\\');
+    if (slash != NULL) name = slash + 1;
+  }
+
+  return HashFinish(StrHashFold(HASH_START, name, strlen(name)));
+}
+
+// "YYYYMMDDHHMMSS[.fff]Z" as unix ms, or -1.
+static int64_t ParseGeneralizedTime(const char *value)
+{
+  struct tm tm;
+  memset(&tm, 0, sizeof(tm));
+  if (sscanf(value, "%4d%2d%2d%2d%2d%2d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+             &tm.tm_hour, &tm.tm_min, &tm.tm_sec) < 5) {
+    return -1;
+  }
+  tm.tm_year -= 1900;
+  tm.tm_mon -= 1;
+  return (int64_t)timegm(&tm) * 1000;
+}
+
+static void FormatGeneralizedTime(int64_t ms, char *buffer, size_t size)
+{
+  time_t seconds = ms / 1000;
+  struct tm tm;
+  gmtime_r(&seconds, &tm);
+  strftime(buffer, size, "%Y%m%d%H%M%SZ", &tm);
+}
+
+// Empty if the entry has no such attribute.
+static std::string FirstValue(LDAP *ldap, LDAPMessage *entry, const char *attr)
+{
+  char **values = ldap_get_values(ldap, entry, attr);
+  std::string value = values != NULL && values[0] != NULL ? values[0] : "";
+  ldap_value_free(values);
+  return value;
+}
+
+// Works out an entry's state and adds it under each of its names. The
+// directory does not say when an Active Directory lockout ends, so it is
+// believed until recheck_at (unix ms), by when a poll has read the entry
+// again.
+static void AddEntry(LDAP *ldap, LDAPMessage *entry, const std::vector<std::string> &attributes,
+                     int lockout_duration_ms, int64_t recheck_at, uint32_t owner,
+                     std::vector<account_entry> *entries)
+{
+  account_entry account;
+  account.state = ACCOUNT_ACTIVE;
+  account.locked_until = 0;
+  account.owner = owner;
+
+  std::string control = FirstValue(ldap, entry, "userAccountControl");
+  std::string computed = FirstValue(ldap, entry, "msDS-User-Account-Control-Computed");
+  std::string locked = FirstValue(ldap, entry, "pwdAccountLockedTime");
+
+  if (strtoul(control.c_str(), NULL, 10) & UF_ACCOUNTDISABLE) {
+    account.state = ACCOUNT_DISABLED;
+  } else if (strtoul(computed.c_str(), NULL, 10) & UF_LOCKOUT) {
+    account.state = ACCOUNT_LOCKED;
+    account.locked_until = recheck_at;
+  } else if (!locked.empty()) {
+    account.state = ACCOUNT_LOCKED;
+    // "000001010000Z" is ppolicy's permanent lock.
+    int64_t since = locked.compare(0, 4, "0000") == 0 ? -1 : ParseGeneralizedTime(locked.c_str());
+    if (since > 0 && lockout_duration_ms > 0) {
+      account.locked_until = since + lockout_duration_ms;
+    }
+  }
+
+  char *dn = ldap_get_dn(ldap, entry);
+  if (dn != NULL) {
+    account.key = AccountKey(dn);
+    entries->push_back(account);
+    ldap_memfree(dn);
+  }
+
+  for (size_t idx = 0; idx < attributes.size(); idx++)
+  {
+    char **names = ldap_get_values(ldap, entry, attributes[idx].c_str());
+    for (int name = 0; names != NULL && names[name] != NULL; name++)
+    {
+      account.key = AccountKey(names[name]);
+      entries->push_back(account);
+    }
+    ldap_value_free(names);
+  }
+}
+
+// What Load() needs for each page.
+struct load_state
+{
+  std::vector<std::string> attributes;
+  int lockout_duration_ms;
+  int64_t recheck_at;
+  uint32_t owner;
+  std::vector<account_entry> *entries;
+};
+
+static int AddPage(LDAP *ldap, LDAPMessage *page, void *arg)
+{
+  load_state *state = (load_state*)arg;
+  for (LDAPMessage *entry = ldap_first_entry(ldap, page); entry != NULL; entry = ldap_next_entry(ldap, entry))
+  {
+    AddEntry(ldap, entry, state->attributes, state->lockout_duration_ms, state->recheck_at, state->owner++,
+             state->entries);
+  }
+  return LDAP_SUCCESS;
+}
+
+// Reads every entry matching filter, a page at a time.
+static int Load(const accounts_config &settings, const std::string &filter, std::vector<account_entry> *entries)
+{
+  int rc;
+  LDAP *ldap = ServersConnect(settings.host.c_str(), settings.port, settings.binddn.c_str(),
+                              settings.password.c_str(), &rc);
+  if (ldap == NULL) return rc;
+
+  load_state state;
+  const char *attrs[64];
+  int attr_count = 0;
+  attrs[attr_count++] = "userAccountControl";
+  attrs[attr_count++] = "msDS-User-Account-Control-Computed";
+  attrs[attr_count++] = "pwdAccountLockedTime";
+
+  size_t start = 0;
+  while (start < settings.attributes.size())
+  {
+    size_t end = settings.attributes.find(' ', start);
+    if (end == std::string::npos) end = settings.attributes.size();
+    if (end > start) state.attributes.push_back(settings.attributes.substr(start, end - start));
+    start = end + 1;
+  }
+  for (size_t idx = 0; idx < state.attributes.size() && attr_count < 63; idx++)
+  {
+    attrs[attr_count++] = state.attributes[idx].c_str();
+  }
+  attrs[attr_count] = NULL;
+
+  // Polls read the entries again at the latest by then.
+  int recheck_ms = settings.refresh_interval_ms;
+  if (settings.poll_interval_ms > 0 && settings.poll_interval_ms < recheck_ms) recheck_ms = settings.poll_interval_ms;
+  state.lockout_duration_ms = settings.lockout_duration_ms;
+  state.recheck_at = WallClockMs() + recheck_ms;
+  state.owner = 0;
+  state.entries = entries;
+
+  rc = ServersPagedSearch(ldap, settings.base.c_str(), filter.c_str(), (char**)attrs, AddPage, &state);
+  ldap_unbind_ext(ldap, NULL, NULL);
+  return rc;
+}
+
+// By key, the active entries first: when several accounts share a
+// name, it is only refused if every one of them would be.
+static bool KeyBefore(const account_entry &a, const account_entry &b)
+{
+  if (a.key != b.key) return a.key < b.key;
+  return a.state < b.state;
+}
+
+static account_index *BuildIndex(std::vector<account_entry> *entries)
+{
+  std::stable_sort(entries->begin(), entries->end(), KeyBefore);
+
+  account_index *built = new account_index;
+  built->accounts = built->disabled = built->locked = 0;
+  for (size_t idx = 0; idx < entries->size(); idx++)
+  {
+    const account_entry &entry = (*entries)[idx];
+    if (!built->keys.empty() && built->keys.back() == entry.key) {
+      if ((*entries)[idx - 1].owner != entry.owner) built->shared.insert(entry.key);
+      continue;
+    }
+
+    size_t id = built->keys.size();
+    built->keys.push_back(entry.key);
+    if (id % 4 == 0) built->states.push_back(0);
+    built->states[id / 4] |= entry.state << (id % 4 * 2);
+
+    if (entry.state == ACCOUNT_DISABLED) built->disabled++;
+    if (entry.state == ACCOUNT_LOCKED) {
+      built->locked++;
+      built->locked_until[entry.key] = entry.locked_until;
+    }
+  }
+  built->accounts = built->keys.size();
+  return built;
+}
+
+static int IdState(const account_index *index, size_t id)
+{
+  return (index->states[id / 4] >> (id % 4 * 2)) & 3;
+}
+
+static int EntryState(int state, int64_t locked_until);
+
+// Folds a polled entry into index: in place for a name the last load
+// had, in recent otherwise. Only refused names need to be in recent,
+// and only while refused.
+static void FoldEntry(account_index *index, const account_entry &entry)
+{
+  std::vector<uint64_t>::iterator found = std::lower_bound(index->keys.begin(), index->keys.end(), entry.key);
+  if (found == index->keys.end() || *found != entry.key) {
+    if (entry.state != ACCOUNT_ACTIVE) index->recent[entry.key] = entry;
+    else index->recent.erase(entry.key);
+    return;
+  }
+
+  size_t id = found - index->keys.begin();
+  int previous = IdState(index, id);
+  if (previous == ACCOUNT_DISABLED) index->disabled--;
+  if (previous == ACCOUNT_LOCKED) {
+    index->locked--;
+    index->locked_until.erase(entry.key);
+  }
+
+  index->states[id / 4] &= ~(3 << (id % 4 * 2));
+  index->states[id / 4] |= entry.state << (id % 4 * 2);
+  if (entry.state == ACCOUNT_DISABLED) index->disabled++;
+  if (entry.state == ACCOUNT_LOCKED) {
+    index->locked++;
+    index->locked_until[entry.key] = entry.locked_until;
+  }
+}
+
+// Drops recent entries whose lock has run out.
+static void TrimRecent(account_index *index)
+{
+  for (std::map<uint64_t, account_entry>::iterator iter = index->recent.begin(); iter != index->recent.end(); )
+  {
+    if (EntryState(iter->second.state, iter->second.locked_until) == ACCOUNT_ACTIVE) {
+      index->recent.erase(iter++);
+    } else {
+      ++iter;
+    }
+  }
+}
+
+static void RefresherThread(void *arg)
+{
+  int64_t next_refresh = 0, last_poll = 0;
+
+  uv_mutex_lock(&accounts_lock);
+  while (enabled)
+  {
+    accounts_config settings = config;
+    bool full = reload || WallClockMs() >= next_refresh;
+    reload = false;
+    uv_mutex_unlock(&accounts_lock);
+
+    int64_t started = WallClockMs();
+    std::vector<account_entry> entries;
+    int rc;
+    // Installed only while still enabled: AccountsDisable() may have
+    // dropped the index during the load.
+    if (full) {
+      rc = Load(settings, settings.filter, &entries);
+      if (rc == LDAP_SUCCESS) {
+        account_index *built = BuildIndex(&entries);
+        uv_mutex_lock(&accounts_lock);
+        if (enabled) {
+          uv_rwlock_wrlock(&index_lock);
+          std::swap(current_index, built);
+          uv_rwlock_wrunlock(&index_lock);
+        }
+        uv_mutex_unlock(&accounts_lock);
+        delete built;
+        next_refresh = started + settings.refresh_interval_ms;
+        last_poll = started;
+      }
+    } else {
+      // Entries changed since the last poll, and those locked out
+      // recently enough that the lockout may since have ended without
+      // a change. Older lockouts have ended, or are read again by the
+      // next full load.
+      char since[32];
+      FormatGeneralizedTime(last_poll - POLL_OVERLAP_MS, since, sizeof(since));
+      int64_t window_ms = settings.lockout_duration_ms > 0 ? settings.lockout_duration_ms : settings.refresh_interval_ms;
+      char locked_since[32];
+      snprintf(locked_since, sizeof(locked_since), "%lld",
+               (long long)((started - window_ms - POLL_OVERLAP_MS + FILETIME_UNIX_EPOCH_MS) * FILETIME_TICKS_PER_MS));
+      std::string filter = "(&" + settings.filter + "(|(modifyTimestamp>=" + since + ")(lockoutTime>="
+        + locked_since + ")))";
+      rc = Load(settings, filter, &entries);
+      if (rc == LDAP_SUCCESS) {
+        std::stable_sort(entries.begin(), entries.end(), KeyBefore);
+        uv_mutex_lock(&accounts_lock);
+        uv_rwlock_wrlock(&index_lock);
+        for (size_t idx = 0; enabled && current_index != NULL && idx < entries.size(); idx++)
+        {
+          const account_entry &entry = entries[idx];
+          if (idx > 0 && entries[idx - 1].key == entry.key) continue;
+          // A polled entry cannot refuse a name other entries share.
+          if (entry.state != ACCOUNT_ACTIVE && current_index->shared.count(entry.key)) continue;
+          FoldEntry(current_index, entry);
+        }
+        if (enabled && current_index != NULL) TrimRecent(current_index);
+        uv_rwlock_wrunlock(&index_lock);
+        uv_mutex_unlock(&accounts_lock);
+        last_poll = started;
+      }
+    }
+
+    uv_mutex_lock(&accounts_lock);
+    last_error = rc;
+    if (rc == LDAP_SUCCESS) {
+      if (full) {
+        refreshes++;
+        last_refresh = started;
+      } else {
+        polls++;
+      }
+    }
+
+    if (enabled && !reload) {
+      // Failed loads are retried at the poll interval, too.
+      int64_t wait = settings.refresh_interval_ms;
+      if (settings.poll_interval_ms > 0 && settings.poll_interval_ms < wait) wait = settings.poll_interval_ms;
+      if (rc == LDAP_SUCCESS && next_refresh - WallClockMs() < wait) wait = next_refresh - WallClockMs();
+      if (wait > 0) uv_cond_timedwait(&accounts_cond, &accounts_lock, wait * NS_PER_MS);
+    }
+  }
+  refresher_running = false;
+  uv_mutex_unlock(&accounts_lock);
+}
+
+void AccountsDefaults(accounts_config *defaults)
+{
+  defaults->port = 389;
+  defaults->filter = "(objectClass=person)";
+  defaults->attributes = "userPrincipalName sAMAccountName uid";
+  defaults->refresh_interval_ms = 3600000;
+  defaults->poll_interval_ms = 30000;
+  defaults->lockout_duration_ms = 1800000;
+}
+
+void AccountsConfigure(const accounts_config &settings)
+{
+  uv_once(&accounts_once, InitAccounts);
+
+  uv_mutex_lock(&accounts_lock);
+  config = settings;
+  enabled = true;
+  reload = true;
+  bool start = !refresher_running;
+  if (start) refresher_running = true;
+  uv_cond_signal(&accounts_cond);
+  uv_mutex_unlock(&accounts_lock);
+
+  if (start) {
+    uv_thread_create(&refresher, RefresherThread, NULL);
+  }
+}
+
+void AccountsDisable()
+{
+  uv_once(&accounts_once, InitAccounts);
+
+  uv_mutex_lock(&accounts_lock);
+  enabled = false;
+  uv_cond_signal(&accounts_cond);
+  uv_mutex_unlock(&accounts_lock);
+
+  uv_rwlock_wrlock(&index_lock);
+  delete current_index;
+  current_index = NULL;
+  uv_rwlock_wrunlock(&index_lock);
+}
+
+static int EntryState(int state, int64_t locked_until)
+{
+  if (state == ACCOUNT_LOCKED && locked_until != 0 && WallClockMs() >= locked_until) {
+    return ACCOUNT_ACTIVE;
+  }
+  return state;
+}
+
+int AccountsState(const char *username)
+{
+  uv_once(&accounts_once, InitAccounts);
+
+  uint64_t key = AccountKey(username);
+  int state = ACCOUNT_ACTIVE;
+
+  uv_rwlock_rdlock(&index_lock);
+  if (current_index != NULL) {
+    std::map<uint64_t, account_entry>::iterator recent = current_index->recent.find(key);
+    if (recent != current_index->recent.end()) {
+      state = EntryState(recent->second.state, recent->second.locked_until);
+    } else {
+      std::vector<uint64_t>::iterator found = std::lower_bound(current_index->keys.begin(), current_index->keys.end(), key);
+      if (found != current_index->keys.end() && *found == key) {
+        size_t id = found - current_index->keys.begin();
+        state = IdState(current_index, id);
+        if (state == ACCOUNT_LOCKED) state = EntryState(state, current_index->locked_until.find(key)->second);
+      }
+    }
+  }
+  uv_rwlock_rdunlock(&index_lock);
+
+  if (state != ACCOUNT_ACTIVE) __atomic_fetch_add(&rejected, 1, __ATOMIC_RELAXED);
+  return state;
+}
+
+void AccountsStats(accounts_stats *stats)
+{
+  uv_once(&accounts_once, InitAccounts);
+
+  uv_mutex_lock(&accounts_lock);
+  stats->enabled = enabled;
+  stats->refreshes = refreshes;
+  stats->polls = polls;
+  stats->last_refresh = last_refresh;
+  stats->last_error = last_error;
+  uv_mutex_unlock(&accounts_lock);
+
+  stats->rejected = __atomic_load_n(&rejected, __ATOMIC_RELAXED);
+
+  uv_rwlock_rdlock(&index_lock);
+  stats->accounts = current_index != NULL ? current_index->accounts : 0;
+  stats->disabled = current_index != NULL ? current_index->disabled : 0;
+  stats->locked = current_index != NULL ? current_index->locked : 0;
+  uv_rwlock_rdunlock(&index_lock);
+}
@@ -0,0 +1,82 @@
+// Index of disabled and locked-out accounts, checked before binding.
+
+/*
+A bind for a disabled or locked account costs a full round trip, and
+counts against the directory's lockout policy all the same. With
+configure({ accountIndex: { ... } }), a background thread reads every
+account under base with a paged search, and records for each one
+whether it is disabled (userAccountControl ACCOUNTDISABLE) or locked
+(msDS-User-Account-Control-Computed LOCKOUT, pwdAccountLockedTime).
+authenticate() then fails such accounts without contacting the
+directory.
+
+Accounts are stored as a sorted array of 64-bit key hashes, the account
+id being its position, plus two bits of state per id; locked accounts
+also get an unlock time. Each account is indexed under its DN and the
+values of the configured username attributes, lowercased. Between full
+refreshes, a poll for entries with a newer modifyTimestamp updates their
+state in place; names the last load did not have are kept aside while
+refused. An Active Directory lockout ends without changing the entry,
+so polls also read again entries whose lockoutTime is within the
+lockout duration (the refresh interval if that is 0), and a lockout is
+only believed until the next poll.
+
+A name several entries share is refused only if all of them are
+disabled or locked when loaded, and polls never refuse it.
+
+Unknown usernames are never rejected: the index only ever saves a bind.
+*/
+
+#ifndef LDAPAUTH_ACCOUNTS_H
+#define LDAPAUTH_ACCOUNTS_H
+
+#include <stdint.h>
+
+#include <string>
+
+#define ACCOUNT_ACTIVE 0      // or unknown
+#define ACCOUNT_DISABLED 1
+#define ACCOUNT_LOCKED 2
+
+struct accounts_config
+{
+  std::string host;             // may list several servers, see servers.h
+  int port;
+  std::string binddn;
+  std::string password;
+  std::string base;
+  std::string filter;
+  std::string attributes;       // space separated username attributes
+  int refresh_interval_ms;      // full reload
+  int poll_interval_ms;         // modifyTimestamp poll, 0 to disable
+  int lockout_duration_ms;      // for pwdAccountLockedTime, and lockoutTime polls; 0 until cleared
+};
+
+struct accounts_stats
+{
+  bool enabled;
+  uint64_t accounts;
+  uint64_t disabled;
+  uint64_t locked;
+  uint64_t rejected;            // binds saved
+  uint64_t refreshes;
+  uint64_t polls;
+  int64_t last_refresh;         // unix ms, 0 if never
+  int last_error;               // LDAP result code of the last load
+};
+
+void AccountsDefaults(accounts_config *config);
+
+// Starts (or reconfigures) the refresher thread.
+void AccountsConfigure(const accounts_config &config);
+
+// Stops refreshing and drops the index.
+void AccountsDisable();
+
+// ACCOUNT_ACTIVE unless the index knows the account is disabled or
+// currently locked. Safe from any thread.
+int AccountsState(const char *username);
+
+void AccountsStats(accounts_stats *stats);
+
+#endif
@@ -0,0 +1,286 @@
+// Per-thread arenas for libldap/liblber allocations. See arena.h.
+
+#include "arena.h"
+
+#include <ldap.h>
+#include <uv.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Size classes are powers of two from 16 bytes to 4 KB. Anything bigger
+// goes to malloc().
+#define ARENA_MIN_SHIFT 4
+#define ARENA_CLASSES 9
+#define ARENA_MAX_SIZE (1 << (ARENA_MIN_SHIFT + ARENA_CLASSES - 1))
+
+#define ARENA_CHUNK_SIZE (64 * 1024)
+// Chunks kept across resets; the rest go back to malloc().
+#define ARENA_KEEP_CHUNKS 4
+
+#define BLOCK_MAGIC 0x4c444150
+
+// Precedes every block handed to liblber, so free() and realloc() know
+// where a block came from. owner is NULL for malloc() blocks.
+struct block_header
+{
+  arena *owner;
+  uint32_t size;
+  uint32_t magic;
+} __attribute__((aligned(16)));
+
+struct arena_chunk
+{
+  arena_chunk *next;
+  char *limit;
+} __attribute__((aligned(16)));
+
+struct arena
+{
+  arena_chunk *chunks;  // in use, newest first
+  arena_chunk *spare;   // kept from previous requests
+  char *cursor;
+  char *limit;
+  block_header *free_lists[ARENA_CLASSES];
+
+  uint64_t allocations;
+  uint64_t reused;
+  uint64_t heap_allocations;
+  uint64_t resets;
+  uint64_t reserved;
+
+  arena *next_arena;
+};
+
+static __thread arena *current = NULL;  // active on this thread
+static __thread arena *mine = NULL;     // owned by this thread
+
+static bool enabled = true;
+
+// Every arena ever created, for ArenaStats().
+static uv_mutex_t arenas_lock;
+static arena *arenas = NULL;
+// malloc() fallbacks on threads that never opened a scope.
+static uint64_t orphan_heap_allocations = 0;
+
+static int SizeClass(size_t size)
+{
+  int cls = 0;
+  while (((size_t)1 << (ARENA_MIN_SHIFT + cls)) < size) cls++;
+  return cls;
+}
+
+static void *HeapAlloc(size_t size)
+{
+  block_header *header = (block_header*)malloc(sizeof(block_header) + size);
+  if (header == NULL) return NULL;
+
+  header->owner = NULL;
+  header->size = size;
+  header->magic = BLOCK_MAGIC;
+
+  if (mine != NULL) {
+    mine->heap_allocations++;
+  } else {
+    __sync_fetch_and_add(&orphan_heap_allocations, 1);
+  }
+  return header + 1;
+}
+
+// Carves size bytes off the current chunk, starting a new one if needed.
+static void *Bump(arena *a, size_t size)
+{
+  if (a->cursor + size > a->limit) {
+    arena_chunk *chunk = a->spare;
+    if (chunk != NULL) {
+      a->spare = chunk->next;
+    } else {
+      chunk = (arena_chunk*)malloc(ARENA_CHUNK_SIZE);
+      if (chunk == NULL) return NULL;
+      chunk->limit = (char*)chunk + ARENA_CHUNK_SIZE;
+      a->reserved += ARENA_CHUNK_SIZE;
+    }
+    chunk->next = a->chunks;
+    a->chunks = chunk;
+    a->cursor = (char*)(chunk + 1);
+    a->limit = chunk->limit;
+  }
+
+  void *block = a->cursor;
+  a->cursor += size;
+  return block;
+}
+
+static void *ArenaMalloc(ber_len_t size, void *ctx)
+{
+  arena *a = current;
+  if (a != NULL && size <= ARENA_MAX_SIZE) {
+    int cls = SizeClass(size);
+    block_header *header = a->free_lists[cls];
+    if (header != NULL) {
+      a->free_lists[cls] = (block_header*)header->owner;
+      a->reused++;
+    } else {
+      header = (block_header*)Bump(a, sizeof(block_header) + ((size_t)1 << (ARENA_MIN_SHIFT + cls)));
+    }
+    if (header != NULL) {
+      header->owner = a;
+      header->size = 1 << (ARENA_MIN_SHIFT + cls);
+      header->magic = BLOCK_MAGIC;
+      a->allocations++;
+      return header + 1;
+    }
+  }
+  return HeapAlloc(size);
+}
+
+static void ArenaFree(void *p, void *ctx)
+{
+  if (p == NULL) return;
+
+  block_header *header = (block_header*)p - 1;
+  if (header->owner == NULL) {
+    free(header);
+  } else if (header->owner == current) {
+    // Reuse within the same request. Blocks freed from another thread,
+    // or after their scope closed, are left for the owner's reset.
+    arena *a = header->owner;
+    int cls = SizeClass(header->size);
+    header->owner = (arena*)a->free_lists[cls];
+    a->free_lists[cls] = header;
+  }
+}
+
+static void *ArenaCalloc(ber_len_t n, ber_len_t size, void *ctx)
+{
+  if (size != 0 && n > (ber_len_t)-1 / size) return NULL;
+
+  void *p = ArenaMalloc(n * size, ctx);
+  if (p != NULL) memset(p, 0, n * size);
+  return p;
+}
+
+static void *ArenaRealloc(void *p, ber_len_t size, void *ctx)
+{
+  if (p == NULL) return ArenaMalloc(size, ctx);
+
+  block_header *header = (block_header*)p - 1;
+  if (size <= header->size) return p;
+
+  if (header->owner == NULL) {
+    block_header *grown = (block_header*)realloc(header, sizeof(block_header) + size);
+    if (grown == NULL) return NULL;
+    grown->size = size;
+    return grown + 1;
+  }
+
+  void *moved = ArenaMalloc(size, ctx);
+  if (moved == NULL) return NULL;
+  memcpy(moved, p, header->size);
+  ArenaFree(p, ctx);
+  return moved;
+}
+
+// Forgets every block handed out since the scope opened.
+static void ArenaReset(arena *a)
+{
+  int kept = 0;
+  for (arena_chunk *chunk = a->spare; chunk != NULL; chunk = chunk->next) kept++;
+
+  while (a->chunks != NULL)
+  {
+    arena_chunk *chunk = a->chunks;
+    a->chunks = chunk->next;
+    if (kept < ARENA_KEEP_CHUNKS) {
+      chunk->next = a->spare;
+      a->spare = chunk;
+      kept++;
+    } else {
+      free(chunk);
+      a->reserved -= ARENA_CHUNK_SIZE;
+    }
+  }
+
+  a->cursor = a->limit = NULL;
+  memset(a->free_lists, 0, sizeof(a->free_lists));
+  a->resets++;
+}
+
+static arena *ArenaCreate()
+{
+  arena *a = (arena*)calloc(1, sizeof(arena));
+
+  uv_mutex_lock(&arenas_lock);
+  a->next_arena = arenas;
+  arenas = a;
+  uv_mutex_unlock(&arenas_lock);
+
+  return a;
+}
+
+void ArenaInstall()
+{
+  uv_mutex_init(&arenas_lock);
+
+  BerMemoryFunctions fns;
+  fns.bmf_malloc = ArenaMalloc;
+  fns.bmf_calloc = ArenaCalloc;
+  fns.bmf_realloc = ArenaRealloc;
+  fns.bmf_free = ArenaFree;
+  ber_set_option(NULL, LBER_OPT_MEMORY_FNS, &fns);
+
+  // Have libldap set up its global state now, on the heap, rather than
+  // lazily inside somebody's scope.
+  int version;
+  ldap_get_option(NULL, LDAP_OPT_PROTOCOL_VERSION, &version);
+}
+
+void ArenaConfigure(bool on)
+{
+  enabled = on;
+}
+
+arena_scope::arena_scope()
+{
+  saved = current;
+  active = enabled && current == NULL;
+  if (active) {
+    if (mine == NULL) mine = ArenaCreate();
+    current = mine;
+  }
+}
+
+arena_scope::~arena_scope()
+{
+  if (active) {
+    ArenaReset(mine);
+    current = saved;
+  }
+}
+
+arena_pause::arena_pause()
+{
+  saved = current;
+  current = NULL;
+}
+
+arena_pause::~arena_pause()
+{
+  current = saved;
+}
+
+void ArenaStats(arena_stats *stats)
+{
+  memset(stats, 0, sizeof(*stats));
+  stats->heap_allocations = orphan_heap_allocations;
+
+  uv_mutex_lock(&arenas_lock);
+  for (arena *a = arenas; a != NULL; a = a->next_arena)
+  {
+    stats->allocations += a->allocations;
+    stats->reused += a->reused;
+    stats->heap_allocations += a->heap_allocations;
+    stats->resets += a->resets;
+    stats->reserved += a->reserved;
+  }
+  uv_mutex_unlock(&arenas_lock);
+}
@@ -0,0 +1,58 @@
+// Per-thread arenas for libldap/liblber allocations.
+
+/*
+Decoding a search result (BerElements, attribute names, ldap_get_values()
+arrays) makes thousands of small, short-lived allocations, all of which
+are dead by the time the request finishes. ArenaInstall() routes every
+liblber allocation through hooks which, inside an arena_scope, serve them
+from the calling thread's size-class arena. Leaving the scope resets the
+arena in one go. Outside a scope the hooks fall through to malloc().
+
+Anything that must outlive the request (connections, outstanding
+operations on pooled handles) has to be created under an arena_pause.
+*/
+
+#ifndef LDAPAUTH_ARENA_H
+#define LDAPAUTH_ARENA_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct arena;
+
+// Must run before any other libldap/liblber call in the process.
+void ArenaInstall();
+
+// Turns arena scopes on or off. Off, every allocation goes to malloc().
+void ArenaConfigure(bool enabled);
+
+// Serves liblber allocations on this thread from its arena until
+// destroyed, then releases them all.
+struct arena_scope
+{
+  arena *saved;
+  bool active;
+  arena_scope();
+  ~arena_scope();
+};
+
+// Suspends the current arena, e.g. while opening a pooled connection.
+struct arena_pause
+{
+  arena *saved;
+  arena_pause();
+  ~arena_pause();
+};
+
+struct arena_stats
+{
+  uint64_t allocations;       // served from an arena
+  uint64_t reused;            // ... of which came off a free list
+  uint64_t heap_allocations;  // fell through to malloc()
+  uint64_t resets;            // requests finished
+  uint64_t reserved;          // bytes held by arenas between requests
+};
+
+void ArenaStats(arena_stats *stats);
+
+#endif
@@ -0,0 +1,57 @@
+#!/usr/bin/env node
+
+// Search throughput and allocation counts with and without the libldap
+// arena hooks (see arena.h).
+//
+//   node bench/arena.js host port binddn password base filter [searches] [concurrency]
+
+var ldapauth = require('../ldapauth'); // Path to ldapauth.node
+
+var args        = process.argv.slice(2),
+    host        = args[0],
+    port        = parseInt(args[1], 10),
+    username    = args[2],
+    password    = args[3],
+    base        = args[4],
+    filter      = args[5],
+    searches    = parseInt(args[6] || '20000', 10),
+    concurrency = parseInt(args[7] || '64', 10);
+
+function run(arenas, done) {
+  ldapauth.configure({ arenas: arenas });
+
+  var before = ldapauth.stats().arena,
+      started = Date.now(),
+      issued = 0,
+      finished = 0;
+
+  function next() {
+    if (issued >= searches) return;
+    issued++;
+    ldapauth.search(host, port, username, password, base, filter, function(err) {
+      if (err) throw err;
+      if (++finished == searches) {
+        var after = ldapauth.stats().arena,
+            seconds = (Date.now() - started) / 1000;
+        console.log((arenas ? 'arenas' : 'malloc') + ': ' +
+          Math.round(searches / seconds) + ' searches/s, ' +
+          'per search: ' +
+          ((after.allocations - before.allocations) / searches).toFixed(1) + ' arena, ' +
+          ((after.heapAllocations - before.heapAllocations) / searches).toFixed(1) + ' malloc ' +
+          '(' + after.reservedBytes + ' bytes reserved)');
+        done();
+      } else {
+        next();
+      }
+    });
+  }
+
+  for (var i = 0; i < concurrency; i++) next();
+}
+
+// Warm the connection pool first so both runs see the same sockets.
+run(false, function() {
+  run(true, function() {
+    run(false, function() {});
+  });
+});
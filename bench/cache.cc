@@ -0,0 +1,134 @@
+// Hit rate benchmark: W-TinyLFU admission against plain LRU (cache.h),
+// replaying a trace of keys through get, then put on a miss.
+//
+//   g++ -O2 -I. bench/cache.cc cache.cc tier.cc -luv -lpthread -o cache-bench && ./cache-bench [trace]
+//
+// A trace file holds one key per line, e.g. usernames from a login log.
+// Without one, synthetic traces are generated: Zipf-distributed logins
+// from a population of users, alone and interrupted by scans of keys that
+// are each seen once (a nightly export, a credential-stuffing run).
+
+#include "cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#define USERS 100000
+#define REQUESTS 2000000
+
+// Picks ranks 0..n-1 with probability proportional to 1 / (rank+1)^s.
+class zipf
+{
+ public:
+  zipf(int n, double s) : cumulative_(n)
+  {
+    double sum = 0;
+    for (int rank = 0; rank < n; rank++)
+    {
+      sum += 1.0 / pow(rank + 1, s);
+      cumulative_[rank] = sum;
+    }
+    for (int rank = 0; rank < n; rank++) cumulative_[rank] /= sum;
+  }
+
+  int Next()
+  {
+    double u = (double)rand() / RAND_MAX;
+    return std::lower_bound(cumulative_.begin(), cumulative_.end(), u) - cumulative_.begin();
+  }
+
+ private:
+  std::vector<double> cumulative_;
+};
+
+// Logins throughout; every scan_every requests, a scan of scan_length
+// never-repeated keys.
+static std::vector<std::string> Synthetic(int scan_every, int scan_length)
+{
+  srand(42);
+  zipf users(USERS, 0.9);
+  std::vector<std::string> trace;
+  int scanned = 0;
+  char key[32];
+
+  for (int idx = 0; idx < REQUESTS; idx++)
+  {
+    if (scan_every > 0 && idx % scan_every == 0) {
+      for (int scan = 0; scan < scan_length; scan++)
+      {
+        sprintf(key, "scan%d", scanned++);
+        trace.push_back(key);
+      }
+    }
+    sprintf(key, "user%d", users.Next());
+    trace.push_back(key);
+  }
+  return trace;
+}
+
+static std::vector<std::string> Load(const char *path)
+{
+  std::vector<std::string> trace;
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    perror(path);
+    exit(1);
+  }
+
+  char line[4096];
+  while (fgets(line, sizeof(line), file) != NULL)
+  {
+    line[strcspn(line, "\r\n")] = '\0';
+    if (line[0] != '\0') trace.push_back(line);
+  }
+  fclose(file);
+  return trace;
+}
+
+static double HitRate(const std::vector<std::string> &trace, size_t capacity, bool tinylfu)
+{
+  cache *c = CacheCreate(capacity, 24 * 3600 * 1000);
+  CacheConfigureAdmission(c, tinylfu);
+
+  std::string value;
+  for (size_t idx = 0; idx < trace.size(); idx++)
+  {
+    if (!CacheGet(c, trace[idx], &value)) CachePut(c, trace[idx], "x");
+  }
+
+  cache_stats stats;
+  CacheStats(c, &stats);
+  return 100.0 * stats.hits / (stats.hits + stats.misses);
+}
+
+static void Report(const char *name, const std::vector<std::string> &trace)
+{
+  printf("%s (%lu requests)\n", name, (unsigned long)trace.size());
+  printf("  %10s %10s %10s\n", "capacity", "lru", "tinylfu");
+
+  static const size_t capacities[] = { 1000, 5000, 10000, 50000 };
+  for (size_t idx = 0; idx < sizeof(capacities) / sizeof(capacities[0]); idx++)
+  {
+    printf("  %10lu %9.2f%% %9.2f%%\n", (unsigned long)capacities[idx],
+           HitRate(trace, capacities[idx], false), HitRate(trace, capacities[idx], true));
+  }
+}
+
+int main(int argc, char **argv)
+{
+  if (argc > 1) {
+    Report(argv[1], Load(argv[1]));
+    return 0;
+  }
+
+  Report("logins", Synthetic(0, 0));
+  Report("logins + scans of 20000 every 100000", Synthetic(100000, 20000));
+  Report("logins + scans of 100000 every 200000", Synthetic(200000, 100000));
+  return 0;
+}
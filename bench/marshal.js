@@ -0,0 +1,37 @@
+#!/usr/bin/env node
+
+// Calls/s for marshalling authenticate()'s arguments alone, into pooled
+// requests with the strings inline versus a Utf8Value and a strdup() per
+// string (see _marshal() in ldapauth.cc). No request is sent. Needs a
+// build with the hook in:
+//
+//   node-waf configure --bench build && node bench/marshal.js [calls]
+
+var ldapauth = require('../ldapauth'); // Path to ldapauth.node
+
+var calls = parseInt(process.argv[2] || '2000000', 10);
+
+var cases = {
+  typical: ['ldap', 'dc1.example.com', 389, 'jdoe@example.com', 'correct horse battery'],
+  long: ['ldaps', 'dc1.example.com dc2.example.com dc3.example.com', 636,
+         'CN=Jonathan Doe,OU=Engineering,OU=People,DC=corp,DC=example,DC=com',
+         new Array(200).join('x')],
+  unicode: ['ldap', 'dc1.example.com', 389, 'jörg.müller@example.com', 'пароль密码']
+};
+
+function run(name, args, copy) {
+  var started = process.hrtime();
+  for (var i = 0; i < calls; i++) {
+    ldapauth._marshal(args[0], args[1], args[2], args[3], args[4], copy);
+  }
+  var elapsed = process.hrtime(started),
+      seconds = elapsed[0] + elapsed[1] / 1e9;
+  console.log(name + ' ' + (copy ? 'strdup' : 'inline') + ': ' +
+    Math.round(calls / seconds) + ' calls/s');
+}
+
+for (var name in cases) {
+  run(name, cases[name], true);   // warm up
+  run(name, cases[name], true);
+  run(name, cases[name], false);
+}
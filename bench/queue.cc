@@ -0,0 +1,177 @@
+// Contention benchmark: mpmc_queue + parking_lot (queue.h) against a
+// bounded mutex + condition variable queue, across producer/consumer
+// counts.
+//
+//   g++ -O2 -pthread -I. bench/queue.cc -o queue-bench && ./queue-bench [items]
+
+#include "queue.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include <deque>
+
+#define CAPACITY 1024
+
+// The obvious implementation, for comparison.
+class mutex_queue
+{
+ public:
+  explicit mutex_queue(size_t capacity) : capacity_(capacity)
+  {
+    pthread_mutex_init(&lock_, NULL);
+    pthread_cond_init(&not_empty_, NULL);
+    pthread_cond_init(&not_full_, NULL);
+  }
+
+  void Push(long value)
+  {
+    pthread_mutex_lock(&lock_);
+    while (items_.size() >= capacity_) pthread_cond_wait(&not_full_, &lock_);
+    items_.push_back(value);
+    pthread_cond_signal(&not_empty_);
+    pthread_mutex_unlock(&lock_);
+  }
+
+  long Pop()
+  {
+    pthread_mutex_lock(&lock_);
+    while (items_.empty()) pthread_cond_wait(&not_empty_, &lock_);
+    long value = items_.front();
+    items_.pop_front();
+    pthread_cond_signal(&not_full_);
+    pthread_mutex_unlock(&lock_);
+    return value;
+  }
+
+ private:
+  size_t capacity_;
+  std::deque<long> items_;
+  pthread_mutex_t lock_;
+  pthread_cond_t not_empty_;
+  pthread_cond_t not_full_;
+};
+
+// Lock-free queue with parking on both sides, the way jobs.cc uses it.
+class ring_queue
+{
+ public:
+  explicit ring_queue(size_t capacity) : ring_(capacity) {}
+
+  void Push(long value)
+  {
+    for (;;)
+    {
+      if (ring_.TryPush(value)) break;
+      int key = not_full_.Prepare();
+      if (ring_.TryPush(value)) { not_full_.Cancel(); break; }
+      not_full_.Wait(key);
+    }
+    not_empty_.Notify();
+  }
+
+  long Pop()
+  {
+    long value;
+    for (;;)
+    {
+      if (ring_.TryPop(&value)) break;
+      int key = not_empty_.Prepare();
+      if (ring_.TryPop(&value)) { not_empty_.Cancel(); break; }
+      not_empty_.Wait(key);
+    }
+    not_full_.Notify();
+    return value;
+  }
+
+ private:
+  mpmc_queue<long> ring_;
+  parking_lot not_empty_;
+  parking_lot not_full_;
+};
+
+template <typename Q>
+struct bench_state
+{
+  Q *queue;
+  long items_per_producer;
+  long items_per_consumer;
+  long checksum;
+};
+
+template <typename Q>
+static void *Producer(void *arg)
+{
+  bench_state<Q> *state = (bench_state<Q>*)arg;
+  for (long idx = 1; idx <= state->items_per_producer; idx++)
+  {
+    state->queue->Push(idx);
+  }
+  return NULL;
+}
+
+template <typename Q>
+static void *Consumer(void *arg)
+{
+  bench_state<Q> *state = (bench_state<Q>*)arg;
+  long sum = 0;
+  for (long idx = 0; idx < state->items_per_consumer; idx++)
+  {
+    sum += state->queue->Pop();
+  }
+  __sync_fetch_and_add(&state->checksum, sum);
+  return NULL;
+}
+
+static double Now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// Returns items per second moved through the queue.
+template <typename Q>
+static double Run(int producers, int consumers, long items)
+{
+  Q queue(CAPACITY);
+  bench_state<Q> state;
+  state.queue = &queue;
+  state.items_per_producer = items / producers;
+  state.items_per_consumer = state.items_per_producer * producers / consumers;
+  state.checksum = 0;
+
+  pthread_t threads[producers + consumers];
+  double started = Now();
+  for (int idx = 0; idx < consumers; idx++) pthread_create(&threads[idx], NULL, Consumer<Q>, &state);
+  for (int idx = 0; idx < producers; idx++) pthread_create(&threads[consumers + idx], NULL, Producer<Q>, &state);
+  for (int idx = 0; idx < producers + consumers; idx++) pthread_join(threads[idx], NULL);
+  double elapsed = Now() - started;
+
+  long n = state.items_per_producer;
+  if (state.checksum != producers * (n * (n + 1) / 2)) {
+    fprintf(stderr, "checksum mismatch\n");
+    exit(1);
+  }
+  return state.items_per_producer * producers / elapsed;
+}
+
+int main(int argc, char **argv)
+{
+  long items = argc > 1 ? atol(argv[1]) : 2000000;
+  // Consumer counts must divide producers * items evenly.
+  int shapes[][2] = { {1, 1}, {1, 4}, {4, 1}, {2, 2}, {4, 4}, {8, 8}, {1, 8}, {8, 1} };
+
+  printf("%-10s %-10s %14s %14s %8s\n", "producers", "consumers", "mutex ops/s", "ring ops/s", "speedup");
+  for (size_t idx = 0; idx < sizeof(shapes) / sizeof(shapes[0]); idx++)
+  {
+    int producers = shapes[idx][0], consumers = shapes[idx][1];
+    long n = items - items % (producers * consumers);
+    double mutex_rate = Run<mutex_queue>(producers, consumers, n);
+    double ring_rate = Run<ring_queue>(producers, consumers, n);
+    printf("%-10d %-10d %14.0f %14.0f %7.2fx\n", producers, consumers, mutex_rate, ring_rate, ring_rate / mutex_rate);
+  }
+  return 0;
+}
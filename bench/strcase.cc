@@ -0,0 +1,146 @@
+// Case folding kernels (strcase.h): each checked against the scalar one
+// on random strings of every length and alignment up to a few hundred
+// bytes, then timed on DN-sized and longer strings.
+//
+//   g++ -O2 -I. bench/strcase.cc strcase.cc -o strcase-bench && ./strcase-bench
+
+#include "strcase.h"
+#include "hash.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <string>
+#include <vector>
+
+#define MAX_LENGTH 300
+#define ROUNDS 2000000
+
+static const char *kernel_names[] = { "scalar", "sse2", "avx2" };
+
+static double NowMs()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+// Mostly letters of both cases around the A-Z edges, some high bytes.
+static char RandomByte()
+{
+  static const char edges[] = "@AZ[`az{09=,";
+  int pick = rand() % 8;
+  if (pick < 3) return 'A' + rand() % 26;
+  if (pick < 5) return 'a' + rand() % 26;
+  if (pick < 6) return edges[rand() % (sizeof(edges) - 1)];
+  if (pick < 7) return (char)(0x80 + rand() % 128);
+  return (char)(rand() % 256);
+}
+
+struct results
+{
+  std::string folded;
+  bool equal;
+  uint64_t hash;
+};
+
+static results Run(const char *a, const char *b, size_t length)
+{
+  results out;
+  out.folded.resize(length + 1);
+  StrFold(&out.folded[0], a, length);
+  out.equal = StrEqualFold(a, b, length);
+  out.hash = StrHashFold(HASH_START, a, length);
+  return out;
+}
+
+// Differential check of the named kernel against the scalar one.
+static bool Check(const char *name)
+{
+  char a[MAX_LENGTH + 64], b[MAX_LENGTH + 64];
+  srand(7);
+  for (size_t length = 0; length <= MAX_LENGTH; length++)
+  {
+    for (size_t align = 0; align < 32; align++)
+    {
+      for (size_t idx = 0; idx < length; idx++) a[align + idx] = RandomByte();
+      // b: a with the case of some letters flipped, and sometimes one
+      // other byte changed.
+      memcpy(b + align, a + align, length);
+      for (size_t idx = 0; idx < length; idx++)
+      {
+        char c = b[align + idx];
+        if (rand() % 2 && ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'))) b[align + idx] = c ^ 0x20;
+      }
+      if (length > 0 && rand() % 3 == 0) b[align + rand() % length] ^= 1 << (rand() % 8);
+
+      StrCaseUse("scalar");
+      results expected = Run(a + align, b + align, length);
+      StrCaseUse(name);
+      results actual = Run(a + align, b + align, length);
+      if (actual.folded != expected.folded || actual.equal != expected.equal || actual.hash != expected.hash) {
+        printf("%s differs from scalar at length %lu, alignment %lu\n", name, (unsigned long)length, (unsigned long)align);
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+static void Time(const char *name, size_t length)
+{
+  std::string a, b;
+  for (size_t idx = 0; idx < length; idx++) a.push_back(RandomByte());
+  b = StrLower(a);
+  std::vector<char> out(length);
+
+  int rounds = ROUNDS * 64 / (length + 16);
+  volatile uint64_t sink = 0;
+
+  double start = NowMs();
+  for (int round = 0; round < rounds; round++)
+  {
+    StrFold(&out[0], a.data(), length);
+    sink += out[round % length];
+  }
+  double fold = (NowMs() - start) * 1e6 / rounds;
+
+  start = NowMs();
+  for (int round = 0; round < rounds; round++) sink += StrEqualFold(a.data(), b.data(), length);
+  double equal = (NowMs() - start) * 1e6 / rounds;
+
+  start = NowMs();
+  for (int round = 0; round < rounds; round++) sink += StrHashFold(HASH_START, a.data(), length);
+  double hash = (NowMs() - start) * 1e6 / rounds;
+
+  printf("  %-8s %6lu %10.1f %10.1f %10.1f\n", name, (unsigned long)length, fold, equal, hash);
+}
+
+int main()
+{
+  const char *selected = StrCaseKernel();
+  printf("selected kernel: %s\n", selected);
+
+  std::vector<const char*> available;
+  for (size_t idx = 0; idx < sizeof(kernel_names) / sizeof(kernel_names[0]); idx++)
+  {
+    if (!StrCaseUse(kernel_names[idx])) continue;
+    available.push_back(kernel_names[idx]);
+    if (!Check(kernel_names[idx])) return 1;
+    printf("%s matches scalar\n", kernel_names[idx]);
+  }
+
+  static const size_t lengths[] = { 16, 48, 96, 1024 };
+  printf("  %-8s %6s %10s %10s %10s   (ns per call)\n", "kernel", "bytes", "fold", "equal", "hash");
+  for (size_t length = 0; length < sizeof(lengths) / sizeof(lengths[0]); length++)
+  {
+    for (size_t idx = 0; idx < available.size(); idx++)
+    {
+      StrCaseUse(available[idx]);
+      Time(available[idx], lengths[length]);
+    }
+  }
+  return 0;
+}
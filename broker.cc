@@ -0,0 +1,516 @@
+// Broker mode over a Unix socket. See broker.h.
+
+#include "broker.h"
+
+#include <uv.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include <map>
+#include <vector>
+
+// A frame larger than this is taken as a corrupt stream.
+#define MAX_FRAME (16 * 1024 * 1024)
+
+#define HEADER_SIZE 9   // length, id, type
+
+#define NS_PER_MS 1000000ULL
+
+// Broker side: one per client connection, freed when its reader has
+// stopped and every request read from it has been answered.
+struct broker_conn
+{
+  int fd;
+  uv_mutex_t write_lock;
+  int refs;               // reader + unanswered requests; atomic
+};
+
+// Client side: one of the connections requests are spread over.
+struct pending_request
+{
+  void *request;
+  broker_response_cb done;
+  uint64_t deadline;      // uv_hrtime(); failed if not answered by then
+};
+
+struct client_conn
+{
+  int fd;                 // -1 while disconnected
+  bool reading;           // reader thread not yet joined
+  uv_thread_t reader;
+  uv_mutex_t lock;        // fd, pending, next_id and writes
+  uint32_t next_id;
+  std::map<uint32_t, pending_request> pending;
+};
+
+static uv_once_t broker_once = UV_ONCE_INIT;
+static uv_mutex_t broker_lock;    // the client settings below
+
+static int listen_fd = -1;
+static broker_request_cb request_cb = NULL;
+static uv_thread_t acceptor;
+static uint64_t clients = 0;      // atomic
+static uint64_t served = 0;       // atomic
+static uint64_t refused = 0;      // atomic
+
+static std::string broker_path;
+static std::vector<client_conn*> conns;
+static size_t active = 0;         // of conns, the ones requests go to
+static uint32_t next_conn = 0;    // atomic, round robin
+static int timeout_ms = BROKER_TIMEOUT_MS;  // atomic
+static uint64_t timeouts = 0;     // atomic
+
+static void InitBroker()
+{
+  uv_mutex_init(&broker_lock);
+}
+
+static void PutUint32(char *buf, uint32_t value)
+{
+  buf[0] = value;
+  buf[1] = value >> 8;
+  buf[2] = value >> 16;
+  buf[3] = value >> 24;
+}
+
+static uint32_t GetUint32(const char *buf)
+{
+  const unsigned char *bytes = (const unsigned char*)buf;
+  return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+static bool ReadFull(int fd, char *buf, size_t length)
+{
+  while (length > 0)
+  {
+    ssize_t got = read(fd, buf, length);
+    if (got < 0 && errno == EINTR) continue;
+    if (got <= 0) return false;
+    buf += got;
+    length -= got;
+  }
+  return true;
+}
+
+static bool WriteFull(int fd, const char *buf, size_t length)
+{
+  while (length > 0)
+  {
+    // MSG_NOSIGNAL: a vanished peer is an error here, not a SIGPIPE.
+    ssize_t sent = send(fd, buf, length, MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR) continue;
+    if (sent <= 0) return false;
+    buf += sent;
+    length -= sent;
+  }
+  return true;
+}
+
+// Reads one frame. Returns false at end of stream or on a bad frame.
+static bool ReadFrame(int fd, uint32_t *id, int *type, std::string *payload)
+{
+  char header[HEADER_SIZE];
+  if (!ReadFull(fd, header, 4)) return false;
+  uint32_t length = GetUint32(header);
+  if (length < HEADER_SIZE - 4 || length > MAX_FRAME) return false;
+  if (!ReadFull(fd, header + 4, HEADER_SIZE - 4)) return false;
+
+  *id = GetUint32(header + 4);
+  *type = (unsigned char)header[8];
+  payload->resize(length - (HEADER_SIZE - 4));
+  return payload->empty() || ReadFull(fd, &(*payload)[0], payload->size());
+}
+
+// Caller holds the connection's write lock.
+static bool WriteFrame(int fd, uint32_t id, int type, const std::string &payload)
+{
+  std::string frame(HEADER_SIZE, '\0');
+  PutUint32(&frame[0], HEADER_SIZE - 4 + payload.size());
+  PutUint32(&frame[4], id);
+  frame[8] = type;
+  frame.append(payload);
+  return WriteFull(fd, frame.data(), frame.size());
+}
+
+static void Release(broker_conn *conn)
+{
+  if (__atomic_sub_fetch(&conn->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+  close(conn->fd);
+  uv_mutex_destroy(&conn->write_lock);
+  delete conn;
+  __atomic_sub_fetch(&clients, 1, __ATOMIC_RELAXED);
+}
+
+static void ServeThread(void *arg)
+{
+  broker_conn *conn = (broker_conn*)arg;
+
+  uint32_t id;
+  int type;
+  std::string payload;
+  while (ReadFrame(conn->fd, &id, &type, &payload))
+  {
+    __atomic_add_fetch(&conn->refs, 1, __ATOMIC_RELAXED);
+    request_cb(conn, id, type, payload);
+  }
+
+  // Replies still owed are dropped by the failing send.
+  shutdown(conn->fd, SHUT_RDWR);
+  Release(conn);
+}
+
+// Whether the process at the other end of fd runs as our user.
+static bool PeerIsSelf(int fd)
+{
+#ifdef SO_PEERCRED
+  struct ucred cred;
+  socklen_t length = sizeof(cred);
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &length) != 0) return false;
+  return cred.uid == geteuid();
+#else
+  uid_t uid;
+  gid_t gid;
+  if (getpeereid(fd, &uid, &gid) != 0) return false;
+  return uid == geteuid();
+#endif
+}
+
+static void AcceptThread(void *arg)
+{
+  for (;;)
+  {
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      // Out of descriptors, most likely; let some close.
+      usleep(100000);
+      continue;
+    }
+
+    // Clients hand over passwords: only our own user's, and only as
+    // many as there are threads to spare.
+    if (!PeerIsSelf(fd) || __atomic_load_n(&clients, __ATOMIC_RELAXED) >= BROKER_MAX_CLIENTS) {
+      close(fd);
+      __atomic_add_fetch(&refused, 1, __ATOMIC_RELAXED);
+      continue;
+    }
+
+    broker_conn *conn = new broker_conn;
+    conn->fd = fd;
+    conn->refs = 1;
+    uv_mutex_init(&conn->write_lock);
+    __atomic_add_fetch(&clients, 1, __ATOMIC_RELAXED);
+
+    uv_thread_t reader;
+    if (uv_thread_create(&reader, ServeThread, conn) != 0) {
+      Release(conn);
+      continue;
+    }
+    pthread_detach(reader);
+  }
+}
+
+// The directory path is in, created if need be: it must be ours and
+// closed to everybody else, so nobody else can swap the socket.
+static bool PrivateDirectory(const char *path)
+{
+  const char *slash = strrchr(path, '/');
+  std::string dir = slash == NULL ? "." : slash == path ? "/" : std::string(path, slash - path);
+
+  if (mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST) return false;
+  struct stat st;
+  return lstat(dir.c_str(), &st) == 0 && S_ISDIR(st.st_mode) && st.st_uid == geteuid()
+      && (st.st_mode & 077) == 0;
+}
+
+bool BrokerListen(const char *path, broker_request_cb handler)
+{
+  uv_once(&broker_once, InitBroker);
+  if (listen_fd >= 0) return false;
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) return false;
+  strcpy(addr.sun_path, path);
+  if (!PrivateDirectory(path)) return false;
+
+  // Only a stale socket is replaced, never some other file.
+  struct stat st;
+  if (lstat(path, &st) == 0) {
+    if (!S_ISSOCK(st.st_mode) || unlink(path) != 0) return false;
+  } else if (errno != ENOENT) {
+    return false;
+  }
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) return false;
+  mode_t mask = umask(0177);
+  int bound = bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+  umask(mask);
+  if (bound != 0 || chmod(path, 0600) != 0 || listen(fd, 128) != 0) {
+    close(fd);
+    return false;
+  }
+
+  listen_fd = fd;
+  request_cb = handler;
+  uv_thread_create(&acceptor, AcceptThread, NULL);
+  return true;
+}
+
+void BrokerReply(broker_conn *conn, uint32_t id, int status, const std::string &payload)
+{
+  uv_mutex_lock(&conn->write_lock);
+  WriteFrame(conn->fd, id, status, payload);
+  uv_mutex_unlock(&conn->write_lock);
+  __atomic_add_fetch(&served, 1, __ATOMIC_RELAXED);
+  Release(conn);
+}
+
+// Fails everything waiting on conn. Its lock held.
+static void FailPending(client_conn *conn, std::vector<pending_request> *failed)
+{
+  std::map<uint32_t, pending_request>::iterator it;
+  for (it = conn->pending.begin(); it != conn->pending.end(); it++)
+  {
+    failed->push_back(it->second);
+  }
+  conn->pending.clear();
+}
+
+// Takes the requests on conn past their deadline into expired, and
+// returns how long until the next one's, in ms: at most the timeout,
+// which a request sent meanwhile cannot have an earlier deadline than.
+// Its lock held.
+static int ExpirePending(client_conn *conn, std::vector<pending_request> *expired)
+{
+  uint64_t now = uv_hrtime();
+  uint64_t next = now + __atomic_load_n(&timeout_ms, __ATOMIC_RELAXED) * NS_PER_MS;
+  std::map<uint32_t, pending_request>::iterator it = conn->pending.begin();
+  while (it != conn->pending.end())
+  {
+    if (it->second.deadline <= now) {
+      expired->push_back(it->second);
+      conn->pending.erase(it++);
+    } else {
+      if (it->second.deadline < next) next = it->second.deadline;
+      ++it;
+    }
+  }
+  return (int)((next - now + NS_PER_MS - 1) / NS_PER_MS);
+}
+
+static void ClientThread(void *arg)
+{
+  client_conn *conn = (client_conn*)arg;
+
+  uv_mutex_lock(&conn->lock);
+  int fd = conn->fd;
+  uv_mutex_unlock(&conn->lock);
+
+  uint32_t id;
+  int status;
+  std::string payload;
+  for (;;)
+  {
+    // A broker that hangs without closing the socket must not keep the
+    // callers waiting: past its deadline, a request fails (and the
+    // caller falls back to running it here).
+    std::vector<pending_request> expired;
+    uv_mutex_lock(&conn->lock);
+    int wait = ExpirePending(conn, &expired);
+    uv_mutex_unlock(&conn->lock);
+    __atomic_add_fetch(&timeouts, expired.size(), __ATOMIC_RELAXED);
+    for (size_t idx = 0; idx < expired.size(); idx++)
+    {
+      expired[idx].done(expired[idx].request, BROKER_LOST, std::string());
+    }
+
+    struct pollfd ready;
+    ready.fd = fd;
+    ready.events = POLLIN;
+    ready.revents = 0;
+    int polled = poll(&ready, 1, wait);
+    if (polled < 0 && errno != EINTR) break;
+    if (polled <= 0) continue;
+    if (!ReadFrame(fd, &id, &status, &payload)) break;
+
+    uv_mutex_lock(&conn->lock);
+    std::map<uint32_t, pending_request>::iterator found = conn->pending.find(id);
+    if (found == conn->pending.end()) {
+      uv_mutex_unlock(&conn->lock);
+      continue;
+    }
+    pending_request waiting = found->second;
+    conn->pending.erase(found);
+    uv_mutex_unlock(&conn->lock);
+
+    waiting.done(waiting.request, status, payload);
+  }
+
+  // Broker gone (or BrokerConnect() shut us down): the next send
+  // reconnects.
+  std::vector<pending_request> failed;
+  uv_mutex_lock(&conn->lock);
+  if (conn->fd == fd) conn->fd = -1;
+  close(fd);
+  FailPending(conn, &failed);
+  uv_mutex_unlock(&conn->lock);
+
+  for (size_t idx = 0; idx < failed.size(); idx++)
+  {
+    failed[idx].done(failed[idx].request, BROKER_LOST, std::string());
+  }
+}
+
+// Connects conn to path if it is not connected. Its lock held.
+static bool Connect(client_conn *conn, const std::string &path)
+{
+  if (conn->fd >= 0) return true;
+  if (conn->reading) {
+    // The old reader has closed its descriptor and is on its way out.
+    uv_thread_t reader = conn->reader;
+    conn->reading = false;
+    uv_mutex_unlock(&conn->lock);
+    uv_thread_join(&reader);
+    uv_mutex_lock(&conn->lock);
+    if (conn->fd >= 0) return true;
+  }
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path.empty() || path.size() >= sizeof(addr.sun_path)) return false;
+  strcpy(addr.sun_path, path.c_str());
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) return false;
+  // Requests carry passwords: only to a broker running as our user.
+  if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || !PeerIsSelf(fd)) {
+    close(fd);
+    return false;
+  }
+
+  conn->fd = fd;
+  if (uv_thread_create(&conn->reader, ClientThread, conn) != 0) {
+    conn->fd = -1;
+    close(fd);
+    return false;
+  }
+  conn->reading = true;
+  return true;
+}
+
+void BrokerConnect(const char *path, int connections, int request_timeout_ms)
+{
+  uv_once(&broker_once, InitBroker);
+  if (connections < 1) connections = 1;
+  if (request_timeout_ms > 0) __atomic_store_n(&timeout_ms, request_timeout_ms, __ATOMIC_RELAXED);
+
+  uv_mutex_lock(&broker_lock);
+  bool moved = broker_path != path;
+  broker_path = path;
+  while ((int)conns.size() < connections)
+  {
+    client_conn *conn = new client_conn;
+    conn->fd = -1;
+    conn->reading = false;
+    conn->next_id = 0;
+    uv_mutex_init(&conn->lock);
+    conns.push_back(conn);
+  }
+  // Connections are never freed (a sender may be using one); surplus
+  // ones are only no longer picked.
+  active = connections;
+  if (moved) {
+    for (size_t idx = 0; idx < conns.size(); idx++)
+    {
+      uv_mutex_lock(&conns[idx]->lock);
+      // Its reader fails what is pending and marks it disconnected.
+      if (conns[idx]->fd >= 0) shutdown(conns[idx]->fd, SHUT_RDWR);
+      uv_mutex_unlock(&conns[idx]->lock);
+    }
+  }
+  __atomic_store_n(&next_conn, 0, __ATOMIC_RELAXED);
+  uv_mutex_unlock(&broker_lock);
+}
+
+bool BrokerForwarding()
+{
+  uv_once(&broker_once, InitBroker);
+
+  uv_mutex_lock(&broker_lock);
+  bool forwarding = !broker_path.empty();
+  uv_mutex_unlock(&broker_lock);
+  return forwarding;
+}
+
+bool BrokerSend(int type, const std::string &payload, void *request, broker_response_cb done)
+{
+  uv_once(&broker_once, InitBroker);
+
+  uv_mutex_lock(&broker_lock);
+  std::string path = broker_path;
+  client_conn *conn = NULL;
+  if (!path.empty() && active > 0) {
+    uint32_t pick = __atomic_fetch_add(&next_conn, 1, __ATOMIC_RELAXED);
+    conn = conns[pick % active];
+  }
+  uv_mutex_unlock(&broker_lock);
+  if (conn == NULL) return false;
+
+  uv_mutex_lock(&conn->lock);
+  if (!Connect(conn, path)) {
+    uv_mutex_unlock(&conn->lock);
+    return false;
+  }
+
+  uint32_t id = conn->next_id++;
+  pending_request waiting;
+  waiting.request = request;
+  waiting.done = done;
+  waiting.deadline = uv_hrtime() + __atomic_load_n(&timeout_ms, __ATOMIC_RELAXED) * NS_PER_MS;
+  conn->pending[id] = waiting;
+
+  if (!WriteFrame(conn->fd, id, type, payload)) {
+    // Not sent; the reader will notice the broken connection and fail
+    // the others.
+    conn->pending.erase(id);
+    shutdown(conn->fd, SHUT_RDWR);
+    uv_mutex_unlock(&conn->lock);
+    return false;
+  }
+  uv_mutex_unlock(&conn->lock);
+  return true;
+}
+
+void BrokerStats(broker_stats *stats)
+{
+  uv_once(&broker_once, InitBroker);
+
+  stats->serving = listen_fd >= 0;
+  stats->clients = __atomic_load_n(&clients, __ATOMIC_RELAXED);
+  stats->served = __atomic_load_n(&served, __ATOMIC_RELAXED);
+  stats->refused = __atomic_load_n(&refused, __ATOMIC_RELAXED);
+  stats->timeouts = __atomic_load_n(&timeouts, __ATOMIC_RELAXED);
+
+  uv_mutex_lock(&broker_lock);
+  stats->forwarding = !broker_path.empty();
+  stats->connected = 0;
+  stats->pending = 0;
+  for (size_t idx = 0; idx < conns.size(); idx++)
+  {
+    uv_mutex_lock(&conns[idx]->lock);
+    if (conns[idx]->fd >= 0) stats->connected++;
+    stats->pending += conns[idx]->pending.size();
+    uv_mutex_unlock(&conns[idx]->lock);
+  }
+  uv_mutex_unlock(&broker_lock);
+}
@@ -0,0 +1,95 @@
+// Broker mode: one process per host owns the directory connections and
+// caches; the others forward their requests to it over a Unix socket.
+
+/*
+The broker is a node process that has called broker(path), usually
+bin/ldapauth-broker. Clients configure({ broker: path }); authenticate()
+and search() then go to the broker instead of the directory, over a few
+long-lived socket connections, each carrying many requests at once.
+
+Every message is one frame, little-endian:
+
+   uint32 length       of what follows
+   uint32 id           chosen by the client, echoed in the response
+   uint8  type         BROKER_AUTHENTICATE / BROKER_SEARCH; in a
+                       response, BROKER_OK / BROKER_FAILED / BROKER_BUSY
+   payload             length-prefixed fields, see CacheAppend()
+
+Responses come back in completion order, not request order. This file
+only moves frames; ldapauth.cc encodes and runs the requests.
+
+Frames carry passwords, so the socket is only for this user: it is
+created 0600 in a directory that must be ours and closed to others
+(made 0700 if missing), and both ends check with SO_PEERCRED that the
+other runs as the same user. A path that is not a socket is never
+replaced. The broker serves at most BROKER_MAX_CLIENTS connections, a
+thread each; more are refused.
+
+A forwarded request not answered within the request timeout fails as
+if the connection had been lost, and the client runs it itself.
+*/
+
+#ifndef LDAPAUTH_BROKER_H
+#define LDAPAUTH_BROKER_H
+
+#include <stdint.h>
+
+#include <string>
+
+#define BROKER_AUTHENTICATE 1
+#define BROKER_SEARCH 2
+
+#define BROKER_OK 0
+#define BROKER_FAILED 1   // the broker could not reach the directory
+#define BROKER_BUSY 2     // broker's request queue full
+#define BROKER_LOST 3     // client side only: connection lost or timed out
+
+#define BROKER_MAX_CLIENTS 256
+
+// Default client-side deadline of a forwarded request.
+#define BROKER_TIMEOUT_MS 10000
+
+struct broker_conn;
+
+// Broker side. Called on a connection's reader thread for every request;
+// each must be answered with exactly one BrokerReply().
+typedef void (*broker_request_cb)(broker_conn *conn, uint32_t id, int type, const std::string &payload);
+
+// Listens on path, replacing any stale socket there. Returns false if the
+// socket cannot be created, or its directory is not private.
+bool BrokerListen(const char *path, broker_request_cb handler);
+
+// Any thread. Does nothing if the client has gone.
+void BrokerReply(broker_conn *conn, uint32_t id, int status, const std::string &payload);
+
+// Client side. Called on a reader thread with the broker's answer, or
+// with BROKER_LOST if the connection was lost or the request timed out
+// first.
+typedef void (*broker_response_cb)(void *request, int status, const std::string &payload);
+
+// Forwards requests to the broker at path over this many connections,
+// failing each not answered within request_timeout_ms (0 keeps the
+// current timeout). An empty path stops forwarding.
+void BrokerConnect(const char *path, int connections, int request_timeout_ms);
+
+bool BrokerForwarding();
+
+// Any thread. Returns false if the broker cannot be reached; otherwise
+// done is called exactly once.
+bool BrokerSend(int type, const std::string &payload, void *request, broker_response_cb done);
+
+struct broker_stats
+{
+  bool serving;
+  uint64_t clients;       // connected to this broker
+  uint64_t served;        // requests answered by this broker
+  uint64_t refused;       // connections from other users, or past the cap
+  bool forwarding;
+  uint64_t connected;     // of this client's connections
+  uint64_t pending;       // forwarded, not yet answered
+  uint64_t timeouts;      // forwarded, failed unanswered at the deadline
+};
+
+void BrokerStats(broker_stats *stats);
+
+#endif
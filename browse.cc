@@ -0,0 +1,462 @@
+// Sorted windows of search results by VLV, or by local lists. See browse.h.
+
+#include "browse.h"
+#include "bulk.h"
+#include "hash.h"
+#include "servers.h"
+#include "strcase.h"
+
+#include <ldap.h>
+#include <uv.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <map>
+
+#define NS_PER_MS 1000000ULL
+
+// A sorted result set kept for its windows.
+struct browse_list
+{
+  std::string key;              // servers, bind DN, HashKeyed() password, base, filter, sort
+  uint64_t created;             // uv_hrtime()
+  std::vector<std::string> dns;
+};
+
+// An entry being sorted: its DN and each key's first value, lowercased.
+struct sorted_entry
+{
+  std::string dn;
+  std::vector<std::string> keys;
+  std::vector<bool> present;
+};
+
+static uv_once_t browse_once = UV_ONCE_INIT;
+static uv_mutex_t browse_lock;
+static std::map<uint64_t, browse_list*> lists;                  // under browse_lock
+static std::map<std::string, uint64_t> unsupported;             // servers[, sort], until when
+static uint64_t next_list = 1;
+
+static uint64_t vlv_windows = 0;
+static uint64_t sorted_windows = 0;
+static uint64_t scans = 0;
+
+static void InitBrowse()
+{
+  uv_mutex_init(&browse_lock);
+}
+
+static std::string Hex(const char *data, size_t length)
+{
+  static const char digits[] = "0123456789abcdef";
+  std::string hex;
+  hex.reserve(length * 2);
+  for (size_t idx = 0; idx < length; idx++)
+  {
+    hex += digits[(unsigned char)data[idx] >> 4];
+    hex += digits[(unsigned char)data[idx] & 15];
+  }
+  return hex;
+}
+
+static int HexDigit(char c)
+{
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+static bool Unhex(const std::string &hex, std::string *data)
+{
+  if (hex.size() % 2 != 0) return false;
+  data->clear();
+  for (size_t idx = 0; idx < hex.size(); idx += 2)
+  {
+    int high = HexDigit(hex[idx]), low = HexDigit(hex[idx + 1]);
+    if (high < 0 || low < 0) return false;
+    *data += (char)(high << 4 | low);
+  }
+  return true;
+}
+
+void BrowseFree(browse_page *page)
+{
+  for (size_t idx = 0; idx < page->messages.size(); idx++)
+  {
+    ldap_msgfree(page->messages[idx]);
+  }
+  page->messages.clear();
+}
+
+// Whether res's sort response blames a sort key, rather than sorting as
+// such.
+static bool SortKeyRefused(LDAP *ldap, LDAPMessage *res)
+{
+  int err;
+  LDAPControl **response_controls = NULL;
+  if (res == NULL || ldap_parse_result(ldap, res, &err, NULL, NULL, NULL, &response_controls, 0) != LDAP_SUCCESS) {
+    return false;
+  }
+
+  bool by_key = false;
+  LDAPControl *response = ldap_control_find(LDAP_CONTROL_SORTRESPONSE, response_controls, NULL);
+  ber_int_t sort_rc;
+  char *attribute = NULL;
+  if (response != NULL && ldap_parse_sortresponse_control(ldap, response, &sort_rc, &attribute) == LDAP_SUCCESS) {
+    by_key = sort_rc != LDAP_SUCCESS && attribute != NULL;
+    ldap_memfree(attribute);
+  }
+  ldap_controls_free(response_controls);
+  return by_key;
+}
+
+// One window by sort and VLV controls. *refused is set if the server
+// will not sort or list, as opposed to failing the search; *by_key, too,
+// if it only will not sort by these keys.
+static int SearchVlv(conn_pool *pool, const char *base, const char *filter, char **attrs,
+                     LDAPSortKey **keys, const browse_spec &spec, const std::string &context,
+                     browse_page *page, bool *refused, bool *by_key)
+{
+  *refused = false;
+  *by_key = false;
+  LDAP *ldap = DecodeHandle();
+
+  LDAPControl *sort = NULL;
+  int rc = ldap_create_sort_control(ldap, keys, 1, &sort);
+  if (rc != LDAP_SUCCESS) return rc;
+
+  struct berval context_bv;
+  context_bv.bv_val = (char*)context.data();
+  context_bv.bv_len = context.size();
+
+  LDAPVLVInfo info;
+  info.ldvlv_version = 1;
+  info.ldvlv_before_count = 0;
+  info.ldvlv_after_count = spec.count > 0 ? spec.count - 1 : 0;
+  info.ldvlv_offset = spec.offset > 0 ? spec.offset : 1;
+  info.ldvlv_count = spec.total;
+  info.ldvlv_attrvalue = NULL;
+  info.ldvlv_context = context.empty() ? NULL : &context_bv;
+  info.ldvlv_extradata = NULL;
+
+  LDAPControl *vlv = NULL;
+  rc = ldap_create_vlv_control(ldap, &info, &vlv);
+  if (rc != LDAP_SUCCESS) {
+    ldap_control_free(sort);
+    return rc;
+  }
+
+  LDAPControl *controls[] = { sort, vlv, NULL };
+  LDAPMessage *res = NULL;
+  rc = PoolSearchControls(pool, base, LDAP_SCOPE_SUB, filter, attrs, controls, &res);
+  ldap_control_free(sort);
+  ldap_control_free(vlv);
+
+  if (res != NULL) page->messages.push_back(res);
+  if (rc == LDAP_UNAVAILABLE_CRITICAL_EXTENSION) {
+    *refused = true;
+    *by_key = SortKeyRefused(ldap, res);
+    return rc;
+  }
+  if (res == NULL) return rc;
+
+  int err;
+  LDAPControl **response_controls = NULL;
+  if (ldap_parse_result(ldap, res, &err, NULL, NULL, NULL, &response_controls, 0) != LDAP_SUCCESS) {
+    return rc == LDAP_SUCCESS ? LDAP_DECODING_ERROR : rc;
+  }
+
+  // Some servers ignore controls they do not know, critical or not.
+  LDAPControl *response = ldap_control_find(LDAP_CONTROL_VLVRESPONSE, response_controls, NULL);
+  if (response == NULL) {
+    ldap_controls_free(response_controls);
+    if (rc == LDAP_SUCCESS) {
+      *refused = true;
+      rc = LDAP_UNAVAILABLE_CRITICAL_EXTENSION;
+    }
+    return rc;
+  }
+
+  ber_int_t target = 0, count = 0;
+  struct berval *server_context = NULL;
+  int vlv_rc = LDAP_SUCCESS;
+  if (ldap_parse_vlvresponse_control(ldap, response, &target, &count, &server_context, &vlv_rc) == LDAP_SUCCESS) {
+    page->offset = target;
+    page->total = count;
+    page->context = server_context != NULL ? "v" + Hex(server_context->bv_val, server_context->bv_len) : "";
+    page->vlv = true;
+    if (rc == LDAP_SUCCESS) rc = vlv_rc;
+    ber_bvfree(server_context);
+  } else if (rc == LDAP_SUCCESS) {
+    rc = LDAP_DECODING_ERROR;
+  }
+  ldap_controls_free(response_controls);
+
+  return rc;
+}
+
+static bool FirstValue(const bulk_column &column, uint32_t entry, std::string *value)
+{
+  const int32_t *offsets = (const int32_t*)column.offsets.data;
+  const int32_t *value_offsets = (const int32_t*)column.value_offsets.data;
+  if (offsets[entry] == offsets[entry + 1]) return false;
+
+  int32_t first = offsets[entry];
+  value->assign(column.data.data + value_offsets[first], value_offsets[first + 1] - value_offsets[first]);
+  return true;
+}
+
+// RFC 2891: entries without a key's attribute sort as if their value
+// were larger than any other.
+struct SortOrder
+{
+  const std::vector<sorted_entry> *entries;
+  const std::vector<bool> *reverse;
+
+  bool operator()(size_t a, size_t b) const
+  {
+    const sorted_entry &x = (*entries)[a], &y = (*entries)[b];
+    for (size_t key = 0; key < reverse->size(); key++)
+    {
+      int order;
+      if (x.present[key] != y.present[key]) {
+        order = x.present[key] ? -1 : 1;
+      } else {
+        order = x.present[key] ? x.keys[key].compare(y.keys[key]) : 0;
+      }
+      if (order != 0) return (*reverse)[key] ? order > 0 : order < 0;
+    }
+    return x.dn < y.dn;
+  }
+};
+
+// Reads and sorts the whole set with a paged search.
+static int ScanList(const char *host, int port, const char *binddn, const char *password,
+                    const char *base, const char *filter, LDAPSortKey **keys, browse_list *list)
+{
+  std::vector<std::string> attributes;
+  std::vector<bool> reverse;
+  for (LDAPSortKey **key = keys; *key != NULL; key++)
+  {
+    attributes.push_back((*key)->attributeType);
+    reverse.push_back((*key)->reverseOrder != 0);
+  }
+
+  bulk_result bulk;
+  int rc = BulkSearch(host, port, binddn, password, base, filter, attributes, bulk_options(), &bulk);
+  if (rc != LDAP_SUCCESS) {
+    BulkFree(&bulk);
+    return rc;
+  }
+
+  std::vector<sorted_entry> entries(bulk.count);
+  std::vector<size_t> order(bulk.count);
+  for (uint32_t idx = 0; idx < bulk.count; idx++)
+  {
+    sorted_entry &entry = entries[idx];
+    FirstValue(bulk.dn, idx, &entry.dn);
+    entry.keys.resize(attributes.size());
+    entry.present.resize(attributes.size());
+    for (size_t key = 0; key < attributes.size(); key++)
+    {
+      std::string value;
+      entry.present[key] = FirstValue(bulk.columns[key], idx, &value);
+      if (entry.present[key]) entry.keys[key] = StrLower(value);
+    }
+    order[idx] = idx;
+  }
+  BulkFree(&bulk);
+
+  SortOrder less;
+  less.entries = &entries;
+  less.reverse = &reverse;
+  std::sort(order.begin(), order.end(), less);
+
+  list->dns.resize(order.size());
+  for (size_t idx = 0; idx < order.size(); idx++)
+  {
+    list->dns[idx].swap(entries[order[idx]].dn);
+  }
+  return LDAP_SUCCESS;
+}
+
+// Copies spec's window of the list named by its context, if that is
+// still kept for key.
+static bool SliceList(const std::string &key, const browse_spec &spec, browse_page *page,
+                      std::vector<std::string> *dns)
+{
+  if (spec.context.size() < 2 || spec.context[0] != 'l') return false;
+  uint64_t id = strtoull(spec.context.c_str() + 1, NULL, 10);
+  uint64_t now = uv_hrtime();
+
+  uv_mutex_lock(&browse_lock);
+  std::map<uint64_t, browse_list*>::iterator iter = lists.find(id);
+  bool found = iter != lists.end() && iter->second->key == key
+    && now - iter->second->created < BROWSE_TTL_MS * NS_PER_MS;
+  if (found) {
+    const std::vector<std::string> &all = iter->second->dns;
+    uint32_t total = all.size();
+    uint32_t first = std::min(std::max(spec.offset, (uint32_t)1), total);
+    page->offset = first;
+    page->total = total;
+    page->context = spec.context;
+    for (uint32_t idx = first; idx > 0 && idx <= total && idx < first + spec.count; idx++)
+    {
+      dns->push_back(all[idx - 1]);
+    }
+  }
+  uv_mutex_unlock(&browse_lock);
+  return found;
+}
+
+static std::string KeepList(browse_list *list)
+{
+  char context[32];
+  uv_mutex_lock(&browse_lock);
+  uint64_t id = next_list++;
+  lists[id] = list;
+  while (lists.size() > BROWSE_LISTS)
+  {
+    // Ids grow with time: the first is the oldest.
+    delete lists.begin()->second;
+    lists.erase(lists.begin());
+  }
+  scans++;
+  uv_mutex_unlock(&browse_lock);
+
+  snprintf(context, sizeof(context), "l%llu", (unsigned long long)id);
+  return context;
+}
+
+// One window from a local list, read and sorted here when the context
+// names none.
+static int SearchSorted(conn_pool *pool, const char *host, int port, const char *binddn, const char *password,
+                        const char *base, const char *filter, char **attrs, LDAPSortKey **keys,
+                        const browse_spec &spec, browse_page *page)
+{
+  // Only a keyed hash of the password is kept with the list.
+  std::string key = ServersKey(host, port) + '\n' + binddn + '\n' + HashKeyed(password, strlen(password)) + '\n'
+    + base + '\n' + filter + '\n' + spec.sort;
+
+  std::vector<std::string> dns;
+  if (!SliceList(key, spec, page, &dns)) {
+    browse_list *list = new browse_list;
+    list->key = key;
+    list->created = uv_hrtime();
+    int rc = ScanList(host, port, binddn, password, base, filter, keys, list);
+    if (rc != LDAP_SUCCESS) {
+      delete list;
+      return rc;
+    }
+
+    browse_spec named = spec;
+    named.context = KeepList(list);
+    if (!SliceList(key, named, page, &dns)) return LDAP_OTHER;
+  }
+
+  // The window's entries, read all at once but kept in its order.
+  std::vector<LDAPMessage*> res;
+  std::vector<int> rcs;
+  int rc = PoolSearchEach(pool, dns, LDAP_SCOPE_BASE, "(objectClass=*)", attrs, &res, &rcs);
+  for (size_t idx = 0; idx < res.size(); idx++)
+  {
+    if (res[idx] != NULL) page->messages.push_back(res[idx]);
+  }
+  if (rc != LDAP_SUCCESS) return rc;
+  for (size_t idx = 0; idx < rcs.size(); idx++)
+  {
+    // Gone since the list was read: the window is one short.
+    if (rcs[idx] != LDAP_SUCCESS && rcs[idx] != LDAP_NO_SUCH_OBJECT) return rcs[idx];
+  }
+  return LDAP_SUCCESS;
+}
+
+int BrowseSearch(conn_pool *pool, const char *host, int port, const char *binddn, const char *password,
+                 const char *base, const char *filter, const browse_spec &spec, browse_page *page)
+{
+  uv_once(&browse_once, InitBrowse);
+
+  LDAPSortKey **keys = NULL;
+  if (ldap_create_sort_keylist(&keys, (char*)spec.sort.c_str()) != LDAP_SUCCESS || keys == NULL) {
+    return LDAP_PARAM_ERROR;
+  }
+
+  std::vector<char*> attr_list;
+  for (size_t idx = 0; idx < spec.attributes.size(); idx++)
+  {
+    attr_list.push_back((char*)spec.attributes[idx].c_str());
+  }
+  attr_list.push_back(NULL);
+  char **attrs = spec.attributes.empty() ? NULL : &attr_list[0];
+
+  // Refusals blaming a sort key are remembered for that sort only.
+  std::string servers = ServersKey(host, port);
+  std::string servers_sort = servers + '\n' + spec.sort;
+  uint64_t now = uv_hrtime();
+  uv_mutex_lock(&browse_lock);
+  std::map<std::string, uint64_t>::iterator known = unsupported.find(servers);
+  bool refused = known != unsupported.end() && now < known->second;
+  known = unsupported.find(servers_sort);
+  if (known != unsupported.end() && now < known->second) refused = true;
+  uv_mutex_unlock(&browse_lock);
+
+  // A local context means the servers refused last time; a VLV one is
+  // the server's, or stale.
+  std::string context;
+  if (spec.context.size() > 1 && spec.context[0] == 'l') refused = true;
+  if (spec.context.size() > 1 && spec.context[0] == 'v' && !Unhex(spec.context.substr(1), &context)) {
+    context.clear();
+  }
+
+  int rc = LDAP_SUCCESS;
+  if (!refused) {
+    bool by_key;
+    rc = SearchVlv(pool, base, filter, attrs, keys, spec, context, page, &refused, &by_key);
+    if (rc != LDAP_SUCCESS && !refused && !context.empty() && !ServersUnreachable(rc)) {
+      // Likely another connection's context.
+      BrowseFree(page);
+      rc = SearchVlv(pool, base, filter, attrs, keys, spec, std::string(), page, &refused, &by_key);
+    }
+    if (refused) {
+      BrowseFree(page);
+      uv_mutex_lock(&browse_lock);
+      unsupported[by_key ? servers_sort : servers] = uv_hrtime() + BROWSE_TTL_MS * NS_PER_MS;
+      // Expired ones go with the next refusal.
+      now = uv_hrtime();
+      for (std::map<std::string, uint64_t>::iterator iter = unsupported.begin(); iter != unsupported.end(); )
+      {
+        if (iter->second <= now) unsupported.erase(iter++); else ++iter;
+      }
+      uv_mutex_unlock(&browse_lock);
+    }
+  }
+
+  if (refused) {
+    rc = SearchSorted(pool, host, port, binddn, password, base, filter, attrs, keys, spec, page);
+  }
+
+  uv_mutex_lock(&browse_lock);
+  if (rc == LDAP_SUCCESS) {
+    if (page->vlv) vlv_windows++;
+    else sorted_windows++;
+  }
+  uv_mutex_unlock(&browse_lock);
+
+  ldap_free_sort_keylist(keys);
+  return rc;
+}
+
+void BrowseStats(browse_stats *stats)
+{
+  uv_once(&browse_once, InitBrowse);
+
+  uv_mutex_lock(&browse_lock);
+  stats->vlv = vlv_windows;
+  stats->sorted = sorted_windows;
+  stats->scans = scans;
+  stats->lists = lists.size();
+  uv_mutex_unlock(&browse_lock);
+}
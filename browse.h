@@ -0,0 +1,88 @@
+// Sorted, random-access pages of search results, for directory browsing.
+
+/*
+Showing page 500 of an OU's users used to mean fetching every entry and
+slicing in JavaScript. search() given a sort order, an offset and a
+count instead asks the server for just that window: a server-side sort
+control (RFC 2891) and a virtual list view control
+(draft-ietf-ldapext-ldapv3-vlv), both critical, on a pooled connection.
+The answer is the window's entries, where it starts in the sorted set
+and how big the set is, and an opaque context for the next request.
+
+Servers without VLV (or sort) refuse the critical controls. For those,
+the matching entries' DNs and sort attributes are read once with a
+paged search (BulkSearch(), bulk.h), sorted here, and kept for
+BROWSE_TTL_MS under a local context; windows are sliced from that list
+and their entries read by DN, all sent at once on one pooled connection
+(PoolSearchEach()). The sort is by each key's first value,
+case-insensitively, entries without it last; ordering rules are not
+applied. Servers seen refusing are not asked again for BROWSE_TTL_MS;
+if their sort response blames a sort key, only for that sort.
+
+Contexts are "v" and the server's context ID in hex, or "l" and the
+local list's number. A VLV context belongs to the connection that got
+it; if another connection's server rejects it, the search is made again
+without one.
+*/
+
+#ifndef LDAPAUTH_BROWSE_H
+#define LDAPAUTH_BROWSE_H
+
+#include <ldap.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "pool.h"
+
+#define BROWSE_TTL_MS 300000
+
+// Local lists kept at most; the oldest goes first.
+#define BROWSE_LISTS 16
+
+struct browse_spec
+{
+  std::string sort;             // "sn -givenName": keys, '-' for descending
+  uint32_t offset;              // of the window's first entry, from 1
+  uint32_t count;               // entries wanted
+  uint32_t total;               // the set's size as last seen, or 0
+  std::string context;          // from the last window, or empty
+  std::vector<std::string> attributes;  // to return; empty for all
+};
+
+struct browse_page
+{
+  uint32_t offset;              // of the first entry returned, from 1
+  uint32_t total;
+  std::string context;
+  bool vlv;                     // served by the server's VLV
+
+  // The entries, in order: one chain from the server, or one chain per
+  // entry read by DN. Freed with ldap_msgfree().
+  std::vector<LDAPMessage*> messages;
+
+  browse_page() : offset(0), total(0), vlv(false) {}
+};
+
+// Reads spec's window of the entries under base matching filter on
+// pool, whose servers are host:port as binddn. Blocks; returns an LDAP
+// result code, LDAP_PARAM_ERROR for a bad sort order. page->messages
+// may hold entries even on error.
+int BrowseSearch(conn_pool *pool, const char *host, int port, const char *binddn, const char *password,
+                 const char *base, const char *filter, const browse_spec &spec, browse_page *page);
+
+// Frees page's messages.
+void BrowseFree(browse_page *page);
+
+struct browse_stats
+{
+  uint64_t vlv;                 // windows served by VLV
+  uint64_t sorted;              // by local lists
+  uint64_t scans;               // local lists read
+  uint64_t lists;               // kept now
+};
+
+void BrowseStats(browse_stats *stats);
+
+#endif
@@ -0,0 +1,263 @@
+// Host-wide connection budget through shared memory. See budget.h.
+
+#include "budget.h"
+#include "hash.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+
+#define BUDGET_MAGIC 0x4c444231   // "LDB1"
+#define BUDGET_SERVERS 128
+#define BUDGET_PROCESSES 256
+
+#define SLOT_FREE 0
+#define SLOT_LIVE 1
+#define SLOT_BUSY 2   // being registered or reclaimed
+
+struct budget_server
+{
+  uint64_t key;       // hash of the server; 0 while unused
+  uint32_t used;      // connections held host-wide
+  uint32_t unused;
+};
+
+struct budget_process
+{
+  uint32_t state;
+  int32_t pid;
+  uint64_t start_time;              // from /proc, 0 if unknown
+  uint16_t held[BUDGET_SERVERS];    // connections held per server
+};
+
+struct budget_segment
+{
+  uint32_t magic;
+  uint32_t unused;
+  budget_server servers[BUDGET_SERVERS];
+  budget_process processes[BUDGET_PROCESSES];
+};
+
+static budget_segment *segment = NULL;
+static budget_process *self = NULL;
+static int per_server_limit = 0;
+static uint64_t refused = 0;
+static uint64_t reclaimed = 0;
+
+// Field 22 of /proc/<pid>/stat: when the process started, in clock ticks
+// since boot. Tells a reused pid apart from the process that registered.
+static uint64_t ProcessStartTime(int pid)
+{
+  char path[64];
+  sprintf(path, "/proc/%d/stat", pid);
+  FILE *file = fopen(path, "r");
+  if (file == NULL) return 0;
+
+  char line[1024];
+  size_t length = fread(line, 1, sizeof(line) - 1, file);
+  fclose(file);
+  line[length] = '\0';
+
+  // The command name may contain anything; fields resume after its ')'.
+  char *field = strrchr(line, ')');
+  if (field == NULL) return 0;
+  for (int idx = 2; idx < 22 && field != NULL; idx++)
+  {
+    field = strchr(field + 1, ' ');
+  }
+  return field != NULL ? strtoull(field + 1, NULL, 10) : 0;
+}
+
+static bool Dead(budget_process *process)
+{
+  int pid = __atomic_load_n(&process->pid, __ATOMIC_ACQUIRE);
+  if (kill(pid, 0) == -1 && errno == ESRCH) return true;
+
+  uint64_t started = process->start_time;
+  uint64_t now = ProcessStartTime(pid);
+  return started != 0 && now != 0 && started != now;
+}
+
+// Gives back everything process holds. The caller owns it (SLOT_BUSY).
+static uint64_t Drain(budget_process *process)
+{
+  uint64_t total = 0;
+  for (int idx = 0; idx < BUDGET_SERVERS; idx++)
+  {
+    uint16_t held = __atomic_exchange_n(&process->held[idx], 0, __ATOMIC_ACQ_REL);
+    if (held > 0) {
+      __atomic_fetch_sub(&segment->servers[idx].used, held, __ATOMIC_ACQ_REL);
+      total += held;
+    }
+  }
+  return total;
+}
+
+// Releases what dead processes held. Returns whether any was found.
+static bool ReclaimDead()
+{
+  bool found = false;
+  for (int idx = 0; idx < BUDGET_PROCESSES; idx++)
+  {
+    budget_process *process = &segment->processes[idx];
+    if (process == self || __atomic_load_n(&process->state, __ATOMIC_ACQUIRE) != SLOT_LIVE) continue;
+    if (!Dead(process)) continue;
+
+    uint32_t live = SLOT_LIVE;
+    if (!__atomic_compare_exchange_n(&process->state, &live, SLOT_BUSY, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) continue;
+    __atomic_fetch_add(&reclaimed, Drain(process), __ATOMIC_RELAXED);
+    __atomic_store_n(&process->state, SLOT_FREE, __ATOMIC_RELEASE);
+    found = true;
+  }
+  return found;
+}
+
+static void Leave()
+{
+  if (self == NULL) return;
+  __atomic_store_n(&self->state, SLOT_BUSY, __ATOMIC_RELEASE);
+  Drain(self);
+  __atomic_store_n(&self->state, SLOT_FREE, __ATOMIC_RELEASE);
+  self = NULL;
+}
+
+static bool Register()
+{
+  for (int pass = 0; pass < 2; pass++)
+  {
+    for (int idx = 0; idx < BUDGET_PROCESSES; idx++)
+    {
+      budget_process *process = &segment->processes[idx];
+      uint32_t free_slot = SLOT_FREE;
+      if (!__atomic_compare_exchange_n(&process->state, &free_slot, SLOT_BUSY, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) continue;
+
+      memset(process->held, 0, sizeof(process->held));
+      process->start_time = ProcessStartTime(getpid());
+      __atomic_store_n(&process->pid, getpid(), __ATOMIC_RELEASE);
+      __atomic_store_n(&process->state, SLOT_LIVE, __ATOMIC_RELEASE);
+      self = process;
+      atexit(Leave);
+      return true;
+    }
+    // Full: maybe of processes that are gone.
+    if (!ReclaimDead()) break;
+  }
+  return false;
+}
+
+bool BudgetConfigure(const char *name, int per_server)
+{
+  if (per_server > 0) per_server_limit = per_server;
+  if (segment != NULL) return true;
+
+  std::string path = std::string("/ldapauth-") + name;
+  int fd = shm_open(path.c_str(), O_RDWR | O_CREAT, 0600);
+  if (fd < 0) return false;
+
+  // Growing a new segment zero-fills it; an existing one is left as is.
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (st.st_size < (off_t)sizeof(budget_segment)
+                              && ftruncate(fd, sizeof(budget_segment)) != 0)) {
+    close(fd);
+    return false;
+  }
+
+  void *mapped = mmap(NULL, sizeof(budget_segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED) return false;
+
+  budget_segment *shared = (budget_segment*)mapped;
+  uint32_t magic = 0;
+  __atomic_compare_exchange_n(&shared->magic, &magic, BUDGET_MAGIC, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+  if (magic != 0 && magic != BUDGET_MAGIC) {
+    // Another version's layout.
+    munmap(mapped, sizeof(budget_segment));
+    return false;
+  }
+
+  segment = shared;
+  if (!Register()) {
+    segment = NULL;
+    munmap(mapped, sizeof(budget_segment));
+    return false;
+  }
+  return true;
+}
+
+// The server's slot, claiming a free one the first time. -1 if full.
+static int ServerSlot(const char *server)
+{
+  uint64_t key = HashBytes(server, strlen(server));
+  if (key == 0) key = 1;
+
+  for (int probe = 0; probe < BUDGET_SERVERS; probe++)
+  {
+    budget_server *slot = &segment->servers[(key + probe) % BUDGET_SERVERS];
+    uint64_t current = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE);
+    if (current == 0) {
+      __atomic_compare_exchange_n(&slot->key, &current, key, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+      if (current == 0) current = key;
+    }
+    if (current == key) return slot - segment->servers;
+  }
+  return -1;
+}
+
+static bool TakeOne(budget_server *slot)
+{
+  uint32_t used = __atomic_load_n(&slot->used, __ATOMIC_ACQUIRE);
+  do {
+    if (used >= (uint32_t)per_server_limit) return false;
+  } while (!__atomic_compare_exchange_n(&slot->used, &used, used + 1, true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+  return true;
+}
+
+bool BudgetAcquire(const char *server, bool *counted)
+{
+  *counted = false;
+  if (self == NULL) return true;
+
+  int idx = ServerSlot(server);
+  if (idx < 0) return true;
+
+  budget_server *slot = &segment->servers[idx];
+  if (!TakeOne(slot) && !(ReclaimDead() && TakeOne(slot))) {
+    __atomic_fetch_add(&refused, 1, __ATOMIC_RELAXED);
+    return false;
+  }
+  __atomic_fetch_add(&self->held[idx], 1, __ATOMIC_ACQ_REL);
+  *counted = true;
+  return true;
+}
+
+void BudgetRelease(const char *server)
+{
+  if (self == NULL) return;
+
+  int idx = ServerSlot(server);
+  if (idx < 0) return;
+
+  __atomic_fetch_sub(&self->held[idx], 1, __ATOMIC_ACQ_REL);
+  __atomic_fetch_sub(&segment->servers[idx].used, 1, __ATOMIC_ACQ_REL);
+}
+
+void BudgetStats(budget_stats *stats)
+{
+  stats->enabled = self != NULL;
+  stats->per_server = per_server_limit;
+  stats->processes = 0;
+  for (int idx = 0; segment != NULL && idx < BUDGET_PROCESSES; idx++)
+  {
+    if (__atomic_load_n(&segment->processes[idx].state, __ATOMIC_ACQUIRE) == SLOT_LIVE) stats->processes++;
+  }
+  stats->refused = __atomic_load_n(&refused, __ATOMIC_RELAXED);
+  stats->reclaimed = __atomic_load_n(&reclaimed, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,56 @@
+// Host-wide connection budget, shared by every process through shm.
+
+/*
+Cluster workers each load their own copy of the addon, and each opens
+its own search pools. With configure({ connectionBudget }), they all map
+one POSIX shared memory segment (/ldapauth-<name>) and count their pooled
+connections to each server there, so that together the host stays within
+perServer connections per server:
+
+  servers[]    server key and connections held host-wide (atomic)
+  processes[]  pid, start time and connections held per server, so that
+               what a crashed process held can be taken back
+
+A pool asks BudgetAcquire() before opening a connection and calls
+BudgetRelease() when it closes one. Every connection counts, a pool's
+first included. A refused pool makes do with the connections it has; a
+pool with none first has this process's least recently used idle pool
+to the same server close, and if there is none its search fails with
+LDAP_ADMINLIMIT_EXCEEDED (pool.h). When the budget is exhausted,
+processes that have died (no such pid, or a different process under
+that pid) are looked for and their connections released.
+
+The segment is zero-filled on creation and an all-zero segment is empty,
+so processes can start in any order. Everything in it is updated with
+atomic operations; there is no lock a crashed process could leave held.
+*/
+
+#ifndef LDAPAUTH_BUDGET_H
+#define LDAPAUTH_BUDGET_H
+
+#include <stdint.h>
+
+// Joins the segment called name. A process joins one segment, once;
+// later calls only change per_server. Returns false, leaving budgeting
+// off, if the segment cannot be mapped or has no free process slot.
+bool BudgetConfigure(const char *name, int per_server);
+
+// May this process open another connection to server? *counted says
+// whether the connection went against the budget (it does not when
+// budgeting is off); if so, it must be given back with BudgetRelease().
+bool BudgetAcquire(const char *server, bool *counted);
+
+void BudgetRelease(const char *server);
+
+struct budget_stats
+{
+  bool enabled;
+  int per_server;
+  int processes;          // registered and alive
+  uint64_t refused;       // by this process
+  uint64_t reclaimed;     // connections taken back from dead processes
+};
+
+void BudgetStats(budget_stats *stats);
+
+#endif
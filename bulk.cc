@@ -0,0 +1,368 @@
+// Columnar bulk searches. See bulk.h.
+
+#include "bulk.h"
+#include "servers.h"
+#include "hash.h"
+#include "strcase.h"
+
+#include <ldap.h>
+#include <uv.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+// Offsets are int32s.
+#define MAX_OFFSET 0x7fffffff
+
+#define DIGEST_SIZE 16
+#define TABLE_RECORD_SIZE (8 + DIGEST_SIZE)
+
+// An entry of the digest table being built.
+struct digest_record
+{
+  uint64_t dn_hash;
+  unsigned char digest[DIGEST_SIZE];
+  std::string dn;
+
+  bool operator<(const digest_record &other) const { return dn_hash < other.dn_hash; }
+};
+
+// An entry of the previous run's table, pointing into it.
+struct previous_record
+{
+  uint64_t dn_hash;
+  const char *digest;
+  const char *dn;
+  uint32_t dn_length;
+  bool seen;
+
+  bool operator<(const previous_record &other) const { return dn_hash < other.dn_hash; }
+};
+
+// What a search needs between pages, for digests.
+struct digest_state
+{
+  bool digests;
+  std::vector<size_t> order;    // columns by lowercased name
+  std::vector<std::string> names;       // lowercased, by column
+  std::vector<previous_record> previous;
+  bool has_previous;
+  std::vector<digest_record> records;
+  std::string canonical;        // scratch
+};
+
+static bool Reserve(bulk_buffer *buffer, size_t more)
+{
+  if (buffer->size + more <= buffer->capacity) return true;
+  size_t capacity = buffer->capacity < 4096 ? 4096 : buffer->capacity;
+  while (capacity < buffer->size + more) capacity *= 2;
+  char *data = (char*)realloc(buffer->data, capacity);
+  if (data == NULL) return false;
+  buffer->data = data;
+  buffer->capacity = capacity;
+  return true;
+}
+
+static bool Append(bulk_buffer *buffer, const void *data, size_t length)
+{
+  if (!Reserve(buffer, length)) return false;
+  memcpy(buffer->data + buffer->size, data, length);
+  buffer->size += length;
+  return true;
+}
+
+static bool AppendOffset(bulk_buffer *buffer, size_t offset)
+{
+  if (offset > MAX_OFFSET) return false;
+  int32_t value = (int32_t)offset;
+  return Append(buffer, &value, sizeof(value));
+}
+
+// Sets or clears entry index's bit, growing the bitmap a byte at a time.
+static bool AppendValid(bulk_buffer *validity, uint32_t index, bool valid)
+{
+  if (index % 8 == 0) {
+    unsigned char zero = 0;
+    if (!Append(validity, &zero, 1)) return false;
+  }
+  if (valid) validity->data[index / 8] |= (unsigned char)(1 << (index % 8));
+  return true;
+}
+
+static void InitColumn(bulk_column *column, const std::string &name)
+{
+  column->name = name;
+  AppendOffset(&column->offsets, 0);
+  AppendOffset(&column->value_offsets, 0);
+}
+
+// Appends one entry's values, none if values is NULL.
+static bool AppendEntry(bulk_column *column, uint32_t index, struct berval **values)
+{
+  int count = ldap_count_values_len(values);
+  if (!AppendValid(&column->validity, index, values != NULL)) return false;
+  for (int idx = 0; idx < count; idx++)
+  {
+    if (!Append(&column->data, values[idx]->bv_val, values[idx]->bv_len)
+        || !AppendOffset(&column->value_offsets, column->data.size)) {
+      return false;
+    }
+  }
+  return AppendOffset(&column->offsets, column->value_offsets.size / sizeof(int32_t) - 1);
+}
+
+static bool ValueLess(const struct berval *a, const struct berval *b)
+{
+  int order = memcmp(a->bv_val, b->bv_val, std::min(a->bv_len, b->bv_len));
+  return order != 0 ? order < 0 : a->bv_len < b->bv_len;
+}
+
+static void AppendLength(std::string *canonical, size_t length)
+{
+  uint32_t value = (uint32_t)length;
+  canonical->append((const char*)&value, sizeof(value));
+}
+
+// The digest of an entry's values, one list per column.
+static void Digest(digest_state *state, const std::vector<struct berval**> &values, unsigned char *digest)
+{
+  std::string &canonical = state->canonical;
+  canonical.clear();
+  std::vector<struct berval*> sorted;
+  for (size_t idx = 0; idx < state->order.size(); idx++)
+  {
+    size_t column = state->order[idx];
+    int count = ldap_count_values_len(values[column]);
+    if (count == 0) continue;
+
+    AppendLength(&canonical, state->names[column].size());
+    canonical += state->names[column];
+    AppendLength(&canonical, count);
+    sorted.assign(values[column], values[column] + count);
+    std::sort(sorted.begin(), sorted.end(), ValueLess);
+    for (int value = 0; value < count; value++)
+    {
+      AppendLength(&canonical, sorted[value]->bv_len);
+      canonical.append(sorted[value]->bv_val, sorted[value]->bv_len);
+    }
+  }
+  Murmur3(canonical.data(), canonical.size(), digest);
+}
+
+// Orders column indexes by their lowercased names.
+struct ColumnOrder
+{
+  const std::vector<std::string> &names;
+
+  ColumnOrder(const std::vector<std::string> &names) : names(names) {}
+  bool operator()(size_t a, size_t b) const { return names[a] < names[b]; }
+};
+
+// Reads the previous run's table into state, sorted as written. False if
+// it is not one.
+static bool ParsePrevious(const char *table, size_t length, digest_state *state)
+{
+  uint32_t count;
+  if (length < sizeof(count)) return false;
+  memcpy(&count, table, sizeof(count));
+  if ((length - sizeof(count)) / TABLE_RECORD_SIZE < count) return false;
+
+  const char *record = table + sizeof(count);
+  const char *dn = record + (size_t)count * TABLE_RECORD_SIZE;
+  const char *end = table + length;
+  state->previous.resize(count);
+  for (uint32_t idx = 0; idx < count; idx++, record += TABLE_RECORD_SIZE)
+  {
+    previous_record *previous = &state->previous[idx];
+    memcpy(&previous->dn_hash, record, 8);
+    previous->digest = record + 8;
+    if (end - dn < 4) return false;
+    memcpy(&previous->dn_length, dn, 4);
+    if ((size_t)(end - dn - 4) < previous->dn_length) return false;
+    previous->dn = dn + 4;
+    dn += 4 + previous->dn_length;
+    previous->seen = false;
+    if (idx > 0 && previous->dn_hash < state->previous[idx - 1].dn_hash) return false;
+  }
+  return true;
+}
+
+static void WriteTable(digest_state *state, bulk_result *result)
+{
+  std::sort(state->records.begin(), state->records.end());
+  uint32_t count = state->records.size();
+  Append(&result->table, &count, sizeof(count));
+  for (size_t idx = 0; idx < state->records.size(); idx++)
+  {
+    Append(&result->table, &state->records[idx].dn_hash, 8);
+    Append(&result->table, state->records[idx].digest, DIGEST_SIZE);
+  }
+  for (size_t idx = 0; idx < state->records.size(); idx++)
+  {
+    uint32_t length = state->records[idx].dn.size();
+    Append(&result->table, &length, sizeof(length));
+    Append(&result->table, state->records[idx].dn.data(), length);
+  }
+
+  for (size_t idx = 0; idx < state->previous.size(); idx++)
+  {
+    if (!state->previous[idx].seen) {
+      result->removed.push_back(std::string(state->previous[idx].dn, state->previous[idx].dn_length));
+    }
+  }
+}
+
+// Whether an entry goes in the columns, and as what; records its digest.
+static bool Compare(digest_state *state, const char *dn, const std::vector<struct berval**> &values,
+                    unsigned char *digest, char *change, bulk_result *result)
+{
+  digest_record record;
+  record.dn = dn;
+  std::string lowered = StrLower(record.dn);
+  record.dn_hash = HashBytes(lowered.data(), lowered.size());
+  Digest(state, values, digest);
+  memcpy(record.digest, digest, DIGEST_SIZE);
+  state->records.push_back(record);
+
+  *change = BULK_ADDED;
+  if (!state->has_previous) return true;
+
+  previous_record key;
+  key.dn_hash = record.dn_hash;
+  std::vector<previous_record>::iterator previous = std::lower_bound(state->previous.begin(), state->previous.end(), key);
+  // Two DNs may share a hash; only the same DN is the same entry.
+  while (previous != state->previous.end() && previous->dn_hash == record.dn_hash
+         && StrLower(std::string(previous->dn, previous->dn_length)) != lowered)
+  {
+    ++previous;
+  }
+  if (previous == state->previous.end() || previous->dn_hash != record.dn_hash) return true;
+
+  previous->seen = true;
+  if (memcmp(previous->digest, digest, DIGEST_SIZE) == 0) {
+    result->unchanged++;
+    return false;
+  }
+  *change = BULK_CHANGED;
+  return true;
+}
+
+struct page_state
+{
+  digest_state *digests;
+  bulk_result *result;
+};
+
+// Appends a page of entries to the columns.
+static int AppendPage(LDAP *ldap, LDAPMessage *page, void *arg)
+{
+  digest_state *state = ((page_state*)arg)->digests;
+  bulk_result *result = ((page_state*)arg)->result;
+  std::vector<struct berval**> values(result->columns.size());
+  for (LDAPMessage *entry = ldap_first_entry(ldap, page); entry != NULL; entry = ldap_next_entry(ldap, entry))
+  {
+    char *dn = ldap_get_dn(ldap, entry);
+    struct berval dn_value = { dn != NULL ? strlen(dn) : 0, dn != NULL ? dn : (char*)"" };
+    struct berval *dn_values[] = { &dn_value, NULL };
+    for (size_t column = 0; column < result->columns.size(); column++)
+    {
+      values[column] = ldap_get_values_len(ldap, entry, result->columns[column].name.c_str());
+    }
+
+    bool emit = true, appended = true;
+    unsigned char digest[DIGEST_SIZE];
+    char change;
+    if (state->digests) emit = Compare(state, dn_value.bv_val, values, digest, &change, result);
+
+    if (emit) {
+      appended = AppendEntry(&result->dn, result->count, dn_values);
+      for (size_t column = 0; appended && column < result->columns.size(); column++)
+      {
+        appended = AppendEntry(&result->columns[column], result->count, values[column]);
+      }
+      if (appended && state->digests) appended = Append(&result->digests, digest, DIGEST_SIZE);
+      if (appended && state->has_previous) appended = Append(&result->changes, &change, 1);
+    }
+
+    for (size_t column = 0; column < result->columns.size(); column++)
+    {
+      ldap_value_free_len(values[column]);
+    }
+    ldap_memfree(dn);
+    // Out of memory, or past what int32 offsets reach.
+    if (!appended) return LDAP_SIZELIMIT_EXCEEDED;
+    if (emit) result->count++;
+  }
+  return LDAP_SUCCESS;
+}
+
+int BulkSearch(const char *host, int port, const char *binddn, const char *password,
+               const char *base, const char *filter, const std::vector<std::string> &attributes,
+               const bulk_options &options, bulk_result *result)
+{
+  InitColumn(&result->dn, "dn");
+  result->columns.resize(attributes.size());
+  for (size_t idx = 0; idx < attributes.size(); idx++)
+  {
+    InitColumn(&result->columns[idx], attributes[idx]);
+  }
+
+  digest_state state;
+  state.digests = options.digests;
+  state.has_previous = options.digests && options.previous != NULL;
+  if (state.has_previous && !ParsePrevious(options.previous, options.previous_length, &state)) {
+    return LDAP_PARAM_ERROR;
+  }
+  for (size_t idx = 0; idx < attributes.size(); idx++)
+  {
+    state.names.push_back(StrLower(attributes[idx]));
+    state.order.push_back(idx);
+  }
+  std::sort(state.order.begin(), state.order.end(), ColumnOrder(state.names));
+
+  int rc;
+  LDAP *ldap = ServersConnect(host, port, binddn, password, &rc);
+  if (ldap == NULL) return rc;
+
+  std::vector<char*> attrs;
+  for (size_t idx = 0; idx < attributes.size(); idx++)
+  {
+    attrs.push_back((char*)attributes[idx].c_str());
+  }
+  char noattrs[] = LDAP_NO_ATTRS;
+  if (attrs.empty()) attrs.push_back(noattrs);
+  attrs.push_back(NULL);
+
+  page_state pages;
+  pages.digests = &state;
+  pages.result = result;
+  rc = ServersPagedSearch(ldap, base, filter, &attrs[0], AppendPage, &pages);
+
+  ldap_unbind_ext(ldap, NULL, NULL);
+  if (rc == LDAP_SUCCESS && state.digests) WriteTable(&state, result);
+  return rc;
+}
+
+static void FreeColumn(bulk_column *column)
+{
+  free(column->validity.data);
+  free(column->offsets.data);
+  free(column->value_offsets.data);
+  free(column->data.data);
+  column->validity.data = column->offsets.data = column->value_offsets.data = column->data.data = NULL;
+}
+
+void BulkFree(bulk_result *result)
+{
+  free(result->digests.data);
+  free(result->table.data);
+  free(result->changes.data);
+  result->digests.data = result->table.data = result->changes.data = NULL;
+  FreeColumn(&result->dn);
+  for (size_t idx = 0; idx < result->columns.size(); idx++)
+  {
+    FreeColumn(&result->columns[idx]);
+  }
+}
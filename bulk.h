@@ -0,0 +1,108 @@
+// Bulk searches returned as columns rather than one object per entry.
+
+/*
+An export of a few attributes of half a million entries, as search()
+style objects, is half a million V8 objects holding a few million
+strings: slow to build, and slow to scan for one attribute. BulkSearch()
+instead reads the entries with a paged search on a worker, and appends
+each page's values to one column per attribute, in Apache Arrow's
+columnar layout (List<Binary>) without the IPC framing:
+
+  validity      a bit per entry, least significant first: set if the
+                entry has the attribute
+  offsets       count + 1 int32s: entry i's values are values
+                offsets[i] to offsets[i + 1]
+  value_offsets int32s, one more than there are values: value j is
+                data[value_offsets[j], value_offsets[j + 1])
+  data          the values' bytes, back to back
+
+Entries' DNs make one more column with every bit set and one value
+each. Integers are little-endian, as Arrow has them on every platform
+ldapauth runs on. The buffers are malloc()ed, so aligned to at least 8
+bytes, and are handed to JavaScript as they are.
+
+For incremental syncs, each entry can also get a digest: MurmurHash3
+x64_128 of its requested attributes in a canonical form (attributes by
+lowercased name, each one's values sorted bytewise, all with their
+lengths), so that the same content always hashes the same whatever
+order the server sent it in. The digests of all entries come back as a
+table, keyed by a 64-bit hash of the lowercased DN:
+
+  count           uint32
+  count records   uint64 DN hash, 16 digest bytes; by DN hash
+  count DNs       uint32 length and bytes, in the records' order
+
+Given the previous run's table, only entries added (BULK_ADDED) or
+changed (BULK_CHANGED) since go in the columns, with a byte each saying
+which, and the DNs no longer there are listed as removed.
+*/
+
+#ifndef LDAPAUTH_BULK_H
+#define LDAPAUTH_BULK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+// A growing malloc()ed buffer; data is given away with it.
+struct bulk_buffer
+{
+  char *data;
+  size_t size;
+  size_t capacity;
+
+  bulk_buffer() : data(NULL), size(0), capacity(0) {}
+};
+
+struct bulk_column
+{
+  std::string name;
+  bulk_buffer validity;
+  bulk_buffer offsets;
+  bulk_buffer value_offsets;
+  bulk_buffer data;
+};
+
+#define BULK_ADDED 'a'
+#define BULK_CHANGED 'c'
+
+struct bulk_options
+{
+  bool digests;
+  const char *previous;         // the last run's digest table, or NULL
+  size_t previous_length;
+
+  bulk_options() : digests(false), previous(NULL), previous_length(0) {}
+};
+
+struct bulk_result
+{
+  uint32_t count;               // entries in the columns
+  bulk_column dn;
+  std::vector<bulk_column> columns;
+
+  // With digests.
+  bulk_buffer digests;          // 16 bytes per entry in the columns
+  bulk_buffer table;            // of every entry read, see above
+  bulk_buffer changes;          // BULK_* per entry in the columns, given previous
+  std::vector<std::string> removed;
+  uint32_t unchanged;
+
+  bulk_result() : count(0), unchanged(0) {}
+};
+
+// Reads every entry under base matching filter, made on host:port as
+// binddn, into result, attributes' values in columns named after them.
+// Blocks; returns an LDAP result code, LDAP_PARAM_ERROR if
+// options.previous is not a digest table. On error, result holds what
+// was read before it.
+int BulkSearch(const char *host, int port, const char *binddn, const char *password,
+               const char *base, const char *filter, const std::vector<std::string> &attributes,
+               const bulk_options &options, bulk_result *result);
+
+// Frees what was not given away; given away buffers have NULL data.
+void BulkFree(bulk_result *result);
+
+#endif
@@ -0,0 +1,753 @@
+// Bounded, expiring caches with W-TinyLFU admission. See cache.h.
+
+#include "cache.h"
+#include "hash.h"
+#include "tier.h"
+
+#include <uv.h>
+#include <string.h>
+#include <sys/time.h>
+
+#ifdef HAVE_ZSTD
+#include <pthread.h>
+#include <zstd.h>
+#include <zdict.h>
+#endif
+
+#include <list>
+#include <map>
+#include <vector>
+#include <algorithm>
+
+#define NS_PER_MS 1000000ULL
+
+// Entries live in one of three LRU lists.
+#define SEGMENT_WINDOW 0
+#define SEGMENT_PROBATION 1
+#define SEGMENT_PROTECTED 2
+
+// Of the capacity, the window gets 1% and the protected segment 80% of
+// the rest.
+#define WINDOW_PERCENT 1
+#define PROTECTED_PERCENT 80
+
+#define SKETCH_ROWS 4
+#define SKETCH_MAX 15          // counters saturate, as 4-bit counters would
+#define SAMPLE_FACTOR 10       // counts recorded per entry before aging
+
+// Compression: values sampled, and the dictionary trained from them.
+#define TRAIN_SAMPLES 1000
+#define TRAIN_MAX_BYTES (4 * 1024 * 1024)
+#define DICT_SIZE (16 * 1024)
+#define ZSTD_LEVEL 3
+
+// Evicted entries waiting for the demoter thread; past this many, more
+// are not demoted.
+#define DEMOTE_QUEUE_MAX 4096
+
+struct cache_entry
+{
+  std::string key;
+  std::string value;
+  uint64_t expires;   // hrtime
+  int segment;
+  bool compressed;    // value is a zstd frame
+  size_t raw_size;    // of key and value before compression
+};
+
+typedef std::list<cache_entry> cache_list;
+
+struct demotion
+{
+  std::string key;
+  std::string value;
+  bool compressed;
+  int64_t expires;    // unix ms
+};
+
+struct cache
+{
+  uv_mutex_t lock;
+  size_t capacity;
+  uint64_t ttl_ns;
+  bool tinylfu;                     // else plain LRU: the window is everything
+  cache_list segments[3];           // most recently used first
+  std::map<std::string, cache_list::iterator> index;
+  cache_stats stats;
+
+  // Count-min sketch of how often each key was asked for lately. Every
+  // sample_size additions, all counters are halved, so that old
+  // popularity fades.
+  std::vector<uint8_t> sketch;      // SKETCH_ROWS rows of width counters
+  size_t width;                     // power of two
+  size_t additions;
+  size_t sample_size;
+
+  // Optional compression, see CacheConfigureCompression().
+  bool compress;                    // atomic
+  uint64_t bytes;                   // stored keys and values
+  uint64_t raw_bytes;               // ... as they would be uncompressed
+  uint64_t decompressions;          // atomic
+  uint64_t decompress_ns;           // atomic
+
+  // Where entries evicted for room go, if anywhere. See tier.h. The
+  // tier is only used outside lock: its puts may compact the log. Gets,
+  // puts and removals hold tier_lock for reading, replacing the tier
+  // holds it for writing; cold changes under both locks.
+  tier *cold;
+  uv_rwlock_t tier_lock;
+  std::vector<demotion> demotions;  // under lock
+  uv_cond_t demote_cond;
+  bool demoting;                    // demoter thread started
+#ifdef HAVE_ZSTD
+  ZSTD_CDict *cdict;                // atomic; never freed once trained
+  ZSTD_DDict *ddict;
+  bool training;
+  std::vector<std::string> samples;
+  size_t sampled_bytes;
+#endif
+};
+
+static size_t WindowCapacity(cache *c)
+{
+  if (!c->tinylfu) return c->capacity;
+  size_t window = c->capacity * WINDOW_PERCENT / 100;
+  return window > 0 ? window : 1;
+}
+
+static size_t ProtectedCapacity(cache *c)
+{
+  size_t main = c->capacity - std::min(c->capacity, WindowCapacity(c));
+  return main * PROTECTED_PERCENT / 100;
+}
+
+static void ResizeSketch(cache *c)
+{
+  size_t width = 16;
+  while (width < c->capacity) width <<= 1;
+  if (width == c->width) return;
+
+  c->width = width;
+  c->sketch.assign(SKETCH_ROWS * width, 0);
+  c->additions = 0;
+  c->sample_size = SAMPLE_FACTOR * width;
+}
+
+// Each row's counter for hash, from a different 16 bits of it.
+static size_t SketchSlot(cache *c, uint64_t hash, int row)
+{
+  uint64_t mixed = (hash >> (16 * row)) * 0x9e3779b97f4a7c15ULL + row;
+  return row * c->width + (size_t)(mixed >> 32) % c->width;
+}
+
+static int Frequency(cache *c, uint64_t hash)
+{
+  int frequency = SKETCH_MAX;
+  for (int row = 0; row < SKETCH_ROWS; row++)
+  {
+    frequency = std::min(frequency, (int)c->sketch[SketchSlot(c, hash, row)]);
+  }
+  return frequency;
+}
+
+static void Increment(cache *c, uint64_t hash)
+{
+  if (!c->tinylfu) return;
+
+  bool added = false;
+  for (int row = 0; row < SKETCH_ROWS; row++)
+  {
+    uint8_t &counter = c->sketch[SketchSlot(c, hash, row)];
+    if (counter < SKETCH_MAX) {
+      counter++;
+      added = true;
+    }
+  }
+
+  if (added && ++c->additions >= c->sample_size) {
+    for (size_t idx = 0; idx < c->sketch.size(); idx++)
+    {
+      c->sketch[idx] >>= 1;
+    }
+    c->additions /= 2;
+  }
+}
+
+static uint64_t KeyHash(const std::string &key)
+{
+  return HashBytes(key.data(), key.size());
+}
+
+static size_t Size(cache *c)
+{
+  return c->index.size();
+}
+
+static void Evict(cache *c, cache_list::iterator entry)
+{
+  c->bytes -= entry->key.size() + entry->value.size();
+  c->raw_bytes -= entry->raw_size;
+  c->index.erase(entry->key);
+  c->segments[entry->segment].erase(entry);
+}
+
+// Moves entry to the front of segment.
+static void MoveTo(cache *c, cache_list::iterator entry, int segment)
+{
+  int from = entry->segment;
+  entry->segment = segment;
+  c->segments[segment].splice(c->segments[segment].begin(), c->segments[from], entry);
+}
+
+// A hit: probation entries have proved themselves and are protected,
+// pushing the least recent protected entry back to probation if full.
+static void Touch(cache *c, cache_list::iterator entry)
+{
+  if (entry->segment != SEGMENT_PROBATION) {
+    MoveTo(c, entry, entry->segment);
+    return;
+  }
+
+  MoveTo(c, entry, SEGMENT_PROTECTED);
+  if (c->segments[SEGMENT_PROTECTED].size() > ProtectedCapacity(c)) {
+    MoveTo(c, --c->segments[SEGMENT_PROTECTED].end(), SEGMENT_PROBATION);
+  }
+}
+
+static void Demote(cache *c, cache_list::iterator entry);
+
+// Entries leaving the window must beat the main segment's least
+// recently used entry on frequency to get in; otherwise they are the
+// ones evicted. A scan of keys seen once cannot flush the main segment.
+static void EvictOverflow(cache *c)
+{
+  cache_list &window = c->segments[SEGMENT_WINDOW];
+  cache_list &probation = c->segments[SEGMENT_PROBATION];
+  cache_list &protect = c->segments[SEGMENT_PROTECTED];
+
+  while (window.size() > WindowCapacity(c))
+  {
+    cache_list::iterator candidate = --window.end();
+    if (!c->tinylfu) {
+      Demote(c, candidate);
+      Evict(c, candidate);
+      c->stats.evictions++;
+      continue;
+    }
+    MoveTo(c, candidate, SEGMENT_PROBATION);
+    if (Size(c) <= c->capacity) continue;
+
+    cache_list::iterator victim = candidate;
+    if (probation.size() > 1) victim = --probation.end();
+    else if (!protect.empty()) victim = --protect.end();
+
+    // Entries that made it into the main segment go to the cold tier;
+    // rejected candidates, seen too rarely to be worth it, do not.
+    if (victim != candidate && Frequency(c, KeyHash(candidate->key)) > Frequency(c, KeyHash(victim->key))) {
+      Demote(c, victim);
+      Evict(c, victim);
+    } else {
+      Evict(c, candidate);
+    }
+    c->stats.evictions++;
+  }
+
+  // Shrunk: take from the least valuable end first.
+  while (Size(c) > c->capacity)
+  {
+    cache_list::iterator entry;
+    if (!probation.empty()) entry = --probation.end();
+    else if (!window.empty()) entry = --window.end();
+    else entry = --protect.end();
+    Demote(c, entry);
+    Evict(c, entry);
+    c->stats.evictions++;
+  }
+}
+
+cache *CacheCreate(size_t capacity, int ttl_ms)
+{
+  cache *c = new cache;
+  uv_mutex_init(&c->lock);
+  c->capacity = capacity;
+  c->ttl_ns = (uint64_t)ttl_ms * NS_PER_MS;
+  c->tinylfu = true;
+  c->width = 0;
+  ResizeSketch(c);
+  memset(&c->stats, 0, sizeof(c->stats));
+  c->compress = false;
+  c->bytes = 0;
+  c->raw_bytes = 0;
+  c->decompressions = 0;
+  c->decompress_ns = 0;
+  c->cold = NULL;
+  uv_rwlock_init(&c->tier_lock);
+  uv_cond_init(&c->demote_cond);
+  c->demoting = false;
+#ifdef HAVE_ZSTD
+  c->cdict = NULL;
+  c->ddict = NULL;
+  c->training = false;
+  c->sampled_bytes = 0;
+#endif
+  return c;
+}
+
+void CacheConfigure(cache *c, int capacity, int ttl_ms)
+{
+  uv_mutex_lock(&c->lock);
+  if (capacity > 0) c->capacity = capacity;
+  if (ttl_ms >= 0) c->ttl_ns = (uint64_t)ttl_ms * NS_PER_MS;
+  ResizeSketch(c);
+
+  if (c->ttl_ns == 0) {
+    for (int segment = 0; segment < 3; segment++) c->segments[segment].clear();
+    c->index.clear();
+    c->bytes = 0;
+    c->raw_bytes = 0;
+  }
+  EvictOverflow(c);
+  uv_mutex_unlock(&c->lock);
+}
+
+void CacheConfigureAdmission(cache *c, bool tinylfu)
+{
+  uv_mutex_lock(&c->lock);
+  if (c->tinylfu != tinylfu) {
+    c->tinylfu = tinylfu;
+    // Everything starts over in the window, oldest last.
+    for (int segment = SEGMENT_PROTECTED; segment > SEGMENT_WINDOW; segment--)
+    {
+      while (!c->segments[segment].empty())
+      {
+        cache_list::iterator entry = c->segments[segment].begin();
+        entry->segment = SEGMENT_WINDOW;
+        c->segments[SEGMENT_WINDOW].splice(c->segments[SEGMENT_WINDOW].end(), c->segments[segment], entry);
+      }
+    }
+    std::fill(c->sketch.begin(), c->sketch.end(), 0);
+    c->additions = 0;
+    EvictOverflow(c);
+  }
+  uv_mutex_unlock(&c->lock);
+}
+
+#ifdef HAVE_ZSTD
+// Per thread, reused: creating contexts costs more than most values take
+// to compress.
+static __thread ZSTD_CCtx *compress_context = NULL;
+static __thread ZSTD_DCtx *decompress_context = NULL;
+
+struct training
+{
+  cache *c;
+  std::vector<std::string> samples;
+};
+
+// Trains the dictionary from the samples, on a thread of its own: it
+// takes far longer than any put should.
+static void TrainThread(void *arg)
+{
+  training *job = (training*)arg;
+  cache *c = job->c;
+  std::vector<std::string> &samples = job->samples;
+
+  std::string buffer;
+  std::vector<size_t> sizes;
+  for (size_t idx = 0; idx < samples.size(); idx++)
+  {
+    buffer.append(samples[idx]);
+    sizes.push_back(samples[idx].size());
+  }
+  std::string dict(DICT_SIZE, '\0');
+  size_t length = ZDICT_trainFromBuffer(&dict[0], dict.size(), buffer.data(), &sizes[0], sizes.size());
+
+  ZSTD_CDict *cdict = NULL;
+  ZSTD_DDict *ddict = NULL;
+  if (!ZDICT_isError(length)) {
+    cdict = ZSTD_createCDict(dict.data(), length, ZSTD_LEVEL);
+    ddict = ZSTD_createDDict(dict.data(), length);
+  }
+
+  uv_mutex_lock(&c->lock);
+  // If training failed (too few or too uniform samples), the next
+  // TRAIN_SAMPLES values get another go.
+  __atomic_store_n(&c->ddict, ddict, __ATOMIC_RELEASE);
+  __atomic_store_n(&c->cdict, cdict, __ATOMIC_RELEASE);
+  c->training = false;
+  uv_mutex_unlock(&c->lock);
+  delete job;
+}
+
+// Keeps value as a training sample until there are enough, then starts
+// training the dictionary.
+static void Sample(cache *c, const std::string &value)
+{
+  training *job = NULL;
+
+  uv_mutex_lock(&c->lock);
+  if (!c->training && c->cdict == NULL && c->sampled_bytes + value.size() <= TRAIN_MAX_BYTES) {
+    c->samples.push_back(value);
+    c->sampled_bytes += value.size();
+  }
+  if (!c->training && c->cdict == NULL
+      && (c->samples.size() >= TRAIN_SAMPLES || c->sampled_bytes + value.size() > TRAIN_MAX_BYTES)) {
+    c->training = true;
+    job = new training;
+    job->c = c;
+    job->samples.swap(c->samples);
+    c->sampled_bytes = 0;
+  }
+  uv_mutex_unlock(&c->lock);
+  if (job == NULL) return;
+
+  uv_thread_t trainer;
+  if (uv_thread_create(&trainer, TrainThread, job) != 0) {
+    // Another put gets another go.
+    uv_mutex_lock(&c->lock);
+    c->training = false;
+    uv_mutex_unlock(&c->lock);
+    delete job;
+    return;
+  }
+  pthread_detach(trainer);
+}
+
+// Returns false, leaving *frame alone, if compression would not help.
+static bool Compress(ZSTD_CDict *cdict, const std::string &value, std::string *frame)
+{
+  if (compress_context == NULL) compress_context = ZSTD_createCCtx();
+
+  std::string out(ZSTD_compressBound(value.size()), '\0');
+  size_t length = ZSTD_compress_usingCDict(compress_context, &out[0], out.size(),
+                                           value.data(), value.size(), cdict);
+  if (ZSTD_isError(length) || length >= value.size()) return false;
+  out.resize(length);
+  frame->swap(out);
+  return true;
+}
+
+static bool Decompress(cache *c, const std::string &frame, std::string *value)
+{
+  if (decompress_context == NULL) decompress_context = ZSTD_createDCtx();
+
+  unsigned long long length = ZSTD_getFrameContentSize(frame.data(), frame.size());
+  if (length == ZSTD_CONTENTSIZE_ERROR || length == ZSTD_CONTENTSIZE_UNKNOWN) return false;
+
+  // Stored before the CDict that compressed frame; never changes after.
+  ZSTD_DDict *ddict = __atomic_load_n(&c->ddict, __ATOMIC_ACQUIRE);
+  value->resize(length);
+  size_t got = ZSTD_decompress_usingDDict(decompress_context, length > 0 ? &(*value)[0] : NULL, length,
+                                          frame.data(), frame.size(), ddict);
+  return !ZSTD_isError(got) && got == length;
+}
+#endif
+
+bool CacheConfigureCompression(cache *c, bool enabled)
+{
+#ifdef HAVE_ZSTD
+  __atomic_store_n(&c->compress, enabled, __ATOMIC_RELAXED);
+  return true;
+#else
+  (void)c;
+  return !enabled;
+#endif
+}
+
+// Queues entry, evicted for room, for the cold tier. Lock held.
+static void Demote(cache *c, cache_list::iterator entry)
+{
+  if (c->cold == NULL || c->demotions.size() >= DEMOTE_QUEUE_MAX) return;
+
+  uint64_t now = uv_hrtime();
+  if (entry->expires <= now) return;
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+
+  demotion demoted;
+  demoted.key = entry->key;
+  demoted.value = entry->value;
+  demoted.compressed = entry->compressed;
+  demoted.expires = (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000 + (entry->expires - now) / NS_PER_MS;
+  c->demotions.push_back(demoted);
+  uv_cond_signal(&c->demote_cond);
+}
+
+// Writes queued demotions to the tier, without the cache's lock: a put
+// may compact the tier's log, which takes a while.
+static void DemoterThread(void *arg)
+{
+  cache *c = (cache*)arg;
+  for (;;)
+  {
+    uv_mutex_lock(&c->lock);
+    while (c->demotions.empty()) uv_cond_wait(&c->demote_cond, &c->lock);
+    uv_mutex_unlock(&c->lock);
+
+    // tier_lock comes before lock; the queue may have emptied between.
+    std::vector<demotion> batch;
+    uv_rwlock_rdlock(&c->tier_lock);
+    uv_mutex_lock(&c->lock);
+    batch.swap(c->demotions);
+    tier *cold = c->cold;
+    uv_mutex_unlock(&c->lock);
+
+    for (size_t idx = 0; cold != NULL && idx < batch.size(); idx++)
+    {
+      // Uncompressed: the dictionary does not outlive the process, the
+      // tier does.
+      if (batch[idx].compressed) {
+#ifdef HAVE_ZSTD
+        std::string value;
+        if (Decompress(c, batch[idx].value, &value)) TierPut(cold, batch[idx].key, value, batch[idx].expires);
+#endif
+      } else {
+        TierPut(cold, batch[idx].key, batch[idx].value, batch[idx].expires);
+      }
+    }
+    uv_rwlock_rdunlock(&c->tier_lock);
+  }
+}
+
+void CacheConfigureTier(cache *c, tier *cold)
+{
+  uv_rwlock_wrlock(&c->tier_lock);
+  uv_mutex_lock(&c->lock);
+  tier *previous = c->cold;
+  c->cold = cold;
+  if (cold == NULL) c->demotions.clear();
+  bool start = cold != NULL && !c->demoting;
+  if (start) c->demoting = true;
+  uv_mutex_unlock(&c->lock);
+
+  if (previous != NULL && previous != cold) TierClose(previous);
+  uv_rwlock_wrunlock(&c->tier_lock);
+
+  if (start) {
+    uv_thread_t demoter;
+    uv_thread_create(&demoter, DemoterThread, c);
+  }
+}
+
+// Stores value (as kept: compressed or not) under key. Lock held.
+static void Link(cache *c, const std::string &key, const std::string &value, bool compressed,
+                 size_t raw_size, uint64_t expires)
+{
+  std::map<std::string, cache_list::iterator>::iterator found = c->index.find(key);
+  if (found != c->index.end()) {
+    // A refresh (or a replay, see prewarm.h) keeps the entry's place.
+    cache_list::iterator entry = found->second;
+    c->bytes += value.size() - entry->value.size();
+    c->raw_bytes += raw_size - entry->raw_size;
+    entry->value = value;
+    entry->compressed = compressed;
+    entry->raw_size = raw_size;
+    entry->expires = expires;
+    Touch(c, entry);
+  } else {
+    // Gets already counted the misses that led here.
+    cache_entry entry;
+    entry.key = key;
+    entry.value = value;
+    entry.compressed = compressed;
+    entry.raw_size = raw_size;
+    entry.expires = expires;
+    entry.segment = SEGMENT_WINDOW;
+    c->bytes += key.size() + value.size();
+    c->raw_bytes += raw_size;
+    c->segments[SEGMENT_WINDOW].push_front(entry);
+    c->index[key] = c->segments[SEGMENT_WINDOW].begin();
+    EvictOverflow(c);
+  }
+}
+
+bool CacheGet(cache *c, const std::string &key, std::string *value)
+{
+  bool hit = false;
+#ifdef HAVE_ZSTD
+  bool compressed = false;
+#endif
+
+  uv_mutex_lock(&c->lock);
+  Increment(c, KeyHash(key));
+  std::map<std::string, cache_list::iterator>::iterator found = c->index.find(key);
+  if (found != c->index.end()) {
+    cache_list::iterator entry = found->second;
+    if (entry->expires > uv_hrtime()) {
+      Touch(c, entry);
+      *value = entry->value;
+#ifdef HAVE_ZSTD
+      compressed = entry->compressed;
+#endif
+      hit = true;
+    } else {
+      Evict(c, entry);
+    }
+  }
+  if (hit) c->stats.hits++; else c->stats.misses++;
+  bool look_cold = !hit && c->cold != NULL && c->ttl_ns > 0;
+  uv_mutex_unlock(&c->lock);
+
+  // Not in memory: a page fault away in the cold tier, maybe. Found
+  // there, the entry comes back into memory.
+  if (look_cold) {
+    int64_t expires;
+    uv_rwlock_rdlock(&c->tier_lock);
+    bool found = c->cold != NULL && TierGet(c->cold, key, value, &expires);
+    uv_rwlock_rdunlock(&c->tier_lock);
+
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    int64_t left_ms = found ? expires - ((int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000) : 0;
+    if (left_ms > 0) {
+      uv_mutex_lock(&c->lock);
+      Link(c, key, *value, false, key.size() + value->size(), uv_hrtime() + left_ms * NS_PER_MS);
+      uv_mutex_unlock(&c->lock);
+      hit = true;
+    }
+  }
+
+#ifdef HAVE_ZSTD
+  // Straight into the caller's buffer, outside the lock.
+  if (compressed) {
+    uint64_t started = uv_hrtime();
+    std::string frame;
+    frame.swap(*value);
+    hit = Decompress(c, frame, value);
+    __atomic_add_fetch(&c->decompressions, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&c->decompress_ns, uv_hrtime() - started, __ATOMIC_RELAXED);
+
+    // A corrupt frame is a miss, and goes.
+    if (!hit) {
+      uv_mutex_lock(&c->lock);
+      c->stats.hits--;
+      c->stats.misses++;
+      std::map<std::string, cache_list::iterator>::iterator found = c->index.find(key);
+      if (found != c->index.end() && found->second->value == frame) Evict(c, found->second);
+      uv_mutex_unlock(&c->lock);
+      value->clear();
+    }
+  }
+#endif
+
+  return hit;
+}
+
+void CachePut(cache *c, const std::string &key, const std::string &value, int ttl_ms)
+{
+  std::string stored;
+  bool compressed = false;
+#ifdef HAVE_ZSTD
+  if (__atomic_load_n(&c->compress, __ATOMIC_RELAXED)) {
+    ZSTD_CDict *cdict = __atomic_load_n(&c->cdict, __ATOMIC_ACQUIRE);
+    if (cdict != NULL) {
+      compressed = Compress(cdict, value, &stored);
+    } else {
+      Sample(c, value);
+    }
+  }
+#endif
+
+  uv_mutex_lock(&c->lock);
+  uint64_t ttl_ns = c->ttl_ns;
+  if (ttl_ms >= 0) ttl_ns = std::min(ttl_ns, (uint64_t)(ttl_ms * NS_PER_MS));
+  if (ttl_ns > 0 && c->capacity > 0) {
+    Link(c, key, compressed ? stored : value, compressed, key.size() + value.size(), uv_hrtime() + ttl_ns);
+  }
+  uv_mutex_unlock(&c->lock);
+}
+
+size_t CacheRemove(cache *c, cache_match_cb match, void *arg)
+{
+  size_t removed = 0;
+
+  // For writing: no demotion queued before the removal may reach the
+  // tier after it.
+  uv_rwlock_wrlock(&c->tier_lock);
+  uv_mutex_lock(&c->lock);
+  for (int segment = 0; segment < 3; segment++)
+  {
+    cache_list::iterator entry = c->segments[segment].begin();
+    while (entry != c->segments[segment].end())
+    {
+      cache_list::iterator next = entry;
+      next++;
+      if (match == NULL || match(entry->key, arg)) {
+        Evict(c, entry);
+        removed++;
+      }
+      entry = next;
+    }
+  }
+  for (size_t idx = 0; idx < c->demotions.size(); )
+  {
+    if (match == NULL || match(c->demotions[idx].key, arg)) {
+      c->demotions.erase(c->demotions.begin() + idx);
+    } else {
+      idx++;
+    }
+  }
+  uv_mutex_unlock(&c->lock);
+
+  // The tier's copies may be the same entries; count them once.
+  if (c->cold != NULL) removed = std::max(removed, TierRemove(c->cold, match, arg));
+  uv_rwlock_wrunlock(&c->tier_lock);
+
+  return removed;
+}
+
+void CacheStats(cache *c, cache_stats *stats)
+{
+  uv_mutex_lock(&c->lock);
+  *stats = c->stats;
+  stats->entries = Size(c);
+  stats->bytes = c->bytes;
+  stats->raw_bytes = c->raw_bytes;
+#ifdef HAVE_ZSTD
+  stats->dictionary = c->cdict != NULL;
+#else
+  stats->dictionary = false;
+#endif
+  stats->decompressions = __atomic_load_n(&c->decompressions, __ATOMIC_RELAXED);
+  stats->decompress_ns = __atomic_load_n(&c->decompress_ns, __ATOMIC_RELAXED);
+  uv_mutex_unlock(&c->lock);
+
+  uv_rwlock_rdlock(&c->tier_lock);
+  stats->tiered = c->cold != NULL;
+  if (c->cold != NULL) TierStats(c->cold, &stats->cold);
+  uv_rwlock_rdunlock(&c->tier_lock);
+}
+
+void CacheAppend(std::string *buffer, uint32_t value)
+{
+  buffer->append((const char*)&value, sizeof(value));
+}
+
+void CacheAppend(std::string *buffer, const char *data, size_t length)
+{
+  CacheAppend(buffer, (uint32_t)length);
+  buffer->append(data, length);
+}
+
+void CacheAppend(std::string *buffer, const std::string &data)
+{
+  CacheAppend(buffer, data.data(), data.size());
+}
+
+bool CacheRead(const std::string &buffer, size_t *offset, uint32_t *value)
+{
+  if (buffer.size() - *offset < sizeof(*value)) return false;
+  memcpy(value, buffer.data() + *offset, sizeof(*value));
+  *offset += sizeof(*value);
+  return true;
+}
+
+bool CacheRead(const std::string &buffer, size_t *offset, std::string *data)
+{
+  uint32_t length;
+  if (!CacheRead(buffer, offset, &length)) return false;
+  if (buffer.size() - *offset < length) return false;
+  data->assign(buffer, *offset, length);
+  *offset += length;
+  return true;
+}
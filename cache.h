@@ -0,0 +1,103 @@
+// Bounded, expiring caches of search results and group lookups.
+
+/*
+Each cache maps a string key to a serialized string value, holding at
+most capacity entries and treating entries older than its TTL as absent.
+All calls are thread-safe.
+
+Which entries stay is decided W-TinyLFU style, so that a bulk export or
+a credential-stuffing run (many keys, each asked for once) cannot flush
+the entries everyday logins keep hitting:
+
+  window     1% of capacity, plain LRU; new entries start here
+  probation  main segment entries not hit since they were admitted
+  protected  main segment entries hit again, up to 80% of the main segment
+
+An entry pushed out of the window is only admitted to the main segment
+if its key has been asked for more often lately than that of probation's
+least recently used entry, which it then replaces. How often is
+estimated with a count-min sketch of recent gets, halved every ten gets
+per entry so that it forgets. Plain LRU can be chosen instead.
+
+Values can be kept zstd-compressed, with a dictionary trained on the
+first thousand or so values put (directory entries repeat themselves:
+OU paths, objectClass lists, group DNs). Until it is trained, and for
+values it does not shrink, values are kept as they are. Training runs on
+a thread of its own, not in the put that completes the samples. Gets
+decompress into the caller's buffer; a value that fails to decompress
+counts as a miss and is dropped. Needs libzstd at build time (HAVE_ZSTD).
+
+A cache can have a cold tier on disk (tier.h). Entries it evicts for
+room, other than candidates refused admission, are demoted there, and a
+get that misses in memory looks there before giving up, bringing what
+it finds back into memory. Demotions are queued and written by a thread
+of the cache's own, and gets read the tier, without the cache's lock:
+a put into the tier may compact its log.
+
+A TTL of 0 turns a cache off: gets miss and puts are dropped.
+*/
+
+#ifndef LDAPAUTH_CACHE_H
+#define LDAPAUTH_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <string>
+
+#include "tier.h"
+
+struct cache;
+
+struct cache_stats
+{
+  uint64_t entries;
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  uint64_t bytes;             // keys and values as stored
+  uint64_t raw_bytes;         // ... and uncompressed
+  bool dictionary;            // trained, see CacheConfigureCompression()
+  uint64_t decompressions;
+  uint64_t decompress_ns;     // spent in them, in total
+  bool tiered;
+  tier_stats cold;            // if tiered
+};
+
+cache *CacheCreate(size_t capacity, int ttl_ms);
+
+// A capacity of 0 or a negative ttl keeps the current setting; a ttl of
+// 0 turns the cache off. Shrinking evicts at once.
+void CacheConfigure(cache *c, int capacity, int ttl_ms);
+
+// true (the default) for W-TinyLFU admission, false for plain LRU.
+void CacheConfigureAdmission(cache *c, bool tinylfu);
+
+// Compresses values put from now on. Returns false if compression was
+// asked for but the module was built without zstd.
+bool CacheConfigureCompression(cache *c, bool enabled);
+
+// Demotes evicted entries to cold from now on, or stops if NULL. The
+// cache owns cold from then on, and closes it when replaced.
+void CacheConfigureTier(cache *c, tier *cold);
+
+bool CacheGet(cache *c, const std::string &key, std::string *value);
+// ttl_ms, if not negative, is used for this entry instead of the cache's
+// TTL when shorter (e.g. for not-found results).
+void CachePut(cache *c, const std::string &key, const std::string &value, int ttl_ms = -1);
+
+// Removes the entries, in memory and in the cold tier, whose key match()
+// accepts; all of them if match is NULL. Returns how many.
+typedef bool (*cache_match_cb)(const std::string &key, void *arg);
+size_t CacheRemove(cache *c, cache_match_cb match, void *arg);
+
+void CacheStats(cache *c, cache_stats *stats);
+
+// Length-prefixed fields, for building and parsing values.
+void CacheAppend(std::string *buffer, const char *data, size_t length);
+void CacheAppend(std::string *buffer, const std::string &data);
+void CacheAppend(std::string *buffer, uint32_t value);
+bool CacheRead(const std::string &buffer, size_t *offset, std::string *data);
+bool CacheRead(const std::string &buffer, size_t *offset, uint32_t *value);
+
+#endif
@@ -0,0 +1,232 @@
+// Canonical forms of LDAP search filters. See filter.h.
+
+#include "filter.h"
+#include "strcase.h"
+
+#include <ctype.h>
+#include <string.h>
+
+#include <vector>
+#include <algorithm>
+
+// Filters nested deeper than this are not canonicalized.
+#define MAX_DEPTH 64
+
+struct filter_parser
+{
+  const char *at;
+  int depth;
+};
+
+static void SkipSpace(filter_parser *p)
+{
+  while (*p->at == ' ' || *p->at == '\t' || *p->at == '\n' || *p->at == '\r') p->at++;
+}
+
+static int HexDigit(char c)
+{
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+static void AppendEscaped(std::string *out, unsigned char c)
+{
+  static const char hex[] = "0123456789abcdef";
+  if (c == '\\' || c == '*' || c == '(' || c == ')' || c < 0x20 || c > 0x7e) {
+    out->push_back('\\');
+    out->push_back(hex[c >> 4]);
+    out->push_back(hex[c & 15]);
+  } else {
+    out->push_back(c);
+  }
+}
+
+// An attribute description or matching rule: letters, digits, '-', '.'
+// and ';' options. Lowercased.
+static bool ParseName(filter_parser *p, std::string *out)
+{
+  const char *start = p->at;
+  while (isalnum((unsigned char)*p->at) || *p->at == '-' || *p->at == '.' || *p->at == ';' || *p->at == '_') p->at++;
+  size_t length = p->at - start;
+  out->resize(out->size() + length);
+  if (length > 0) StrFold(&(*out)[out->size() - length], start, length);
+  return length > 0;
+}
+
+// A value up to the closing ')'. Unescaped '*'s are kept as separators
+// when substrings are allowed; everything else comes out escaped the
+// canonical way.
+static bool ParseValue(filter_parser *p, bool substrings, std::string *out)
+{
+  while (*p->at != ')')
+  {
+    char c = *p->at;
+    if (c == '\0' || c == '(') return false;
+    if (c == '\\') {
+      int high = HexDigit(p->at[1]);
+      int low = high >= 0 ? HexDigit(p->at[2]) : -1;
+      if (low < 0) return false;
+      AppendEscaped(out, (unsigned char)(high << 4 | low));
+      p->at += 3;
+    } else if (c == '*') {
+      if (!substrings) return false;
+      out->push_back('*');
+      p->at++;
+    } else {
+      AppendEscaped(out, (unsigned char)c);
+      p->at++;
+    }
+  }
+  return true;
+}
+
+static bool ParseFilter(filter_parser *p, std::string *out);
+
+// attr=value, attr~=value, attr>=value, attr<=value, attr=*, substrings,
+// and extensible matches attr:dn:rule:=value. p is past the '('.
+static bool ParseItem(filter_parser *p, std::string *out)
+{
+  std::string attr;
+  ParseName(p, &attr);
+
+  // Extensible: [attr][:dn][:rule]:=value
+  if (*p->at == ':') {
+    std::string item = attr;
+    while (*p->at == ':' && p->at[1] != '=')
+    {
+      p->at++;
+      std::string part;
+      if (!ParseName(p, &part)) return false;
+      item += ":" + part;
+    }
+    if (p->at[0] != ':' || p->at[1] != '=') return false;
+    p->at += 2;
+    if (attr.empty() && item.find(':') == std::string::npos) return false;
+    item += ":=";
+    if (!ParseValue(p, false, &item)) return false;
+    out->append(item);
+    return true;
+  }
+
+  if (attr.empty()) return false;
+  std::string op;
+  if ((*p->at == '~' || *p->at == '>' || *p->at == '<') && p->at[1] == '=') {
+    op.assign(p->at, 2);
+    p->at += 2;
+  } else if (*p->at == '=') {
+    op = "=";
+    p->at++;
+  } else {
+    return false;
+  }
+
+  out->append(attr).append(op);
+  return ParseValue(p, op == "=", out);
+}
+
+// The operands of & or |, canonicalized, flattened if of the same kind,
+// sorted and deduplicated.
+static bool ParseList(filter_parser *p, char kind, std::string *out)
+{
+  std::vector<std::string> operands;
+  SkipSpace(p);
+  while (*p->at == '(')
+  {
+    std::string operand;
+    if (!ParseFilter(p, &operand)) return false;
+    if (operand[1] == kind) {
+      // (&(a)(&(b)(c))): the inner operands join ours. They are already
+      // canonical, each a balanced (...) group.
+      const char *inner = operand.c_str() + 2;
+      while (*inner == '(')
+      {
+        const char *end = inner;
+        int depth = 0;
+        do
+        {
+          if (*end == '\\') end += 2;
+          else if (*end == '(') depth++;
+          else if (*end == ')') depth--;
+          end++;
+        } while (depth > 0);
+        operands.push_back(std::string(inner, end - inner));
+        inner = end;
+      }
+    } else {
+      operands.push_back(operand);
+    }
+    SkipSpace(p);
+  }
+  if (operands.empty()) return false;
+
+  std::sort(operands.begin(), operands.end());
+  operands.erase(std::unique(operands.begin(), operands.end()), operands.end());
+  if (operands.size() == 1) {
+    out->append(operands[0]);
+    return true;
+  }
+
+  out->push_back('(');
+  out->push_back(kind);
+  for (size_t idx = 0; idx < operands.size(); idx++) out->append(operands[idx]);
+  out->push_back(')');
+  return true;
+}
+
+static bool ParseFilter(filter_parser *p, std::string *out)
+{
+  SkipSpace(p);
+  if (*p->at != '(' || ++p->depth > MAX_DEPTH) return false;
+  p->at++;
+  SkipSpace(p);
+
+  bool ok;
+  char kind = *p->at;
+  if (kind == '&' || kind == '|') {
+    p->at++;
+    ok = ParseList(p, kind, out);
+  } else if (kind == '!') {
+    p->at++;
+    std::string operand;
+    ok = ParseFilter(p, &operand);
+    if (ok && operand.compare(0, 2, "(!") == 0) {
+      out->append(operand, 2, operand.size() - 3);
+    } else if (ok) {
+      out->append("(!").append(operand).append(")");
+    }
+    SkipSpace(p);
+  } else {
+    out->push_back('(');
+    ok = ParseItem(p, out);
+    out->push_back(')');
+  }
+
+  if (!ok || *p->at != ')') return false;
+  p->at++;
+  p->depth--;
+  return true;
+}
+
+bool FilterCanonical(const char *filter, std::string *canonical)
+{
+  filter_parser p;
+  p.at = filter;
+  p.depth = 0;
+
+  std::string out;
+  SkipSpace(&p);
+  if (*p.at == '(') {
+    if (!ParseFilter(&p, &out)) return false;
+  } else {
+    // libldap accepts a bare item, e.g. "uid=jdoe".
+    std::string wrapped = std::string("(") + filter + ")";
+    return FilterCanonical(wrapped.c_str(), canonical);
+  }
+
+  SkipSpace(&p);
+  if (*p.at != '\0') return false;
+  canonical->swap(out);
+  return true;
+}
@@ -0,0 +1,31 @@
+// Canonical forms of LDAP search filters (RFC 4515), for cache keys.
+
+/*
+The same search arrives spelled in different ways: (&(a=1)(b=2)) and
+(&(b=2)(a=1)), objectClass and objectclass, \2a and \2A. FilterCanonical()
+rewrites a filter so that such spellings come out the same:
+
+  - attribute descriptions and matching rule names lowercased
+  - values unescaped, then escaped again the one way: \, *, ( and ), NUL
+    and bytes outside printable ASCII as \xx in lowercase hex
+  - & and | operands canonicalized, sorted and deduplicated; nested
+    operators of the same kind flattened, single operands unwrapped
+  - (!(!f)) is f
+  - the outer parentheses added if missing, whitespace between
+    components dropped
+
+Values themselves are left in their case: whether they match case
+insensitively depends on the attribute's schema, which is not known here.
+
+One pass over the filter plus sorting the operand lists; no lookups.
+*/
+
+#ifndef LDAPAUTH_FILTER_H
+#define LDAPAUTH_FILTER_H
+
+#include <string>
+
+// Returns false, leaving *canonical alone, if filter does not parse.
+bool FilterCanonical(const char *filter, std::string *canonical);
+
+#endif
@@ -0,0 +1,52 @@
+// A user's group closure. See groups.h.
+
+#include "groups.h"
+#include "strcase.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <set>
+
+group_node *NewGroup(const char *dn)
+{
+  group_node *node = new group_node;
+  node->dn = strdup(dn);
+  node->name = NULL;
+  return node;
+}
+
+static void Flatten(const std::vector<group_node*> &nodes, const group_index &expanded,
+                    std::set<group_node*> *listed, std::vector<char*> *names)
+{
+  for (size_t idx = 0; idx < nodes.size(); idx++)
+  {
+    group_index::const_iterator found = expanded.find(StrLower(nodes[idx]->dn));
+    group_node *node = found != expanded.end() ? found->second : nodes[idx];
+    if (!listed->insert(node).second) continue;
+
+    if (node->name != NULL) names->push_back(node->name);
+    node->name = NULL;
+    Flatten(node->parents, expanded, listed, names);
+  }
+}
+
+void FlattenGroups(const std::vector<group_node*> &nodes, const group_index &expanded,
+                   std::vector<char*> *names)
+{
+  std::set<group_node*> listed;
+  Flatten(nodes, expanded, &listed, names);
+}
+
+void FreeGroups(std::vector<group_node*> *nodes)
+{
+  for (size_t idx = 0; idx < nodes->size(); idx++)
+  {
+    group_node *node = nodes->at(idx);
+    FreeGroups(&node->parents);
+    free(node->dn);
+    free(node->name);
+    delete node;
+  }
+  nodes->clear();
+}
@@ -0,0 +1,44 @@
+// A user's group closure: memberOf, followed up to the top.
+
+/*
+search() lists the groups an entry is in, directly or through other
+groups, as allGroups. Groups are looked up in parallel, a sub-task per
+group (ldapauth.cc), and each DN only once: the first node to claim a DN
+in the index is expanded, and a node for a group met again, through a
+second path (a diamond) or a memberOf loop, is left as a leaf.
+
+Which node claims a DN depends on which sub-task gets there first, so
+the order is not taken from the expansion. FlattenGroups() walks the
+nodes as the directory lists them, depth first, each node standing for
+the one expanded for its DN, and lists each group once, where that walk
+first meets it: the same order whatever the timing.
+*/
+
+#ifndef LDAPAUTH_GROUPS_H
+#define LDAPAUTH_GROUPS_H
+
+#include <map>
+#include <string>
+#include <vector>
+
+struct group_node
+{
+  char *dn;
+  char *name;                           // NULL until looked up, and for leaves
+  std::vector<group_node*> parents;     // memberOf, in the directory's order
+};
+
+// The expanded node for each DN, by lowercased DN.
+typedef std::map<std::string, group_node*> group_index;
+
+group_node *NewGroup(const char *dn);
+
+// Appends the names under nodes to names, depth first and each group
+// once. The names move out of the nodes.
+void FlattenGroups(const std::vector<group_node*> &nodes, const group_index &expanded,
+                   std::vector<char*> *names);
+
+// Frees nodes and everything under them, and clears it.
+void FreeGroups(std::vector<group_node*> *nodes);
+
+#endif
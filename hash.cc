@@ -0,0 +1,200 @@
+// Keyed and 128-bit hashing. See hash.h.
+
+#include "hash.h"
+
+#include <uv.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static uv_once_t key_once = UV_ONCE_INIT;
+static uint64_t keys[4];
+
+// Reads up to length bytes of fd into out; returns how many.
+static size_t ReadFully(int fd, void *out, size_t length)
+{
+  size_t got = 0;
+  while (fd >= 0 && got < length)
+  {
+    ssize_t n = read(fd, (char*)out + got, length - got);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    got += n;
+  }
+  return got;
+}
+
+static bool ReadRandom(void *out, size_t length)
+{
+  int fd = open("/dev/urandom", O_RDONLY);
+  size_t got = ReadFully(fd, out, length);
+  if (fd >= 0) close(fd);
+  return got == length;
+}
+
+static void InitKeys()
+{
+  // No urandom (a chroot?): weaker, but still not known outside.
+  if (!ReadRandom(keys, sizeof(keys))) {
+    uint64_t seed = uv_hrtime() ^ ((uint64_t)getpid() << 32) ^ (uint64_t)(uintptr_t)&seed;
+    for (int idx = 0; idx < 4; idx++)
+    {
+      seed = HashFinish(seed + 0x9e3779b97f4a7c15ULL);
+      keys[idx] ^= seed;
+    }
+  }
+}
+
+static inline uint64_t Rotl(uint64_t x, int r)
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+#define SIPROUND                                                  \
+  do {                                                            \
+    v0 += v1; v1 = Rotl(v1, 13); v1 ^= v0; v0 = Rotl(v0, 32);     \
+    v2 += v3; v3 = Rotl(v3, 16); v3 ^= v2;                        \
+    v0 += v3; v3 = Rotl(v3, 21); v3 ^= v0;                        \
+    v2 += v1; v1 = Rotl(v1, 17); v1 ^= v2; v2 = Rotl(v2, 32);     \
+  } while (0)
+
+static uint64_t SipHash(uint64_t k0, uint64_t k1, const char *data, size_t length)
+{
+  uint64_t v0 = k0 ^ 0x736f6d6570736575ULL;
+  uint64_t v1 = k1 ^ 0x646f72616e646f6dULL;
+  uint64_t v2 = k0 ^ 0x6c7967656e657261ULL;
+  uint64_t v3 = k1 ^ 0x7465646279746573ULL;
+
+  const unsigned char *bytes = (const unsigned char*)data;
+  size_t blocks = length / 8;
+  for (size_t block = 0; block < blocks; block++)
+  {
+    uint64_t m = 0;
+    for (int idx = 0; idx < 8; idx++) m |= (uint64_t)bytes[block * 8 + idx] << (8 * idx);
+    v3 ^= m;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= m;
+  }
+
+  uint64_t last = (uint64_t)length << 56;
+  for (size_t idx = blocks * 8; idx < length; idx++)
+  {
+    last |= (uint64_t)bytes[idx] << (8 * (idx - blocks * 8));
+  }
+  v3 ^= last;
+  SIPROUND;
+  SIPROUND;
+  v0 ^= last;
+
+  v2 ^= 0xff;
+  SIPROUND;
+  SIPROUND;
+  SIPROUND;
+  SIPROUND;
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+
+static std::string HashHex(const uint64_t *key, const char *data, size_t length)
+{
+  char hex[33];
+  snprintf(hex, sizeof(hex), "%016llx%016llx",
+           (unsigned long long)SipHash(key[0], key[1], data, length),
+           (unsigned long long)SipHash(key[2], key[3], data, length));
+  return std::string(hex, 32);
+}
+
+std::string HashKeyed(const char *data, size_t length)
+{
+  uv_once(&key_once, InitKeys);
+  return HashHex(keys, data, length);
+}
+
+std::string HashKeyed(const hash_key &key, const char *data, size_t length)
+{
+  return HashHex(key.k, data, length);
+}
+
+bool HashKeyLoad(const char *path, hash_key *key)
+{
+  int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+  if (fd >= 0) {
+    // Unlike the per-process key, never a weak one: it is kept.
+    bool written = ReadRandom(key->k, sizeof(key->k))
+                   && write(fd, key->k, sizeof(key->k)) == (ssize_t)sizeof(key->k)
+                   && fsync(fd) == 0;
+    close(fd);
+    if (!written) unlink(path);
+    return written;
+  }
+  if (errno != EEXIST) return false;
+
+  fd = open(path, O_RDONLY | O_NOFOLLOW);
+  if (fd < 0) return false;
+  struct stat st;
+  bool ours = fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_uid == geteuid()
+              && (st.st_mode & 077) == 0 && st.st_size == (off_t)sizeof(key->k);
+  bool read_all = ours && ReadFully(fd, key->k, sizeof(key->k)) == sizeof(key->k);
+  close(fd);
+  return read_all;
+}
+
+void Murmur3(const char *data, size_t length, unsigned char *out)
+{
+  const unsigned char *bytes = (const unsigned char*)data;
+  const size_t blocks = length / 16;
+  const uint64_t c1 = 0x87c37b91114253d5ULL;
+  const uint64_t c2 = 0x4cf5ad432745937fULL;
+  uint64_t h1 = 0, h2 = 0;
+
+  for (size_t idx = 0; idx < blocks; idx++)
+  {
+    uint64_t k1, k2;
+    memcpy(&k1, bytes + idx * 16, 8);
+    memcpy(&k2, bytes + idx * 16 + 8, 8);
+
+    k1 *= c1; k1 = Rotl(k1, 31); k1 *= c2; h1 ^= k1;
+    h1 = Rotl(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+    k2 *= c2; k2 = Rotl(k2, 33); k2 *= c1; h2 ^= k2;
+    h2 = Rotl(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+  }
+
+  // Every case falls through to the next: each adds one more tail byte.
+  const unsigned char *tail = bytes + blocks * 16;
+  uint64_t k1 = 0, k2 = 0;
+  switch (length & 15)
+  {
+    case 15: k2 ^= (uint64_t)tail[14] << 48;  // Fall through.
+    case 14: k2 ^= (uint64_t)tail[13] << 40;  // Fall through.
+    case 13: k2 ^= (uint64_t)tail[12] << 32;  // Fall through.
+    case 12: k2 ^= (uint64_t)tail[11] << 24;  // Fall through.
+    case 11: k2 ^= (uint64_t)tail[10] << 16;  // Fall through.
+    case 10: k2 ^= (uint64_t)tail[9] << 8;    // Fall through.
+    case 9:  k2 ^= (uint64_t)tail[8];
+             k2 *= c2; k2 = Rotl(k2, 33); k2 *= c1; h2 ^= k2;
+             // Fall through: the first eight tail bytes.
+    case 8:  k1 ^= (uint64_t)tail[7] << 56;   // Fall through.
+    case 7:  k1 ^= (uint64_t)tail[6] << 48;   // Fall through.
+    case 6:  k1 ^= (uint64_t)tail[5] << 40;   // Fall through.
+    case 5:  k1 ^= (uint64_t)tail[4] << 32;   // Fall through.
+    case 4:  k1 ^= (uint64_t)tail[3] << 24;   // Fall through.
+    case 3:  k1 ^= (uint64_t)tail[2] << 16;   // Fall through.
+    case 2:  k1 ^= (uint64_t)tail[1] << 8;    // Fall through.
+    case 1:  k1 ^= (uint64_t)tail[0];
+             k1 *= c1; k1 = Rotl(k1, 31); k1 *= c2; h1 ^= k1;
+  }
+
+  h1 ^= length; h2 ^= length;
+  h1 += h2; h2 += h1;
+  h1 = HashFinish(h1); h2 = HashFinish(h2);
+  h1 += h2; h2 += h1;
+
+  for (int idx = 0; idx < 8; idx++)
+  {
+    out[idx] = (unsigned char)(h1 >> (8 * idx));
+    out[8 + idx] = (unsigned char)(h2 >> (8 * idx));
+  }
+}
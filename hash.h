@@ -0,0 +1,70 @@
+// String hashes shared by the sketches, indexes, caches and digests.
+
+#ifndef LDAPAUTH_HASH_H
+#define LDAPAUTH_HASH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <string>
+
+// FNV-1a, then MurmurHash3's finalizer to spread it over all 64 bits.
+// HashUpdate from HASH_START, then HashFinish, for data in pieces.
+#define HASH_START 14695981039346656037ULL
+
+static inline uint64_t HashUpdate(uint64_t hash, const char *data, size_t length)
+{
+  for (size_t idx = 0; idx < length; idx++)
+  {
+    hash ^= (unsigned char)data[idx];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+static inline uint64_t HashFinish(uint64_t hash)
+{
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+static inline uint64_t HashBytes(const char *data, size_t length)
+{
+  return HashFinish(HashUpdate(HASH_START, data, length));
+}
+
+// MurmurHash3_x64_128, seed 0, written to out (16 bytes) little-endian.
+// The same everywhere and across restarts, for digests that are kept.
+void Murmur3(const char *data, size_t length, unsigned char *out);
+
+// SipHash-2-4 under a key drawn from /dev/urandom at startup, as 32 hex
+// digits (two hashes under independent keys). For keys derived from
+// passwords: they cannot be tested against guesses without the key,
+// which never leaves the process, nor made to collide on purpose. Not
+// stable across restarts. Any thread.
+std::string HashKeyed(const char *data, size_t length);
+
+static inline std::string HashKeyed(const std::string &data)
+{
+  return HashKeyed(data.data(), data.size());
+}
+
+// A key of one's own for HashKeyed(), for hashes that must stay the same
+// across restarts.
+struct hash_key
+{
+  uint64_t k[4];
+};
+
+std::string HashKeyed(const hash_key &key, const char *data, size_t length);
+
+// Reads the key kept at path, or creates it there (mode 0600, from
+// /dev/urandom). False if it cannot be created, or the file is not a
+// regular file of ours closed to everybody else.
+bool HashKeyLoad(const char *path, hash_key *key);
+
+#endif
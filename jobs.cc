@@ -0,0 +1,161 @@
+// Native worker pool for LDAP requests. See jobs.h.
+
+#include "jobs.h"
+#include "queue.h"
+
+#include <uv.h>
+#include <vector>
+
+static int worker_count = 8;
+static int capacity = 1024;
+
+static bool started = false;
+static mpmc_queue<job*> *pending_jobs;   // waiting for a worker
+static mpmc_queue<job*> *finished_jobs;  // waiting for the main loop
+static parking_lot idle_workers;
+static std::vector<uv_thread_t> workers;
+
+// Queued but not yet handed back to the main loop. Bounded by capacity,
+// so finished_jobs can never overflow.
+static int in_flight = 0;
+
+// Refused jobs, delivered on the next turn of the main loop.
+static std::vector<job*> rejected_jobs;
+static uv_async_t finished_async;
+
+void JobsConfigure(int workers, int jobs)
+{
+  if (started) return;
+  if (workers > 0) worker_count = workers;
+  if (jobs > 0) capacity = jobs;
+}
+
+static void RunJob(job *j)
+{
+  // A deferred job may be complete, and freed, by the time work returns.
+  bool complete = j->after != NULL && !j->deferred;
+  j->work(j);
+  if (complete) {
+    JobsComplete(j);
+  }
+}
+
+static void WorkerThread(void *arg)
+{
+  for (;;)
+  {
+    job *j;
+    if (pending_jobs->TryPop(&j)) {
+      RunJob(j);
+      continue;
+    }
+
+    int key = idle_workers.Prepare();
+    if (pending_jobs->TryPop(&j)) {
+      idle_workers.Cancel();
+      RunJob(j);
+      continue;
+    }
+    idle_workers.Wait(key);
+  }
+}
+
+// Main loop: hands finished and refused jobs to their after callbacks.
+static void AfterJobs(uv_async_t *handle, int status)
+{
+  std::vector<job*> refused;
+  refused.swap(rejected_jobs);
+  for (size_t idx = 0; idx < refused.size(); idx++)
+  {
+    refused[idx]->after(refused[idx]);
+  }
+
+  job *j;
+  while (finished_jobs->TryPop(&j))
+  {
+    __atomic_fetch_sub(&in_flight, 1, __ATOMIC_RELAXED);
+    j->after(j);
+  }
+}
+
+static void StartJobs()
+{
+  pending_jobs = new mpmc_queue<job*>(capacity);
+  finished_jobs = new mpmc_queue<job*>(capacity);
+
+  uv_async_init(uv_default_loop(), &finished_async, AfterJobs);
+  // Outstanding requests keep the loop alive, not the pool itself.
+  uv_unref((uv_handle_t*)&finished_async);
+
+  workers.resize(worker_count);
+  for (int idx = 0; idx < worker_count; idx++)
+  {
+    uv_thread_create(&workers[idx], WorkerThread, NULL);
+  }
+  __atomic_store_n(&started, true, __ATOMIC_RELEASE);
+}
+
+// Fills in j and hands it to a worker, unless the pool is at capacity.
+static bool Submit(job *j, job_cb work, job_cb after, bool deferred)
+{
+  j->work = work;
+  j->after = after;
+  j->status = JOB_DONE;
+  j->deferred = deferred;
+
+  if (__atomic_add_fetch(&in_flight, 1, __ATOMIC_RELAXED) > (int)finished_jobs->Capacity()
+      || !pending_jobs->TryPush(j)) {
+    __atomic_fetch_sub(&in_flight, 1, __ATOMIC_RELAXED);
+    return false;
+  }
+
+  idle_workers.Notify();
+  return true;
+}
+
+void JobsStart()
+{
+  if (!started) StartJobs();
+}
+
+bool JobsQueue(job *j, job_cb work, job_cb after, bool deferred)
+{
+  if (!started) StartJobs();
+
+  if (!Submit(j, work, after, deferred)) {
+    j->status = JOB_REJECTED;
+    rejected_jobs.push_back(j);
+    uv_async_send(&finished_async);
+    return false;
+  }
+  return true;
+}
+
+bool JobsTry(job *j, job_cb work, job_cb after, bool deferred)
+{
+  // The pool is started, and its queues created, on the main thread; see
+  // JobsStart().
+  if (!__atomic_load_n(&started, __ATOMIC_ACQUIRE)) return false;
+  return Submit(j, work, after, deferred);
+}
+
+void JobsSpawn(job *j, job_cb work)
+{
+  j->work = work;
+  j->after = NULL;
+  j->status = JOB_DONE;
+  j->deferred = false;
+
+  if (pending_jobs->TryPush(j)) {
+    idle_workers.Notify();
+  } else {
+    RunJob(j);
+  }
+}
+
+void JobsComplete(job *j)
+{
+  // Cannot fail: at most capacity jobs are in flight.
+  finished_jobs->TryPush(j);
+  uv_async_send(&finished_async);
+}
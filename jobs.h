@@ -0,0 +1,60 @@
+// Native worker pool for LDAP requests.
+
+/*
+Requests are queued from the main thread with JobsQueue(), run on one of
+the pool's worker threads, and their after callback is then invoked back
+on the main loop. Workers can fan work out further with JobsSpawn()
+(e.g. one sub-task per group while expanding memberOf).
+
+Both directions go through bounded lock-free queues (queue.h). When the
+pool already holds its capacity of requests, JobsQueue() refuses the job:
+the caller's after callback still runs on the main loop, with status
+JOB_REJECTED, and the JS caller sees an error instead of the backlog
+growing without limit.
+*/
+
+#ifndef LDAPAUTH_JOBS_H
+#define LDAPAUTH_JOBS_H
+
+#define JOB_DONE 0
+#define JOB_REJECTED 1
+
+struct job;
+typedef void (*job_cb)(job *j);
+
+struct job
+{
+  void *data;
+  job_cb work;
+  job_cb after;
+  int status;
+  // Completes on JobsComplete() rather than when work returns.
+  bool deferred;
+};
+
+// Worker count and request capacity. Takes effect if called before the
+// first job is queued.
+void JobsConfigure(int workers, int capacity);
+
+// Main thread only. Starts the workers now rather than on the first
+// JobsQueue(), for callers of JobsTry().
+void JobsStart();
+
+// Main thread only. Returns false, and arranges for after to run with
+// JOB_REJECTED, if the pool is at capacity. A deferred job is complete
+// when somebody calls JobsComplete() on it, which may happen on any
+// thread and before work has returned; work must not touch j after that.
+bool JobsQueue(job *j, job_cb work, job_cb after, bool deferred = false);
+
+// Any thread, for background work nobody is waiting on. Returns false
+// if the pool is at capacity (or not yet started), without calling after.
+bool JobsTry(job *j, job_cb work, job_cb after, bool deferred = false);
+
+// Worker threads, or other background threads once the pool is
+// started. Runs work on another worker, or right here if the queue is
+// full. The pool does not free j.
+void JobsSpawn(job *j, job_cb work);
+
+void JobsComplete(job *j);
+
+#endif
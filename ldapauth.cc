@@ -4,9 +4,9 @@
 
 
 /*
-Here's the basic flow of events. LibEIO is used to ensure that
-the LDAP calls occur on a background thread and do not block
-the main Node event loop.
+Here's the basic flow of events. A native worker pool (jobs.h) is
+used to ensure that the LDAP calls occur on a background thread and
+do not block the main Node event loop.
 
  +----------------------+                +------------------------+
  | Main Node Event Loop |                | Background Thread Pool |
@@ -39,24 +39,58 @@ Invoke user supplied JS callback
 
 #include <v8.h>
 #include <node.h>
+#include <node_buffer.h>
 #include <ldap.h>
 #include <unistd.h>
 #include <stdlib.h>
 
 #include <map>
+#include <set>
 #include <vector>
 #include <algorithm>
 #include <string>
 #include <iostream>
 
+#include "pool.h"
+#include "arena.h"
+#include "jobs.h"
+#include "servers.h"
+#include "sketch.h"
+#include "accounts.h"
+#include "cache.h"
+#include "prewarm.h"
+#include "budget.h"
+#include "broker.h"
+#include "hash.h"
+#include "filter.h"
+#include "replica.h"
+#include "strcase.h"
+#include "groups.h"
+#include "subscribe.h"
+#include "schema.h"
+#include "bulk.h"
+#include "browse.h"
+
 using namespace v8;
 
 #define THROW(message) ThrowException(Exception::TypeError(String::New(message)))
 
+#define QUEUE_FULL_MESSAGE "LDAP request queue full"
+
+// Room in a request for its strings without a malloc(): enough for the
+// usual scheme, host, credentials and search base.
+#define REQUEST_INLINE_BYTES 256
+
+// Spare auth_requests kept for authenticate(), at most.
+#define REQUEST_POOL_SIZE 256
+
+// Strings marshalled at once, at most.
+#define MAX_REQUEST_STRINGS 8
+
 // Data passed between threads
 struct auth_request 
 {
-  // Input params
+  // Input params, in strings
   char *scheme;
   char *host;
   int port;
@@ -67,35 +101,211 @@ struct auth_request
   // Result
   bool connected;
   bool authenticated;
+  int account_state;   // ACCOUNT_*; not ACTIVE if refused without a bind
+  // Serving a client in broker mode (broker.h): where the answer goes.
+  broker_conn *reply_conn;
+  uint32_t reply_id;
+
+  // The strings, back to back with their NULs: inline, or malloc()ed
+  // when they do not fit. strings_used of them hold the last request's.
+  char *strings;
+  size_t strings_capacity;
+  size_t strings_used;
+  char inline_strings[REQUEST_INLINE_BYTES];
+
+  auth_request() : strings(inline_strings), strings_capacity(REQUEST_INLINE_BYTES), strings_used(0) {}
 
   ~auth_request()
   {
-    free(scheme);
-    free(host);
-    free(username);
-    free(password);
+    WipeStrings();
+    if (strings != inline_strings) free(strings);
     callback.Dispose();
   }
+
+  // Zeroes the last request's strings, its password among them, through
+  // volatile so that the stores are not dropped before a free().
+  void WipeStrings()
+  {
+    volatile char *bytes = strings;
+    for (size_t idx = 0; idx < strings_used; idx++) bytes[idx] = '\0';
+    strings_used = 0;
+  }
 };
 
 struct search_request : auth_request
 {
-  // Search Input params
+  // Search Input params, in strings
   char *base;
   char *filter;
 
+  // Replaying a recorded search to refresh the caches (prewarm.h):
+  // nobody is waiting, and cached entries are not trusted.
+  bool warming;
+
+  // Values typed by the servers' schema (schema.h), and the types of
+  // the attributes in result.
+  bool typed;
+  std::map<std::string, schema_attr> types;
+
+  // Group expansion
+  job *work_req;
+  conn_pool *pool;
+  std::vector<group_node*> groups;
+  int expanding;  // sub-tasks still running, plus one for EIO_Search
+  bool partial;   // some group could not be looked up: do not cache
+  bool found;     // the filter matched an entry
+  int search_rc;  // the server's answer; only LDAP_SUCCESS is cached
+  // The node expanded for each group met so far (groups.h): memberOf
+  // may loop (A in B, B in A), and a group reached twice is expanded
+  // and listed once.
+  group_index expanded;
+  uv_mutex_t expanded_lock;
+
   // Results
   std::map<char*, std::vector<char*> > result;
 
+  // Browsing (browse.h): a sorted window of entries, each with its dn,
+  // instead of one entry and its groups. NULL for a plain search.
+  browse_spec *browse;
+  int browse_rc;
+  browse_page page;             // its messages freed on the worker
+  std::vector<std::map<char*, std::vector<char*> > > entries;
+
+  search_request() : pool(NULL)
+  {
+    uv_mutex_init(&expanded_lock);
+  }
+
   ~search_request()
   {
-    free(base);
-    free(filter);
+    uv_mutex_destroy(&expanded_lock);
+    PoolRelease(pool);
+    delete browse;
   }
 };
 
+// A group whose name and parents are being looked up on a worker.
+struct expand_task
+{
+  job work_req;
+  search_request *search_req;
+  group_node *node;
+};
+
+// Main thread only: allocated in Authenticate(), returned by the
+// callbacks after it.
+static std::vector<auth_request*> spare_requests;
+
+static auth_request *NewAuthRequest()
+{
+  if (spare_requests.empty()) return new auth_request;
+  auth_request *auth_req = spare_requests.back();
+  spare_requests.pop_back();
+  return auth_req;
+}
+
+static void FreeAuthRequest(auth_request *auth_req)
+{
+  if (spare_requests.size() >= REQUEST_POOL_SIZE) {
+    delete auth_req;
+    return;
+  }
+  auth_req->callback.Dispose();
+  auth_req->callback.Clear();
+  auth_req->WipeStrings();
+  if (auth_req->strings != auth_req->inline_strings) {
+    free(auth_req->strings);
+    auth_req->strings = auth_req->inline_strings;
+    auth_req->strings_capacity = REQUEST_INLINE_BYTES;
+  }
+  auth_req->reply_conn = NULL;
+  spare_requests.push_back(auth_req);
+}
+
+// Room for length bytes of strings in req; what was there is wiped.
+static char *ReserveStrings(auth_request *req, size_t length)
+{
+  req->WipeStrings();
+  req->strings_used = length;
+  if (length > req->strings_capacity) {
+    if (req->strings != req->inline_strings) free(req->strings);
+    req->strings = (char*)malloc(length);
+    req->strings_capacity = length;
+  }
+  return req->strings;
+}
+
+// Copies values into req's strings, pointing fields at the copies.
+static void CopyStrings(auth_request *req, int count, const char *const *values, char **const *fields)
+{
+  size_t lengths[MAX_REQUEST_STRINGS];
+  size_t total = 0;
+  for (int idx = 0; idx < count; idx++)
+  {
+    lengths[idx] = strlen(values[idx]);
+    total += lengths[idx] + 1;
+  }
+
+  char *out = ReserveStrings(req, total);
+  for (int idx = 0; idx < count; idx++)
+  {
+    memcpy(out, values[idx], lengths[idx] + 1);
+    *fields[idx] = out;
+    out += lengths[idx] + 1;
+  }
+}
+
+// As CopyStrings(), straight from JavaScript values as UTF-8: sized
+// first, then written in place without a temporary copy, byte for byte
+// when V8 knows them to be ASCII.
+static void MarshalStrings(auth_request *req, int count, const Handle<Value> *values, char **const *fields)
+{
+  Local<String> strings[MAX_REQUEST_STRINGS];
+  bool ascii[MAX_REQUEST_STRINGS];
+  int lengths[MAX_REQUEST_STRINGS];
+  size_t total = 0;
+  for (int idx = 0; idx < count; idx++)
+  {
+    strings[idx] = values[idx]->ToString();
+    ascii[idx] = !strings[idx]->MayContainNonAscii();
+    lengths[idx] = ascii[idx] ? strings[idx]->Length() : strings[idx]->Utf8Length();
+    total += lengths[idx] + 1;
+  }
+
+  char *out = ReserveStrings(req, total);
+  for (int idx = 0; idx < count; idx++)
+  {
+    if (ascii[idx]) {
+      strings[idx]->WriteAscii(out, 0, lengths[idx], String::NO_NULL_TERMINATION);
+    } else {
+      strings[idx]->WriteUtf8(out, lengths[idx], NULL, String::NO_NULL_TERMINATION);
+    }
+    out[lengths[idx]] = '\0';
+    *fields[idx] = out;
+    out += lengths[idx] + 1;
+  }
+}
+
+// Whole search() results, and each group's name and parents, by the
+// search that produced them. See cache.h.
+static cache *search_cache;
+static cache *group_cache;
+
+// The key search cache entries' passwords are hashed under while the
+// search cache has a tier: kept next to it, so that what the tier holds
+// is still hit after a restart. NULL for the per-process key. Atomic;
+// one replaced is not freed, as searches may still be using it.
+static hash_key *search_key = NULL;
+
+// How long a search that found nobody is cached, at most. Short, so that
+// a user created a moment ago can log in soon.
+static int negative_ttl = 60000;
+
+// configure({ typedValues }), see schema.h.
+static int typed_values = 0;
+
 // Runs on background thread, performing the actual LDAP request.
-static void EIO_Authenticate(uv_work_t* req) 
+static void EIO_Authenticate(job* req) 
 {
   struct auth_request *auth_req = (struct auth_request*)(req->data);
 
@@ -105,57 +315,120 @@ static void EIO_Authenticate(uv_work_t* req)
   // thread anyway, it's just simpler to call the rest of the calls
   // synchronously.
   
-  // Connect to LDAP server
-  LDAP *ldap = ldap_init(auth_req->host, auth_req->port);
-  unsigned long int len = 5 + sizeof(auth_req->scheme) + sizeof(auth_req->host) + sizeof(auth_req->port);
-  char uri[len];
-  sprintf(uri, "%s://%s:%d/", auth_req->scheme, auth_req->host, auth_req->port);
-
-  int res = ldap_initialize(&ldap, uri);
-  if (ldap == NULL  || res < 0) {
-    auth_req->connected = false;
-    auth_req->authenticated = false;
-  } else {
+  std::vector<server_addr> servers;
+  ServersSelect(auth_req->host, auth_req->port, &servers);
+
+  auth_req->connected = false;
+  auth_req->authenticated = false;
+
+  // Known disabled or locked accounts fail without costing a bind.
+  auth_req->account_state = AccountsState(auth_req->username);
+  if (auth_req->account_state != ACCOUNT_ACTIVE) {
+    auth_req->connected = true;
+    return;
+  }
+
+  // Try each server in turn until one answers the bind, either way.
+  for (size_t idx = 0; idx < servers.size() && !auth_req->connected; idx++)
+  {
+    ServersSetScheme(servers[idx], auth_req->scheme);
+
+    // Connect to LDAP server
+    char uri[strlen(auth_req->scheme) + servers[idx].host.size() + 32];
+    snprintf(uri, sizeof(uri), "%s://%s:%d/", auth_req->scheme, servers[idx].host.c_str(), servers[idx].port);
+
+    uint64_t started = uv_hrtime();
+    LDAP *ldap = NULL;
+    int res = ldap_initialize(&ldap, uri);
+    if (ldap == NULL || res != LDAP_SUCCESS) continue;
+    ServersStart(servers[idx]);
+
+    struct timeval timeout;
+    ServersConnectTimeout(&timeout);
+    ldap_set_option(ldap, LDAP_OPT_NETWORK_TIMEOUT, &timeout);
+
     // Bind with credentials, passing result into auth_request struct
     int ldap_result = ldap_simple_bind_s(ldap, auth_req->username, auth_req->password);
     // Disconnect
     ldap_unbind_s(ldap);
 
-    auth_req->connected = true;
-    auth_req->authenticated = (ldap_result == LDAP_SUCCESS);
+    bool reached = !ServersUnreachable(ldap_result);
+    ServersReport(servers[idx], ldap_result, uv_hrtime() - started);
+    if (reached) {
+      auth_req->connected = true;
+      auth_req->authenticated = (ldap_result == LDAP_SUCCESS);
+    }
   }
 
   return;
 }
 
 // Called on main event loop when background thread has completed
-static void EIO_AfterAuthenticate(uv_work_t* req) 
+static void EIO_AfterAuthenticate(job* req) 
 {
   ev_unref(EV_DEFAULT_UC);
   HandleScope scope;
   struct auth_request *auth_req = (struct auth_request *)(req->data);
   
-  // Invoke callback JS function
-  Handle<Value> callback_args[2];
-  callback_args[0] = auth_req->connected ? (Handle<Value>)Undefined() : Exception::Error(String::New("LDAP connection failed"));
-  callback_args[1] = Boolean::New(auth_req->authenticated);
-  auth_req->callback->Call(Context::GetCurrent()->Global(), 2, callback_args);
+  // Invoke callback JS function. A third argument says why an account
+  // in the index was refused without binding.
+  Handle<Value> callback_args[3];
+  int argc = 2;
+  if (req->status == JOB_REJECTED) {
+    callback_args[0] = Exception::Error(String::New(QUEUE_FULL_MESSAGE));
+    callback_args[1] = Boolean::New(false);
+  } else {
+    callback_args[0] = auth_req->connected ? (Handle<Value>)Undefined() : Exception::Error(String::New("LDAP connection failed"));
+    callback_args[1] = Boolean::New(auth_req->authenticated);
+    if (auth_req->account_state != ACCOUNT_ACTIVE) {
+      callback_args[argc++] = String::New(auth_req->account_state == ACCOUNT_DISABLED ? "disabled" : "locked");
+    }
+  }
+  auth_req->callback->Call(Context::GetCurrent()->Global(), argc, callback_args);
 
   // Cleanup auth_request struct
-  delete auth_req;
+  FreeAuthRequest(auth_req);
+  free(req);
 
   return;
 }
 
-static std::map<char*, std::vector<char*> > ResultObject(LDAP* ldap, LDAPMessage *resultMessage)
+// A value as it goes in the result: as is, or typed by attr's syntax.
+static char *ResultValue(search_request *search_req, const schema_attr &type, const char *data, size_t length)
+{
+  if (!search_req->typed) return strdup(data);
+  return strdup(SchemaConvert(type.type, data, length).c_str());
+}
+
+static std::map<char*, std::vector<char*> > ResultObject(LDAP* ldap, LDAPMessage *resultMessage, search_request *search_req)
 {
   std::map<char*, std::vector<char*> > results;
 
   BerElement *berptr;
   char *attr;
+  std::string servers = search_req->typed ? ServersKey(search_req->host, search_req->port) : std::string();
 
   for (attr = ldap_first_attribute(ldap, resultMessage, &berptr); attr; attr = ldap_next_attribute(ldap, resultMessage, berptr))
   {
+    if (search_req->typed) {
+      // Binary values may hold NULs: read them with their lengths.
+      schema_attr type = SchemaLookup(servers, attr);
+      struct berval **vals = ldap_get_values_len(ldap, resultMessage, attr);
+      int numVals = ldap_count_values_len(vals);
+
+      std::vector<char*> values;
+      for (int idx = 0; idx < numVals; idx++)
+      {
+        values.push_back(ResultValue(search_req, type, vals[idx]->bv_val, vals[idx]->bv_len));
+      }
+
+      search_req->types[attr] = type;
+      results.insert(std::pair<char*, std::vector<char*> >(strdup(attr), values));
+      ldap_value_free_len(vals);
+      ldap_memfree(attr);
+      continue;
+    }
+
     char **vals = ldap_get_values(ldap, resultMessage, attr);
     int numVals = ldap_count_values(vals);
 
@@ -175,7 +448,38 @@ static std::map<char*, std::vector<char*> > ResultObject(LDAP* ldap, LDAPMessage
   return results;
 }
 
-static Handle<Value> JsResultObject(std::map<char*, std::vector<char*> > c_results)
+// 2^53: integers beyond it stay strings rather than lose precision.
+#define MAX_SAFE_INTEGER 9007199254740992LL
+
+// A typed value (see SchemaConvert()) as JavaScript sees it.
+static Handle<Value> JsTypedValue(char type, const char *value)
+{
+  char *end;
+  switch (type)
+  {
+    case SCHEMA_BOOLEAN:
+      if (strcmp(value, "TRUE") == 0) return True();
+      if (strcmp(value, "FALSE") == 0) return False();
+      break;
+
+    case SCHEMA_TIME:
+    case SCHEMA_UTCTIME:
+    case SCHEMA_FILETIME:
+      if (*value == '\0') return Null();
+      // Fall through: epoch ms, unless the value could not be parsed.
+    case SCHEMA_INTEGER: {
+      long long number = strtoll(value, &end, 10);
+      if (end != value && *end == '\0' && number <= MAX_SAFE_INTEGER && number >= -MAX_SAFE_INTEGER) {
+        return Number::New((double)number);
+      }
+      break;
+    }
+  }
+  return String::New(value);
+}
+
+// Frees c_results' names and values as it goes.
+static Handle<Value> JsResultObject(search_request *search_req, std::map<char*, std::vector<char*> > &c_results)
 {
   HandleScope scope;
 
@@ -188,7 +492,25 @@ static Handle<Value> JsResultObject(std::map<char*, std::vector<char*> > c_resul
 
     int numVals = values.size();
 
-    if (numVals == 1) {
+    if (search_req->typed) {
+      // Unknown attributes, allGroups among them, are multi-valued strings.
+      schema_attr type;
+      type.type = SCHEMA_STRING;
+      type.single = false;
+      std::map<std::string, schema_attr>::iterator known = search_req->types.find(attr);
+      if (known != search_req->types.end()) type = known->second;
+
+      if (type.single) {
+        results->Set(String::New(attr), numVals > 0 ? JsTypedValue(type.type, values[0]) : (Handle<Value>)Null());
+      } else {
+        Local<Array> jsValues = Array::New(numVals);
+        for (int idx = 0; idx < numVals; idx++)
+        {
+          jsValues->Set(Integer::New(idx), JsTypedValue(type.type, values[idx]));
+        }
+        results->Set(String::New(attr), jsValues);
+      }
+    } else if (numVals == 1) {
       results->Set(String::New(attr), String::New(values[0]));
     } else {
       Local<Array> jsValues = Array::New(numVals);
@@ -209,6 +531,8 @@ static Handle<Value> JsResultObject(std::map<char*, std::vector<char*> > c_resul
   return scope.Close(results);
 }
 
+static void EIO_BrokerAuthenticate(job* req);
+
 // Exposed authenticate() JavaScript function
 static Handle<Value> Authenticate(const Arguments& args)
 {
@@ -222,167 +546,2021 @@ static Handle<Value> Authenticate(const Arguments& args)
   if (!args[3]->IsString())   return THROW("username should be a string");
   if (!args[4]->IsString())   return THROW("password should be a string");
   if (!args[5]->IsFunction()) return THROW("callback should be a function");
-
-  // Input params.
-  String::Utf8Value scheme(args[0]);
-  String::Utf8Value host(args[1]);
-  int port = args[2]->Int32Value();
-  String::Utf8Value username(args[3]);
-  String::Utf8Value password(args[4]);
-  Local<Function> callback = Local<Function>::Cast(args[5]);
-  
-  // Store all parameters in auth_request struct, which shall be passed across threads.
-  //struct auth_request *auth_req = (struct auth_request*) calloc(1, sizeof(struct auth_request));
-  struct auth_request *auth_req = new auth_request;
-  auth_req->scheme = strdup(*scheme);
-  auth_req->host = strdup(*host);
-  auth_req->port = port;
-  auth_req->username = strdup(*username);
-  auth_req->password = strdup(*password);
-  auth_req->callback = Persistent<Function>::New(callback);
+  if (args.Length() > 6 && !args[6]->IsString() && !args[6]->IsUndefined()) return THROW("source should be a string");
+
+  // Store all parameters in auth_request struct, which shall be passed
+  // across threads: the strings in one buffer of its own.
+  struct auth_request *auth_req = NewAuthRequest();
+  Handle<Value> strings[] = { args[0], args[1], args[3], args[4] };
+  char **fields[] = { &auth_req->scheme, &auth_req->host, &auth_req->username, &auth_req->password };
+  MarshalStrings(auth_req, 4, strings, fields);
+  auth_req->port = args[2]->Int32Value();
+  auth_req->callback = Persistent<Function>::New(Local<Function>::Cast(args[5]));
+
+  if (args.Length() > 6 && args[6]->IsString()) {
+    String::Utf8Value source(args[6]);
+    SketchRecord(auth_req->username, *source);
+  } else {
+    SketchRecord(auth_req->username, NULL);
+  }
+  auth_req->account_state = ACCOUNT_ACTIVE;
   
-  uv_work_t *work_req = (uv_work_t *) (calloc(1, sizeof(uv_work_t)));
+  job *work_req = (job *) (calloc(1, sizeof(job)));
   work_req->data = auth_req;
 
-  // Use uv_queue_work to invoke EIO_Authenticate() in background thread pool
-  // and call EIO_AfterAuthententicate in the foreground when done
-  uv_queue_work(uv_default_loop(), work_req, EIO_Authenticate, EIO_AfterAuthenticate);
+  // Use JobsQueue to invoke EIO_Authenticate() in background thread pool
+  // and call EIO_AfterAuthententicate in the foreground when done.
+  // Returns false when the pool is full (callback gets an error).
+  bool queued;
+  if (BrokerForwarding()) {
+    queued = JobsQueue(work_req, EIO_BrokerAuthenticate, EIO_AfterAuthenticate, true);
+  } else {
+    queued = JobsQueue(work_req, EIO_Authenticate, EIO_AfterAuthenticate);
+  }
 
   ev_ref(EV_DEFAULT_UC);
 
+  return scope.Close(Boolean::New(queued));
+}
+
+#ifdef LDAPAUTH_BENCH
+// Exposed _marshal() JavaScript function, for bench/marshal.js, in builds
+// configured with --bench only: turns authenticate()'s arguments
+// (scheme, host, port, username, password) into a request and drops it,
+// nothing else. With a sixth argument true, as it used to be done: a
+// Utf8Value and a strdup() per string.
+static Handle<Value> Marshal(const Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() < 5) return THROW("Required arguments: ldap_scheme, ldap_host, ldap_port, username, password, [copy]");
+
+  if (args.Length() > 5 && args[5]->BooleanValue()) {
+    String::Utf8Value scheme(args[0]);
+    String::Utf8Value host(args[1]);
+    String::Utf8Value username(args[3]);
+    String::Utf8Value password(args[4]);
+    char *copies[] = { strdup(*scheme), strdup(*host), strdup(*username), strdup(*password) };
+    struct auth_request *auth_req = new auth_request;
+    auth_req->scheme = copies[0];
+    auth_req->host = copies[1];
+    auth_req->port = args[2]->Int32Value();
+    auth_req->username = copies[2];
+    auth_req->password = copies[3];
+    delete auth_req;
+    for (int idx = 0; idx < 4; idx++) free(copies[idx]);
+    return Undefined();
+  }
+
+  struct auth_request *auth_req = NewAuthRequest();
+  Handle<Value> strings[] = { args[0], args[1], args[3], args[4] };
+  char **fields[] = { &auth_req->scheme, &auth_req->host, &auth_req->username, &auth_req->password };
+  MarshalStrings(auth_req, 4, strings, fields);
+  auth_req->port = args[2]->Int32Value();
+  FreeAuthRequest(auth_req);
   return Undefined();
 }
+#endif
 
 static search_request* BuildSearchRequest(const Arguments& args) 
 { 
-  // Input params.
-  String::Utf8Value host(args[0]);
-  int port = args[1]->Int32Value();
-  String::Utf8Value username(args[2]);
-  String::Utf8Value password(args[3]);
-  String::Utf8Value base(args[4]);
-  String::Utf8Value filter(args[5]);
-  Local<Function> callback = Local<Function>::Cast(args[6]);
-
   // Store all parameters in search_request struct, which shall be passed across threads.
-  //struct search_request *search_req = (struct search_request*) calloc(1, sizeof(struct search_request));
   struct search_request *search_req = new search_request;
-  search_req->host = strdup(*host);
-  search_req->port = port;
-  search_req->username = strdup(*username);
-  search_req->password = strdup(*password);
-  search_req->base = strdup(*base);
-  search_req->filter = strdup(*filter);
-  search_req->callback = Persistent<Function>::New(callback);
+  Handle<Value> strings[] = { args[0], args[2], args[3], args[4], args[5] };
+  char **fields[] = { &search_req->host, &search_req->username, &search_req->password,
+                      &search_req->base, &search_req->filter };
+  MarshalStrings(search_req, 5, strings, fields);
+  search_req->scheme = NULL;
+  search_req->port = args[1]->Int32Value();
+  search_req->callback = Persistent<Function>::New(Local<Function>::Cast(args[6]));
+  search_req->warming = false;
+  search_req->typed = typed_values != 0;
+  search_req->browse = NULL;
 
   return search_req;
 }
 
-static void SearchAncestors(LDAP *ldap, char* group, char* base, std::vector<char*> *groups)
+// The filter the way it goes in a key; as given if it does not parse,
+// and then libldap will reject it anyway.
+static std::string CanonicalFilter(const char *filter)
+{
+  std::string canonical;
+  if (!FilterCanonical(filter, &canonical)) canonical = filter;
+  return canonical;
+}
+
+// The search and the identity it ran as: servers, bind DN, password, base,
+// scope, canonical filter (filter.h), attributes. The password only goes
+// in keyed-hashed (hash.h, under search_key if set), but must go in: a
+// cached result must not reward a wrong one.
+// search() always asks for every attribute of a subtree, so those two
+// fields are constant for now. Typed results (schema.h) are kept apart.
+static std::string SearchKey(search_request *search_req)
+{
+  std::string key;
+  CacheAppend(&key, ServersKey(search_req->host, search_req->port));
+  CacheAppend(&key, search_req->username, strlen(search_req->username));
+  hash_key *kept = __atomic_load_n(&search_key, __ATOMIC_ACQUIRE);
+  size_t password_length = strlen(search_req->password);
+  CacheAppend(&key, kept ? HashKeyed(*kept, search_req->password, password_length)
+                         : HashKeyed(search_req->password, password_length));
+  CacheAppend(&key, StrLower(search_req->base));
+  CacheAppend(&key, "sub", 3);
+  CacheAppend(&key, CanonicalFilter(search_req->filter));
+  CacheAppend(&key, "*", 1);
+  CacheAppend(&key, search_req->typed ? "typed" : "", search_req->typed ? 5 : 0);
+  return key;
+}
+
+// What invalidate() removes; empty fields match anything.
+struct invalidation
+{
+  std::string bind_dn;
+  std::string base;
+  std::string filter;
+};
+
+static bool SearchKeyMatches(const std::string &key, void *arg)
+{
+  invalidation *which = (invalidation*)arg;
+  size_t offset = 0;
+  std::string servers, bind_dn, password, base, scope, filter;
+  if (!CacheRead(key, &offset, &servers) || !CacheRead(key, &offset, &bind_dn)
+      || !CacheRead(key, &offset, &password) || !CacheRead(key, &offset, &base)
+      || !CacheRead(key, &offset, &scope) || !CacheRead(key, &offset, &filter)) {
+    return true;  // not ours: drop it
+  }
+  return (which->bind_dn.empty() || which->bind_dn == bind_dn)
+      && (which->base.empty() || which->base == base)
+      && (which->filter.empty() || which->filter == filter);
+}
+
+// By the identity the group was read as, too: what a group entry shows
+// depends on the reader's access. Groups are only expanded after a search
+// has bound as it, so the password need not go in.
+static std::string GroupKey(search_request *search_req, const char *dn)
+{
+  std::string key;
+  CacheAppend(&key, ServersKey(search_req->host, search_req->port));
+  CacheAppend(&key, search_req->username, strlen(search_req->username));
+  CacheAppend(&key, search_req->base, strlen(search_req->base));
+  CacheAppend(&key, dn, strlen(dn));
+  return key;
+}
+
+// The attributes, then the types of those typed (schema.h), each a name
+// and its type and "1" or "0" for single-valued.
+static std::string EncodeResult(search_request *search_req)
+{
+  const std::map<char*, std::vector<char*> > &result = search_req->result;
+  std::string value;
+  CacheAppend(&value, (uint32_t)result.size());
+  for (std::map<char*, std::vector<char*> >::const_iterator iter = result.begin(); iter != result.end(); ++iter)
+  {
+    CacheAppend(&value, iter->first, strlen(iter->first));
+    CacheAppend(&value, (uint32_t)iter->second.size());
+    for (size_t idx = 0; idx < iter->second.size(); idx++)
+    {
+      CacheAppend(&value, iter->second[idx], strlen(iter->second[idx]));
+    }
+  }
+
+  CacheAppend(&value, (uint32_t)search_req->types.size());
+  for (std::map<std::string, schema_attr>::const_iterator iter = search_req->types.begin(); iter != search_req->types.end(); ++iter)
+  {
+    char type[2] = { iter->second.type, iter->second.single ? '1' : '0' };
+    CacheAppend(&value, iter->first);
+    CacheAppend(&value, type, sizeof(type));
+  }
+  return value;
+}
+
+static void FreeResult(search_request *search_req);
+
+// False, with nothing decoded, if value is truncated.
+static bool DecodeResult(const std::string &value, search_request *search_req)
+{
+  std::map<char*, std::vector<char*> > *result = &search_req->result;
+  size_t offset = 0;
+  uint32_t attrs, count;
+  std::string attr, data;
+  bool complete = CacheRead(value, &offset, &attrs);
+  for (uint32_t attr_idx = 0; complete && attr_idx < attrs; attr_idx++)
+  {
+    complete = CacheRead(value, &offset, &attr) && CacheRead(value, &offset, &count);
+    std::vector<char*> values;
+    for (uint32_t idx = 0; complete && idx < count; idx++)
+    {
+      complete = CacheRead(value, &offset, &data);
+      if (complete) values.push_back(strdup(data.c_str()));
+    }
+    result->insert(std::pair<char*, std::vector<char*> >(strdup(attr.c_str()), values));
+  }
+  if (!complete) {
+    FreeResult(search_req);
+    return false;
+  }
+
+  // Absent from results cached before types were.
+  uint32_t types;
+  if (!CacheRead(value, &offset, &types)) return true;
+  for (uint32_t idx = 0; idx < types; idx++)
+  {
+    if (!CacheRead(value, &offset, &attr) || !CacheRead(value, &offset, &data) || data.size() != 2) break;
+    schema_attr type;
+    type.type = data[0];
+    type.single = data[1] == '1';
+    search_req->types[attr] = type;
+  }
+  return true;
+}
+
+// Runs on whichever thread finishes the last piece of a search.
+static void FinishSearch(search_request *search_req)
+{
+  std::vector<char*> groups;
+  FlattenGroups(search_req->groups, search_req->expanded, &groups);
+  FreeGroups(&search_req->groups);
+  search_req->result.insert(std::pair<char*, std::vector<char*> >(strdup("allGroups"), groups));
+
+  // A time or size limit, a busy or confused server: whatever came back
+  // may be short of the truth, and "nobody" above all must not stick.
+  if (!__atomic_load_n(&search_req->partial, __ATOMIC_SEQ_CST) && search_req->search_rc == LDAP_SUCCESS) {
+    CachePut(search_cache, SearchKey(search_req), EncodeResult(search_req),
+             search_req->found ? -1 : negative_ttl);
+  }
+
+  JobsComplete(search_req->work_req);
+}
+
+static void EIO_ExpandGroup(job* req);
+static conn_pool *SearchPool(search_request *search_req);
+
+// Queues lookups for nodes' names and parents, but for groups already
+// met, whose nodes stay as leaves. Called with one outstanding count
+// already held, so the search cannot finish early.
+static void ExpandGroups(search_request *search_req, const std::vector<group_node*> &nodes)
+{
+  std::vector<group_node*> claimed;
+  uv_mutex_lock(&search_req->expanded_lock);
+  for (size_t idx = 0; idx < nodes.size(); idx++)
+  {
+    group_node *node = nodes[idx];
+    if (search_req->expanded.insert(std::make_pair(StrLower(node->dn), node)).second) claimed.push_back(node);
+  }
+  uv_mutex_unlock(&search_req->expanded_lock);
+
+  __atomic_add_fetch(&search_req->expanding, (int)claimed.size(), __ATOMIC_SEQ_CST);
+  for (size_t idx = 0; idx < claimed.size(); idx++)
+  {
+    struct expand_task *task = new expand_task;
+    task->work_req.data = task;
+    task->search_req = search_req;
+    task->node = claimed[idx];
+    JobsSpawn(&task->work_req, EIO_ExpandGroup);
+  }
+}
+
+// A group's name and parents from the replica, if it holds the group.
+static bool ReplicaGroup(search_request *search_req, group_node *node)
+{
+  replica_entry entry;
+  std::string group_filter = std::string("(distinguishedName=") + node->dn + ")";
+  if (!ReplicaSearch(search_req->host, search_req->port, search_req->username, search_req->password,
+                     search_req->base, group_filter.c_str(), &entry)) {
+    return false;
+  }
+
+  const std::vector<std::string> *names = ReplicaValues(entry, "name");
+  node->name = strdup(names != NULL && !names->empty() ? names->at(0).c_str() : node->dn);
+  const std::vector<std::string> *ancestors = ReplicaValues(entry, "memberOf");
+  for (size_t idx = 0; ancestors != NULL && idx < ancestors->size(); idx++)
+  {
+    node->parents.push_back(NewGroup(ancestors->at(idx).c_str()));
+  }
+  return true;
+}
+
+// Runs on background thread, one per group in the user's memberOf closure.
+static void EIO_ExpandGroup(job* req)
 {
-    std::string group_dn (group);
+  struct expand_task *task = (struct expand_task*)(req->data);
+  struct search_request *search_req = task->search_req;
+  group_node *node = task->node;
+  delete task;
+
+  // Cached as the name, then the parents' DNs.
+  std::string cached;
+  std::string group_key = GroupKey(search_req, node->dn);
+  if (!search_req->warming && CacheGet(group_cache, group_key, &cached)) {
+    size_t offset = 0;
+    std::string name, parent;
+    CacheRead(cached, &offset, &name);
+    node->name = strdup(name.c_str());
+    while (CacheRead(cached, &offset, &parent))
+    {
+      node->parents.push_back(NewGroup(parent.c_str()));
+    }
+  } else if (ReplicaGroup(search_req, node)) {
+    // Answered from the replica; too cheap to be worth caching.
+  } else {
+    arena_scope request_arena;
+    LDAP *ldap = DecodeHandle();
+    std::string group_dn (node->dn);
     std::string group_filter ("(distinguishedName=" + group_dn + ")");
 
     LDAPMessage *groupSearchResultMessage;
-    int ldap_result = ldap_search_ext_s(ldap, base, LDAP_SCOPE_SUB, group_filter.c_str(), NULL, 0, NULL, NULL, NULL, 0, &groupSearchResultMessage);
-    if(ldap_result == LDAP_SUCCESS)
+    int ldap_result = PoolSearch(SearchPool(search_req), search_req->base, LDAP_SCOPE_SUB, group_filter.c_str(), NULL, &groupSearchResultMessage);
+    LDAPMessage *groupEntry = ldap_result == LDAP_SUCCESS ? ldap_first_entry(ldap, groupSearchResultMessage) : NULL;
+    if(groupEntry != NULL)
     {
-      char **names = ldap_get_values(ldap, groupSearchResultMessage, "name");
-      char* group_short_name;
+      char **names = ldap_get_values(ldap, groupEntry, "name");
       if (ldap_count_values(names)) {
-        group_short_name = names[0];
+        node->name = strdup(names[0]);
       } else {
-        group_short_name = group;
+        node->name = strdup(node->dn);
       }
 
-      groups->push_back(strdup(group_short_name));
-
-      char** ancestors = ldap_get_values(ldap, groupSearchResultMessage, "memberOf");
+      char** ancestors = ldap_get_values(ldap, groupEntry, "memberOf");
       int numAncestors = ldap_count_values(ancestors);
-      if (numAncestors == 0) {
-      }
       for( int j = 0; j < numAncestors; j++) 
       {
-        SearchAncestors(ldap, ancestors[j], base, groups);
+        node->parents.push_back(NewGroup(ancestors[j]));
       }
       ldap_value_free(ancestors);
       ldap_value_free(names);
     }
     else 
     {
-      groups->push_back(strdup(group));
+      node->name = strdup(node->dn);
     }
     ldap_msgfree(groupSearchResultMessage);
+
+    if (ldap_result == LDAP_SUCCESS) {
+      std::string value;
+      CacheAppend(&value, node->name, strlen(node->name));
+      for (size_t idx = 0; idx < node->parents.size(); idx++)
+      {
+        CacheAppend(&value, node->parents[idx]->dn, strlen(node->parents[idx]->dn));
+      }
+      CachePut(group_cache, group_key, value);
+    } else {
+      __atomic_store_n(&search_req->partial, true, __ATOMIC_SEQ_CST);
+    }
+  }
+
+  ExpandGroups(search_req, node->parents);
+
+  if (__atomic_sub_fetch(&search_req->expanding, 1, __ATOMIC_SEQ_CST) == 0) {
+    FinishSearch(search_req);
+  }
 }
 
-static void EIO_Search(uv_work_t* req)
+// Points search_req at the pool for server, giving back the one before.
+// False if no pool can be had (see POOL_MAX_POOLS).
+static bool UsePool(search_request *search_req, const server_addr &server)
 {
-  struct search_request *search_req = (struct search_request*)(req->data);
-  LDAP *ldap = ldap_open(search_req->host, search_req->port);
+  char uri[server.scheme.size() + server.host.size() + 32];
+  snprintf(uri, sizeof(uri), "%s://%s:%d/", server.scheme.c_str(), server.host.c_str(), server.port);
+  PoolRelease(search_req->pool);
+  search_req->pool = PoolAcquire(uri, search_req->username, search_req->password);
+  return search_req->pool != NULL;
+}
 
-  if (ldap == NULL) {
-    search_req->connected = false;
-  } else {
-    ldap_simple_bind_s(ldap, search_req->username, search_req->password);
+// search_req's pool, picked the first time one is needed: a search the
+// replica answers only needs one for typing or for groups it lacks. Group
+// sub-tasks may race here; the first pool in wins.
+static conn_pool *SearchPool(search_request *search_req)
+{
+  conn_pool *pool = __atomic_load_n(&search_req->pool, __ATOMIC_ACQUIRE);
+  if (pool != NULL) return pool;
+
+  std::vector<server_addr> servers;
+  ServersSelect(search_req->host, search_req->port, &servers);
+  if (servers.empty()) return NULL;
+
+  char uri[servers[0].scheme.size() + servers[0].host.size() + 32];
+  snprintf(uri, sizeof(uri), "%s://%s:%d/", servers[0].scheme.c_str(), servers[0].host.c_str(), servers[0].port);
+  conn_pool *picked = PoolAcquire(uri, search_req->username, search_req->password);
+  if (picked == NULL) return NULL;
+  if (!__atomic_compare_exchange_n(&search_req->pool, &pool, picked, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    PoolRelease(picked);
+  }
+  return __atomic_load_n(&search_req->pool, __ATOMIC_ACQUIRE);
+}
+
+// One try of a request on search_req->pool, for FailOver(). Frees what
+// it got if the result code says the server could not be reached.
+typedef int (*server_attempt)(search_request *search_req, void *arg);
+
+// Tries search_req's servers, best first, until one answers; its pool
+// is then search_req's. False if none did. *rc is the last attempt's.
+static bool FailOver(search_request *search_req, server_attempt attempt, void *arg, int *rc)
+{
+  std::vector<server_addr> servers;
+  ServersSelect(search_req->host, search_req->port, &servers);
+
+  *rc = LDAP_SERVER_DOWN;
+  for (size_t idx = 0; idx < servers.size(); idx++)
+  {
+    if (!UsePool(search_req, servers[idx])) break;
+
+    ServersStart(servers[idx]);
+    uint64_t started = uv_hrtime();
+    *rc = attempt(search_req, arg);
+    ServersReport(servers[idx], *rc, uv_hrtime() - started);
+    if (!ServersUnreachable(*rc)) return true;
+  }
+  return false;
+}
 
-    LDAPMessage *resultMessage;
-    char **attrs = NULL;
-    ldap_search_ext_s(ldap, search_req->base, LDAP_SCOPE_SUB, search_req->filter, attrs, 0, NULL, NULL, NULL, 0, &resultMessage);
+// Answers a search from the replica (replica.h) if it can, without a
+// pool unless typing needs the schema.
+static bool SearchReplica(search_request *search_req)
+{
+  replica_entry entry;
+  if (!ReplicaSearch(search_req->host, search_req->port, search_req->username, search_req->password,
+                     search_req->base, search_req->filter, &entry)) {
+    return false;
+  }
 
-    std::vector<char*> groups;
+  // Typing needs the schema, which a pool then connects for, once.
+  std::string servers_key;
+  if (search_req->typed) {
+    servers_key = ServersKey(search_req->host, search_req->port);
+    if (!SchemaFresh(servers_key)) {
+      conn_pool *pool = SearchPool(search_req);
+      if (pool != NULL) SchemaLoad(servers_key, pool);
+    }
+  }
 
-    char** members = ldap_get_values(ldap, resultMessage, "memberOf");
-    int numMembers = ldap_count_values(members);
+  search_req->found = true;
+  for (size_t attr = 0; attr < entry.attributes.size(); attr++)
+  {
+    const char *name = entry.attributes[attr].first.c_str();
+    schema_attr type = search_req->typed ? SchemaLookup(servers_key, name) : schema_attr();
+    if (search_req->typed) search_req->types[name] = type;
 
-    for (int i = 0; i < numMembers; i++)
+    std::vector<char*> values;
+    for (size_t idx = 0; idx < entry.attributes[attr].second.size(); idx++)
     {
-      SearchAncestors(ldap, members[i], search_req->base, &groups);
+      const std::string &value = entry.attributes[attr].second[idx];
+      values.push_back(ResultValue(search_req, type, value.c_str(), value.size()));
     }
+    search_req->result.insert(std::pair<char*, std::vector<char*> >(strdup(name), values));
+  }
+  const std::vector<std::string> *members = ReplicaValues(entry, "memberOf");
+  for (size_t idx = 0; members != NULL && idx < members->size(); idx++)
+  {
+    search_req->groups.push_back(NewGroup(members->at(idx).c_str()));
+  }
+  search_req->connected = true;
+  return true;
+}
+
+static int SearchAttempt(search_request *search_req, void *arg)
+{
+  LDAPMessage **res = (LDAPMessage**)arg;
+  int rc = PoolSearch(search_req->pool, search_req->base, LDAP_SCOPE_SUB, search_req->filter, NULL, res);
+  if (ServersUnreachable(rc)) {
+    ldap_msgfree(*res);
+    *res = NULL;
+  }
+  return rc;
+}
+
+// Runs on background thread. Searches share pooled connections, see pool.h,
+// and each group found is expanded by its own sub-task.
+static void EIO_Search(job* req)
+{
+  struct search_request *search_req = (struct search_request*)(req->data);
+  search_req->work_req = req;
+  search_req->expanding = 1;
+  search_req->partial = false;
+  search_req->found = false;
+  search_req->search_rc = LDAP_SUCCESS;
+
+  std::string cached;
+  if (!search_req->warming && CacheGet(search_cache, SearchKey(search_req), &cached)
+      && DecodeResult(cached, search_req)) {
+    search_req->connected = true;
+    JobsComplete(req);
+    return;
+  }
+
+  if (!SearchReplica(search_req)) {
+    // libldap's allocations while decoding the result all die with this scope.
+    arena_scope request_arena;
+
+    // Fail over until some server answers; its pool then serves the
+    // group expansion, too.
+    LDAPMessage *resultMessage = NULL;
+    int rc;
+    FailOver(search_req, SearchAttempt, &resultMessage, &rc);
+    search_req->search_rc = rc;
+
+    if (resultMessage == NULL) {
+      search_req->connected = false;
+      JobsComplete(req);
+      return;
+    }
+
+    LDAP *ldap = DecodeHandle();
+    LDAPMessage *entry = ldap_first_entry(ldap, resultMessage);
 
-    ldap_value_free(members);
+    if (entry != NULL) {
+      search_req->found = true;
+      char** members = ldap_get_values(ldap, entry, "memberOf");
+      int numMembers = ldap_count_values(members);
+
+      for (int i = 0; i < numMembers; i++)
+      {
+        search_req->groups.push_back(NewGroup(members[i]));
+      }
+
+      ldap_value_free(members);
+
+      if (search_req->typed) SchemaLoad(ServersKey(search_req->host, search_req->port), search_req->pool);
+      search_req->result = ResultObject(ldap, entry, search_req);
+    }
 
-    std::map<char*, std::vector<char*> > results = ResultObject(ldap, resultMessage);
-    results.insert(std::pair<char*, std::vector<char*> >(strdup("allGroups"), groups));
-    search_req->result = results;
     search_req->connected = true;
 
     ldap_msgfree(resultMessage);
-    ldap_unbind_s(ldap);
   }
 
-  return;
+  ExpandGroups(search_req, search_req->groups);
+
+  if (__atomic_sub_fetch(&search_req->expanding, 1, __ATOMIC_SEQ_CST) == 0) {
+    FinishSearch(search_req);
+  }
 }
 
-static void EIO_AfterSearch(uv_work_t* req) 
+static void EIO_AfterSearch(job* req) 
 {
 
   ev_unref(EV_DEFAULT_UC);
   HandleScope scope;
   struct search_request *search_req = (struct search_request *)(req->data);
 
-  Handle<Value> jsResults = search_req->connected ? JsResultObject(search_req->result) : (Handle<Value>)Undefined();
+  bool connected = req->status != JOB_REJECTED && search_req->connected;
+  Handle<Value> jsResults = connected ? JsResultObject(search_req, search_req->result) : (Handle<Value>)Undefined();
 
   Handle<Value> callback_args[2];
-  callback_args[0] = search_req->connected ? (Handle<Value>)Undefined() : Exception::Error(String::New("LDAP connection failed"));
+  if (req->status == JOB_REJECTED) {
+    callback_args[0] = Exception::Error(String::New(QUEUE_FULL_MESSAGE));
+  } else {
+    callback_args[0] = connected ? (Handle<Value>)Undefined() : Exception::Error(String::New("LDAP connection failed"));
+  }
   callback_args[1] = jsResults;
   search_req->callback->Call(Context::GetCurrent()->Global(), 2, callback_args);
 
+  delete search_req;
+  free(req);
+
   return;
 }
 
-static Handle<Value> Search(const Arguments &args)
+// Results not passed to JsResultObject() are still ours to free.
+static void FreeResult(search_request *search_req)
 {
-  HandleScope scope;
-  search_request *search_req = BuildSearchRequest(args);
+  for (std::map<char*, std::vector<char*> >::iterator iter = search_req->result.begin(); iter != search_req->result.end(); ++iter)
+  {
+    for (size_t idx = 0; idx < iter->second.size(); idx++)
+    {
+      free(iter->second[idx]);
+    }
+    free(iter->first);
+  }
+  search_req->result.clear();
+}
 
-  uv_work_t *work_req = (uv_work_t *) (calloc(1, sizeof(uv_work_t)));
-  work_req->data = search_req;
+static int BrowseAttempt(search_request *search_req, void *arg)
+{
+  int rc = BrowseSearch(search_req->pool, search_req->host, search_req->port,
+                        search_req->username, search_req->password, search_req->base,
+                        search_req->filter, *search_req->browse, &search_req->page);
+  if (ServersUnreachable(rc)) BrowseFree(&search_req->page);
+  return rc;
+}
 
-  uv_queue_work(uv_default_loop(), work_req, EIO_Search, EIO_AfterSearch);
+// Runs on background thread for a browsing search(): one window, with
+// failover, and no caches or group expansion.
+static void EIO_Browse(job* req)
+{
+  struct search_request *search_req = (struct search_request*)(req->data);
 
-  ev_ref(EV_DEFAULT_UC);
+  // libldap's allocations while decoding the window all die with this scope.
+  arena_scope request_arena;
 
-  return Undefined();
+  search_req->connected = FailOver(search_req, BrowseAttempt, NULL, &search_req->browse_rc);
+
+  if (search_req->connected && search_req->typed) {
+    SchemaLoad(ServersKey(search_req->host, search_req->port), search_req->pool);
+    schema_attr dn_type;
+    dn_type.type = SCHEMA_STRING;
+    dn_type.single = true;
+    search_req->types["dn"] = dn_type;
+  }
+
+  LDAP *ldap = DecodeHandle();
+  for (size_t idx = 0; idx < search_req->page.messages.size(); idx++)
+  {
+    LDAPMessage *message = search_req->page.messages[idx];
+    for (LDAPMessage *entry = ldap_first_entry(ldap, message); entry; entry = ldap_next_entry(ldap, entry))
+    {
+      std::map<char*, std::vector<char*> > result = ResultObject(ldap, entry, search_req);
+      char *dn = ldap_get_dn(ldap, entry);
+      result[strdup("dn")].push_back(strdup(dn != NULL ? dn : ""));
+      ldap_memfree(dn);
+      search_req->entries.push_back(result);
+    }
+  }
+  BrowseFree(&search_req->page);
+}
+
+static void EIO_AfterBrowse(job* req)
+{
+  ev_unref(EV_DEFAULT_UC);
+  HandleScope scope;
+  struct search_request *search_req = (struct search_request *)(req->data);
+
+  Handle<Value> callback_args[2];
+  callback_args[1] = Undefined();
+  if (req->status == JOB_REJECTED) {
+    callback_args[0] = Exception::Error(String::New(QUEUE_FULL_MESSAGE));
+  } else if (!search_req->connected) {
+    callback_args[0] = Exception::Error(String::New("LDAP connection failed"));
+  } else if (search_req->browse_rc != LDAP_SUCCESS) {
+    callback_args[0] = Exception::Error(String::New(ldap_err2string(search_req->browse_rc)));
+  } else {
+    callback_args[0] = Undefined();
+  }
+
+  // Entries not handed over are still freed by JsResultObject().
+  Local<Array> jsEntries = Array::New(search_req->entries.size());
+  for (size_t idx = 0; idx < search_req->entries.size(); idx++)
+  {
+    jsEntries->Set(Integer::New(idx), JsResultObject(search_req, search_req->entries[idx]));
+  }
+
+  if (callback_args[0]->IsUndefined()) {
+    browse_page *page = &search_req->page;
+    Local<Object> jsWindow = Object::New();
+    jsWindow->Set(String::New("entries"), jsEntries);
+    jsWindow->Set(String::New("offset"), Number::New(page->offset));
+    jsWindow->Set(String::New("total"), Number::New(page->total));
+    jsWindow->Set(String::New("context"), String::New(page->context.c_str()));
+    callback_args[1] = jsWindow;
+  }
+  search_req->callback->Call(Context::GetCurrent()->Global(), 2, callback_args);
+
+  delete search_req;
+  free(req);
+}
+
+// A replay has refreshed the caches; there is no callback.
+static void EIO_AfterWarm(job* req)
+{
+  struct search_request *search_req = (struct search_request *)(req->data);
+
+  FreeResult(search_req);
+  delete search_req;
+  free(req);
+
+  PrewarmDone();
+}
+
+// Runs on the prewarm thread; see prewarm.h.
+static bool WarmSearch(const prewarm_search &search, const std::string &binddn, const std::string &password)
+{
+  struct search_request *search_req = new search_request;
+  const char *strings[] = { search.host.c_str(), binddn.c_str(), password.c_str(),
+                            search.base.c_str(), search.filter.c_str() };
+  char **fields[] = { &search_req->host, &search_req->username, &search_req->password,
+                      &search_req->base, &search_req->filter };
+  CopyStrings(search_req, 5, strings, fields);
+  search_req->scheme = NULL;
+  search_req->port = search.port;
+  search_req->warming = true;
+  search_req->typed = typed_values != 0;
+  search_req->browse = NULL;
+
+  job *work_req = (job *) (calloc(1, sizeof(job)));
+  work_req->data = search_req;
+
+  if (!JobsTry(work_req, EIO_Search, EIO_AfterWarm, true)) {
+    delete search_req;
+    free(work_req);
+    return false;
+  }
+  return true;
+}
+
+// Broker mode, client side (broker.h). The request is sent to the broker
+// on a worker and completes when the answer arrives, through the same
+// EIO_AfterAuthenticate / EIO_AfterSearch as if it had run here. If the
+// broker cannot be reached, or never answers, it runs here after all.
+struct fallback_task
+{
+  job work_req;
+  job *req;
+};
+
+static void EIO_LocalAuthenticate(job* task_req)
+{
+  struct fallback_task *task = (struct fallback_task*)(task_req->data);
+  job *req = task->req;
+  delete task;
+  EIO_Authenticate(req);
+  JobsComplete(req);
+}
+
+static void EIO_LocalSearch(job* task_req)
+{
+  struct fallback_task *task = (struct fallback_task*)(task_req->data);
+  job *req = task->req;
+  delete task;
+  EIO_Search(req);
+}
+
+// On a reader thread: hands req back to a worker to run locally.
+static void FallBack(job *req, job_cb work)
+{
+  struct fallback_task *task = new fallback_task;
+  task->work_req.data = task;
+  task->req = req;
+  JobsSpawn(&task->work_req, work);
+}
+
+static void BrokerAuthenticated(void *request, int status, const std::string &payload)
+{
+  job *req = (job*)request;
+  struct auth_request *auth_req = (struct auth_request*)(req->data);
+
+  size_t offset = 0;
+  uint32_t authenticated, account_state;
+  if (status == BROKER_LOST) {
+    FallBack(req, EIO_LocalAuthenticate);
+    return;
+  }
+  if (status == BROKER_OK && CacheRead(payload, &offset, &authenticated)
+      && CacheRead(payload, &offset, &account_state)) {
+    auth_req->connected = true;
+    auth_req->authenticated = authenticated != 0;
+    auth_req->account_state = account_state;
+  } else if (status == BROKER_BUSY) {
+    req->status = JOB_REJECTED;
+  }
+  JobsComplete(req);
+}
+
+static void EIO_BrokerAuthenticate(job* req)
+{
+  struct auth_request *auth_req = (struct auth_request*)(req->data);
+  auth_req->connected = false;
+  auth_req->authenticated = false;
+
+  std::string payload;
+  CacheAppend(&payload, auth_req->scheme, strlen(auth_req->scheme));
+  CacheAppend(&payload, auth_req->host, strlen(auth_req->host));
+  CacheAppend(&payload, (uint32_t)auth_req->port);
+  CacheAppend(&payload, auth_req->username, strlen(auth_req->username));
+  CacheAppend(&payload, auth_req->password, strlen(auth_req->password));
+  if (!BrokerSend(BROKER_AUTHENTICATE, payload, req, BrokerAuthenticated)) {
+    EIO_Authenticate(req);
+    JobsComplete(req);
+  }
+}
+
+static void BrokerSearched(void *request, int status, const std::string &payload)
+{
+  job *req = (job*)request;
+  struct search_request *search_req = (struct search_request*)(req->data);
+
+  if (status == BROKER_LOST) {
+    FallBack(req, EIO_LocalSearch);
+    return;
+  }
+  if (status == BROKER_OK && DecodeResult(payload, search_req)) {
+    search_req->connected = true;
+  } else if (status == BROKER_BUSY) {
+    req->status = JOB_REJECTED;
+  }
+  JobsComplete(req);
+}
+
+static void EIO_BrokerSearch(job* req)
+{
+  struct search_request *search_req = (struct search_request*)(req->data);
+  search_req->connected = false;
+
+  std::string payload;
+  CacheAppend(&payload, search_req->host, strlen(search_req->host));
+  CacheAppend(&payload, (uint32_t)search_req->port);
+  CacheAppend(&payload, search_req->username, strlen(search_req->username));
+  CacheAppend(&payload, search_req->password, strlen(search_req->password));
+  CacheAppend(&payload, search_req->base, strlen(search_req->base));
+  CacheAppend(&payload, search_req->filter, strlen(search_req->filter));
+  CacheAppend(&payload, (uint32_t)search_req->typed);
+  if (!BrokerSend(BROKER_SEARCH, payload, req, BrokerSearched)) {
+    EIO_Search(req);
+  }
+}
+
+// Broker mode, broker side: runs on the broker's main loop once a
+// client's request has run here.
+static void EIO_AfterBrokerAuthenticate(job* req)
+{
+  struct auth_request *auth_req = (struct auth_request*)(req->data);
+
+  std::string payload;
+  if (auth_req->connected) {
+    CacheAppend(&payload, (uint32_t)auth_req->authenticated);
+    CacheAppend(&payload, (uint32_t)auth_req->account_state);
+  }
+  BrokerReply(auth_req->reply_conn, auth_req->reply_id, auth_req->connected ? BROKER_OK : BROKER_FAILED, payload);
+
+  FreeAuthRequest(auth_req);
+  free(req);
+}
+
+static void EIO_AfterBrokerSearch(job* req)
+{
+  struct search_request *search_req = (struct search_request*)(req->data);
+
+  std::string payload;
+  if (search_req->connected) payload = EncodeResult(search_req);
+  BrokerReply(search_req->reply_conn, search_req->reply_id, search_req->connected ? BROKER_OK : BROKER_FAILED, payload);
+
+  FreeResult(search_req);
+  delete search_req;
+  free(req);
+}
+
+// Runs on a broker connection's reader thread, for each request a client
+// sends. Requests run on the worker pool like local ones; a full pool
+// answers BROKER_BUSY at once.
+static void ServeBrokerRequest(broker_conn *conn, uint32_t id, int type, const std::string &payload)
+{
+  size_t offset = 0;
+  std::string scheme, host, username, password, base, filter;
+  uint32_t port;
+  bool valid = false, queued = false;
+  job *work_req = (job *) (calloc(1, sizeof(job)));
+
+  if (type == BROKER_AUTHENTICATE) {
+    valid = CacheRead(payload, &offset, &scheme) && CacheRead(payload, &offset, &host)
+      && CacheRead(payload, &offset, &port) && CacheRead(payload, &offset, &username)
+      && CacheRead(payload, &offset, &password);
+    if (valid) {
+      struct auth_request *auth_req = new auth_request;
+      const char *strings[] = { scheme.c_str(), host.c_str(), username.c_str(), password.c_str() };
+      char **fields[] = { &auth_req->scheme, &auth_req->host, &auth_req->username, &auth_req->password };
+      CopyStrings(auth_req, 4, strings, fields);
+      auth_req->port = port;
+      auth_req->account_state = ACCOUNT_ACTIVE;
+      auth_req->reply_conn = conn;
+      auth_req->reply_id = id;
+      work_req->data = auth_req;
+
+      queued = JobsTry(work_req, EIO_Authenticate, EIO_AfterBrokerAuthenticate);
+      if (!queued) delete auth_req;
+    }
+  } else if (type == BROKER_SEARCH) {
+    valid = CacheRead(payload, &offset, &host) && CacheRead(payload, &offset, &port)
+      && CacheRead(payload, &offset, &username) && CacheRead(payload, &offset, &password)
+      && CacheRead(payload, &offset, &base) && CacheRead(payload, &offset, &filter);
+    // Clients from before typed values do not send the flag.
+    uint32_t typed = 0;
+    if (valid) CacheRead(payload, &offset, &typed);
+    if (valid) {
+      struct search_request *search_req = new search_request;
+      const char *strings[] = { host.c_str(), username.c_str(), password.c_str(), base.c_str(), filter.c_str() };
+      char **fields[] = { &search_req->host, &search_req->username, &search_req->password,
+                          &search_req->base, &search_req->filter };
+      CopyStrings(search_req, 5, strings, fields);
+      search_req->scheme = NULL;
+      search_req->port = port;
+      search_req->warming = false;
+      search_req->typed = typed != 0;
+      search_req->browse = NULL;
+      search_req->reply_conn = conn;
+      search_req->reply_id = id;
+      work_req->data = search_req;
+
+      // The clients' searches are the ones worth replaying here.
+      PrewarmRecord(search_req->host, search_req->port, search_req->username, search_req->base, search_req->filter);
+      queued = JobsTry(work_req, EIO_Search, EIO_AfterBrokerSearch, true);
+      if (!queued) delete search_req;
+    }
+  }
+
+  if (!queued) {
+    free(work_req);
+    BrokerReply(conn, id, valid ? BROKER_BUSY : BROKER_FAILED, std::string());
+  }
+}
+
+static const char *BrowseOptions(Local<Object> options, search_request *search_req);
+
+// Exposed search() JavaScript function. The last argument is the source,
+// or options: { source, sort, offset, count, total, context, attributes };
+// with sort, the callback gets a window of entries, see browse.h.
+static Handle<Value> Search(const Arguments &args)
+{
+  HandleScope scope;
+  Handle<Value> source = Undefined();
+  if (args.Length() > 7) source = args[7];
+  if (!source->IsString() && !source->IsObject() && !source->IsUndefined()) {
+    return THROW("source should be a string or an options object");
+  }
+
+  search_request *search_req = BuildSearchRequest(args);
+  if (source->IsObject()) {
+    const char *error = BrowseOptions(source->ToObject(), search_req);
+    if (error != NULL) {
+      delete search_req;
+      return THROW(error);
+    }
+    source = source->ToObject()->Get(String::New("source"));
+  }
+
+  if (source->IsString()) {
+    String::Utf8Value utf8(source);
+    SketchRecord(search_req->username, *utf8);
+  } else {
+    SketchRecord(search_req->username, NULL);
+  }
+
+  if (search_req->browse != NULL) {
+    // Windows are read here, even for a broker's client: they carry
+    // server state (VLV contexts) and are not cached.
+    job *work_req = (job *) (calloc(1, sizeof(job)));
+    work_req->data = search_req;
+    bool queued = JobsQueue(work_req, EIO_Browse, EIO_AfterBrowse);
+
+    ev_ref(EV_DEFAULT_UC);
+
+    return scope.Close(Boolean::New(queued));
+  }
+
+  bool forwarding = BrokerForwarding();
+  if (!forwarding) {
+    PrewarmRecord(search_req->host, search_req->port, search_req->username, search_req->base, search_req->filter);
+  }
+
+  job *work_req = (job *) (calloc(1, sizeof(job)));
+  work_req->data = search_req;
+
+  // Deferred: the search is complete when its last group is expanded,
+  // or when the broker answers.
+  bool queued = JobsQueue(work_req, forwarding ? EIO_BrokerSearch : EIO_Search, EIO_AfterSearch, true);
+
+  ev_ref(EV_DEFAULT_UC);
+
+  return scope.Close(Boolean::New(queued));
+}
+
+// Optional configure() settings. Each leaves *value alone when the key
+// is missing, and returns false when it has the wrong type.
+static bool IntOption(Local<Object> options, const char *name, int *value)
+{
+  Local<Value> option = options->Get(String::New(name));
+  if (option->IsUndefined()) return true;
+  if (!option->IsInt32()) return false;
+  *value = option->Int32Value();
+  return true;
+}
+
+static bool NumberOption(Local<Object> options, const char *name, double *value)
+{
+  Local<Value> option = options->Get(String::New(name));
+  if (option->IsUndefined()) return true;
+  if (!option->IsNumber()) return false;
+  *value = option->NumberValue();
+  return true;
+}
+
+// *value becomes 0 or 1.
+static bool BoolOption(Local<Object> options, const char *name, int *value)
+{
+  Local<Value> option = options->Get(String::New(name));
+  if (option->IsUndefined()) return true;
+  if (!option->IsBoolean()) return false;
+  *value = option->BooleanValue() ? 1 : 0;
+  return true;
+}
+
+static bool StringOption(Local<Object> options, const char *name, std::string *value)
+{
+  Local<Value> option = options->Get(String::New(name));
+  if (option->IsUndefined()) return true;
+  if (!option->IsString()) return false;
+  String::Utf8Value utf8(option);
+  value->assign(*utf8);
+  return true;
+}
+
+// search()'s browsing options: search_req->browse is left NULL without
+// sort. Returns an error message, or NULL.
+static const char *BrowseOptions(Local<Object> options, search_request *search_req)
+{
+  std::string sort, context;
+  int offset = 1, count = 20, total = 0;
+  if (!StringOption(options, "sort", &sort))       return "sort should be a string";
+  if (!IntOption(options, "offset", &offset) || offset < 1) return "offset should be a positive integer";
+  if (!IntOption(options, "count", &count) || count < 1)    return "count should be a positive integer";
+  if (!IntOption(options, "total", &total) || total < 0)    return "total should be a non-negative integer";
+  if (!StringOption(options, "context", &context)) return "context should be a string";
+
+  Local<Value> source = options->Get(String::New("source"));
+  if (!source->IsUndefined() && !source->IsString()) return "source should be a string";
+
+  std::vector<std::string> names;
+  Local<Value> attributes = options->Get(String::New("attributes"));
+  if (!attributes->IsUndefined()) {
+    if (!attributes->IsArray()) return "attributes should be an array of strings";
+    Local<Array> list = Local<Array>::Cast(attributes);
+    for (uint32_t idx = 0; idx < list->Length(); idx++)
+    {
+      Local<Value> name = list->Get(idx);
+      if (!name->IsString()) return "attributes should be an array of strings";
+      String::Utf8Value utf8(name);
+      names.push_back(*utf8);
+    }
+  }
+
+  if (sort.empty()) return NULL;
+
+  browse_spec *browse = new browse_spec;
+  browse->sort = sort;
+  browse->offset = offset;
+  browse->count = count;
+  browse->total = total;
+  browse->context = context;
+  browse->attributes = names;
+  search_req->browse = browse;
+  return NULL;
+}
+
+// Data passed between threads for bulkSearch().
+struct bulk_request
+{
+  char *host;
+  int port;
+  char *binddn;
+  char *password;
+  char *base;
+  char *filter;
+  std::vector<std::string> attributes;
+  bulk_options options;
+  Persistent<Object> previous;  // holds options.previous
+  Persistent<Function> callback;
+  int rc;
+  bulk_result result;
+
+  ~bulk_request()
+  {
+    if (!previous.IsEmpty()) previous.Dispose();
+    free(host);
+    free(binddn);
+    free(password);
+    free(base);
+    free(filter);
+    callback.Dispose();
+    BulkFree(&result);
+  }
+};
+
+// Runs on background thread, for as many pages as it takes.
+static void EIO_BulkSearch(job* req)
+{
+  struct bulk_request *bulk_req = (struct bulk_request*)(req->data);
+  bulk_req->rc = BulkSearch(bulk_req->host, bulk_req->port, bulk_req->binddn, bulk_req->password,
+                            bulk_req->base, bulk_req->filter, bulk_req->attributes, bulk_req->options,
+                            &bulk_req->result);
+}
+
+static void FreeBulkBuffer(char *data, void *hint)
+{
+  free(data);
+}
+
+// The buffer's memory becomes the Buffer's, without a copy.
+static Handle<Value> JsBuffer(bulk_buffer *buffer)
+{
+  if (buffer->data == NULL) return node::Buffer::New(0)->handle_;
+  node::Buffer *jsBuffer = node::Buffer::New(buffer->data, buffer->size, FreeBulkBuffer, NULL);
+  buffer->data = NULL;
+  return jsBuffer->handle_;
+}
+
+static void EIO_AfterBulkSearch(job* req)
+{
+  ev_unref(EV_DEFAULT_UC);
+  HandleScope scope;
+  struct bulk_request *bulk_req = (struct bulk_request *)(req->data);
+
+  Handle<Value> callback_args[2];
+  callback_args[1] = Undefined();
+  if (req->status == JOB_REJECTED) {
+    callback_args[0] = Exception::Error(String::New(QUEUE_FULL_MESSAGE));
+  } else if (bulk_req->rc != LDAP_SUCCESS) {
+    callback_args[0] = Exception::Error(String::New(ldap_err2string(bulk_req->rc)));
+  } else {
+    bulk_result *result = &bulk_req->result;
+
+    // One value per entry: the value offsets are the offsets.
+    Local<Object> jsDn = Object::New();
+    jsDn->Set(String::New("offsets"), JsBuffer(&result->dn.value_offsets));
+    jsDn->Set(String::New("data"), JsBuffer(&result->dn.data));
+
+    Local<Object> jsColumns = Object::New();
+    for (size_t idx = 0; idx < result->columns.size(); idx++)
+    {
+      bulk_column *column = &result->columns[idx];
+      Local<Object> jsColumn = Object::New();
+      jsColumn->Set(String::New("validity"), JsBuffer(&column->validity));
+      jsColumn->Set(String::New("offsets"), JsBuffer(&column->offsets));
+      jsColumn->Set(String::New("valueOffsets"), JsBuffer(&column->value_offsets));
+      jsColumn->Set(String::New("data"), JsBuffer(&column->data));
+      jsColumns->Set(String::New(column->name.c_str()), jsColumn);
+    }
+
+    Local<Object> jsResult = Object::New();
+    jsResult->Set(String::New("count"), Number::New(result->count));
+    jsResult->Set(String::New("dn"), jsDn);
+    jsResult->Set(String::New("columns"), jsColumns);
+
+    if (bulk_req->options.digests) {
+      jsResult->Set(String::New("digests"), JsBuffer(&result->digests));
+      jsResult->Set(String::New("table"), JsBuffer(&result->table));
+    }
+    if (bulk_req->options.previous != NULL) {
+      Local<Array> jsRemoved = Array::New(result->removed.size());
+      for (size_t idx = 0; idx < result->removed.size(); idx++)
+      {
+        jsRemoved->Set(Integer::New(idx), String::New(result->removed[idx].data(), result->removed[idx].size()));
+      }
+      jsResult->Set(String::New("changes"), JsBuffer(&result->changes));
+      jsResult->Set(String::New("removed"), jsRemoved);
+      jsResult->Set(String::New("unchanged"), Number::New(result->unchanged));
+    }
+    callback_args[0] = Undefined();
+    callback_args[1] = jsResult;
+  }
+  bulk_req->callback->Call(Context::GetCurrent()->Global(), 2, callback_args);
+
+  delete bulk_req;
+  free(req);
+}
+
+// Exposed bulkSearch() JavaScript function. Reads every entry under base
+// matching filter, and calls back with attributes' values in columns;
+// see bulk.h. Options, before the callback: { digests, previous }.
+static Handle<Value> BulkSearchColumns(const Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() < 8)      return THROW("Required arguments: ldap_host, ldap_port, bind_dn, password, base, filter, attributes, [options], callback");
+  int callback_arg = args.Length() > 8 ? 8 : 7;
+  if (!args[0]->IsString())   return THROW("ldap_host should be a string");
+  if (!args[1]->IsInt32())    return THROW("ldap_port should be an integer");
+  if (!args[2]->IsString())   return THROW("bind_dn should be a string");
+  if (!args[3]->IsString())   return THROW("password should be a string");
+  if (!args[4]->IsString())   return THROW("base should be a string");
+  if (!args[5]->IsString())   return THROW("filter should be a string");
+  if (!args[6]->IsArray())    return THROW("attributes should be an array of strings");
+  if (callback_arg == 8 && !args[7]->IsObject()) return THROW("options should be an object");
+  if (!args[callback_arg]->IsFunction()) return THROW("callback should be a function");
+
+  int digests = 0;
+  Handle<Value> previous = Undefined();
+  if (callback_arg == 8) {
+    Local<Object> options = args[7]->ToObject();
+    if (!BoolOption(options, "digests", &digests)) return THROW("digests should be a boolean");
+    previous = options->Get(String::New("previous"));
+    if (!previous->IsUndefined() && !node::Buffer::HasInstance(previous)) return THROW("previous should be a Buffer");
+    if (!previous->IsUndefined()) digests = 1;
+  }
+
+  Local<Array> attributes = Local<Array>::Cast(args[6]);
+  std::vector<std::string> names;
+  std::set<std::string> seen;
+  for (uint32_t idx = 0; idx < attributes->Length(); idx++)
+  {
+    Local<Value> name = attributes->Get(idx);
+    if (!name->IsString()) return THROW("attributes should be an array of strings");
+    String::Utf8Value utf8(name);
+    // Attribute names are case-insensitive; two would share a column.
+    if (!seen.insert(StrLower(*utf8)).second) return THROW("attributes should not name an attribute twice");
+    names.push_back(*utf8);
+  }
+
+  String::Utf8Value host(args[0]);
+  String::Utf8Value binddn(args[2]);
+  String::Utf8Value password(args[3]);
+  String::Utf8Value base(args[4]);
+  String::Utf8Value filter(args[5]);
+
+  struct bulk_request *bulk_req = new bulk_request;
+  bulk_req->host = strdup(*host);
+  bulk_req->port = args[1]->Int32Value();
+  bulk_req->binddn = strdup(*binddn);
+  bulk_req->password = strdup(*password);
+  bulk_req->base = strdup(*base);
+  bulk_req->filter = strdup(*filter);
+  bulk_req->attributes = names;
+  bulk_req->options.digests = digests != 0;
+  if (!previous->IsUndefined()) {
+    // The table is read on the worker, where it is, until the callback.
+    bulk_req->previous = Persistent<Object>::New(previous->ToObject());
+    bulk_req->options.previous = node::Buffer::Data(previous);
+    bulk_req->options.previous_length = node::Buffer::Length(previous);
+  }
+  bulk_req->callback = Persistent<Function>::New(Local<Function>::Cast(args[callback_arg]));
+  bulk_req->rc = LDAP_SUCCESS;
+
+  job *work_req = (job *) (calloc(1, sizeof(job)));
+  work_req->data = bulk_req;
+  bool queued = JobsQueue(work_req, EIO_BulkSearch, EIO_AfterBulkSearch);
+
+  ev_ref(EV_DEFAULT_UC);
+
+  return scope.Close(Boolean::New(queued));
+}
+
+// configure({ servers: [{ host, port, scheme, locality }, ...] })
+static Handle<Value> ConfigureServers(Local<Value> servers)
+{
+  if (!servers->IsArray()) return THROW("servers should be an array");
+
+  Local<Array> list = Local<Array>::Cast(servers);
+  for (uint32_t idx = 0; idx < list->Length(); idx++)
+  {
+    if (!list->Get(idx)->IsObject()) return THROW("servers should contain { host, port, scheme, locality } objects");
+    Local<Object> server = list->Get(idx)->ToObject();
+
+    std::string host, scheme = "ldap", locality;
+    int port = 389;
+    if (!server->Get(String::New("host"))->IsString()) return THROW("server host should be a string");
+    StringOption(server, "host", &host);
+    if (!IntOption(server, "port", &port))             return THROW("server port should be an integer");
+    if (!StringOption(server, "scheme", &scheme))      return THROW("server scheme should be a string");
+    if (!StringOption(server, "locality", &locality))  return THROW("server locality should be a string");
+
+    ServersAdd(scheme.c_str(), host.c_str(), port, locality.c_str());
+  }
+
+  return Undefined();
+}
+
+// configure({ poolSizing: { min, max, utilization, perConnection, interval,
+// shrinkAfter } }), or false for fixed-size pools.
+static Handle<Value> ConfigurePoolSizing(Local<Value> value)
+{
+  if (value->IsFalse()) {
+    PoolConfigureSizing(0, 0, 0, 0, 0, 0, 0);
+    return Undefined();
+  }
+  if (!value->IsObject()) return THROW("poolSizing should be an object or false");
+  Local<Object> options = value->ToObject();
+
+  int min = 0, max = 0, perConnection = 0, interval = 0, shrinkAfter = 0;
+  double utilization = 0;
+  if (!IntOption(options, "min", &min))                        return THROW("poolSizing min should be an integer");
+  if (!IntOption(options, "max", &max))                        return THROW("poolSizing max should be an integer");
+  if (!NumberOption(options, "utilization", &utilization))     return THROW("poolSizing utilization should be a number");
+  if (!IntOption(options, "perConnection", &perConnection))    return THROW("poolSizing perConnection should be an integer");
+  if (!IntOption(options, "interval", &interval))              return THROW("poolSizing interval should be an integer");
+  if (!IntOption(options, "shrinkAfter", &shrinkAfter))        return THROW("poolSizing shrinkAfter should be an integer");
+  if (utilization < 0 || utilization > 1)                      return THROW("poolSizing utilization should be between 0 and 1");
+
+  PoolConfigureSizing(1, min, max, utilization, perConnection, interval, shrinkAfter);
+  return Undefined();
+}
+
+// configure({ connectionBudget: { name, perServer } })
+static Handle<Value> ConfigureBudget(Local<Value> value)
+{
+  if (!value->IsObject()) return THROW("connectionBudget should be an object");
+  Local<Object> options = value->ToObject();
+
+  std::string name = "default";
+  int perServer = 0;
+  if (!StringOption(options, "name", &name))             return THROW("connectionBudget name should be a string");
+  if (!IntOption(options, "perServer", &perServer))      return THROW("connectionBudget perServer should be an integer");
+  if (perServer <= 0)                                    return THROW("connectionBudget perServer should be positive");
+  if (name.empty() || name.find('/') != std::string::npos) return THROW("connectionBudget name should be a non-empty name without '/'");
+
+  if (!BudgetConfigure(name.c_str(), perServer)) {
+    return ThrowException(Exception::Error(String::New("connectionBudget: could not map the shared memory segment")));
+  }
+  return Undefined();
+}
+
+// configure({ searchCacheTier: { path, entries, maxBytes } }), or false
+// to drop the cold tier; the same for groupCacheTier. The search cache's
+// tier also keeps the key its passwords are hashed under, in <path>.key.
+static Handle<Value> ConfigureTier(Local<Value> value, cache *c, const char *name)
+{
+  if (value->IsFalse()) {
+    CacheConfigureTier(c, NULL);
+    if (c == search_cache) __atomic_store_n(&search_key, (hash_key*)NULL, __ATOMIC_RELEASE);
+    return Undefined();
+  }
+  std::string error = std::string(name) + " should be an object or false";
+  if (!value->IsObject()) return THROW(error.c_str());
+  Local<Object> options = value->ToObject();
+
+  std::string path;
+  int entries = 100000, maxBytes = 256 * 1024 * 1024;
+  error = std::string(name) + " path should be a string";
+  if (!options->Get(String::New("path"))->IsString()) return THROW(error.c_str());
+  StringOption(options, "path", &path);
+  error = std::string(name) + " entries and maxBytes should be positive integers";
+  if (!IntOption(options, "entries", &entries) || !IntOption(options, "maxBytes", &maxBytes)
+      || entries <= 0 || maxBytes <= 0) return THROW(error.c_str());
+
+  tier *cold = TierOpen(path.c_str(), entries, maxBytes);
+  if (cold == NULL) {
+    error = std::string(name) + ": could not open, map or lock " + path;
+    return ThrowException(Exception::Error(String::New(error.c_str())));
+  }
+  if (c == search_cache) {
+    hash_key *kept = new hash_key;
+    if (!HashKeyLoad((path + ".key").c_str(), kept)) {
+      delete kept;
+      TierClose(cold);
+      error = std::string(name) + ": could not read or create " + path + ".key (it must be ours, mode 0600)";
+      return ThrowException(Exception::Error(String::New(error.c_str())));
+    }
+    __atomic_store_n(&search_key, kept, __ATOMIC_RELEASE);
+  }
+  CacheConfigureTier(c, cold);
+  return Undefined();
+}
+
+// configure({ prewarm: { bindDn, password, lead, rate, concurrency } }),
+// or false to stop.
+static Handle<Value> ConfigurePrewarm(Local<Value> value)
+{
+  if (value->IsFalse()) {
+    PrewarmDisable();
+    return Undefined();
+  }
+  if (!value->IsObject()) return THROW("prewarm should be an object or false");
+  Local<Object> options = value->ToObject();
+
+  std::string binddn, password;
+  int lead = 0, rate = 0, concurrency = 0;
+  if (!options->Get(String::New("bindDn"))->IsString()) return THROW("prewarm bindDn should be a string");
+  StringOption(options, "bindDn", &binddn);
+  if (!StringOption(options, "password", &password))    return THROW("prewarm password should be a string");
+  if (!IntOption(options, "lead", &lead))               return THROW("prewarm lead should be an integer");
+  if (!IntOption(options, "rate", &rate))               return THROW("prewarm rate should be an integer");
+  if (!IntOption(options, "concurrency", &concurrency)) return THROW("prewarm concurrency should be an integer");
+
+  // Replays go through the worker pool, which must be running for them.
+  JobsStart();
+  PrewarmConfigure(WarmSearch, binddn.c_str(), password.c_str(), lead, rate, concurrency);
+  return Undefined();
+}
+
+// configure({ accountIndex: { host, base, ... } }), or false to stop.
+static Handle<Value> ConfigureAccounts(Local<Value> value)
+{
+  if (value->IsFalse()) {
+    AccountsDisable();
+    return Undefined();
+  }
+  if (!value->IsObject()) return THROW("accountIndex should be an object or false");
+  Local<Object> options = value->ToObject();
+
+  accounts_config config;
+  AccountsDefaults(&config);
+  if (!options->Get(String::New("host"))->IsString())                   return THROW("accountIndex host should be a string");
+  if (!options->Get(String::New("base"))->IsString())                   return THROW("accountIndex base should be a string");
+  StringOption(options, "host", &config.host);
+  StringOption(options, "base", &config.base);
+  if (!IntOption(options, "port", &config.port))                         return THROW("accountIndex port should be an integer");
+  if (!StringOption(options, "bindDn", &config.binddn))                  return THROW("accountIndex bindDn should be a string");
+  if (!StringOption(options, "password", &config.password))              return THROW("accountIndex password should be a string");
+  if (!StringOption(options, "filter", &config.filter))                  return THROW("accountIndex filter should be a string");
+  if (!StringOption(options, "attributes", &config.attributes))          return THROW("accountIndex attributes should be a string");
+  if (!IntOption(options, "refreshInterval", &config.refresh_interval_ms)) return THROW("accountIndex refreshInterval should be an integer");
+  if (!IntOption(options, "pollInterval", &config.poll_interval_ms))     return THROW("accountIndex pollInterval should be an integer");
+  if (!IntOption(options, "lockoutDuration", &config.lockout_duration_ms)) return THROW("accountIndex lockoutDuration should be an integer");
+  if (config.refresh_interval_ms <= 0)                                   return THROW("accountIndex refreshInterval should be positive");
+
+  AccountsConfigure(config);
+  return Undefined();
+}
+
+static Handle<Value> ConfigureReplica(Local<Value> value)
+{
+  if (value->IsFalse()) {
+    ReplicaDisable();
+    return Undefined();
+  }
+  if (!value->IsObject()) return THROW("replica should be an object or false");
+  Local<Object> options = value->ToObject();
+
+  replica_config config;
+  ReplicaDefaults(&config);
+  if (!options->Get(String::New("host"))->IsString())                   return THROW("replica host should be a string");
+  if (!options->Get(String::New("base"))->IsString())                   return THROW("replica base should be a string");
+  StringOption(options, "host", &config.host);
+  StringOption(options, "base", &config.base);
+  if (!IntOption(options, "port", &config.port))                         return THROW("replica port should be an integer");
+  if (!StringOption(options, "bindDn", &config.binddn))                  return THROW("replica bindDn should be a string");
+  if (!StringOption(options, "password", &config.password))              return THROW("replica password should be a string");
+  if (!StringOption(options, "filter", &config.filter))                  return THROW("replica filter should be a string");
+  if (!StringOption(options, "indexes", &config.indexes))                return THROW("replica indexes should be a string");
+  if (!IntOption(options, "refreshInterval", &config.refresh_interval_ms)) return THROW("replica refreshInterval should be an integer");
+  if (!IntOption(options, "pollInterval", &config.poll_interval_ms))     return THROW("replica pollInterval should be an integer");
+  if (!StringOption(options, "ldif", &config.ldif))                      return THROW("replica ldif should be a string");
+  if (config.refresh_interval_ms <= 0)                                   return THROW("replica refreshInterval should be positive");
+
+  ReplicaConfigure(config);
+  return Undefined();
+}
+
+// Exposed configure() JavaScript function. Takes an options object;
+// unknown keys are ignored, missing keys keep their current value.
+static Handle<Value> Configure(const Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() < 1 || !args[0]->IsObject()) return THROW("Required arguments: options");
+  Local<Object> options = args[0]->ToObject();
+
+  int connections = 0, timeout = 0, arenas = -1, workers = 0, queueSize = 0;
+  int probeInterval = -1, failureThreshold = 0, breakerCooldown = 0, connectTimeout = 0;
+  int outlierInterval = -1, outlierMinRequests = 0, ejectionTime = 0, maxEjectionTime = 0, maxEjectedPercent = -1;
+  int maxInFlight = -1, heavyHitters = 0, sketchWindow = 0;
+  int searchCacheSize = 0, searchCacheTtl = -1, groupCacheSize = 0, groupCacheTtl = -1;
+  int searchCacheCompression = -1, groupCacheCompression = -1, searchCacheNegativeTtl = -1, typedValues = -1;
+  double outlierLatencyFactor = 0, outlierErrorRate = 0;
+  std::string probeBindDn, probePassword, locality, cacheAdmission;
+
+  if (!IntOption(options, "searchConnections", &connections))      return THROW("searchConnections should be an integer");
+  if (!IntOption(options, "searchTimeout", &timeout))              return THROW("searchTimeout should be an integer");
+  if (!BoolOption(options, "arenas", &arenas))                     return THROW("arenas should be a boolean");
+  if (!IntOption(options, "workers", &workers))                    return THROW("workers should be an integer");
+  if (!IntOption(options, "queueSize", &queueSize))                return THROW("queueSize should be an integer");
+  if (!IntOption(options, "probeInterval", &probeInterval))        return THROW("probeInterval should be an integer");
+  if (!StringOption(options, "probeBindDn", &probeBindDn))         return THROW("probeBindDn should be a string");
+  if (!StringOption(options, "probePassword", &probePassword))     return THROW("probePassword should be a string");
+  if (!IntOption(options, "failureThreshold", &failureThreshold))  return THROW("failureThreshold should be an integer");
+  if (!IntOption(options, "breakerCooldown", &breakerCooldown))    return THROW("breakerCooldown should be an integer");
+  if (!IntOption(options, "connectTimeout", &connectTimeout))      return THROW("connectTimeout should be an integer");
+  if (!IntOption(options, "outlierInterval", &outlierInterval))    return THROW("outlierInterval should be an integer");
+  if (!NumberOption(options, "outlierLatencyFactor", &outlierLatencyFactor)) return THROW("outlierLatencyFactor should be a number");
+  if (!NumberOption(options, "outlierErrorRate", &outlierErrorRate))         return THROW("outlierErrorRate should be a number");
+  if (!IntOption(options, "outlierMinRequests", &outlierMinRequests))        return THROW("outlierMinRequests should be an integer");
+  if (!IntOption(options, "ejectionTime", &ejectionTime))                    return THROW("ejectionTime should be an integer");
+  if (!IntOption(options, "maxEjectionTime", &maxEjectionTime))              return THROW("maxEjectionTime should be an integer");
+  if (!IntOption(options, "maxEjectedPercent", &maxEjectedPercent))          return THROW("maxEjectedPercent should be an integer");
+  if (!StringOption(options, "locality", &locality))                         return THROW("locality should be a string");
+  if (!IntOption(options, "maxInFlight", &maxInFlight))                      return THROW("maxInFlight should be an integer");
+  if (!IntOption(options, "heavyHitters", &heavyHitters))                    return THROW("heavyHitters should be an integer");
+  if (!IntOption(options, "sketchWindow", &sketchWindow))                    return THROW("sketchWindow should be an integer");
+  if (!IntOption(options, "searchCacheSize", &searchCacheSize))              return THROW("searchCacheSize should be an integer");
+  if (!IntOption(options, "searchCacheTtl", &searchCacheTtl))                return THROW("searchCacheTtl should be an integer");
+  if (!IntOption(options, "searchCacheNegativeTtl", &searchCacheNegativeTtl)) return THROW("searchCacheNegativeTtl should be an integer");
+  if (!IntOption(options, "groupCacheSize", &groupCacheSize))                return THROW("groupCacheSize should be an integer");
+  if (!IntOption(options, "groupCacheTtl", &groupCacheTtl))                  return THROW("groupCacheTtl should be an integer");
+  if (!BoolOption(options, "searchCacheCompression", &searchCacheCompression)) return THROW("searchCacheCompression should be a boolean");
+  if (!BoolOption(options, "groupCacheCompression", &groupCacheCompression))   return THROW("groupCacheCompression should be a boolean");
+  if (!StringOption(options, "cacheAdmission", &cacheAdmission))             return THROW("cacheAdmission should be a string");
+  if (!BoolOption(options, "typedValues", &typedValues))                     return THROW("typedValues should be a boolean");
+  if (!cacheAdmission.empty() && cacheAdmission != "tinylfu" && cacheAdmission != "lru") return THROW("cacheAdmission should be 'tinylfu' or 'lru'");
+
+  Local<Value> servers = options->Get(String::New("servers"));
+  if (!servers->IsUndefined()) {
+    Handle<Value> error = ConfigureServers(servers);
+    if (!error->IsUndefined()) return error;
+  }
+
+  Local<Value> connectionBudget = options->Get(String::New("connectionBudget"));
+  if (!connectionBudget->IsUndefined()) {
+    Handle<Value> error = ConfigureBudget(connectionBudget);
+    if (!error->IsUndefined()) return error;
+  }
+
+  Local<Value> poolSizing = options->Get(String::New("poolSizing"));
+  if (!poolSizing->IsUndefined()) {
+    Handle<Value> error = ConfigurePoolSizing(poolSizing);
+    if (!error->IsUndefined()) return error;
+  }
+
+  Local<Value> searchCacheTier = options->Get(String::New("searchCacheTier"));
+  if (!searchCacheTier->IsUndefined()) {
+    Handle<Value> error = ConfigureTier(searchCacheTier, search_cache, "searchCacheTier");
+    if (!error->IsUndefined()) return error;
+  }
+
+  Local<Value> groupCacheTier = options->Get(String::New("groupCacheTier"));
+  if (!groupCacheTier->IsUndefined()) {
+    Handle<Value> error = ConfigureTier(groupCacheTier, group_cache, "groupCacheTier");
+    if (!error->IsUndefined()) return error;
+  }
+
+  // broker: a broker's socket path to forward requests to, or false.
+  Local<Value> broker = options->Get(String::New("broker"));
+  if (!broker->IsUndefined()) {
+    std::string path;
+    int brokerConnections = 2;
+    int brokerTimeout = 0;
+    if (broker->IsString()) {
+      StringOption(options, "broker", &path);
+    } else if (!broker->IsFalse()) {
+      return THROW("broker should be a socket path or false");
+    }
+    if (!IntOption(options, "brokerConnections", &brokerConnections)) return THROW("brokerConnections should be an integer");
+    if (!IntOption(options, "brokerTimeout", &brokerTimeout)) return THROW("brokerTimeout should be an integer");
+    BrokerConnect(path.c_str(), brokerConnections, brokerTimeout);
+  }
+
+  Local<Value> accountIndex = options->Get(String::New("accountIndex"));
+  if (!accountIndex->IsUndefined()) {
+    Handle<Value> error = ConfigureAccounts(accountIndex);
+    if (!error->IsUndefined()) return error;
+  }
+
+  Local<Value> replica = options->Get(String::New("replica"));
+  if (!replica->IsUndefined()) {
+    Handle<Value> error = ConfigureReplica(replica);
+    if (!error->IsUndefined()) return error;
+  }
+
+  PoolConfigure(connections, timeout);
+  if (arenas >= 0) ArenaConfigure(arenas);
+  JobsConfigure(workers, queueSize);
+  ServersConfigureBreaker(failureThreshold, breakerCooldown);
+  ServersConfigureOutliers(outlierInterval, outlierLatencyFactor, outlierErrorRate,
+                           outlierMinRequests, ejectionTime, maxEjectionTime, maxEjectedPercent);
+  ServersConfigureConnectTimeout(connectTimeout);
+  ServersConfigureLocality(options->Has(String::New("locality")) ? locality.c_str() : NULL, maxInFlight);
+  SketchConfigure(heavyHitters, sketchWindow);
+  CacheConfigure(search_cache, searchCacheSize, searchCacheTtl);
+  if (searchCacheNegativeTtl >= 0) negative_ttl = searchCacheNegativeTtl;
+  if (typedValues >= 0) typed_values = typedValues;
+  CacheConfigure(group_cache, groupCacheSize, groupCacheTtl);
+  if ((searchCacheCompression >= 0 && !CacheConfigureCompression(search_cache, searchCacheCompression))
+      || (groupCacheCompression >= 0 && !CacheConfigureCompression(group_cache, groupCacheCompression))) {
+    return ThrowException(Exception::Error(String::New("cache compression needs ldapauth built with libzstd")));
+  }
+  if (!cacheAdmission.empty()) {
+    CacheConfigureAdmission(search_cache, cacheAdmission == "tinylfu");
+    CacheConfigureAdmission(group_cache, cacheAdmission == "tinylfu");
+  }
+  if (probeInterval >= 0) {
+    ServersConfigureProbe(probeInterval, probeBindDn.c_str(), probePassword.c_str());
+  }
+
+  // After JobsConfigure(): this starts the worker pool.
+  Local<Value> prewarm = options->Get(String::New("prewarm"));
+  if (!prewarm->IsUndefined()) {
+    Handle<Value> error = ConfigurePrewarm(prewarm);
+    if (!error->IsUndefined()) return error;
+  }
+
+  return Undefined();
+}
+
+// Exposed stats() JavaScript function. Counters since the module loaded.
+static Handle<Value> JsCacheStats(const cache_stats &stats)
+{
+  Local<Object> jsStats = Object::New();
+  jsStats->Set(String::New("entries"), Number::New(stats.entries));
+  jsStats->Set(String::New("hits"), Number::New(stats.hits));
+  jsStats->Set(String::New("misses"), Number::New(stats.misses));
+  jsStats->Set(String::New("evictions"), Number::New(stats.evictions));
+  jsStats->Set(String::New("bytes"), Number::New(stats.bytes));
+  jsStats->Set(String::New("rawBytes"), Number::New(stats.raw_bytes));
+  jsStats->Set(String::New("compressionRatio"), Number::New(stats.bytes ? (double)stats.raw_bytes / stats.bytes : 1));
+  jsStats->Set(String::New("dictionary"), Boolean::New(stats.dictionary));
+  jsStats->Set(String::New("decompressions"), Number::New(stats.decompressions));
+  jsStats->Set(String::New("decompressUs"), Number::New(stats.decompressions ? stats.decompress_ns / 1000.0 / stats.decompressions : 0));
+  if (stats.tiered) {
+    Local<Object> jsTier = Object::New();
+    jsTier->Set(String::New("entries"), Number::New(stats.cold.entries));
+    jsTier->Set(String::New("logBytes"), Number::New(stats.cold.log_bytes));
+    jsTier->Set(String::New("maxBytes"), Number::New(stats.cold.max_bytes));
+    jsTier->Set(String::New("hits"), Number::New(stats.cold.hits));
+    jsTier->Set(String::New("misses"), Number::New(stats.cold.misses));
+    jsTier->Set(String::New("demotions"), Number::New(stats.cold.demotions));
+    jsTier->Set(String::New("compactions"), Number::New(stats.cold.compactions));
+    jsStats->Set(String::New("tier"), jsTier);
+  } else {
+    jsStats->Set(String::New("tier"), Null());
+  }
+  return jsStats;
+}
+
+static Handle<Value> Stats(const Arguments& args)
+{
+  HandleScope scope;
+
+  arena_stats arena;
+  ArenaStats(&arena);
+
+  Local<Object> jsArena = Object::New();
+  jsArena->Set(String::New("allocations"), Number::New(arena.allocations));
+  jsArena->Set(String::New("reused"), Number::New(arena.reused));
+  jsArena->Set(String::New("heapAllocations"), Number::New(arena.heap_allocations));
+  jsArena->Set(String::New("resets"), Number::New(arena.resets));
+  jsArena->Set(String::New("reservedBytes"), Number::New(arena.reserved));
+
+  std::vector<server_info> servers;
+  ServersList(&servers);
+
+  Local<Array> jsServers = Array::New(servers.size());
+  for (size_t idx = 0; idx < servers.size(); idx++)
+  {
+    Local<Object> jsServer = Object::New();
+    jsServer->Set(String::New("host"), String::New(servers[idx].host.c_str()));
+    jsServer->Set(String::New("port"), Integer::New(servers[idx].port));
+    jsServer->Set(String::New("locality"), String::New(servers[idx].locality.c_str()));
+    jsServer->Set(String::New("inFlight"), Integer::New(servers[idx].in_flight));
+    jsServer->Set(String::New("state"), String::New(servers[idx].state));
+    jsServer->Set(String::New("latencyMs"), Number::New(servers[idx].latency_ms));
+    jsServer->Set(String::New("p95Ms"), Number::New(servers[idx].p95_ms));
+    jsServer->Set(String::New("ejected"), Boolean::New(servers[idx].ejected));
+    jsServer->Set(String::New("ejections"), Integer::New(servers[idx].ejections));
+    jsServer->Set(String::New("successes"), Number::New(servers[idx].successes));
+    jsServer->Set(String::New("failures"), Number::New(servers[idx].failures));
+    jsServer->Set(String::New("probe"), servers[idx].probed ? (Handle<Value>)Boolean::New(servers[idx].probe_ok) : (Handle<Value>)Null());
+    jsServers->Set(Integer::New(idx), jsServer);
+  }
+
+  accounts_stats accounts;
+  AccountsStats(&accounts);
+
+  Local<Object> jsAccounts = Object::New();
+  jsAccounts->Set(String::New("enabled"), Boolean::New(accounts.enabled));
+  jsAccounts->Set(String::New("accounts"), Number::New(accounts.accounts));
+  jsAccounts->Set(String::New("disabled"), Number::New(accounts.disabled));
+  jsAccounts->Set(String::New("locked"), Number::New(accounts.locked));
+  jsAccounts->Set(String::New("rejected"), Number::New(accounts.rejected));
+  jsAccounts->Set(String::New("refreshes"), Number::New(accounts.refreshes));
+  jsAccounts->Set(String::New("polls"), Number::New(accounts.polls));
+  jsAccounts->Set(String::New("lastRefresh"), Number::New(accounts.last_refresh));
+  jsAccounts->Set(String::New("lastError"), accounts.last_error == LDAP_SUCCESS ? (Handle<Value>)Null() : String::New(ldap_err2string(accounts.last_error)));
+
+  replica_stats replica;
+  ReplicaStats(&replica);
+
+  Local<Object> jsReplica = Object::New();
+  jsReplica->Set(String::New("enabled"), Boolean::New(replica.enabled));
+  jsReplica->Set(String::New("entries"), Number::New(replica.entries));
+  jsReplica->Set(String::New("bytes"), Number::New(replica.bytes));
+  jsReplica->Set(String::New("answered"), Number::New(replica.answered));
+  jsReplica->Set(String::New("fallbacks"), Number::New(replica.fallbacks));
+  jsReplica->Set(String::New("refreshes"), Number::New(replica.refreshes));
+  jsReplica->Set(String::New("polls"), Number::New(replica.polls));
+  jsReplica->Set(String::New("seeded"), Number::New(replica.seeded));
+  jsReplica->Set(String::New("lastRefresh"), Number::New(replica.last_refresh));
+  jsReplica->Set(String::New("lastError"), replica.last_error == LDAP_SUCCESS ? (Handle<Value>)Null() : String::New(ldap_err2string(replica.last_error)));
+
+  std::vector<pool_info> pools;
+  PoolList(&pools);
+
+  Local<Array> jsPools = Array::New(pools.size());
+  for (size_t idx = 0; idx < pools.size(); idx++)
+  {
+    Local<Object> jsPool = Object::New();
+    jsPool->Set(String::New("uri"), String::New(pools[idx].uri.c_str()));
+    jsPool->Set(String::New("bindDn"), String::New(pools[idx].binddn.c_str()));
+    jsPool->Set(String::New("connections"), Integer::New(pools[idx].connections));
+    jsPool->Set(String::New("target"), Integer::New(pools[idx].target));
+    jsPool->Set(String::New("desired"), Integer::New(pools[idx].desired));
+    jsPool->Set(String::New("arrivalRate"), Number::New(pools[idx].arrival_rate));
+    jsPool->Set(String::New("serviceMs"), Number::New(pools[idx].service_ms));
+    jsPool->Set(String::New("inFlight"), Number::New(pools[idx].in_flight));
+    jsPool->Set(String::New("grows"), Number::New(pools[idx].grows));
+    jsPool->Set(String::New("shrinks"), Number::New(pools[idx].shrinks));
+    jsPools->Set(Integer::New(idx), jsPool);
+  }
+
+  budget_stats budget;
+  BudgetStats(&budget);
+
+  Local<Object> jsBudget = Object::New();
+  jsBudget->Set(String::New("enabled"), Boolean::New(budget.enabled));
+  jsBudget->Set(String::New("perServer"), Integer::New(budget.per_server));
+  jsBudget->Set(String::New("processes"), Integer::New(budget.processes));
+  jsBudget->Set(String::New("refused"), Number::New(budget.refused));
+  jsBudget->Set(String::New("reclaimed"), Number::New(budget.reclaimed));
+
+  cache_stats searchCache, groupCache;
+  CacheStats(search_cache, &searchCache);
+  CacheStats(group_cache, &groupCache);
+
+  Local<Object> jsCaches = Object::New();
+  jsCaches->Set(String::New("search"), JsCacheStats(searchCache));
+  jsCaches->Set(String::New("group"), JsCacheStats(groupCache));
+
+  prewarm_stats prewarm;
+  PrewarmStats(&prewarm);
+
+  Local<Object> jsPrewarm = Object::New();
+  jsPrewarm->Set(String::New("enabled"), Boolean::New(prewarm.enabled));
+  jsPrewarm->Set(String::New("searches"), Number::New(prewarm.searches));
+  jsPrewarm->Set(String::New("queued"), Number::New(prewarm.queued));
+  jsPrewarm->Set(String::New("warmed"), Number::New(prewarm.warmed));
+  jsPrewarm->Set(String::New("lastRun"), Number::New(prewarm.last_run));
+
+  broker_stats broker;
+  BrokerStats(&broker);
+
+  Local<Object> jsBroker = Object::New();
+  jsBroker->Set(String::New("serving"), Boolean::New(broker.serving));
+  jsBroker->Set(String::New("clients"), Number::New(broker.clients));
+  jsBroker->Set(String::New("served"), Number::New(broker.served));
+  jsBroker->Set(String::New("refused"), Number::New(broker.refused));
+  jsBroker->Set(String::New("forwarding"), Boolean::New(broker.forwarding));
+  jsBroker->Set(String::New("connected"), Number::New(broker.connected));
+  jsBroker->Set(String::New("pending"), Number::New(broker.pending));
+  jsBroker->Set(String::New("timeouts"), Number::New(broker.timeouts));
+
+  schema_stats schema;
+  SchemaStats(&schema);
+
+  Local<Object> jsSchema = Object::New();
+  jsSchema->Set(String::New("servers"), Number::New(schema.servers));
+  jsSchema->Set(String::New("attributes"), Number::New(schema.attributes));
+  jsSchema->Set(String::New("loads"), Number::New(schema.loads));
+  jsSchema->Set(String::New("failures"), Number::New(schema.failures));
+
+  subscribe_stats subscribe;
+  SubscribeStats(&subscribe);
+
+  Local<Object> jsSubscriptions = Object::New();
+  jsSubscriptions->Set(String::New("connections"), Number::New(subscribe.connections));
+  jsSubscriptions->Set(String::New("subscriptions"), Number::New(subscribe.subscriptions));
+  jsSubscriptions->Set(String::New("notifications"), Number::New(subscribe.notifications));
+  jsSubscriptions->Set(String::New("deliveries"), Number::New(subscribe.deliveries));
+  jsSubscriptions->Set(String::New("reconnects"), Number::New(subscribe.reconnects));
+
+  browse_stats browse;
+  BrowseStats(&browse);
+
+  Local<Object> jsBrowse = Object::New();
+  jsBrowse->Set(String::New("vlv"), Number::New(browse.vlv));
+  jsBrowse->Set(String::New("sorted"), Number::New(browse.sorted));
+  jsBrowse->Set(String::New("scans"), Number::New(browse.scans));
+  jsBrowse->Set(String::New("lists"), Number::New(browse.lists));
+
+  Local<Object> stats = Object::New();
+  stats->Set(String::New("arena"), jsArena);
+  stats->Set(String::New("servers"), jsServers);
+  stats->Set(String::New("pools"), jsPools);
+  stats->Set(String::New("budget"), jsBudget);
+  stats->Set(String::New("accounts"), jsAccounts);
+  stats->Set(String::New("replica"), jsReplica);
+  stats->Set(String::New("caches"), jsCaches);
+  stats->Set(String::New("prewarm"), jsPrewarm);
+  stats->Set(String::New("broker"), jsBroker);
+  stats->Set(String::New("subscriptions"), jsSubscriptions);
+  stats->Set(String::New("schema"), jsSchema);
+  stats->Set(String::New("browse"), jsBrowse);
+
+  return scope.Close(stats);
+}
+
+static Handle<Value> JsHitters(const std::vector<heavy_hitter> &hitters)
+{
+  Local<Array> jsHitters = Array::New(hitters.size());
+  for (size_t idx = 0; idx < hitters.size(); idx++)
+  {
+    Local<Object> jsHitter = Object::New();
+    jsHitter->Set(String::New("key"), String::New(hitters[idx].key.c_str()));
+    jsHitter->Set(String::New("count"), Number::New(hitters[idx].count));
+    jsHitter->Set(String::New("error"), Number::New(hitters[idx].error));
+    jsHitters->Set(Integer::New(idx), jsHitter);
+  }
+  return jsHitters;
+}
+
+static Handle<Value> JsWindow(const sketch_window &window)
+{
+  Local<Object> jsWindow = Object::New();
+  jsWindow->Set(String::New("started"), Number::New(window.started));
+  jsWindow->Set(String::New("requests"), Number::New(window.requests));
+  jsWindow->Set(String::New("distinctUsers"), Number::New(window.distinct_users));
+  jsWindow->Set(String::New("users"), JsHitters(window.users));
+  jsWindow->Set(String::New("sources"), JsHitters(window.sources));
+  return jsWindow;
+}
+
+// Exposed heavyHitters() JavaScript function. Returns { current, previous }
+// request windows, see sketch.h.
+static Handle<Value> HeavyHitters(const Arguments& args)
+{
+  HandleScope scope;
+
+  sketch_window current, previous;
+  SketchSnapshot(&current, &previous);
+
+  Local<Object> result = Object::New();
+  result->Set(String::New("current"), JsWindow(current));
+  result->Set(String::New("previous"), JsWindow(previous));
+
+  return scope.Close(result);
+}
+
+// Exposed broker() JavaScript function. Serves other processes' requests
+// on the Unix socket at path; see broker.h.
+static Handle<Value> Broker(const Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() < 1 || !args[0]->IsString()) return THROW("Required arguments: path");
+  String::Utf8Value path(args[0]);
+
+  // Requests arrive on reader threads and go through JobsTry().
+  JobsStart();
+  if (!BrokerListen(*path, ServeBrokerRequest)) {
+    return ThrowException(Exception::Error(String::New("broker: could not listen on the socket")));
+  }
+  return Undefined();
+}
+
+// Exposed invalidate() JavaScript function. With no arguments, empties
+// both caches. With { bindDn, base, filter }, any of them, removes the
+// cached searches made as that DN, under that base, with that filter
+// however it was spelled. Returns how many entries went.
+static Handle<Value> Invalidate(const Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() < 1 || args[0]->IsUndefined()) {
+    size_t removed = CacheRemove(search_cache, NULL, NULL) + CacheRemove(group_cache, NULL, NULL);
+    return scope.Close(Number::New(removed));
+  }
+  if (!args[0]->IsObject()) return THROW("invalidate() takes an options object");
+  Local<Object> options = args[0]->ToObject();
+
+  invalidation which;
+  std::string base, filter;
+  if (!StringOption(options, "bindDn", &which.bind_dn)) return THROW("bindDn should be a string");
+  if (!StringOption(options, "base", &base))            return THROW("base should be a string");
+  if (!StringOption(options, "filter", &filter))        return THROW("filter should be a string");
+  if (!base.empty()) which.base = StrLower(base);
+  if (!filter.empty()) which.filter = CanonicalFilter(filter.c_str());
+
+  return scope.Close(Number::New(CacheRemove(search_cache, SearchKeyMatches, &which)));
+}
+
+// Callbacks of live subscriptions, by id.
+static std::map<int, Persistent<Function> > subscribers;
+
+static void EndSubscription(int id)
+{
+  std::map<int, Persistent<Function> >::iterator it = subscribers.find(id);
+  if (it == subscribers.end()) return;
+  it->second.Dispose();
+  subscribers.erase(it);
+  ev_unref(EV_DEFAULT_UC);
+}
+
+static Handle<Value> JsChanges(int change)
+{
+  static const struct { int bit; const char *name; } names[] = {
+    { SUBSCRIBE_ADD, "add" }, { SUBSCRIBE_DELETE, "delete" }, { SUBSCRIBE_MODIFY, "modify" },
+    { SUBSCRIBE_MODDN, "moddn" }, { SUBSCRIBE_RESYNC, "resync" }
+  };
+
+  Local<Array> jsChanges = Array::New();
+  for (size_t idx = 0; idx < sizeof(names) / sizeof(names[0]); idx++)
+  {
+    if (change & names[idx].bit) jsChanges->Set(jsChanges->Length(), String::New(names[idx].name));
+  }
+  return jsChanges;
+}
+
+// Main loop: a batch of changes, or the end of the subscription.
+static void Subscribed(int id, int rc, const std::vector<subscribe_event> &events, void *arg)
+{
+  HandleScope scope;
+  std::map<int, Persistent<Function> >::iterator it = subscribers.find(id);
+  if (it == subscribers.end()) return;
+  // The callback may unsubscribe.
+  Persistent<Function> callback = Persistent<Function>::New(it->second);
+
+  Handle<Value> callback_args[2];
+  if (rc != LDAP_SUCCESS) {
+    EndSubscription(id);
+    callback_args[0] = Exception::Error(String::New(ldap_err2string(rc)));
+    callback_args[1] = Undefined();
+  } else {
+    Local<Array> jsEvents = Array::New(events.size());
+    for (size_t idx = 0; idx < events.size(); idx++)
+    {
+      Local<Object> jsEvent = Object::New();
+      jsEvent->Set(String::New("dn"), String::New(events[idx].dn.c_str()));
+      jsEvent->Set(String::New("changes"), JsChanges(events[idx].change));
+      jsEvents->Set(Integer::New(idx), jsEvent);
+    }
+    callback_args[0] = Undefined();
+    callback_args[1] = jsEvents;
+  }
+  callback->Call(Context::GetCurrent()->Global(), 2, callback_args);
+  callback.Dispose();
+}
+
+// Exposed subscribe() JavaScript function. Leaves a search for { dn } or
+// { base, filter, scope } outstanding, and calls back with the entries
+// that change, coalesced over options.coalesce ms; see subscribe.h.
+// Returns the id to pass to unsubscribe().
+static Handle<Value> Subscribe(const Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() < 6)      return THROW("Required arguments: ldap_host, ldap_port, bind_dn, password, options, callback");
+  if (!args[0]->IsString())   return THROW("ldap_host should be a string");
+  if (!args[1]->IsInt32())    return THROW("ldap_port should be an integer");
+  if (!args[2]->IsString())   return THROW("bind_dn should be a string");
+  if (!args[3]->IsString())   return THROW("password should be a string");
+  if (!args[4]->IsObject())   return THROW("options should be an object");
+  if (!args[5]->IsFunction()) return THROW("callback should be a function");
+
+  String::Utf8Value host(args[0]);
+  String::Utf8Value binddn(args[2]);
+  String::Utf8Value password(args[3]);
+  Local<Object> options = args[4]->ToObject();
+
+  subscribe_spec spec;
+  spec.host = *host;
+  spec.port = args[1]->Int32Value();
+  spec.binddn = *binddn;
+  spec.password = *password;
+  spec.scope = LDAP_SCOPE_SUBTREE;
+  spec.coalesce_ms = 1000;
+
+  std::string dn, scopeName = "sub", control = "psearch";
+  if (!StringOption(options, "dn", &dn))               return THROW("dn should be a string");
+  if (!StringOption(options, "base", &spec.base))      return THROW("base should be a string");
+  if (!StringOption(options, "filter", &spec.filter))  return THROW("filter should be a string");
+  if (!StringOption(options, "scope", &scopeName))     return THROW("scope should be a string");
+  if (!StringOption(options, "control", &control))     return THROW("control should be a string");
+  if (!IntOption(options, "coalesce", &spec.coalesce_ms) || spec.coalesce_ms < 0) {
+    return THROW("coalesce should be a non-negative integer");
+  }
+
+  if (!dn.empty()) {
+    spec.base = dn;
+    spec.scope = LDAP_SCOPE_BASE;
+  } else if (scopeName == "base") {
+    spec.scope = LDAP_SCOPE_BASE;
+  } else if (scopeName == "one") {
+    spec.scope = LDAP_SCOPE_ONELEVEL;
+  } else if (scopeName != "sub") {
+    return THROW("scope should be 'base', 'one' or 'sub'");
+  }
+  if (spec.base.empty()) return THROW("dn or base is required");
+
+  if (control == "psearch") {
+    spec.control = SUBSCRIBE_PSEARCH;
+  } else if (control == "notification") {
+    spec.control = SUBSCRIBE_NOTIFICATION;
+  } else if (control == "sync") {
+    spec.control = SUBSCRIBE_SYNC;
+  } else {
+    return THROW("control should be 'psearch', 'notification' or 'sync'");
+  }
+
+  int id = SubscribeStart(spec, Subscribed, NULL);
+  subscribers[id] = Persistent<Function>::New(Local<Function>::Cast(args[5]));
+  // Like a listening socket, a subscription keeps the process alive.
+  ev_ref(EV_DEFAULT_UC);
+
+  return scope.Close(Integer::New(id));
+}
+
+// Exposed unsubscribe() JavaScript function. Its callback is not called
+// again.
+static Handle<Value> Unsubscribe(const Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() < 1 || !args[0]->IsInt32()) return THROW("Required arguments: id");
+  int id = args[0]->Int32Value();
+  SubscribeStop(id);
+  EndSubscription(id);
+  return Undefined();
+}
+
+// Exposed prewarm() JavaScript function. Replays the searches recorded
+// for the upcoming bucket now; returns how many were queued.
+static Handle<Value> Prewarm(const Arguments& args)
+{
+  HandleScope scope;
+  return scope.Close(Integer::New(PrewarmNow()));
 }
 
 // Entry point for native Node module
@@ -390,6 +2568,22 @@ extern "C" void
 init (Handle<Object> target) 
 {
   HandleScope scope;
+  // Before anything else touches libldap, see arena.h.
+  ArenaInstall();
+  search_cache = CacheCreate(10000, 0);
+  group_cache = CacheCreate(10000, 0);
   target->Set(String::New("authenticate"), FunctionTemplate::New(Authenticate)->GetFunction());
   target->Set(String::New("search"), FunctionTemplate::New(Search)->GetFunction());
+  target->Set(String::New("bulkSearch"), FunctionTemplate::New(BulkSearchColumns)->GetFunction());
+  target->Set(String::New("configure"), FunctionTemplate::New(Configure)->GetFunction());
+  target->Set(String::New("stats"), FunctionTemplate::New(Stats)->GetFunction());
+  target->Set(String::New("heavyHitters"), FunctionTemplate::New(HeavyHitters)->GetFunction());
+  target->Set(String::New("prewarm"), FunctionTemplate::New(Prewarm)->GetFunction());
+  target->Set(String::New("invalidate"), FunctionTemplate::New(Invalidate)->GetFunction());
+  target->Set(String::New("broker"), FunctionTemplate::New(Broker)->GetFunction());
+  target->Set(String::New("subscribe"), FunctionTemplate::New(Subscribe)->GetFunction());
+  target->Set(String::New("unsubscribe"), FunctionTemplate::New(Unsubscribe)->GetFunction());
+#ifdef LDAPAUTH_BENCH
+  target->Set(String::New("_marshal"), FunctionTemplate::New(Marshal)->GetFunction());
+#endif
 }
@@ -0,0 +1,391 @@
+// Memory-mapped, parallel LDIF reader. See ldif.h.
+
+#include "ldif.h"
+#include "cache.h"
+#include "strcase.h"
+
+#include <uv.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <list>
+
+// Pieces smaller than this are not worth a thread.
+#define MIN_PIECE (4 << 20)
+
+#define MAX_THREADS 64
+
+struct ldif_piece
+{
+  const char *begin;
+  const char *end;
+  std::vector<ldif_record> records;
+  uint64_t skipped;
+  bool opens_file;
+  uv_thread_t thread;
+};
+
+static int Base64Digit(char c)
+{
+  if (c >= 'A' && c <= 'Z') return c - 'A';
+  if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+  if (c >= '0' && c <= '9') return c - '0' + 52;
+  if (c == '+') return 62;
+  if (c == '/') return 63;
+  return -1;
+}
+
+static bool Base64Decode(const std::string &text, std::string *out)
+{
+  out->clear();
+  uint32_t bits = 0;
+  int count = 0;
+  for (size_t idx = 0; idx < text.size(); idx++)
+  {
+    char c = text[idx];
+    if (c == '=' || c == ' ') continue;
+    int digit = Base64Digit(c);
+    if (digit < 0) return false;
+    bits = bits << 6 | digit;
+    count += 6;
+    if (count >= 8) {
+      count -= 8;
+      out->push_back((char)(bits >> count));
+    }
+  }
+  return true;
+}
+
+// Text in the mapped file, or in a piece's scratch when it had to be
+// joined or decoded.
+struct ldif_text
+{
+  const char *data;
+  size_t length;
+};
+
+struct ldif_attribute
+{
+  ldif_text name;
+  std::vector<ldif_text> values;
+};
+
+// A thread's working space, reused from record to record.
+struct ldif_scratch
+{
+  std::vector<ldif_text> lines;
+  std::list<std::string> joined;          // stable: lines point into it
+  std::vector<ldif_attribute> attributes; // the first used ones in use
+  size_t used;
+};
+
+static bool TextEqualFold(ldif_text text, const char *name)
+{
+  size_t length = strlen(name);
+  return text.length == length && StrEqualFold(text.data, name, length);
+}
+
+static std::string Text(ldif_text text)
+{
+  return std::string(text.data, text.length);
+}
+
+static ldif_text Keep(ldif_scratch *scratch, const std::string &text)
+{
+  scratch->joined.push_back(text);
+  ldif_text kept = { scratch->joined.back().data(), text.size() };
+  return kept;
+}
+
+// Reads the logical line at *at, joining folded continuation lines.
+// False at an empty line, which ends a record, and at the end.
+static bool ReadLine(const char **at, const char *end, ldif_scratch *scratch, ldif_text *line)
+{
+  if (*at >= end) return false;
+  const char *stop = (const char*)memchr(*at, '\n', end - *at);
+  if (stop == NULL) stop = end;
+  line->data = *at;
+  line->length = (stop > *at && stop[-1] == '\r' ? stop - 1 : stop) - *at;
+  *at = stop < end ? stop + 1 : end;
+  if (line->length == 0) return false;
+
+  if (*at < end && **at == ' ') {
+    std::string joined(line->data, line->length);
+    while (*at < end && **at == ' ')
+    {
+      const char *start = *at + 1;
+      stop = (const char*)memchr(start, '\n', end - start);
+      if (stop == NULL) stop = end;
+      joined.append(start, (stop > start && stop[-1] == '\r' ? stop - 1 : stop) - start);
+      *at = stop < end ? stop + 1 : end;
+    }
+    *line = Keep(scratch, joined);
+  }
+  return true;
+}
+
+// name: value, name:: base64 or name:< url. False if the line is not an
+// attribute-value pair or its value cannot be had.
+static bool SplitLine(ldif_scratch *scratch, ldif_text line, ldif_text *name, ldif_text *value, bool *url)
+{
+  const char *colon = (const char*)memchr(line.data, ':', line.length);
+  if (colon == NULL || colon == line.data) return false;
+  name->data = line.data;
+  name->length = colon - line.data;
+
+  const char *start = colon + 1, *end = line.data + line.length;
+  char kind = start < end ? *start : ' ';
+  if (kind == ':' || kind == '<') start++;
+  while (start < end && *start == ' ') start++;
+
+  *url = kind == '<';
+  if (kind == ':') {
+    std::string decoded;
+    if (!Base64Decode(std::string(start, end - start), &decoded)) return false;
+    *value = Keep(scratch, decoded);
+    return true;
+  }
+  value->data = start;
+  value->length = end - start;
+  return true;
+}
+
+// The values of the attribute called name, found or started.
+static std::vector<ldif_text> *Values(ldif_scratch *scratch, ldif_text name)
+{
+  // Attributes usually come in runs: try the last first.
+  for (size_t idx = scratch->used; idx-- > 0; )
+  {
+    ldif_text known = scratch->attributes[idx].name;
+    if (known.length == name.length && StrEqualFold(known.data, name.data, name.length)) return &scratch->attributes[idx].values;
+  }
+  if (scratch->used == scratch->attributes.size()) scratch->attributes.push_back(ldif_attribute());
+  ldif_attribute *attribute = &scratch->attributes[scratch->used++];
+  attribute->name = name;
+  attribute->values.clear();
+  return &attribute->values;
+}
+
+static void AppendValues(std::string *body, const std::string &name, const std::vector<std::string> &values)
+{
+  CacheAppend(body, name);
+  CacheAppend(body, (uint32_t)values.size());
+  for (size_t idx = 0; idx < values.size(); idx++) CacheAppend(body, values[idx]);
+}
+
+// Interprets the record in scratch->lines. False if it is malformed.
+static bool ParseRecord(ldif_scratch *scratch, ldif_record *record, uint64_t *skipped)
+{
+  const std::vector<ldif_text> &lines = scratch->lines;
+  ldif_text name, value;
+  bool url;
+  size_t idx = 0;
+
+  if (!SplitLine(scratch, lines[idx], &name, &value, &url) || !TextEqualFold(name, "dn")) return false;
+  record->dn = Text(value);
+  record->change = LDIF_ADD;
+  idx++;
+
+  for (; idx < lines.size(); idx++)
+  {
+    if (!SplitLine(scratch, lines[idx], &name, &value, &url)) return false;
+    if (TextEqualFold(name, "control")) continue;
+    if (TextEqualFold(name, "changetype")) {
+      std::string type = StrLower(Text(value));
+      if (type == "add") record->change = LDIF_ADD;
+      else if (type == "delete") record->change = LDIF_DELETE;
+      else if (type == "modify") record->change = LDIF_MODIFY;
+      else if (type == "modrdn" || type == "moddn") record->change = LDIF_MODRDN;
+      else return false;
+      idx++;
+    }
+    break;
+  }
+
+  if (record->change == LDIF_ADD) {
+    scratch->used = 0;
+    size_t bytes = sizeof(uint32_t);
+    for (; idx < lines.size(); idx++)
+    {
+      if (!SplitLine(scratch, lines[idx], &name, &value, &url)) return false;
+      if (url) {
+        (*skipped)++;
+        continue;
+      }
+      Values(scratch, name)->push_back(value);
+      bytes += name.length + value.length + 3 * sizeof(uint32_t);
+    }
+
+    record->body.reserve(bytes);
+    CacheAppend(&record->body, (uint32_t)scratch->used);
+    for (size_t attr = 0; attr < scratch->used; attr++)
+    {
+      const ldif_attribute &attribute = scratch->attributes[attr];
+      CacheAppend(&record->body, attribute.name.data, attribute.name.length);
+      CacheAppend(&record->body, (uint32_t)attribute.values.size());
+      for (size_t value = 0; value < attribute.values.size(); value++)
+      {
+        CacheAppend(&record->body, attribute.values[value].data, attribute.values[value].length);
+      }
+    }
+  } else if (record->change == LDIF_MODIFY) {
+    std::string mods;
+    uint32_t count = 0;
+    while (idx < lines.size())
+    {
+      ldif_text op, attr;
+      if (!SplitLine(scratch, lines[idx++], &op, &attr, &url)) return false;
+      std::string action = StrLower(Text(op));
+      if (action != "add" && action != "delete" && action != "replace") return false;
+
+      std::vector<std::string> values;
+      for (; idx < lines.size() && !(lines[idx].length == 1 && lines[idx].data[0] == '-'); idx++)
+      {
+        if (!SplitLine(scratch, lines[idx], &name, &value, &url) || !StrEqualFold(Text(name), Text(attr))) return false;
+        if (url) {
+          (*skipped)++;
+          continue;
+        }
+        values.push_back(Text(value));
+      }
+      idx++;    // the "-"
+
+      CacheAppend(&mods, action);
+      AppendValues(&mods, Text(attr), values);
+      count++;
+    }
+    CacheAppend(&record->body, count);
+    record->body.append(mods);
+  } else if (record->change == LDIF_MODRDN) {
+    std::string newrdn, deleteoldrdn = "0", newsuperior;
+    for (; idx < lines.size(); idx++)
+    {
+      if (!SplitLine(scratch, lines[idx], &name, &value, &url)) return false;
+      if (TextEqualFold(name, "newrdn")) newrdn = Text(value);
+      else if (TextEqualFold(name, "deleteoldrdn")) deleteoldrdn = Text(value);
+      else if (TextEqualFold(name, "newsuperior")) newsuperior = Text(value);
+    }
+    if (newrdn.empty()) return false;
+    CacheAppend(&record->body, newrdn);
+    CacheAppend(&record->body, deleteoldrdn == "1" ? "1" : "0", 1);
+    CacheAppend(&record->body, newsuperior);
+  }
+  return true;
+}
+
+static void ParsePiece(void *arg)
+{
+  ldif_piece *piece = (ldif_piece*)arg;
+  const char *at = piece->begin;
+  ldif_scratch scratch;
+  ldif_text line;
+  bool first = piece->opens_file;
+
+  while (at < piece->end)
+  {
+    scratch.lines.clear();
+    scratch.joined.clear();
+    while (ReadLine(&at, piece->end, &scratch, &line))
+    {
+      if (line.data[0] == '#') continue;
+      // "version: 1" may open the file, before the first record.
+      if (first && scratch.lines.empty() && line.length >= 8 && memcmp(line.data, "version:", 8) == 0) continue;
+      scratch.lines.push_back(line);
+    }
+    if (scratch.lines.empty()) continue;
+    first = false;
+
+    piece->records.push_back(ldif_record());
+    if (!ParseRecord(&scratch, &piece->records.back(), &piece->skipped)) {
+      piece->records.pop_back();
+      piece->skipped++;
+    }
+  }
+}
+
+// Where the record after pos starts: past the next empty line.
+static const char *NextRecord(const char *pos, const char *end)
+{
+  while (pos < end)
+  {
+    const char *newline = (const char*)memchr(pos, '\n', end - pos);
+    if (newline == NULL) return end;
+    pos = newline + 1;
+    if (pos < end && *pos == '\n') return pos + 1;
+    if (pos + 1 < end && pos[0] == '\r' && pos[1] == '\n') return pos + 2;
+  }
+  return end;
+}
+
+bool LdifRead(const char *path, int threads, ldif_result *result, std::string *error)
+{
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    *error = std::string(path) + ": " + strerror(errno);
+    if (fd >= 0) close(fd);
+    return false;
+  }
+
+  result->records.clear();
+  result->bytes = st.st_size;
+  result->skipped = 0;
+  result->modified = (int64_t)st.st_mtime * 1000;
+  if (st.st_size == 0) {
+    close(fd);
+    return true;
+  }
+
+  const char *data = (const char*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    *error = std::string(path) + ": " + strerror(errno);
+    return false;
+  }
+  madvise((void*)data, st.st_size, MADV_SEQUENTIAL);
+
+  if (threads <= 0) threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads > MAX_THREADS) threads = MAX_THREADS;
+  if ((uint64_t)threads > (uint64_t)st.st_size / MIN_PIECE) threads = st.st_size / MIN_PIECE;
+  if (threads < 1) threads = 1;
+
+  const char *end = data + st.st_size;
+  std::vector<ldif_piece> pieces(threads);
+  const char *begin = data;
+  for (int idx = 0; idx < threads; idx++)
+  {
+    pieces[idx].begin = begin;
+    pieces[idx].end = idx == threads - 1 ? end : NextRecord(data + st.st_size / threads * (idx + 1), end);
+    if (pieces[idx].end < begin) pieces[idx].end = begin;
+    pieces[idx].skipped = 0;
+    pieces[idx].opens_file = idx == 0;
+    begin = pieces[idx].end;
+  }
+
+  for (int idx = 1; idx < threads; idx++) uv_thread_create(&pieces[idx].thread, ParsePiece, &pieces[idx]);
+  ParsePiece(&pieces[0]);
+  for (int idx = 1; idx < threads; idx++) uv_thread_join(&pieces[idx].thread);
+
+  size_t total = 0;
+  for (int idx = 0; idx < threads; idx++) total += pieces[idx].records.size();
+  result->records.reserve(total);
+  for (int idx = 0; idx < threads; idx++)
+  {
+    for (size_t record = 0; record < pieces[idx].records.size(); record++)
+    {
+      result->records.push_back(ldif_record());
+      result->records.back().change = pieces[idx].records[record].change;
+      result->records.back().dn.swap(pieces[idx].records[record].dn);
+      result->records.back().body.swap(pieces[idx].records[record].body);
+    }
+    std::vector<ldif_record>().swap(pieces[idx].records);
+    result->skipped += pieces[idx].skipped;
+  }
+
+  munmap((void*)data, st.st_size);
+  return true;
+}
@@ -0,0 +1,62 @@
+// LDIF (RFC 2849) reader, memory-mapped and parallel, for seeding the
+// replica from an export.
+
+/*
+A nightly export of a large directory runs to gigabytes; reading it a
+line at a time takes minutes. LdifRead() maps the file and cuts it into
+one piece per thread, each cut moved forward to the next empty line so
+that pieces hold whole records. Threads parse their pieces independently
+and the records are returned in file order:
+
+  - folded lines (continuations starting with a space) are joined
+  - "attr:: " values are base64-decoded; "attr:< " URL values are
+    skipped and counted
+  - comments, the version line and controls are dropped
+  - lines of the same attribute are gathered into one list of values
+  - changetype add, delete, modify (add/delete/replace) and modrdn/moddn
+    records are returned as such, for the caller to apply in order
+
+Records are encoded with the cache's helpers (cache.h), so that the
+replica can take an added entry as it is:
+
+  add      attribute count, then each name, value count and values
+  modify   modification count, then each "add", "delete" or "replace",
+           the attribute and its value count and values
+  modrdn   new RDN, "1" or "0" for deleteoldrdn, new superior or ""
+  delete   nothing
+*/
+
+#ifndef LDAPAUTH_LDIF_H
+#define LDAPAUTH_LDIF_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <string>
+#include <vector>
+
+#define LDIF_ADD 'a'
+#define LDIF_DELETE 'd'
+#define LDIF_MODIFY 'm'
+#define LDIF_MODRDN 'r'
+
+struct ldif_record
+{
+  char change;
+  std::string dn;
+  std::string body;
+};
+
+struct ldif_result
+{
+  std::vector<ldif_record> records;
+  uint64_t bytes;
+  uint64_t skipped;             // URL values and malformed records
+  int64_t modified;             // the file's mtime, unix ms
+};
+
+// Reads the LDIF file at path with up to threads threads (0: one per
+// CPU). Returns false, with *error set, if it cannot be opened or mapped.
+bool LdifRead(const char *path, int threads, ldif_result *result, std::string *error);
+
+#endif
@@ -0,0 +1,790 @@
+// Shared, multiplexed LDAP connections for search(). See pool.h.
+
+#include "pool.h"
+#include "arena.h"
+#include "servers.h"
+#include "budget.h"
+#include "hash.h"
+
+#include <uv.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include <map>
+#include <algorithm>
+
+// How often an idle reader wakes up to notice a dropped connection.
+#define READER_POLL_MS 250
+
+// How often the sweeper looks for idle pools, and resizes the others.
+#define SWEEP_INTERVAL_MS 1000
+
+#define NS_PER_MS 1000000ULL
+
+// A worker blocked in PoolSearch(), waiting for its message id.
+struct pending_search
+{
+  uv_cond_t cond;
+  bool done;
+  int rc;
+  LDAPMessage *result;
+};
+
+struct mux_conn
+{
+  LDAP *ldap;
+  // Guards every libldap call on this handle, and everything below.
+  uv_mutex_t lock;
+  uv_thread_t reader;
+  std::map<int, pending_search*> pending;
+  bool broken;   // no new searches; reader is on its way out
+  bool stopped;  // reader thread has returned
+  // Guarded by the pool lock: workers currently using this connection,
+  // and whether it is being retired by auto-sizing.
+  int users;
+  bool draining;
+  bool budgeted;  // counted against the host-wide budget, see budget.h
+};
+
+struct conn_pool
+{
+  std::string key;         // HashKeyed() of uri, binddn and password
+  std::string uri;
+  std::string binddn;
+  std::string password;    // for opening connections; wiped on eviction
+  uv_mutex_t lock;
+  std::vector<mux_conn*> conns;
+  int opening;             // connections being opened without the lock
+  uv_cond_t opened;        // signalled as each of those is done
+
+  // Under pools_lock: PoolAcquire()s not yet released, and when the
+  // last one was.
+  int refs;
+  uint64_t last_used;
+
+  // Auto-sizing, guarded by lock.
+  int target;
+  int desired;
+  int low_intervals;       // consecutive evaluations wanting fewer
+  uint64_t window_start;   // hrtime
+  uint64_t arrivals;
+  uint64_t completions;
+  uint64_t service_ns;
+  int in_flight;           // searches on the pool's connections
+  uint64_t in_flight_ns;   // in_flight integrated over the window
+  uint64_t in_flight_at;   // hrtime in_flight_ns is counted up to
+  double arrival_rate;
+  double service_ms;
+  double mean_in_flight;
+  uint64_t grows;
+  uint64_t shrinks;
+};
+
+static uv_once_t pools_once = UV_ONCE_INIT;
+static uv_mutex_t pools_lock;
+static uv_cond_t sweeper_cond;
+static uv_thread_t sweeper;
+static std::map<std::string, conn_pool*> pools;
+
+static int pool_connections = 4;
+static int search_timeout_ms = 30000;
+
+static bool sizing_enabled = false;
+static int sizing_min = 1;
+static int sizing_max = 16;
+static double sizing_utilization = 0.7;
+static int sizing_per_connection = 8;
+static int sizing_interval_ms = 5000;
+static int sizing_shrink_after = 3;
+
+static void SweeperThread(void *arg);
+
+static void InitPools()
+{
+  uv_mutex_init(&pools_lock);
+  uv_cond_init(&sweeper_cond);
+  uv_thread_create(&sweeper, SweeperThread, NULL);
+}
+
+void PoolConfigure(int connections, int timeout_ms)
+{
+  if (connections > 0) pool_connections = connections;
+  if (timeout_ms > 0) search_timeout_ms = timeout_ms;
+}
+
+void PoolConfigureSizing(int enabled, int min, int max, double utilization,
+                         int per_connection, int interval_ms, int shrink_after)
+{
+  if (enabled >= 0) sizing_enabled = enabled;
+  if (min > 0) sizing_min = min;
+  if (max > 0) sizing_max = max;
+  if (sizing_max < sizing_min) sizing_max = sizing_min;
+  if (utilization > 0 && utilization <= 1) sizing_utilization = utilization;
+  if (per_connection > 0) sizing_per_connection = per_connection;
+  if (interval_ms > 0) sizing_interval_ms = interval_ms;
+  if (shrink_after > 0) sizing_shrink_after = shrink_after;
+}
+
+LDAP *DecodeHandle()
+{
+  static __thread LDAP *decoder = NULL;
+  if (decoder == NULL) {
+    arena_pause pause;
+    ldap_initialize(&decoder, NULL);
+  }
+  return decoder;
+}
+
+// Wakes every waiter on a connection that has gone bad.
+static void FailPending(mux_conn *conn, int rc)
+{
+  for (std::map<int, pending_search*>::iterator iter = conn->pending.begin(); iter != conn->pending.end(); ++iter)
+  {
+    iter->second->rc = rc;
+    iter->second->done = true;
+    uv_cond_signal(&iter->second->cond);
+  }
+  conn->pending.clear();
+}
+
+// Hands a completed result chain to whoever is waiting for it.
+// Called with conn->lock held.
+static void Dispatch(mux_conn *conn, LDAPMessage *msg)
+{
+  std::map<int, pending_search*>::iterator iter = conn->pending.find(ldap_msgid(msg));
+  if (iter == conn->pending.end()) {
+    // Waiter timed out and abandoned the search.
+    ldap_msgfree(msg);
+    return;
+  }
+
+  pending_search *waiter = iter->second;
+  conn->pending.erase(iter);
+
+  waiter->rc = ldap_result2error(conn->ldap, msg, 0);
+  waiter->result = msg;
+  waiter->done = true;
+  uv_cond_signal(&waiter->cond);
+}
+
+// One per connection. Waits for the socket to become readable without
+// holding the lock, then drains every complete result chain.
+static void ReaderThread(void *arg)
+{
+  mux_conn *conn = (mux_conn*)arg;
+
+  int fd = -1;
+  ldap_get_option(conn->ldap, LDAP_OPT_DESC, &fd);
+
+  bool running = true;
+  while (running)
+  {
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    poll(&pfd, 1, READER_POLL_MS);
+
+    uv_mutex_lock(&conn->lock);
+    if (!conn->broken && (pfd.revents != 0 || !conn->pending.empty())) {
+      struct timeval zero = {0, 0};
+      LDAPMessage *msg;
+      int type;
+      while ((type = ldap_result(conn->ldap, LDAP_RES_ANY, LDAP_MSG_ALL, &zero, &msg)) > 0)
+      {
+        Dispatch(conn, msg);
+      }
+      if (type < 0) {
+        conn->broken = true;
+      }
+    }
+    if (conn->broken) {
+      FailPending(conn, LDAP_SERVER_DOWN);
+      conn->stopped = true;
+      running = false;
+    }
+    uv_mutex_unlock(&conn->lock);
+  }
+}
+
+// Connects and binds a new connection, then starts its reader.
+// Returns NULL, with the reason in *rc, if the server is unreachable or
+// rejects the bind.
+static mux_conn *OpenConnection(conn_pool *pool, int *rc)
+{
+  LDAP *ldap = NULL;
+  *rc = ldap_initialize(&ldap, pool->uri.c_str());
+  if (*rc != LDAP_SUCCESS || ldap == NULL) {
+    return NULL;
+  }
+
+  int version = LDAP_VERSION3;
+  struct timeval timeout;
+  ServersConnectTimeout(&timeout);
+  ldap_set_option(ldap, LDAP_OPT_PROTOCOL_VERSION, &version);
+  ldap_set_option(ldap, LDAP_OPT_REFERRALS, LDAP_OPT_OFF);
+  ldap_set_option(ldap, LDAP_OPT_NETWORK_TIMEOUT, &timeout);
+
+  *rc = ldap_simple_bind_s(ldap, pool->binddn.c_str(), pool->password.c_str());
+  if (*rc != LDAP_SUCCESS) {
+    ldap_unbind_ext(ldap, NULL, NULL);
+    return NULL;
+  }
+
+  mux_conn *conn = new mux_conn;
+  conn->ldap = ldap;
+  conn->broken = false;
+  conn->stopped = false;
+  conn->users = 0;
+  conn->draining = false;
+  conn->budgeted = false;
+  uv_mutex_init(&conn->lock);
+
+  if (uv_thread_create(&conn->reader, ReaderThread, conn) != 0) {
+    *rc = LDAP_OTHER;
+    uv_mutex_destroy(&conn->lock);
+    ldap_unbind_ext(ldap, NULL, NULL);
+    delete conn;
+    return NULL;
+  }
+
+  return conn;
+}
+
+static void CloseConnection(conn_pool *pool, mux_conn *conn)
+{
+  if (conn->budgeted) BudgetRelease(pool->uri.c_str());
+  uv_thread_join(&conn->reader);
+  ldap_unbind_ext(conn->ldap, NULL, NULL);
+  uv_mutex_destroy(&conn->lock);
+  delete conn;
+}
+
+// Frees connections whose reader has exited and which nobody is using,
+// and stops the readers of retired connections once they are idle.
+// Called with pool->lock held.
+static void ReapConnections(conn_pool *pool)
+{
+  for (size_t idx = 0; idx < pool->conns.size(); )
+  {
+    mux_conn *conn = pool->conns[idx];
+
+    uv_mutex_lock(&conn->lock);
+    if (conn->draining && conn->users == 0 && conn->pending.empty()) {
+      conn->broken = true;
+    }
+    bool dead = conn->stopped && conn->users == 0;
+    uv_mutex_unlock(&conn->lock);
+
+    if (dead) {
+      pool->conns.erase(pool->conns.begin() + idx);
+      CloseConnection(pool, conn);
+    } else {
+      idx++;
+    }
+  }
+}
+
+// Adds delta searches in flight, having counted the current number up
+// to now. Called with pool->lock held.
+static void CountInFlight(conn_pool *pool, int delta, uint64_t now)
+{
+  pool->in_flight_ns += (uint64_t)pool->in_flight * (now - pool->in_flight_at);
+  pool->in_flight_at = now;
+  pool->in_flight += delta;
+}
+
+// Re-evaluates the pool's size once per interval, from the searches it
+// had in flight on average: each connection multiplexes up to
+// perConnection of them at full utilization. Called with pool->lock held.
+static void SizePool(conn_pool *pool, uint64_t now)
+{
+  uint64_t elapsed = now - pool->window_start;
+  if (elapsed < (uint64_t)sizing_interval_ms * 1000000) return;
+
+  pool->arrival_rate = pool->arrivals / (elapsed / 1e9);
+  if (pool->completions > 0) {
+    pool->service_ms = pool->service_ns / 1e6 / pool->completions;
+  }
+
+  CountInFlight(pool, 0, now);
+  pool->mean_in_flight = (double)pool->in_flight_ns / elapsed;
+  int desired = (int)ceil(pool->mean_in_flight / (sizing_per_connection * sizing_utilization));
+  pool->desired = std::max(sizing_min, std::min(sizing_max, desired));
+
+  if (pool->desired > pool->target) {
+    pool->target = pool->desired;
+    pool->low_intervals = 0;
+    pool->grows++;
+  } else if (pool->desired < pool->target) {
+    if (++pool->low_intervals >= sizing_shrink_after) {
+      pool->target--;
+      pool->low_intervals = 0;
+      pool->shrinks++;
+    }
+  } else {
+    pool->low_intervals = 0;
+  }
+
+  pool->window_start = now;
+  pool->arrivals = 0;
+  pool->completions = 0;
+  pool->service_ns = 0;
+  pool->in_flight_ns = 0;
+}
+
+// Whether conn takes new searches. Called with pool->lock held; broken
+// is the connection's own.
+static bool Usable(mux_conn *conn)
+{
+  if (conn->draining) return false;
+  uv_mutex_lock(&conn->lock);
+  bool broken = conn->broken;
+  uv_mutex_unlock(&conn->lock);
+  return !broken;
+}
+
+// Connections open and taking searches. Called with pool->lock held.
+static int LiveConnections(conn_pool *pool)
+{
+  int live = 0;
+  for (size_t idx = 0; idx < pool->conns.size(); idx++)
+  {
+    if (Usable(pool->conns[idx])) live++;
+  }
+  return live;
+}
+
+// The pool's current size. Called with pool->lock held.
+static int PoolSize(conn_pool *pool)
+{
+  return sizing_enabled ? pool->target : pool_connections;
+}
+
+// Retires the least busy connections above the pool's size, and returns
+// how many are left taking searches. Called with pool->lock held.
+static int TrimPool(conn_pool *pool)
+{
+  int size = PoolSize(pool);
+  int live = LiveConnections(pool);
+  while (live > size)
+  {
+    mux_conn *idlest = NULL;
+    for (size_t idx = 0; idx < pool->conns.size(); idx++)
+    {
+      mux_conn *conn = pool->conns[idx];
+      if (!Usable(conn)) continue;
+      if (idlest == NULL || conn->users < idlest->users) idlest = conn;
+    }
+    idlest->draining = true;
+    live--;
+  }
+  return live;
+}
+
+// Picks the least busy connection, opening another while the pool is
+// below its size and every existing connection already has work.
+// Returns NULL, with the reason in *rc, if there is none to be had.
+// Sizing itself happens on the sweeper thread.
+static mux_conn *PickConnection(conn_pool *pool, int *rc)
+{
+  *rc = LDAP_SUCCESS;
+  uv_mutex_lock(&pool->lock);
+  if (sizing_enabled) pool->arrivals++;
+
+  int size, live;
+  mux_conn *best;
+  for (;;)
+  {
+    ReapConnections(pool);
+    size = PoolSize(pool);
+    live = TrimPool(pool);
+
+    best = NULL;
+    for (size_t idx = 0; idx < pool->conns.size(); idx++)
+    {
+      mux_conn *conn = pool->conns[idx];
+      if (!Usable(conn)) continue;
+      if (best == NULL || conn->users < best->users) best = conn;
+    }
+
+    // The only connections there will be are still being opened.
+    if (best != NULL || pool->opening == 0 || live + pool->opening < size) break;
+    uv_cond_wait(&pool->opened, &pool->lock);
+  }
+
+  // Other processes on the host may already hold the server's budget;
+  // then make do with the connections there are, if any. The connect
+  // and bind happen without the lock: other workers keep using the rest.
+  bool counted;
+  bool wanted = (best == NULL || best->users > 0) && live + pool->opening < size;
+  if (wanted && !BudgetAcquire(pool->uri.c_str(), &counted)) {
+    if (best == NULL) *rc = LDAP_ADMINLIMIT_EXCEEDED;
+  } else if (wanted) {
+    if (best != NULL) best->users++;
+    pool->opening++;
+    uv_mutex_unlock(&pool->lock);
+    int open_rc;
+    mux_conn *fresh = OpenConnection(pool, &open_rc);
+    uv_mutex_lock(&pool->lock);
+    pool->opening--;
+    uv_cond_broadcast(&pool->opened);
+    if (best != NULL) best->users--;
+    if (fresh != NULL) {
+      fresh->budgeted = counted;
+      pool->conns.push_back(fresh);
+      best = fresh;
+    } else {
+      if (counted) BudgetRelease(pool->uri.c_str());
+      if (best == NULL) *rc = open_rc;
+    }
+  }
+
+  if (best != NULL) {
+    best->users++;
+    CountInFlight(pool, 1, uv_hrtime());
+  }
+  uv_mutex_unlock(&pool->lock);
+
+  return best;
+}
+
+static void ReleaseConnection(conn_pool *pool, mux_conn *conn, uint64_t service_ns)
+{
+  uv_mutex_lock(&pool->lock);
+  conn->users--;
+  CountInFlight(pool, -1, uv_hrtime());
+  pool->completions++;
+  pool->service_ns += service_ns;
+  uv_mutex_unlock(&pool->lock);
+}
+
+// Closes an evicted pool's connections and frees it. Nobody holds it,
+// and it is no longer in pools.
+static void DestroyPool(conn_pool *pool)
+{
+  for (size_t idx = 0; idx < pool->conns.size(); idx++)
+  {
+    mux_conn *conn = pool->conns[idx];
+    uv_mutex_lock(&conn->lock);
+    conn->broken = true;
+    uv_mutex_unlock(&conn->lock);
+    CloseConnection(pool, conn);
+  }
+  std::fill(pool->password.begin(), pool->password.end(), '\0');
+  uv_cond_destroy(&pool->opened);
+  uv_mutex_destroy(&pool->lock);
+  delete pool;
+}
+
+// Takes out of pools the ones idle since before idle_before, or if
+// oldest is set, the least recently used unheld one (to uri, unless
+// that is NULL). Called with pools_lock held; the caller destroys them
+// without it.
+static void EvictPools(uint64_t idle_before, bool oldest, const std::string *uri,
+                       std::vector<conn_pool*> *evicted)
+{
+  std::map<std::string, conn_pool*>::iterator lru = pools.end();
+  for (std::map<std::string, conn_pool*>::iterator iter = pools.begin(); iter != pools.end(); )
+  {
+    conn_pool *pool = iter->second;
+    if (pool->refs == 0 && pool->last_used < idle_before) {
+      evicted->push_back(pool);
+      pools.erase(iter++);
+      continue;
+    }
+    if (pool->refs == 0 && (uri == NULL || pool->uri == *uri)
+        && (lru == pools.end() || pool->last_used < lru->second->last_used)) {
+      lru = iter;
+    }
+    ++iter;
+  }
+  if (oldest && evicted->empty() && lru != pools.end()) {
+    evicted->push_back(lru->second);
+    pools.erase(lru);
+  }
+}
+
+// Closes pools nobody has used for POOL_IDLE_MS, so that per-user
+// pools do not pile up, and sizes the rest: on a timer, so that a pool
+// nobody searches on shrinks, too.
+static void SweeperThread(void *arg)
+{
+  uv_mutex_lock(&pools_lock);
+  for (;;)
+  {
+    uv_cond_timedwait(&sweeper_cond, &pools_lock, SWEEP_INTERVAL_MS * NS_PER_MS);
+
+    uint64_t now = uv_hrtime();
+    std::vector<conn_pool*> evicted;
+    if (now > POOL_IDLE_MS * NS_PER_MS) EvictPools(now - POOL_IDLE_MS * NS_PER_MS, false, NULL, &evicted);
+
+    for (std::map<std::string, conn_pool*>::iterator iter = pools.begin(); iter != pools.end(); ++iter)
+    {
+      conn_pool *pool = iter->second;
+      uv_mutex_lock(&pool->lock);
+      if (sizing_enabled) SizePool(pool, now);
+      ReapConnections(pool);
+      TrimPool(pool);
+      uv_mutex_unlock(&pool->lock);
+    }
+
+    uv_mutex_unlock(&pools_lock);
+    for (size_t idx = 0; idx < evicted.size(); idx++) DestroyPool(evicted[idx]);
+    uv_mutex_lock(&pools_lock);
+  }
+}
+
+conn_pool *PoolAcquire(const char *uri, const char *binddn, const char *password)
+{
+  uv_once(&pools_once, InitPools);
+
+  // Keyed, so that the map holds nothing a password can be recovered
+  // or tested from.
+  std::string key = HashKeyed(std::string(uri) + '\n' + binddn + '\n' + password);
+
+  uv_mutex_lock(&pools_lock);
+  conn_pool *pool;
+  std::vector<conn_pool*> evicted;
+  std::map<std::string, conn_pool*>::iterator iter = pools.find(key);
+  if (iter != pools.end()) {
+    pool = iter->second;
+    pool->refs++;
+  } else {
+    if (pools.size() >= POOL_MAX_POOLS) EvictPools(0, true, NULL, &evicted);
+    if (pools.size() >= POOL_MAX_POOLS) {
+      uv_mutex_unlock(&pools_lock);
+      return NULL;
+    }
+
+    pool = new conn_pool;
+    pool->key = key;
+    pool->uri = uri;
+    pool->binddn = binddn;
+    pool->password = password;
+    pool->opening = 0;
+    pool->refs = 1;
+    pool->last_used = uv_hrtime();
+    uv_mutex_init(&pool->lock);
+    uv_cond_init(&pool->opened);
+    pool->target = std::max(sizing_min, std::min(sizing_max, pool_connections));
+    pool->desired = pool->target;
+    pool->low_intervals = 0;
+    pool->window_start = uv_hrtime();
+    pool->arrivals = pool->completions = pool->service_ns = 0;
+    pool->in_flight = 0;
+    pool->in_flight_ns = 0;
+    pool->in_flight_at = pool->window_start;
+    pool->arrival_rate = pool->service_ms = pool->mean_in_flight = 0;
+    pool->grows = pool->shrinks = 0;
+    pools.insert(std::pair<std::string, conn_pool*>(key, pool));
+  }
+  uv_mutex_unlock(&pools_lock);
+
+  for (size_t idx = 0; idx < evicted.size(); idx++) DestroyPool(evicted[idx]);
+  return pool;
+}
+
+void PoolRelease(conn_pool *pool)
+{
+  if (pool == NULL) return;
+  uv_mutex_lock(&pools_lock);
+  pool->refs--;
+  pool->last_used = uv_hrtime();
+  uv_mutex_unlock(&pools_lock);
+}
+
+// Closes the least recently used pool to uri that nobody holds, giving
+// its connections' budget back. False if there is none.
+static bool ReclaimIdle(const std::string &uri)
+{
+  std::vector<conn_pool*> evicted;
+  uv_mutex_lock(&pools_lock);
+  EvictPools(0, true, &uri, &evicted);
+  uv_mutex_unlock(&pools_lock);
+
+  for (size_t idx = 0; idx < evicted.size(); idx++) DestroyPool(evicted[idx]);
+  return !evicted.empty();
+}
+
+int PoolSearch(conn_pool *pool, const char *base, int scope, const char *filter,
+               char **attrs, LDAPMessage **res)
+{
+  return PoolSearchControls(pool, base, scope, filter, attrs, NULL, res);
+}
+
+int PoolSearchControls(conn_pool *pool, const char *base, int scope, const char *filter,
+                       char **attrs, LDAPControl **serverctrls, LDAPMessage **res)
+{
+  *res = NULL;
+  if (pool == NULL) return LDAP_ADMINLIMIT_EXCEEDED;
+
+  // Connections and the operations queued on them outlive any request.
+  arena_pause pause;
+
+  uint64_t started = uv_hrtime();
+  int rc;
+  mux_conn *conn = PickConnection(pool, &rc);
+  // Refused by the budget with no connection to share: idle pools to
+  // the same server make way.
+  while (conn == NULL && rc == LDAP_ADMINLIMIT_EXCEEDED && ReclaimIdle(pool->uri)) {
+    conn = PickConnection(pool, &rc);
+  }
+  if (conn == NULL) {
+    return rc;
+  }
+
+  pending_search waiter;
+  uv_cond_init(&waiter.cond);
+  waiter.done = false;
+  waiter.rc = LDAP_OTHER;
+  waiter.result = NULL;
+
+  uv_mutex_lock(&conn->lock);
+
+  int msgid;
+  rc = conn->broken ? LDAP_SERVER_DOWN
+    : ldap_search_ext(conn->ldap, base, scope, filter, attrs, 0, serverctrls, NULL, NULL, 0, &msgid);
+
+  if (rc == LDAP_SUCCESS) {
+    // Registered before the lock is released, so the reader cannot
+    // see the response before it knows who is waiting for it.
+    conn->pending[msgid] = &waiter;
+
+    uint64_t deadline = uv_hrtime() + (uint64_t)search_timeout_ms * 1000000;
+    while (!waiter.done)
+    {
+      uint64_t now = uv_hrtime();
+      if (now >= deadline) break;
+      uv_cond_timedwait(&waiter.cond, &conn->lock, deadline - now);
+    }
+
+    if (waiter.done) {
+      rc = waiter.rc;
+      *res = waiter.result;
+    } else {
+      conn->pending.erase(msgid);
+      ldap_abandon_ext(conn->ldap, msgid, NULL, NULL);
+      rc = LDAP_TIMEOUT;
+    }
+  } else if (rc == LDAP_SERVER_DOWN) {
+    conn->broken = true;
+  }
+
+  uv_mutex_unlock(&conn->lock);
+  uv_cond_destroy(&waiter.cond);
+  ReleaseConnection(pool, conn, uv_hrtime() - started);
+
+  return rc;
+}
+
+int PoolSearchEach(conn_pool *pool, const std::vector<std::string> &bases, int scope, const char *filter,
+                   char **attrs, std::vector<LDAPMessage*> *res, std::vector<int> *rcs)
+{
+  res->assign(bases.size(), (LDAPMessage*)NULL);
+  rcs->assign(bases.size(), LDAP_OTHER);
+  if (bases.empty()) return LDAP_SUCCESS;
+  if (pool == NULL) return LDAP_ADMINLIMIT_EXCEEDED;
+
+  arena_pause pause;
+
+  uint64_t started = uv_hrtime();
+  int rc;
+  mux_conn *conn = PickConnection(pool, &rc);
+  while (conn == NULL && rc == LDAP_ADMINLIMIT_EXCEEDED && ReclaimIdle(pool->uri)) {
+    conn = PickConnection(pool, &rc);
+  }
+  if (conn == NULL) {
+    return rc;
+  }
+
+  std::vector<pending_search> waiters(bases.size());
+  std::vector<int> msgids(bases.size(), -1);
+  for (size_t idx = 0; idx < waiters.size(); idx++)
+  {
+    uv_cond_init(&waiters[idx].cond);
+    waiters[idx].done = false;
+    waiters[idx].rc = LDAP_OTHER;
+    waiters[idx].result = NULL;
+  }
+
+  uv_mutex_lock(&conn->lock);
+
+  // All sent before any is waited for: the answers come back while the
+  // rest are still going out.
+  rc = LDAP_SUCCESS;
+  for (size_t idx = 0; idx < bases.size(); idx++)
+  {
+    rc = conn->broken ? LDAP_SERVER_DOWN
+      : ldap_search_ext(conn->ldap, bases[idx].c_str(), scope, filter, attrs, 0, NULL, NULL, NULL, 0, &msgids[idx]);
+    if (rc != LDAP_SUCCESS) {
+      if (rc == LDAP_SERVER_DOWN) conn->broken = true;
+      break;
+    }
+    conn->pending[msgids[idx]] = &waiters[idx];
+  }
+  int unsent = rc;
+
+  uint64_t deadline = uv_hrtime() + (uint64_t)search_timeout_ms * 1000000;
+  for (size_t idx = 0; idx < bases.size(); idx++)
+  {
+    if (msgids[idx] < 0) {
+      (*rcs)[idx] = unsent;
+      continue;
+    }
+    while (!waiters[idx].done)
+    {
+      uint64_t now = uv_hrtime();
+      if (now >= deadline) break;
+      uv_cond_timedwait(&waiters[idx].cond, &conn->lock, deadline - now);
+    }
+
+    if (waiters[idx].done) {
+      (*rcs)[idx] = waiters[idx].rc;
+      (*res)[idx] = waiters[idx].result;
+    } else {
+      conn->pending.erase(msgids[idx]);
+      ldap_abandon_ext(conn->ldap, msgids[idx], NULL, NULL);
+      (*rcs)[idx] = LDAP_TIMEOUT;
+    }
+  }
+
+  uv_mutex_unlock(&conn->lock);
+  for (size_t idx = 0; idx < waiters.size(); idx++)
+  {
+    uv_cond_destroy(&waiters[idx].cond);
+  }
+  ReleaseConnection(pool, conn, uv_hrtime() - started);
+
+  return LDAP_SUCCESS;
+}
+
+void PoolList(std::vector<pool_info> *list)
+{
+  uv_once(&pools_once, InitPools);
+
+  list->clear();
+  uv_mutex_lock(&pools_lock);
+  for (std::map<std::string, conn_pool*>::iterator iter = pools.begin(); iter != pools.end(); ++iter)
+  {
+    conn_pool *pool = iter->second;
+
+    uv_mutex_lock(&pool->lock);
+    pool_info info;
+    info.uri = pool->uri;
+    info.binddn = pool->binddn;
+    info.connections = LiveConnections(pool);
+    info.target = PoolSize(pool);
+    info.desired = sizing_enabled ? pool->desired : pool_connections;
+    info.arrival_rate = pool->arrival_rate;
+    info.service_ms = pool->service_ms;
+    info.in_flight = pool->mean_in_flight;
+    info.grows = pool->grows;
+    info.shrinks = pool->shrinks;
+    uv_mutex_unlock(&pool->lock);
+
+    list->push_back(info);
+  }
+  uv_mutex_unlock(&pools_lock);
+}
@@ -0,0 +1,115 @@
+// Shared, multiplexed LDAP connections for search().
+
+/*
+LDAP allows many outstanding operations on one connection, each tagged
+with a message id. Rather than connecting and binding once per search,
+workers share a small set of bound connections per (server, bind DN):
+
+   worker threads                       mux_conn (one per socket)
+   --------------                       -------------------------
+   PoolSearch() --ldap_search_ext()-->  pending[msgid] = waiter
+        |                                       |
+   (wait on condvar)                    reader thread: poll(fd),
+        |                               ldap_result(LDAP_RES_ANY)
+        |                                       |
+   wakes with LDAPMessage* <--- signal ---  dispatch by msgid
+
+All libldap calls on a connection are made with that connection's lock
+held, so a thread-safe libldap (libldap_r before OpenLDAP 2.5) is needed.
+
+Pool size is fixed (searchConnections) unless auto-sizing is on. Then
+every interval, on a timer whether or not searches arrive, each pool
+measures the searches it had in flight on average. A connection
+multiplexes perConnection of them at full utilization; the pool wants
+enough connections for its searches to keep each at the target
+utilization, within [min, max]. It grows at once, but only shrinks, one
+connection at a time, after wanting fewer for shrinkAfter intervals in
+a row. Connections being retired take no new searches and close when
+their last one completes.
+
+Either way, opening a connection first asks the host-wide budget
+(budget.h), when one is configured.
+
+Pools are per bind identity, so there can be one per user. They are
+looked up by a keyed hash (hash.h) rather than by the password, are
+closed once nobody has used them for POOL_IDLE_MS, and there are never
+more than POOL_MAX_POOLS: past that the least recently used idle pool
+makes way, or PoolAcquire() fails.
+*/
+
+#ifndef LDAPAUTH_POOL_H
+#define LDAPAUTH_POOL_H
+
+#include <ldap.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#define POOL_IDLE_MS 300000
+#define POOL_MAX_POOLS 1024
+
+struct conn_pool;
+
+// Returns the shared pool for this server and bind identity, creating it
+// on first use, to be given back with PoolRelease(). NULL if there are
+// POOL_MAX_POOLS pools and all are in use.
+conn_pool *PoolAcquire(const char *uri, const char *binddn, const char *password);
+
+// The pool may be closed once idle. NULL is ignored.
+void PoolRelease(conn_pool *pool);
+
+// Runs a search on one of the pool's connections and blocks until the
+// complete result chain arrives. Returns an LDAP result code,
+// LDAP_ADMINLIMIT_EXCEEDED for a NULL pool or one the host-wide budget
+// allows no connection. *res is set whenever the
+// server answered (even with an error) and must be released with
+// ldap_msgfree(); it is NULL if no answer was received.
+int PoolSearch(conn_pool *pool, const char *base, int scope, const char *filter,
+               char **attrs, LDAPMessage **res);
+
+// As PoolSearch(), with server controls (sort, VLV, ...) sent along.
+// Controls whose state lives on the server's side of one connection
+// may not find it: successive searches can go out on different ones.
+int PoolSearchControls(conn_pool *pool, const char *base, int scope, const char *filter,
+                       char **attrs, LDAPControl **serverctrls, LDAPMessage **res);
+
+// As PoolSearch(), for each of bases: the searches all go out on one
+// connection before any answer is awaited, so they cost about one round
+// trip rather than one each. (*res)[i] and (*rcs)[i] are base i's; a
+// search not sent or not answered in time has its code and a NULL chain.
+// Returns LDAP_SUCCESS, or why no connection could be had.
+int PoolSearchEach(conn_pool *pool, const std::vector<std::string> &bases, int scope, const char *filter,
+                   char **attrs, std::vector<LDAPMessage*> *res, std::vector<int> *rcs);
+
+// An unconnected handle owned by the calling thread, for the parsing
+// functions (ldap_first_entry(), ldap_get_values(), ...) that want an LDAP*
+// but never touch the network.
+LDAP *DecodeHandle();
+
+// Connections opened per pool, and how long a search may wait for its
+// result before it is abandoned.
+void PoolConfigure(int connections, int timeout_ms);
+
+// Turns auto-sizing on or off (enabled < 0 keeps it). Non-positive
+// arguments keep the current setting.
+void PoolConfigureSizing(int enabled, int min, int max, double utilization,
+                         int per_connection, int interval_ms, int shrink_after);
+
+struct pool_info
+{
+  std::string uri;
+  std::string binddn;
+  int connections;        // open and taking searches
+  int target;             // current size
+  int desired;            // as of the last evaluation
+  double arrival_rate;    // searches per second, last interval
+  double service_ms;      // mean search time, last interval
+  double in_flight;       // mean searches in flight, last interval
+  uint64_t grows;
+  uint64_t shrinks;
+};
+
+void PoolList(std::vector<pool_info> *pools);
+
+#endif
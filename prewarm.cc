@@ -0,0 +1,271 @@
+// Pre-warming the caches ahead of recurring login peaks. See prewarm.h.
+
+#include "prewarm.h"
+#include "strcase.h"
+
+#include <uv.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include <map>
+#include <deque>
+#include <vector>
+#include <algorithm>
+
+#define NS_PER_MS 1000000ULL
+
+#define BUCKET_SECONDS 300
+#define BUCKETS_PER_WEEK (7 * 24 * 3600 / BUCKET_SECONDS)
+
+// Distinct searches remembered; later ones are not recorded.
+#define MAX_SEARCHES 100000
+
+// Back-off while the worker pool refuses replays.
+#define BUSY_WAIT_MS 100
+
+struct bucket
+{
+  int64_t slot;                  // which five minutes since the epoch
+  std::vector<uint32_t> ids;     // sorted
+};
+
+static uv_once_t prewarm_once = UV_ONCE_INIT;
+static uv_mutex_t prewarm_lock;
+static uv_cond_t prewarm_cond;
+
+static bool enabled = false;
+static bool running = false;
+static uv_thread_t prewarmer;
+static prewarm_cb warm_cb = NULL;
+static int lead_ms = 120000;
+static int rate = 10;
+static int concurrency = 4;
+static std::string service_binddn;
+static std::string service_password;
+
+static std::vector<prewarm_search> searches;
+static std::map<std::string, uint32_t> search_ids;
+static bucket buckets[BUCKETS_PER_WEEK];
+
+static std::deque<uint32_t> queued;
+static int outstanding = 0;
+static uint64_t warmed = 0;
+static int64_t last_run = 0;
+
+static void InitPrewarm()
+{
+  uv_mutex_init(&prewarm_lock);
+  uv_cond_init(&prewarm_cond);
+}
+
+static int64_t WallClockMs()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+// The local-time slot containing unix time ms, and its bucket in the week.
+static int64_t Slot(int64_t ms, int *week_bucket)
+{
+  time_t seconds = ms / 1000;
+  struct tm tm;
+  localtime_r(&seconds, &tm);
+
+  int in_week = (tm.tm_wday * 24 + tm.tm_hour) * 3600 + tm.tm_min * 60 + tm.tm_sec;
+  *week_bucket = in_week / BUCKET_SECONDS;
+  return (seconds + tm.tm_gmtoff) / BUCKET_SECONDS;
+}
+
+void PrewarmRecord(const char *host, int port, const char *binddn, const char *base, const char *filter)
+{
+  uv_once(&prewarm_once, InitPrewarm);
+
+  uv_mutex_lock(&prewarm_lock);
+  if (!enabled || StrLower(binddn) != StrLower(service_binddn)) {
+    uv_mutex_unlock(&prewarm_lock);
+    return;
+  }
+
+  std::string key;
+  key.append(host).append(1, '\0').append(base).append(1, '\0').append(filter);
+  key.append((const char*)&port, sizeof(port));
+
+  uint32_t id;
+  std::map<std::string, uint32_t>::iterator found = search_ids.find(key);
+  if (found != search_ids.end()) {
+    id = found->second;
+  } else if (searches.size() < MAX_SEARCHES) {
+    prewarm_search search;
+    search.host = host;
+    search.port = port;
+    search.base = base;
+    search.filter = filter;
+    id = searches.size();
+    searches.push_back(search);
+    search_ids[key] = id;
+  } else {
+    uv_mutex_unlock(&prewarm_lock);
+    return;
+  }
+
+  int week_bucket;
+  int64_t slot = Slot(WallClockMs(), &week_bucket);
+  bucket &b = buckets[week_bucket];
+  if (b.slot != slot) {
+    // Last week's: start over.
+    b.slot = slot;
+    b.ids.clear();
+  }
+  std::vector<uint32_t>::iterator pos = std::lower_bound(b.ids.begin(), b.ids.end(), id);
+  if (pos == b.ids.end() || *pos != id) b.ids.insert(pos, id);
+  uv_mutex_unlock(&prewarm_lock);
+}
+
+// Queues the bucket that starts lead ms from now. Lock held.
+static int QueueUpcoming(int64_t now)
+{
+  int week_bucket;
+  Slot(now + lead_ms, &week_bucket);
+  const std::vector<uint32_t> &ids = buckets[week_bucket].ids;
+  queued.insert(queued.end(), ids.begin(), ids.end());
+  last_run = now;
+  uv_cond_signal(&prewarm_cond);
+  return ids.size();
+}
+
+static void PrewarmThread(void *arg)
+{
+  int64_t next_run = 0;
+  uint64_t next_start = 0;
+
+  uv_mutex_lock(&prewarm_lock);
+  while (enabled)
+  {
+    int64_t now = WallClockMs();
+    if (next_run == 0 || now >= next_run) {
+      if (next_run != 0) QueueUpcoming(now);
+      // Next time a bucket boundary is exactly lead ms away.
+      int64_t boundary = ((now + lead_ms) / (BUCKET_SECONDS * 1000) + 1) * BUCKET_SECONDS * 1000;
+      next_run = boundary - lead_ms;
+    }
+
+    uint64_t wait_ns = (uint64_t)(next_run - now) * NS_PER_MS;
+    if (!queued.empty() && outstanding < concurrency) {
+      uint64_t hrnow = uv_hrtime();
+      if (hrnow >= next_start) {
+        uint32_t id = queued.front();
+        queued.pop_front();
+        prewarm_search search = searches[id];
+        prewarm_cb warm = warm_cb;
+        std::string binddn = service_binddn;
+        std::string password = service_password;
+        outstanding++;
+        uv_mutex_unlock(&prewarm_lock);
+
+        bool started = warm(search, binddn, password);
+
+        uv_mutex_lock(&prewarm_lock);
+        if (started) {
+          warmed++;
+          next_start = hrnow + 1000 * NS_PER_MS / rate;
+        } else {
+          outstanding--;
+          // Unless PrewarmDisable() forgot it meanwhile.
+          if (id < searches.size()) queued.push_front(id);
+          next_start = uv_hrtime() + BUSY_WAIT_MS * NS_PER_MS;
+        }
+        continue;
+      }
+      wait_ns = std::min(wait_ns, next_start - hrnow);
+    }
+
+    uv_cond_timedwait(&prewarm_cond, &prewarm_lock, wait_ns);
+  }
+  running = false;
+  queued.clear();
+  uv_mutex_unlock(&prewarm_lock);
+}
+
+static void Forget()
+{
+  searches.clear();
+  search_ids.clear();
+  for (int idx = 0; idx < BUCKETS_PER_WEEK; idx++)
+  {
+    buckets[idx].slot = 0;
+    buckets[idx].ids.clear();
+  }
+  queued.clear();
+}
+
+void PrewarmConfigure(prewarm_cb warm, const char *binddn, const char *password,
+                      int lead, int per_second, int parallel)
+{
+  uv_once(&prewarm_once, InitPrewarm);
+
+  uv_mutex_lock(&prewarm_lock);
+  warm_cb = warm;
+  if (StrLower(binddn) != StrLower(service_binddn)) Forget();
+  service_binddn = binddn;
+  service_password = password;
+  if (lead > 0) lead_ms = lead;
+  if (per_second > 0) rate = per_second;
+  if (parallel > 0) concurrency = parallel;
+  enabled = true;
+
+  bool start = !running;
+  if (start) running = true;
+  uv_cond_signal(&prewarm_cond);
+  uv_mutex_unlock(&prewarm_lock);
+
+  if (start) {
+    uv_thread_create(&prewarmer, PrewarmThread, NULL);
+  }
+}
+
+void PrewarmDisable()
+{
+  uv_once(&prewarm_once, InitPrewarm);
+
+  uv_mutex_lock(&prewarm_lock);
+  enabled = false;
+  Forget();
+  service_binddn.clear();
+  service_password.clear();
+  uv_cond_signal(&prewarm_cond);
+  uv_mutex_unlock(&prewarm_lock);
+}
+
+int PrewarmNow()
+{
+  uv_once(&prewarm_once, InitPrewarm);
+
+  uv_mutex_lock(&prewarm_lock);
+  int count = enabled ? QueueUpcoming(WallClockMs()) : 0;
+  uv_mutex_unlock(&prewarm_lock);
+  return count;
+}
+
+void PrewarmDone()
+{
+  uv_once(&prewarm_once, InitPrewarm);
+
+  uv_mutex_lock(&prewarm_lock);
+  outstanding--;
+  uv_cond_signal(&prewarm_cond);
+  uv_mutex_unlock(&prewarm_lock);
+}
+
+void PrewarmStats(prewarm_stats *stats)
+{
+  uv_once(&prewarm_once, InitPrewarm);
+
+  uv_mutex_lock(&prewarm_lock);
+  stats->enabled = enabled;
+  stats->searches = searches.size();
+  stats->queued = queued.size();
+  stats->warmed = warmed;
+  stats->last_run = last_run;
+  uv_mutex_unlock(&prewarm_lock);
+}
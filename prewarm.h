@@ -0,0 +1,74 @@
+// Pre-warming the caches ahead of recurring login peaks.
+
+/*
+Logins follow the week: the same people sign in around 08:55 every
+weekday. While pre-warming is configured, every search() made as its
+service identity (bindDn) is recorded in the five-minute bucket of the
+week it happened in (a bucket keeps only its most recent week). lead ms
+before each bucket comes round again, a background thread replays that
+bucket's searches with the warm callback, so user entries and group
+closures are cached before the users arrive.
+
+Passwords are never recorded. Replays bind as the service identity with
+the password configured for it; searches made as anybody else are not
+recorded, so no user's bind is ever repeated.
+
+Replays are throttled to rate searches per second, with at most
+concurrency of them outstanding, and back off while the worker pool is
+full. prewarm() replays the upcoming bucket at once.
+
+Searches are stored interned (each distinct one once, buckets hold ids),
+up to a fixed number of distinct searches.
+*/
+
+#ifndef LDAPAUTH_PREWARM_H
+#define LDAPAUTH_PREWARM_H
+
+#include <stdint.h>
+
+#include <string>
+
+struct prewarm_search
+{
+  std::string host;
+  int port;
+  std::string base;
+  std::string filter;
+};
+
+// Starts a replay of search as binddn. Returns false if that cannot be
+// done right now; the search is then retried later. Runs on the prewarm
+// thread.
+typedef bool (*prewarm_cb)(const prewarm_search &search, const std::string &binddn,
+                           const std::string &password);
+
+// Any thread. Does nothing unless pre-warming is configured and binddn
+// is its service identity.
+void PrewarmRecord(const char *host, int port, const char *binddn, const char *base, const char *filter);
+
+// Starts (or reconfigures) the prewarm thread. Non-positive arguments
+// keep the current setting; a new bind DN forgets what was recorded.
+void PrewarmConfigure(prewarm_cb warm, const char *binddn, const char *password,
+                      int lead_ms, int rate, int concurrency);
+
+// Stops replaying and recording, and forgets what was recorded.
+void PrewarmDisable();
+
+// Queues the upcoming bucket's searches now. Returns how many.
+int PrewarmNow();
+
+// A replay started by the warm callback has finished.
+void PrewarmDone();
+
+struct prewarm_stats
+{
+  bool enabled;
+  uint64_t searches;    // distinct searches recorded
+  uint64_t queued;      // replays waiting for the throttle
+  uint64_t warmed;      // replays started
+  int64_t last_run;     // unix ms a bucket was last replayed, 0 if never
+};
+
+void PrewarmStats(prewarm_stats *stats);
+
+#endif
@@ -0,0 +1,228 @@
+// Bounded lock-free multi-producer/multi-consumer queue, and a parking
+// primitive for threads waiting on one.
+
+/*
+mpmc_queue is the bounded ring from Dmitry Vyukov's design: each cell
+carries a sequence number telling producers and consumers whose turn it
+is, so pushes and pops are one CAS on the shared position plus a release
+store on the cell. A full queue fails the push rather than growing.
+
+parking_lot is an eventcount for consumers that find the queue empty:
+
+    for (;;) {
+      if (queue.TryPop(&item)) break;
+      int key = lot.Prepare();
+      if (queue.TryPop(&item)) { lot.Cancel(); break; }
+      lot.Wait(key);
+    }
+
+Producers call lot.Notify() after every successful push; it costs one
+load when nobody is parked, and skips the wake syscall while every
+parked thread already has a wakeup pending. On Linux parking is a
+futex, elsewhere a mutex and condition variable.
+*/
+
+#ifndef LDAPAUTH_QUEUE_H
+#define LDAPAUTH_QUEUE_H
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#else
+#include <pthread.h>
+#endif
+
+#define QUEUE_CACHE_LINE 64
+
+template <typename T>
+class mpmc_queue
+{
+ public:
+  // Capacity is rounded up to a power of two.
+  explicit mpmc_queue(size_t capacity)
+  {
+    size_t size = 2;
+    while (size < capacity) size <<= 1;
+
+    mask_ = size - 1;
+    cells_ = new cell[size];
+    for (size_t idx = 0; idx < size; idx++)
+    {
+      cells_[idx].sequence = idx;
+    }
+    enqueue_pos_ = 0;
+    dequeue_pos_ = 0;
+  }
+
+  ~mpmc_queue()
+  {
+    delete[] cells_;
+  }
+
+  size_t Capacity() const
+  {
+    return mask_ + 1;
+  }
+
+  // Returns false if the queue is full.
+  bool TryPush(const T &value)
+  {
+    size_t pos = __atomic_load_n(&enqueue_pos_, __ATOMIC_RELAXED);
+    for (;;)
+    {
+      cell *c = &cells_[pos & mask_];
+      size_t seq = __atomic_load_n(&c->sequence, __ATOMIC_ACQUIRE);
+      long diff = (long)seq - (long)pos;
+      if (diff == 0) {
+        if (__atomic_compare_exchange_n(&enqueue_pos_, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+          c->value = value;
+          __atomic_store_n(&c->sequence, pos + 1, __ATOMIC_RELEASE);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = __atomic_load_n(&enqueue_pos_, __ATOMIC_RELAXED);
+      }
+    }
+  }
+
+  // Returns false if the queue is empty.
+  bool TryPop(T *value)
+  {
+    size_t pos = __atomic_load_n(&dequeue_pos_, __ATOMIC_RELAXED);
+    for (;;)
+    {
+      cell *c = &cells_[pos & mask_];
+      size_t seq = __atomic_load_n(&c->sequence, __ATOMIC_ACQUIRE);
+      long diff = (long)seq - (long)(pos + 1);
+      if (diff == 0) {
+        if (__atomic_compare_exchange_n(&dequeue_pos_, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+          *value = c->value;
+          __atomic_store_n(&c->sequence, pos + mask_ + 1, __ATOMIC_RELEASE);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = __atomic_load_n(&dequeue_pos_, __ATOMIC_RELAXED);
+      }
+    }
+  }
+
+ private:
+  struct cell
+  {
+    size_t sequence;
+    T value;
+  };
+
+  char pad0_[QUEUE_CACHE_LINE];
+  cell *cells_;
+  size_t mask_;
+  char pad1_[QUEUE_CACHE_LINE];
+  size_t enqueue_pos_;
+  char pad2_[QUEUE_CACHE_LINE];
+  size_t dequeue_pos_;
+  char pad3_[QUEUE_CACHE_LINE];
+
+  mpmc_queue(const mpmc_queue&);
+  void operator=(const mpmc_queue&);
+};
+
+class parking_lot
+{
+ public:
+  parking_lot() : epoch_(0), state_(0)
+  {
+#ifndef __linux__
+    pthread_mutex_init(&lock_, NULL);
+    pthread_cond_init(&cond_, NULL);
+#endif
+  }
+
+  // Announces intent to park; returns the key to pass to Wait().
+  int Prepare()
+  {
+    __atomic_fetch_add(&state_, WAITER, __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&epoch_, __ATOMIC_SEQ_CST);
+  }
+
+  // Backs out after Prepare() when the re-check found work.
+  void Cancel()
+  {
+    Leave();
+  }
+
+  // Sleeps unless a Notify() happened since Prepare() returned key.
+  void Wait(int key)
+  {
+#ifdef __linux__
+    syscall(SYS_futex, &epoch_, FUTEX_WAIT_PRIVATE, key, NULL, NULL, 0);
+#else
+    pthread_mutex_lock(&lock_);
+    while (__atomic_load_n(&epoch_, __ATOMIC_SEQ_CST) == key)
+    {
+      pthread_cond_wait(&cond_, &lock_);
+    }
+    pthread_mutex_unlock(&lock_);
+#endif
+    Leave();
+  }
+
+  // Wakes one parked thread, if any. Free when nobody is parked, or
+  // when every parked thread already has a wakeup on its way.
+  void Notify()
+  {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    uint64_t state = __atomic_load_n(&state_, __ATOMIC_RELAXED);
+    do {
+      if (Waiters(state) <= Signals(state)) return;
+    } while (!__atomic_compare_exchange_n(&state_, &state, state + 1, true, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+
+    __atomic_fetch_add(&epoch_, 1, __ATOMIC_SEQ_CST);
+#ifdef __linux__
+    syscall(SYS_futex, &epoch_, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#else
+    pthread_mutex_lock(&lock_);
+    pthread_cond_signal(&cond_);
+    pthread_mutex_unlock(&lock_);
+#endif
+  }
+
+ private:
+  // state_ packs registered waiters (high half) and wakeups issued to
+  // them that they have not yet consumed (low half).
+  static const uint64_t WAITER = (uint64_t)1 << 32;
+
+  static uint32_t Waiters(uint64_t state) { return (uint32_t)(state >> 32); }
+  static uint32_t Signals(uint64_t state) { return (uint32_t)state; }
+
+  // Deregisters, consuming a pending wakeup if there is one.
+  void Leave()
+  {
+    uint64_t state = __atomic_load_n(&state_, __ATOMIC_RELAXED);
+    uint64_t next;
+    do {
+      uint32_t waiters = Waiters(state) - 1;
+      uint32_t signals = Signals(state);
+      if (signals > 0) signals--;
+      if (signals > waiters) signals = waiters;
+      next = ((uint64_t)waiters << 32) | signals;
+    } while (!__atomic_compare_exchange_n(&state_, &state, next, true, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+  }
+
+  int epoch_;
+  uint64_t state_;
+#ifndef __linux__
+  pthread_mutex_t lock_;
+  pthread_cond_t cond_;
+#endif
+};
+
+#endif
@@ -0,0 +1,830 @@
+// In-process read replica. See replica.h.
+
+#include "replica.h"
+#include "servers.h"
+#include "filter.h"
+#include "strcase.h"
+#include "ldif.h"
+#include "cache.h"
+#include "hash.h"
+
+#include <ldap.h>
+#include <uv.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include <map>
+#include <algorithm>
+#include <iterator>
+
+#define NS_PER_MS 1000000ULL
+
+// Poll a little further back than the last poll, for clock skew between
+// us and the directory.
+#define POLL_OVERLAP_MS 300000
+
+struct index_key
+{
+  uint64_t hash;
+  uint32_t id;
+};
+
+struct replica_data
+{
+  // What the replica was loaded as, to tell which searches it may answer.
+  std::string servers;                        // ServersKey()
+  std::string binddn;
+  std::string password;                       // HashKeyed()
+  std::string base;                           // lowercased
+  std::vector<std::string> indexes;           // lowercased
+
+  std::string entries;                        // encoded, one after another
+  std::vector<uint64_t> offsets;              // by id
+  std::vector<bool> superseded;               // by id: polled again since
+  std::vector<index_key> keys;                // sorted, ids loaded in full
+  std::multimap<uint64_t, uint32_t> recent;   // ids polled since the load
+  uint64_t live;
+};
+
+// A filter term, parsed from the canonical form.
+struct filter_term
+{
+  char kind;                  // & | ! = (equality), * (presence), ? (anything else)
+  std::string attr;           // lowercased
+  std::string value;          // unescaped
+  std::vector<filter_term> operands;
+};
+
+static uv_once_t replica_once = UV_ONCE_INIT;
+static uv_mutex_t replica_lock;      // config and thread state
+static uv_cond_t replica_cond;
+static uv_rwlock_t data_lock;        // the replica
+
+static replica_data *current_data = NULL;
+
+static replica_config config;
+static bool enabled = false;
+static bool reload = false;          // config changed since the last load
+static bool refresher_running = false;
+static uv_thread_t refresher;
+
+static uint64_t answered = 0;
+static uint64_t fallbacks = 0;
+static uint64_t refreshes = 0;
+static uint64_t polls = 0;
+static uint64_t seeded = 0;
+static int64_t last_refresh = 0;
+static int last_error = LDAP_SUCCESS;
+
+static void InitReplica()
+{
+  uv_mutex_init(&replica_lock);
+  uv_cond_init(&replica_cond);
+  uv_rwlock_init(&data_lock);
+}
+
+static int64_t WallClockMs()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static void FormatGeneralizedTime(int64_t ms, char *buffer, size_t size)
+{
+  time_t seconds = ms / 1000;
+  struct tm tm;
+  gmtime_r(&seconds, &tm);
+  strftime(buffer, size, "%Y%m%d%H%M%SZ", &tm);
+}
+
+// attr=value, both lowercased. The DN goes in with an empty attr.
+static uint64_t IndexKey(const std::string &attr, const std::string &value)
+{
+  uint64_t hash = StrHashFold(HASH_START, attr.data(), attr.size());
+  hash = HashUpdate(hash, "=", 1);
+  return HashFinish(StrHashFold(hash, value.data(), value.size()));
+}
+
+// Whether dn is base or lies below it. Both lowercased.
+static bool WithinBase(const std::string &dn, const std::string &base)
+{
+  if (base.empty()) return true;
+  if (dn.size() < base.size() || dn.compare(dn.size() - base.size(), base.size(), base) != 0) return false;
+  return dn.size() == base.size() || dn[dn.size() - base.size() - 1] == ',';
+}
+
+static std::vector<std::string> SplitSpaces(const std::string &text)
+{
+  std::vector<std::string> words;
+  size_t start = 0;
+  while (start < text.size())
+  {
+    size_t end = text.find(' ', start);
+    if (end == std::string::npos) end = text.size();
+    if (end > start) words.push_back(text.substr(start, end - start));
+    start = end + 1;
+  }
+  return words;
+}
+
+// Entries are encoded with the cache's helpers (cache.h): the DN, the
+// attribute count, then each attribute's name, value count and values.
+static std::string EncodeEntry(LDAP *ldap, LDAPMessage *entry)
+{
+  std::string encoded;
+  char *dn = ldap_get_dn(ldap, entry);
+  CacheAppend(&encoded, dn != NULL ? dn : "", dn != NULL ? strlen(dn) : 0);
+  ldap_memfree(dn);
+
+  std::string attributes;
+  uint32_t count = 0;
+  BerElement *ber = NULL;
+  for (char *attr = ldap_first_attribute(ldap, entry, &ber); attr != NULL; attr = ldap_next_attribute(ldap, entry, ber))
+  {
+    // With their lengths: binary values, objectSid say, may hold NULs.
+    struct berval **values = ldap_get_values_len(ldap, entry, attr);
+    uint32_t value_count = ldap_count_values_len(values);
+    CacheAppend(&attributes, attr, strlen(attr));
+    CacheAppend(&attributes, value_count);
+    for (uint32_t idx = 0; idx < value_count; idx++)
+    {
+      CacheAppend(&attributes, values[idx]->bv_val, values[idx]->bv_len);
+    }
+    ldap_value_free_len(values);
+    ldap_memfree(attr);
+    count++;
+  }
+  ber_free(ber, 0);
+
+  CacheAppend(&encoded, count);
+  return encoded + attributes;
+}
+
+static bool DecodeEntry(const std::string &buffer, size_t offset, replica_entry *entry)
+{
+  uint32_t count, value_count;
+  if (!CacheRead(buffer, &offset, &entry->dn) || !CacheRead(buffer, &offset, &count)) return false;
+  entry->attributes.resize(count);
+  for (uint32_t attr = 0; attr < count; attr++)
+  {
+    std::pair<std::string, std::vector<std::string> > &values = entry->attributes[attr];
+    if (!CacheRead(buffer, &offset, &values.first) || !CacheRead(buffer, &offset, &value_count)) return false;
+    values.second.resize(value_count);
+    for (uint32_t idx = 0; idx < value_count; idx++)
+    {
+      if (!CacheRead(buffer, &offset, &values.second[idx])) return false;
+    }
+  }
+  return true;
+}
+
+static bool KeyBefore(const index_key &a, const index_key &b)
+{
+  return a.hash < b.hash || (a.hash == b.hash && a.id < b.id);
+}
+
+// The live ids indexed under hash, sorted.
+static void Lookup(replica_data *data, uint64_t hash, std::vector<uint32_t> *ids)
+{
+  ids->clear();
+  index_key probe;
+  probe.hash = hash;
+  probe.id = 0;
+  for (std::vector<index_key>::iterator key = std::lower_bound(data->keys.begin(), data->keys.end(), probe, KeyBefore);
+       key != data->keys.end() && key->hash == hash; ++key)
+  {
+    if (!data->superseded[key->id]) ids->push_back(key->id);
+  }
+  std::pair<std::multimap<uint64_t, uint32_t>::iterator, std::multimap<uint64_t, uint32_t>::iterator> range = data->recent.equal_range(hash);
+  for (std::multimap<uint64_t, uint32_t>::iterator key = range.first; key != range.second; ++key)
+  {
+    if (!data->superseded[key->second]) ids->push_back(key->second);
+  }
+  std::sort(ids->begin(), ids->end());
+  ids->erase(std::unique(ids->begin(), ids->end()), ids->end());
+}
+
+// Appends an encoded entry and indexes it, superseding the copy polled
+// or loaded before, if any.
+static void AddEntry(replica_data *data, const std::string &encoded, bool polled)
+{
+  replica_entry entry;
+  if (!DecodeEntry(encoded, 0, &entry)) return;
+
+  uint32_t id = data->offsets.size();
+  std::string dn = StrLower(entry.dn);
+  uint64_t dn_key = IndexKey("", dn);
+  if (polled) {
+    std::vector<uint32_t> previous;
+    Lookup(data, dn_key, &previous);
+    for (size_t idx = 0; idx < previous.size(); idx++)
+    {
+      replica_entry old;
+      if (DecodeEntry(data->entries, data->offsets[previous[idx]], &old) && StrLower(old.dn) == dn) {
+        data->superseded[previous[idx]] = true;
+        data->live--;
+      }
+    }
+  }
+
+  data->offsets.push_back(data->entries.size());
+  data->superseded.push_back(false);
+  data->entries.append(encoded);
+  data->live++;
+
+  std::vector<uint64_t> hashes;
+  hashes.push_back(dn_key);
+  for (size_t attr = 0; attr < entry.attributes.size(); attr++)
+  {
+    std::string name = StrLower(entry.attributes[attr].first);
+    if (std::find(data->indexes.begin(), data->indexes.end(), name) == data->indexes.end()) continue;
+    for (size_t idx = 0; idx < entry.attributes[attr].second.size(); idx++)
+    {
+      hashes.push_back(IndexKey(name, entry.attributes[attr].second[idx]));
+    }
+  }
+
+  for (size_t idx = 0; idx < hashes.size(); idx++)
+  {
+    if (polled) {
+      data->recent.insert(std::pair<uint64_t, uint32_t>(hashes[idx], id));
+    } else {
+      index_key key;
+      key.hash = hashes[idx];
+      key.id = id;
+      data->keys.push_back(key);
+    }
+  }
+}
+
+static int EncodePage(LDAP *ldap, LDAPMessage *page, void *arg)
+{
+  std::vector<std::string> *entries = (std::vector<std::string>*)arg;
+  for (LDAPMessage *entry = ldap_first_entry(ldap, page); entry != NULL; entry = ldap_next_entry(ldap, entry))
+  {
+    entries->push_back(EncodeEntry(ldap, entry));
+  }
+  return LDAP_SUCCESS;
+}
+
+// Reads every entry matching filter, with all its attributes, a page at
+// a time.
+static int Load(const replica_config &settings, const std::string &filter, std::vector<std::string> *entries)
+{
+  int rc;
+  LDAP *ldap = ServersConnect(settings.host.c_str(), settings.port, settings.binddn.c_str(),
+                              settings.password.c_str(), &rc);
+  if (ldap == NULL) return rc;
+
+  rc = ServersPagedSearch(ldap, settings.base.c_str(), filter.c_str(), NULL, EncodePage, entries);
+  ldap_unbind_ext(ldap, NULL, NULL);
+  return rc;
+}
+
+static replica_data *BuildReplica(const replica_config &settings, std::vector<std::string> *entries)
+{
+  replica_data *built = new replica_data;
+  built->servers = ServersKey(settings.host.c_str(), settings.port);
+  built->binddn = settings.binddn;
+  built->password = HashKeyed(settings.password);
+  built->base = StrLower(settings.base);
+  std::vector<std::string> indexes = SplitSpaces(settings.indexes);
+  for (size_t idx = 0; idx < indexes.size(); idx++) built->indexes.push_back(StrLower(indexes[idx]));
+  built->live = 0;
+
+  size_t bytes = 0;
+  for (size_t idx = 0; idx < entries->size(); idx++) bytes += (*entries)[idx].size();
+  built->entries.reserve(bytes);
+
+  for (size_t idx = 0; idx < entries->size(); idx++)
+  {
+    AddEntry(built, (*entries)[idx], false);
+    std::string().swap((*entries)[idx]);
+  }
+  std::sort(built->keys.begin(), built->keys.end(), KeyBefore);
+  return built;
+}
+
+static int Seed(const replica_config &settings, std::vector<std::string> *entries, int64_t *exported);
+
+static void RefresherThread(void *arg)
+{
+  int64_t next_refresh = 0, last_poll = 0;
+  std::string seeded_from;
+
+  uv_mutex_lock(&replica_lock);
+  while (enabled)
+  {
+    replica_config settings = config;
+    bool full = reload || WallClockMs() >= next_refresh;
+    reload = false;
+    uv_mutex_unlock(&replica_lock);
+
+    int64_t started = WallClockMs();
+    std::vector<std::string> entries;
+    int rc;
+    if (full) {
+      // Once per configured export: from the file, and changes since.
+      int64_t exported = started;
+      bool from_ldif = !settings.ldif.empty() && settings.ldif != seeded_from;
+      rc = from_ldif ? Seed(settings, &entries, &exported) : Load(settings, settings.filter, &entries);
+      if (from_ldif) seeded_from = settings.ldif;
+      if (rc == LDAP_SUCCESS) {
+        replica_data *built = BuildReplica(settings, &entries);
+        // Not if disabled meanwhile: ReplicaDisable has dropped the
+        // replica already and would not again.
+        uv_mutex_lock(&replica_lock);
+        uv_rwlock_wrlock(&data_lock);
+        if (enabled) std::swap(current_data, built);
+        uv_rwlock_wrunlock(&data_lock);
+        uv_mutex_unlock(&replica_lock);
+        delete built;
+        next_refresh = started + settings.refresh_interval_ms;
+        last_poll = exported;
+      }
+    } else {
+      char since[32];
+      FormatGeneralizedTime(last_poll - POLL_OVERLAP_MS, since, sizeof(since));
+      std::string filter = "(&" + settings.filter + "(modifyTimestamp>=" + since + "))";
+      rc = Load(settings, filter, &entries);
+      if (rc == LDAP_SUCCESS) {
+        uv_rwlock_wrlock(&data_lock);
+        for (size_t idx = 0; current_data != NULL && idx < entries.size(); idx++)
+        {
+          AddEntry(current_data, entries[idx], true);
+        }
+        uv_rwlock_wrunlock(&data_lock);
+        last_poll = started;
+      }
+    }
+
+    uv_mutex_lock(&replica_lock);
+    last_error = rc;
+    if (rc == LDAP_SUCCESS) {
+      if (full) {
+        refreshes++;
+        last_refresh = started;
+      } else {
+        polls++;
+      }
+    }
+
+    if (enabled && !reload) {
+      // Failed loads are retried at the poll interval, too.
+      int64_t wait = settings.refresh_interval_ms;
+      if (settings.poll_interval_ms > 0 && settings.poll_interval_ms < wait) wait = settings.poll_interval_ms;
+      if (rc == LDAP_SUCCESS && next_refresh - WallClockMs() < wait) wait = next_refresh - WallClockMs();
+      if (wait > 0) uv_cond_timedwait(&replica_cond, &replica_lock, wait * NS_PER_MS);
+    }
+  }
+  refresher_running = false;
+  uv_mutex_unlock(&replica_lock);
+}
+
+void ReplicaDefaults(replica_config *defaults)
+{
+  defaults->port = 389;
+  defaults->filter = "(|(objectClass=person)(objectClass=group))";
+  defaults->indexes = "sAMAccountName mail userPrincipalName uid distinguishedName";
+  defaults->refresh_interval_ms = 3600000;
+  defaults->poll_interval_ms = 30000;
+}
+
+void ReplicaConfigure(const replica_config &settings)
+{
+  uv_once(&replica_once, InitReplica);
+
+  uv_mutex_lock(&replica_lock);
+  config = settings;
+  enabled = true;
+  reload = true;
+  bool start = !refresher_running;
+  if (start) refresher_running = true;
+  uv_cond_signal(&replica_cond);
+  uv_mutex_unlock(&replica_lock);
+
+  if (start) {
+    uv_thread_create(&refresher, RefresherThread, NULL);
+  }
+}
+
+void ReplicaDisable()
+{
+  uv_once(&replica_once, InitReplica);
+
+  uv_mutex_lock(&replica_lock);
+  enabled = false;
+  uv_cond_signal(&replica_cond);
+  uv_mutex_unlock(&replica_lock);
+
+  uv_rwlock_wrlock(&data_lock);
+  delete current_data;
+  current_data = NULL;
+  uv_rwlock_wrunlock(&data_lock);
+}
+
+static int HexDigit(char c)
+{
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  return -1;
+}
+
+// Parses one term of a canonical filter: no whitespace, lowercase names,
+// escapes as \xx.
+static bool ParseTerm(const char **at, filter_term *term)
+{
+  if (**at != '(') return false;
+  (*at)++;
+
+  term->kind = **at;
+  if (term->kind == '&' || term->kind == '|' || term->kind == '!') {
+    (*at)++;
+    while (**at == '(')
+    {
+      term->operands.push_back(filter_term());
+      if (!ParseTerm(at, &term->operands.back())) return false;
+    }
+  } else {
+    const char *name = *at;
+    while (**at != '\0' && strchr("=~<>:", **at) == NULL) (*at)++;
+    term->attr.assign(name, *at - name);
+    term->kind = **at == '=' ? '=' : '?';
+
+    // Values hold no unescaped parentheses.
+    const char *value = *at + 1;
+    while (**at != '\0' && **at != ')') (*at)++;
+    if (term->kind == '=') {
+      std::string raw(value, *at - value);
+      if (raw == "*") {
+        term->kind = '*';
+      } else if (raw.find('*') != std::string::npos) {
+        term->kind = '?';     // substrings
+      } else {
+        for (size_t idx = 0; idx < raw.size(); idx++)
+        {
+          if (raw[idx] == '\\' && idx + 2 < raw.size() && HexDigit(raw[idx + 1]) >= 0 && HexDigit(raw[idx + 2]) >= 0) {
+            term->value.push_back((char)(HexDigit(raw[idx + 1]) << 4 | HexDigit(raw[idx + 2])));
+            idx += 2;
+          } else {
+            term->value.push_back(raw[idx]);
+          }
+        }
+      }
+    }
+  }
+
+  if (**at != ')') return false;
+  (*at)++;
+  return true;
+}
+
+static bool Supported(const filter_term &term)
+{
+  if (term.kind == '?') return false;
+  for (size_t idx = 0; idx < term.operands.size(); idx++)
+  {
+    if (!Supported(term.operands[idx])) return false;
+  }
+  return true;
+}
+
+// The ids the indexes say might match term, sorted; false if the indexes
+// cannot narrow it down.
+static bool Candidates(replica_data *data, const filter_term &term, std::vector<uint32_t> *ids)
+{
+  if (term.kind == '=') {
+    if (std::find(data->indexes.begin(), data->indexes.end(), term.attr) == data->indexes.end()) return false;
+    Lookup(data, IndexKey(term.attr, term.value), ids);
+    return true;
+  }
+
+  if (term.kind == '|') {
+    ids->clear();
+    for (size_t idx = 0; idx < term.operands.size(); idx++)
+    {
+      std::vector<uint32_t> operand, merged;
+      if (!Candidates(data, term.operands[idx], &operand)) return false;
+      std::set_union(ids->begin(), ids->end(), operand.begin(), operand.end(), std::back_inserter(merged));
+      ids->swap(merged);
+    }
+    return true;
+  }
+
+  if (term.kind == '&') {
+    bool narrowed = false;
+    for (size_t idx = 0; idx < term.operands.size(); idx++)
+    {
+      std::vector<uint32_t> operand, common;
+      if (!Candidates(data, term.operands[idx], &operand)) continue;
+      if (narrowed) {
+        std::set_intersection(ids->begin(), ids->end(), operand.begin(), operand.end(), std::back_inserter(common));
+        ids->swap(common);
+      } else {
+        ids->swap(operand);
+        narrowed = true;
+      }
+    }
+    return narrowed;
+  }
+
+  return false;
+}
+
+static bool Matches(const replica_entry &entry, const filter_term &term)
+{
+  switch (term.kind)
+  {
+    case '&':
+      for (size_t idx = 0; idx < term.operands.size(); idx++)
+      {
+        if (!Matches(entry, term.operands[idx])) return false;
+      }
+      return true;
+    case '|':
+      for (size_t idx = 0; idx < term.operands.size(); idx++)
+      {
+        if (Matches(entry, term.operands[idx])) return true;
+      }
+      return false;
+    case '!':
+      return !Matches(entry, term.operands[0]);
+    case '*':
+      return ReplicaValues(entry, term.attr.c_str()) != NULL;
+    case '=': {
+      const std::vector<std::string> *values = ReplicaValues(entry, term.attr.c_str());
+      for (size_t idx = 0; values != NULL && idx < values->size(); idx++)
+      {
+        if (StrEqualFold((*values)[idx], term.value)) return true;
+      }
+      return false;
+    }
+  }
+  return false;
+}
+
+static std::string EncodeEntry(const replica_entry &entry)
+{
+  std::string encoded;
+  CacheAppend(&encoded, entry.dn);
+  CacheAppend(&encoded, (uint32_t)entry.attributes.size());
+  for (size_t attr = 0; attr < entry.attributes.size(); attr++)
+  {
+    CacheAppend(&encoded, entry.attributes[attr].first);
+    CacheAppend(&encoded, (uint32_t)entry.attributes[attr].second.size());
+    for (size_t idx = 0; idx < entry.attributes[attr].second.size(); idx++)
+    {
+      CacheAppend(&encoded, entry.attributes[attr].second[idx]);
+    }
+  }
+  return encoded;
+}
+
+static std::vector<std::string> *MutableValues(replica_entry *entry, const std::string &attr)
+{
+  for (size_t idx = 0; idx < entry->attributes.size(); idx++)
+  {
+    if (StrEqualFold(entry->attributes[idx].first, attr)) return &entry->attributes[idx].second;
+  }
+  entry->attributes.push_back(std::pair<std::string, std::vector<std::string> >(attr, std::vector<std::string>()));
+  return &entry->attributes.back().second;
+}
+
+static void RemoveValue(std::vector<std::string> *values, const std::string &value)
+{
+  for (size_t idx = 0; idx < values->size(); idx++)
+  {
+    if (StrEqualFold((*values)[idx], value)) {
+      values->erase(values->begin() + idx);
+      return;
+    }
+  }
+}
+
+static void DropEmpty(replica_entry *entry)
+{
+  for (size_t idx = entry->attributes.size(); idx-- > 0; )
+  {
+    if (entry->attributes[idx].second.empty()) entry->attributes.erase(entry->attributes.begin() + idx);
+  }
+}
+
+// Applies an LDIF modify record's body to entry.
+static void Modify(replica_entry *entry, const std::string &body)
+{
+  size_t offset = 0;
+  uint32_t count, value_count;
+  if (!CacheRead(body, &offset, &count)) return;
+  for (uint32_t mod = 0; mod < count; mod++)
+  {
+    std::string op, attr;
+    std::vector<std::string> values;
+    if (!CacheRead(body, &offset, &op) || !CacheRead(body, &offset, &attr) || !CacheRead(body, &offset, &value_count)) return;
+    values.resize(value_count);
+    for (uint32_t idx = 0; idx < value_count; idx++) CacheRead(body, &offset, &values[idx]);
+
+    std::vector<std::string> *current = MutableValues(entry, attr);
+    if (op == "replace" || (op == "delete" && values.empty())) current->clear();
+    for (size_t idx = 0; idx < values.size(); idx++)
+    {
+      if (op == "delete") RemoveValue(current, values[idx]);
+      else current->push_back(values[idx]);
+    }
+  }
+  DropEmpty(entry);
+}
+
+// Applies an LDIF modrdn record's body to entry: the new DN, and the RDN
+// attribute's values.
+static void Rename(replica_entry *entry, const std::string &body)
+{
+  size_t offset = 0;
+  std::string newrdn, deleteoldrdn, newsuperior;
+  if (!CacheRead(body, &offset, &newrdn) || !CacheRead(body, &offset, &deleteoldrdn) || !CacheRead(body, &offset, &newsuperior)) return;
+
+  size_t comma = entry->dn.find(',');
+  std::string oldrdn = entry->dn.substr(0, comma);
+  std::string parent = comma != std::string::npos ? entry->dn.substr(comma + 1) : "";
+  if (!newsuperior.empty()) parent = newsuperior;
+  entry->dn = parent.empty() ? newrdn : newrdn + "," + parent;
+
+  size_t equals = oldrdn.find('=');
+  if (deleteoldrdn == "1" && equals != std::string::npos) {
+    RemoveValue(MutableValues(entry, oldrdn.substr(0, equals)), oldrdn.substr(equals + 1));
+  }
+  equals = newrdn.find('=');
+  if (equals != std::string::npos) {
+    std::vector<std::string> *values = MutableValues(entry, newrdn.substr(0, equals));
+    RemoveValue(values, newrdn.substr(equals + 1));
+    values->push_back(newrdn.substr(equals + 1));
+  }
+  DropEmpty(entry);
+}
+
+// The entries of an LDIF export (ldif.h), its change records applied in
+// order, those outside base or not matching filter dropped. The filter
+// is only checked if the replica could evaluate it; otherwise every
+// entry under base is kept.
+static int Seed(const replica_config &settings, std::vector<std::string> *entries, int64_t *exported)
+{
+  ldif_result ldif;
+  std::string error;
+  if (!LdifRead(settings.ldif.c_str(), 0, &ldif, &error)) return LDAP_LOCAL_ERROR;
+
+  std::map<std::string, size_t> positions;    // lowercased DN
+  for (size_t idx = 0; idx < ldif.records.size(); idx++)
+  {
+    ldif_record &record = ldif.records[idx];
+    std::string dn = StrLower(record.dn);
+    std::map<std::string, size_t>::iterator position = positions.find(dn);
+
+    if (record.change == LDIF_ADD) {
+      std::string encoded;
+      CacheAppend(&encoded, record.dn);
+      encoded.append(record.body);
+      if (position != positions.end()) {
+        (*entries)[position->second].swap(encoded);
+      } else {
+        positions[dn] = entries->size();
+        entries->push_back(std::string());
+        entries->back().swap(encoded);
+      }
+    } else if (position != positions.end()) {
+      std::string &encoded = (*entries)[position->second];
+      replica_entry entry;
+      if (record.change == LDIF_DELETE || !DecodeEntry(encoded, 0, &entry)) {
+        std::string().swap(encoded);
+        positions.erase(position);
+        continue;
+      }
+      if (record.change == LDIF_MODIFY) {
+        Modify(&entry, record.body);
+      } else {
+        size_t at = position->second;
+        Rename(&entry, record.body);
+        positions.erase(position);
+        positions[StrLower(entry.dn)] = at;
+      }
+      encoded = EncodeEntry(entry);
+    }
+    std::string().swap(record.body);
+  }
+
+  std::string base = StrLower(settings.base), canonical;
+  filter_term term;
+  const char *at = NULL;
+  bool filtered = FilterCanonical(settings.filter.c_str(), &canonical)
+      && (at = canonical.c_str(), ParseTerm(&at, &term)) && *at == '\0' && Supported(term);
+  size_t kept = 0;
+  for (size_t idx = 0; idx < entries->size(); idx++)
+  {
+    replica_entry entry;
+    if ((*entries)[idx].empty() || !DecodeEntry((*entries)[idx], 0, &entry)) continue;
+    if (!WithinBase(StrLower(entry.dn), base) || (filtered && !Matches(entry, term))) continue;
+    if (kept != idx) (*entries)[kept].swap((*entries)[idx]);
+    kept++;
+  }
+  entries->resize(kept);
+
+  __atomic_store_n(&seeded, (uint64_t)kept, __ATOMIC_RELAXED);
+  *exported = ldif.modified;
+  return LDAP_SUCCESS;
+}
+
+// Compares two HashKeyed() digests in time independent of where they
+// differ, so the replica's password cannot be guessed a byte at a time.
+static bool SameDigest(const std::string &left, const std::string &right)
+{
+  if (left.size() != right.size()) return false;
+  unsigned char diff = 0;
+  for (size_t idx = 0; idx < left.size(); idx++)
+  {
+    diff |= (unsigned char)(left[idx] ^ right[idx]);
+  }
+  return diff == 0;
+}
+
+static bool Answer(replica_data *data, const char *host, int port, const char *binddn, const char *password,
+                   const char *base, const char *filter, replica_entry *found)
+{
+  std::string search_base = StrLower(base);
+  bool same_password = SameDigest(HashKeyed(password, strlen(password)), data->password);
+  if (data->binddn != binddn || !same_password || !WithinBase(search_base, data->base)
+      || data->servers != ServersKey(host, port)) {
+    return false;
+  }
+
+  std::string canonical;
+  if (!FilterCanonical(filter, &canonical)) return false;
+  filter_term term;
+  const char *at = canonical.c_str();
+  if (!ParseTerm(&at, &term) || *at != '\0' || !Supported(term)) return false;
+
+  std::vector<uint32_t> ids;
+  if (!Candidates(data, term, &ids)) return false;
+  for (size_t idx = 0; idx < ids.size(); idx++)
+  {
+    replica_entry entry;
+    if (!DecodeEntry(data->entries, data->offsets[ids[idx]], &entry)) continue;
+    if (WithinBase(StrLower(entry.dn), search_base) && Matches(entry, term)) {
+      *found = entry;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool ReplicaSearch(const char *host, int port, const char *binddn, const char *password,
+                   const char *base, const char *filter, replica_entry *found)
+{
+  uv_once(&replica_once, InitReplica);
+
+  bool local = false;
+  uv_rwlock_rdlock(&data_lock);
+  if (current_data != NULL) {
+    local = Answer(current_data, host, port, binddn, password, base, filter, found);
+    __atomic_fetch_add(local ? &answered : &fallbacks, 1, __ATOMIC_RELAXED);
+  }
+  uv_rwlock_rdunlock(&data_lock);
+  return local;
+}
+
+const std::vector<std::string> *ReplicaValues(const replica_entry &entry, const char *attr)
+{
+  size_t length = strlen(attr);
+  for (size_t idx = 0; idx < entry.attributes.size(); idx++)
+  {
+    const std::string &name = entry.attributes[idx].first;
+    if (name.size() == length && StrEqualFold(name.data(), attr, length)) return &entry.attributes[idx].second;
+  }
+  return NULL;
+}
+
+void ReplicaStats(replica_stats *stats)
+{
+  uv_once(&replica_once, InitReplica);
+
+  uv_mutex_lock(&replica_lock);
+  stats->enabled = enabled;
+  stats->refreshes = refreshes;
+  stats->polls = polls;
+  stats->seeded = __atomic_load_n(&seeded, __ATOMIC_RELAXED);
+  stats->last_refresh = last_refresh;
+  stats->last_error = last_error;
+  uv_mutex_unlock(&replica_lock);
+
+  stats->answered = __atomic_load_n(&answered, __ATOMIC_RELAXED);
+  stats->fallbacks = __atomic_load_n(&fallbacks, __ATOMIC_RELAXED);
+
+  uv_rwlock_rdlock(&data_lock);
+  stats->entries = current_data != NULL ? current_data->live : 0;
+  stats->bytes = current_data != NULL
+      ? current_data->entries.size() + current_data->keys.size() * sizeof(index_key)
+        + current_data->offsets.size() * sizeof(uint64_t)
+      : 0;
+  uv_rwlock_rdunlock(&data_lock);
+}
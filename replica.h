@@ -0,0 +1,100 @@
+// In-process read replica of a subtree, answering simple searches locally.
+
+/*
+Most searches look a user up by sAMAccountName, mail or userPrincipalName:
+for those the directory is a slow key-value store. With configure({
+replica: { ... } }), a background thread reads every entry under base
+matching filter with a paged search, and keeps the lot in memory, encoded
+one after another in a single buffer. Each entry is indexed under its DN
+and the values of the configured index attributes, lowercased, as a
+sorted array of 64-bit hashes paired with entry ids. Between full
+refreshes, a poll for entries with a newer modifyTimestamp brings changed
+entries in: each is appended and supersedes its old copy, its index keys
+going to a small overlay. Deleted entries only go at the next refresh.
+
+Loading a large subtree over the network takes a while. Given an LDIF
+export of it (ldif.h), the replica starts from the file instead, its
+change records applied in order, and the first poll asks for everything
+modified since the file was written; the first full reload comes a
+refresh interval later.
+
+ReplicaSearch() then answers a search when:
+
+  - it runs against the replica's servers, as the replica's bind DN with
+    the same password (the replica saw what that identity may see, and
+    cannot check any other password)
+  - its base lies within the replica's
+  - its filter (canonicalized, see filter.h) is made of &, |, ! and
+    equality and presence terms only, and the indexed equality terms
+    narrow it down: a & needs one, a | needs all of its operands to
+
+Candidates from the indexes are checked against the whole filter,
+values compared case-insensitively. Anything else, and a search the
+replica finds nothing for (the entry may be newer than the last poll),
+goes to the server as before.
+*/
+
+#ifndef LDAPAUTH_REPLICA_H
+#define LDAPAUTH_REPLICA_H
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+#include <utility>
+
+struct replica_config
+{
+  std::string host;             // may list several servers, see servers.h
+  int port;
+  std::string binddn;
+  std::string password;
+  std::string base;
+  std::string filter;
+  std::string indexes;          // space separated attributes
+  int refresh_interval_ms;      // full reload
+  int poll_interval_ms;         // modifyTimestamp poll, 0 to disable
+  std::string ldif;             // export to start from instead, or ""
+};
+
+struct replica_stats
+{
+  bool enabled;
+  uint64_t entries;
+  uint64_t bytes;               // encoded entries and index
+  uint64_t answered;            // searches answered locally
+  uint64_t fallbacks;           // searches sent to the server
+  uint64_t refreshes;
+  uint64_t polls;
+  uint64_t seeded;              // entries last loaded from the LDIF export
+  int64_t last_refresh;         // unix ms, 0 if never
+  int last_error;               // LDAP result code of the last load
+};
+
+// An entry as a search would have returned it.
+struct replica_entry
+{
+  std::string dn;
+  std::vector<std::pair<std::string, std::vector<std::string> > > attributes;
+};
+
+void ReplicaDefaults(replica_config *config);
+
+// Starts (or reconfigures) the refresher thread.
+void ReplicaConfigure(const replica_config &config);
+
+// Stops refreshing and drops the replica.
+void ReplicaDisable();
+
+// Answers a subtree search of base for filter, made on host:port as
+// binddn, from the replica if it can; returns false if the search should
+// go to the server. Safe from any thread.
+bool ReplicaSearch(const char *host, int port, const char *binddn, const char *password,
+                   const char *base, const char *filter, replica_entry *found);
+
+// entry's values of attr, matched case-insensitively, or NULL.
+const std::vector<std::string> *ReplicaValues(const replica_entry &entry, const char *attr);
+
+void ReplicaStats(replica_stats *stats);
+
+#endif
@@ -0,0 +1,467 @@
+// Subschema discovery and value typing. See schema.h.
+
+#include "schema.h"
+#include "strcase.h"
+
+#include <ldap.h>
+#include <uv.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <map>
+#include <vector>
+
+#define NS_PER_MS 1000000ULL
+
+// Following SUP from an attribute type to the one with its syntax.
+#define MAX_SUPERIORS 8
+
+// FILETIME of the unix epoch, in ms, and its "never" values.
+#define FILETIME_EPOCH_MS 11644473600000LL
+#define FILETIME_NEVER 0x7fffffffffffffffLL
+
+typedef std::map<std::string, schema_attr> attr_map;
+
+struct server_schema
+{
+  attr_map *attrs;              // under attrs_lock; NULL until loaded
+  uint64_t loaded;              // uv_hrtime() of the last attempt
+  bool loading;                 // under load_lock
+};
+
+static uv_once_t schema_once = UV_ONCE_INIT;
+static uv_mutex_t load_lock;
+static uv_cond_t load_cond;
+static uv_rwlock_t attrs_lock;
+static std::map<std::string, server_schema*> schemas;   // under load_lock
+
+static uint64_t loads = 0;
+static uint64_t failures = 0;
+
+static void InitSchema()
+{
+  uv_mutex_init(&load_lock);
+  uv_cond_init(&load_cond);
+  uv_rwlock_init(&attrs_lock);
+}
+
+static const char *const sid_names[] = {
+  "objectsid", "sidhistory", "securityidentifier", "ms-ds-creatorsid", "tokengroups",
+  "tokengroupsglobalanduniversal", "tokengroupsnogcacceptable", NULL
+};
+
+static const char *const guid_names[] = {
+  "objectguid", "schemaidguid", "attributesecurityguid", "msexchmailboxguid",
+  "ms-ds-consistencyguid", "msds-consistencyguid", NULL
+};
+
+static const char *const filetime_names[] = {
+  "accountexpires", "badpasswordtime", "lastlogoff", "lastlogon", "lastlogontimestamp",
+  "lockouttime", "pwdlastset", "creationtime", "msds-userpasswordexpirytimecomputed",
+  "msds-lastsuccessfulinteractivelogontime", "msds-lastfailedinteractivelogontime", NULL
+};
+
+static bool Listed(const char *const *names, const std::string &name)
+{
+  for (; *names != NULL; names++)
+  {
+    if (name == *names) return true;
+  }
+  return false;
+}
+
+static char SyntaxType(const std::string &syntax)
+{
+  static const struct { const char *oid; char type; } syntaxes[] = {
+    { "1.3.6.1.4.1.1466.115.121.1.27", SCHEMA_INTEGER },
+    { "1.2.840.113556.1.4.906", SCHEMA_INTEGER },       // AD Large Integer
+    { "1.3.6.1.4.1.1466.115.121.1.7", SCHEMA_BOOLEAN },
+    { "1.3.6.1.4.1.1466.115.121.1.24", SCHEMA_TIME },
+    { "1.3.6.1.4.1.1466.115.121.1.53", SCHEMA_UTCTIME },
+    { "1.3.6.1.4.1.1466.115.121.1.4", SCHEMA_BINARY },  // Audio
+    { "1.3.6.1.4.1.1466.115.121.1.5", SCHEMA_BINARY },
+    { "1.3.6.1.4.1.1466.115.121.1.8", SCHEMA_BINARY },  // Certificate
+    { "1.3.6.1.4.1.1466.115.121.1.9", SCHEMA_BINARY },
+    { "1.3.6.1.4.1.1466.115.121.1.10", SCHEMA_BINARY },
+    { "1.3.6.1.4.1.1466.115.121.1.23", SCHEMA_BINARY }, // Fax
+    { "1.3.6.1.4.1.1466.115.121.1.28", SCHEMA_BINARY }, // JPEG
+    { "1.3.6.1.4.1.1466.115.121.1.40", SCHEMA_BINARY }, // Octet String
+    { "1.2.840.113556.1.4.907", SCHEMA_BINARY },        // AD security descriptor
+  };
+
+  for (size_t idx = 0; idx < sizeof(syntaxes) / sizeof(syntaxes[0]); idx++)
+  {
+    if (syntax == syntaxes[idx].oid) return syntaxes[idx].type;
+  }
+  return SCHEMA_STRING;
+}
+
+// An attribute type as parsed, before its superiors are followed.
+struct parsed_type
+{
+  std::vector<std::string> names;       // lowercased
+  std::string syntax;
+  std::string superior;                 // lowercased name or OID
+  bool single;
+};
+
+static void ParseTypes(const std::vector<std::string> &definitions, attr_map *attrs)
+{
+  std::vector<parsed_type> types;
+  std::map<std::string, size_t> by_name;
+  for (size_t idx = 0; idx < definitions.size(); idx++)
+  {
+    int code;
+    const char *error;
+    LDAPAttributeType *at = ldap_str2attributetype(definitions[idx].c_str(), &code, &error, LDAP_SCHEMA_ALLOW_ALL);
+    if (at == NULL) continue;
+
+    parsed_type type;
+    for (char **name = at->at_names; name != NULL && *name != NULL; name++)
+    {
+      type.names.push_back(StrLower(*name));
+    }
+    if (at->at_syntax_oid != NULL) type.syntax = at->at_syntax_oid;
+    if (at->at_sup_oid != NULL) type.superior = StrLower(at->at_sup_oid);
+    type.single = at->at_single_value != 0;
+
+    for (size_t name = 0; name < type.names.size(); name++)
+    {
+      by_name[type.names[name]] = types.size();
+    }
+    if (at->at_oid != NULL) by_name[at->at_oid] = types.size();
+    types.push_back(type);
+    ldap_attributetype_free(at);
+  }
+
+  for (size_t idx = 0; idx < types.size(); idx++)
+  {
+    // The syntax may only be given by a superior, e.g. cn's by name's.
+    const parsed_type *with_syntax = &types[idx];
+    for (int depth = 0; with_syntax->syntax.empty() && depth < MAX_SUPERIORS; depth++)
+    {
+      std::map<std::string, size_t>::iterator superior = by_name.find(with_syntax->superior);
+      if (superior == by_name.end()) break;
+      with_syntax = &types[superior->second];
+    }
+
+    char syntax_type = SyntaxType(with_syntax->syntax);
+    for (size_t name = 0; name < types[idx].names.size(); name++)
+    {
+      const std::string &lower = types[idx].names[name];
+      schema_attr attr;
+      attr.type = syntax_type;
+      attr.single = types[idx].single;
+      if (syntax_type == SCHEMA_BINARY && Listed(sid_names, lower)) attr.type = SCHEMA_SID;
+      if (syntax_type == SCHEMA_BINARY && Listed(guid_names, lower)) attr.type = SCHEMA_GUID;
+      if (syntax_type == SCHEMA_INTEGER && Listed(filetime_names, lower)) attr.type = SCHEMA_FILETIME;
+      (*attrs)[lower] = attr;
+    }
+  }
+}
+
+// Values of attr in the first entry of a base search of dn.
+static int ReadValues(conn_pool *pool, const char *dn, const char *filter, const char *attr,
+                      std::vector<std::string> *values)
+{
+  char attr_copy[strlen(attr) + 1];
+  strcpy(attr_copy, attr);
+  char *attrs[] = { attr_copy, NULL };
+
+  LDAPMessage *result = NULL;
+  int rc = PoolSearch(pool, dn, LDAP_SCOPE_BASE, filter, attrs, &result);
+  LDAP *ldap = DecodeHandle();
+  LDAPMessage *entry = rc == LDAP_SUCCESS ? ldap_first_entry(ldap, result) : NULL;
+  if (entry != NULL) {
+    struct berval **vals = ldap_get_values_len(ldap, entry, attr);
+    int count = ldap_count_values_len(vals);
+    for (int idx = 0; idx < count; idx++)
+    {
+      values->push_back(std::string(vals[idx]->bv_val, vals[idx]->bv_len));
+    }
+    ldap_value_free_len(vals);
+  }
+  ldap_msgfree(result);
+  return rc;
+}
+
+static attr_map *Fetch(conn_pool *pool)
+{
+  std::vector<std::string> subschema, definitions;
+  if (ReadValues(pool, "", "(objectClass=*)", "subschemaSubentry", &subschema) != LDAP_SUCCESS
+      || subschema.empty()) {
+    return NULL;
+  }
+  if (ReadValues(pool, subschema[0].c_str(), "(objectClass=subschema)", "attributeTypes", &definitions) != LDAP_SUCCESS
+      || definitions.empty()) {
+    return NULL;
+  }
+
+  attr_map *attrs = new attr_map;
+  ParseTypes(definitions, attrs);
+  return attrs;
+}
+
+bool SchemaFresh(const std::string &servers)
+{
+  uv_once(&schema_once, InitSchema);
+
+  uv_mutex_lock(&load_lock);
+  std::map<std::string, server_schema*>::iterator found = schemas.find(servers);
+  server_schema *schema = found != schemas.end() ? found->second : NULL;
+  bool fresh = schema != NULL && schema->loaded != 0
+               && (schema->loading || uv_hrtime() - schema->loaded < SCHEMA_TTL_MS * NS_PER_MS);
+  uv_mutex_unlock(&load_lock);
+  return fresh;
+}
+
+void SchemaLoad(const std::string &servers, conn_pool *pool)
+{
+  uv_once(&schema_once, InitSchema);
+
+  uv_mutex_lock(&load_lock);
+  server_schema *schema = schemas[servers];
+  if (schema == NULL) {
+    schema = new server_schema;
+    schema->attrs = NULL;
+    schema->loaded = 0;
+    schema->loading = false;
+    schemas[servers] = schema;
+  }
+
+  // Nobody waits for a refresh; the first load, everybody does, so that
+  // results do not change shape once it is in.
+  while (schema->loading && schema->loaded == 0)
+  {
+    uv_cond_wait(&load_cond, &load_lock);
+  }
+  uint64_t now = uv_hrtime();
+  if (schema->loading || (schema->loaded != 0 && now - schema->loaded < SCHEMA_TTL_MS * NS_PER_MS)) {
+    uv_mutex_unlock(&load_lock);
+    return;
+  }
+  schema->loading = true;
+  uv_mutex_unlock(&load_lock);
+
+  attr_map *attrs = Fetch(pool);
+
+  if (attrs != NULL) {
+    uv_rwlock_wrlock(&attrs_lock);
+    attr_map *old = schema->attrs;
+    schema->attrs = attrs;
+    uv_rwlock_wrunlock(&attrs_lock);
+    delete old;
+  }
+
+  uv_mutex_lock(&load_lock);
+  // A failed load is retried after the TTL too, not on every search.
+  schema->loaded = now;
+  schema->loading = false;
+  loads++;
+  if (attrs == NULL) failures++;
+  uv_cond_broadcast(&load_cond);
+  uv_mutex_unlock(&load_lock);
+}
+
+schema_attr SchemaLookup(const std::string &servers, const char *attr)
+{
+  uv_once(&schema_once, InitSchema);
+
+  schema_attr found;
+  found.type = SCHEMA_STRING;
+  found.single = false;
+
+  uv_mutex_lock(&load_lock);
+  std::map<std::string, server_schema*>::iterator it = schemas.find(servers);
+  server_schema *schema = it != schemas.end() ? it->second : NULL;
+  uv_mutex_unlock(&load_lock);
+  if (schema == NULL) return found;
+
+  // Options such as ;binary or ;range=0-1499 do not change the type.
+  const char *options = strchr(attr, ';');
+  std::string name = StrLower(options != NULL ? std::string(attr, options - attr) : std::string(attr));
+
+  uv_rwlock_rdlock(&attrs_lock);
+  if (schema->attrs != NULL) {
+    attr_map::iterator type = schema->attrs->find(name);
+    if (type != schema->attrs->end()) found = type->second;
+  }
+  uv_rwlock_rdunlock(&attrs_lock);
+  return found;
+}
+
+// "YYYYMMDDHH[MM[SS]][.fff](Z|+hhmm|-hhmm)", or with a two-digit year
+// and minutes required for UTCTime. -1 if malformed.
+static int64_t ParseTime(const std::string &text, bool utc)
+{
+  const char *p = text.c_str();
+  int fields[6] = { 0, 1, 1, 0, 0, 0 };
+  int widths[6] = { utc ? 2 : 4, 2, 2, 2, 2, 2 };
+  int parsed = 0;
+  for (; parsed < 6; parsed++)
+  {
+    int value = 0;
+    for (int digit = 0; digit < widths[parsed]; digit++, p++)
+    {
+      if (*p < '0' || *p > '9') {
+        if (digit != 0) return -1;
+        goto fields_done;
+      }
+      value = value * 10 + (*p - '0');
+    }
+    fields[parsed] = value;
+  }
+fields_done:
+  if (parsed < (utc ? 5 : 4)) return -1;
+  if (utc) fields[0] += fields[0] < 50 ? 2000 : 1900;
+
+  struct tm tm;
+  memset(&tm, 0, sizeof(tm));
+  tm.tm_year = fields[0] - 1900;
+  tm.tm_mon = fields[1] - 1;
+  tm.tm_mday = fields[2];
+  tm.tm_hour = fields[3];
+  tm.tm_min = fields[4];
+  tm.tm_sec = fields[5];
+  int64_t ms = (int64_t)timegm(&tm) * 1000;
+
+  // A fraction is of the last field given.
+  if (*p == '.' || *p == ',') {
+    static const int64_t unit_ms[] = { 0, 0, 0, 3600000, 60000, 1000 };
+    int64_t unit = unit_ms[parsed - 1];
+    for (p++; *p >= '0' && *p <= '9'; p++)
+    {
+      unit /= 10;
+      ms += (*p - '0') * unit;
+    }
+  }
+
+  if (*p == '+' || *p == '-') {
+    int sign = *p == '+' ? 1 : -1;
+    int hh, mm = 0;
+    if (sscanf(p + 1, "%2d%2d", &hh, &mm) < 1) return -1;
+    ms -= sign * ((int64_t)hh * 3600000 + (int64_t)mm * 60000);
+  } else if (*p != 'Z') {
+    return -1;
+  }
+  return ms;
+}
+
+static std::string Decimal(int64_t value)
+{
+  char buffer[32];
+  sprintf(buffer, "%lld", (long long)value);
+  return buffer;
+}
+
+static std::string Sid(const unsigned char *data, size_t length)
+{
+  if (length < 8 || length != 8 + 4 * (size_t)data[1]) return std::string();
+
+  uint64_t authority = 0;
+  for (int idx = 2; idx < 8; idx++)
+  {
+    authority = authority << 8 | data[idx];
+  }
+
+  char buffer[32];
+  sprintf(buffer, "S-%u-%llu", data[0], (unsigned long long)authority);
+  std::string sid = buffer;
+  for (size_t sub = 8; sub < length; sub += 4)
+  {
+    uint32_t value = data[sub] | data[sub + 1] << 8 | data[sub + 2] << 16 | (uint32_t)data[sub + 3] << 24;
+    sprintf(buffer, "-%u", value);
+    sid += buffer;
+  }
+  return sid;
+}
+
+// The first three fields are little-endian.
+static std::string Guid(const unsigned char *data, size_t length)
+{
+  if (length != 16) return std::string();
+  char buffer[40];
+  sprintf(buffer, "%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+          data[3], data[2], data[1], data[0], data[5], data[4], data[7], data[6],
+          data[8], data[9], data[10], data[11], data[12], data[13], data[14], data[15]);
+  return buffer;
+}
+
+static std::string Base64(const unsigned char *data, size_t length)
+{
+  static const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  std::string encoded;
+  encoded.reserve((length + 2) / 3 * 4);
+  for (size_t idx = 0; idx < length; idx += 3)
+  {
+    uint32_t group = data[idx] << 16;
+    if (idx + 1 < length) group |= data[idx + 1] << 8;
+    if (idx + 2 < length) group |= data[idx + 2];
+    encoded += digits[group >> 18];
+    encoded += digits[(group >> 12) & 63];
+    encoded += idx + 1 < length ? digits[(group >> 6) & 63] : '=';
+    encoded += idx + 2 < length ? digits[group & 63] : '=';
+  }
+  return encoded;
+}
+
+std::string SchemaConvert(char type, const char *data, size_t length)
+{
+  const unsigned char *bytes = (const unsigned char*)data;
+  std::string text(data, length);
+
+  switch (type)
+  {
+    case SCHEMA_TIME:
+    case SCHEMA_UTCTIME: {
+      int64_t ms = ParseTime(text, type == SCHEMA_UTCTIME);
+      return ms == -1 ? text : Decimal(ms);
+    }
+
+    case SCHEMA_FILETIME: {
+      char *end;
+      long long ticks = strtoll(text.c_str(), &end, 10);
+      if (end == text.c_str() || *end != '\0') return text;
+      if (ticks <= 0 || ticks == FILETIME_NEVER) return std::string();
+      return Decimal(ticks / 10000 - FILETIME_EPOCH_MS);
+    }
+
+    case SCHEMA_SID: {
+      std::string sid = Sid(bytes, length);
+      return sid.empty() ? Base64(bytes, length) : sid;
+    }
+
+    case SCHEMA_GUID: {
+      std::string guid = Guid(bytes, length);
+      return guid.empty() ? Base64(bytes, length) : guid;
+    }
+
+    case SCHEMA_BINARY:
+      return Base64(bytes, length);
+
+    default:
+      return text;
+  }
+}
+
+void SchemaStats(schema_stats *stats)
+{
+  uv_once(&schema_once, InitSchema);
+
+  stats->servers = 0;
+  stats->attributes = 0;
+  uv_mutex_lock(&load_lock);
+  uv_rwlock_rdlock(&attrs_lock);
+  for (std::map<std::string, server_schema*>::iterator it = schemas.begin(); it != schemas.end(); ++it)
+  {
+    if (it->second->attrs == NULL) continue;
+    stats->servers++;
+    stats->attributes += it->second->attrs->size();
+  }
+  uv_rwlock_rdunlock(&attrs_lock);
+  stats->loads = loads;
+  stats->failures = failures;
+  uv_mutex_unlock(&load_lock);
+}
@@ -0,0 +1,86 @@
+// Attribute types from each server's subschema, for typing search() values.
+
+/*
+search() hands every value back as a string, a single one bare and
+several in an array, so the same attribute comes back in two shapes
+depending on the user. With configure({ typedValues: true }), the
+servers' subschema (RFC 4512: the root DSE's subschemaSubentry, then its
+attributeTypes) is read once per server set and kept for SCHEMA_TTL_MS,
+and each attribute's syntax and SINGLE-VALUE flag decide its value:
+
+  Integer, AD Large Integer            number (a string past 2^53)
+  Boolean                              true or false
+  GeneralizedTime, UTCTime             epoch ms
+  AD FILETIME (pwdLastSet, ...)        epoch ms, or null for never
+  objectSid and other SIDs             "S-1-5-21-..."
+  objectGUID and other GUIDs           "xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx"
+  other binary syntaxes                base64
+  anything else                        string
+
+Single-valued attributes come back bare, all others as arrays, however
+many values a given entry has. SIDs, GUIDs and FILETIMEs are recognised
+by name: Active Directory gives them plain Octet String and Large Integer
+syntaxes.
+
+Values are converted to typed text on the worker (SchemaConvert()), and
+the main thread only parses numbers out of it. The types travel with
+the result through the caches and the broker.
+*/
+
+#ifndef LDAPAUTH_SCHEMA_H
+#define LDAPAUTH_SCHEMA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+#include "pool.h"
+
+#define SCHEMA_STRING 's'
+#define SCHEMA_INTEGER 'i'
+#define SCHEMA_BOOLEAN 'b'
+#define SCHEMA_TIME 't'         // GeneralizedTime
+#define SCHEMA_UTCTIME 'u'
+#define SCHEMA_FILETIME 'f'     // 100ns intervals since 1601
+#define SCHEMA_BINARY 'x'
+#define SCHEMA_SID 'S'
+#define SCHEMA_GUID 'G'
+
+#define SCHEMA_TTL_MS 3600000
+
+struct schema_attr
+{
+  char type;                    // SCHEMA_*
+  bool single;
+};
+
+// Reads the subschema of servers (ServersKey()) through pool, unless it
+// is known and younger than SCHEMA_TTL_MS. The first read blocks other
+// callers for the same servers until it is done. Worker threads.
+void SchemaLoad(const std::string &servers, conn_pool *pool);
+
+// Whether SchemaLoad() for servers would return without reading: the
+// schema is known and young enough, or being refreshed. Any thread.
+bool SchemaFresh(const std::string &servers);
+
+// attr's type on servers: a multi-valued string if either is unknown.
+// Any thread.
+schema_attr SchemaLookup(const std::string &servers, const char *attr);
+
+// A value as typed text: times as epoch ms in decimal ("" for never),
+// SIDs and GUIDs in their canonical forms, other binary values in base64;
+// integers, booleans and strings unchanged.
+std::string SchemaConvert(char type, const char *data, size_t length);
+
+struct schema_stats
+{
+  uint64_t servers;
+  uint64_t attributes;
+  uint64_t loads;
+  uint64_t failures;
+};
+
+void SchemaStats(schema_stats *stats);
+
+#endif
@@ -0,0 +1,693 @@
+// Directory server table: health, circuit breaking and selection.
+// See servers.h.
+
+#include "servers.h"
+
+#include <ldap.h>
+#include <uv.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <map>
+#include <algorithm>
+
+#define BREAKER_CLOSED 0
+#define BREAKER_OPEN 1
+#define BREAKER_HALF_OPEN 2
+
+// Weight of the newest sample in the latency moving average.
+#define LATENCY_ALPHA 0.2
+
+#define NS_PER_MS 1000000ULL
+
+// Entries per page of ServersPagedSearch().
+#define PAGE_SIZE 1000
+
+// Recent successful request latencies kept per server for percentiles;
+// only those from the last outlier interval are used.
+#define LATENCY_SAMPLES 128
+
+struct latency_sample
+{
+  float ms;
+  uint64_t at;            // hrtime
+};
+
+struct server_state
+{
+  std::string scheme;
+  bool scheme_known;      // configured, or seen on a request
+  std::string host;
+  int port;
+  std::string locality;   // empty if unlabelled
+  int in_flight;          // between ServersStart() and ServersReport()
+
+  int breaker;
+  int consecutive_failures;
+  uint64_t open_until;      // hrtime; while open
+  uint64_t trial_started;   // hrtime; half-open trial in progress, or 0
+
+  double latency_ms;
+  uint64_t successes;
+  uint64_t failures;
+  bool probed;
+  bool probe_ok;
+
+  // Outlier detection
+  latency_sample samples[LATENCY_SAMPLES];  // ring of recent requests
+  int sample_count;
+  int sample_next;
+  int interval_requests;           // since the last evaluation; not probes
+  int interval_failures;           // unreachable, or answered with an error
+  double p95_ms;
+  uint64_t ejected_until;          // hrtime; 0 when not ejected
+  int ejections;                   // consecutive, for backoff
+};
+
+static uv_once_t servers_once = UV_ONCE_INIT;
+static uv_mutex_t servers_lock;
+static std::map<std::string, server_state*> servers;
+
+static int failure_threshold = 3;
+static uint64_t cooldown_ns = 30000 * NS_PER_MS;
+static int connect_timeout_ms = 5000;
+
+static std::string local_locality;
+static int max_in_flight = 0;
+
+static uint64_t outlier_interval_ns = 10000 * NS_PER_MS;
+static double outlier_latency_factor = 3.0;
+static double outlier_error_rate = 0.5;
+static int outlier_min_requests = 20;
+static uint64_t ejection_base_ns = 30000 * NS_PER_MS;
+static uint64_t ejection_max_ns = 300000 * NS_PER_MS;
+static int max_ejected_percent = 50;
+static uint64_t last_evaluation = 0;
+
+static uv_thread_t prober;
+static uv_cond_t prober_cond;
+static bool prober_running = false;
+static int probe_interval_ms = 0;
+static std::string probe_binddn;
+static std::string probe_password;
+
+static void InitServers()
+{
+  uv_mutex_init(&servers_lock);
+  uv_cond_init(&prober_cond);
+}
+
+static std::string ServerKey(const std::string &host, int port)
+{
+  char port_str[16];
+  sprintf(port_str, ":%d", port);
+  return host + port_str;
+}
+
+// Finds or creates a table entry. Called with servers_lock held.
+static server_state *Lookup(const std::string &host, int port)
+{
+  std::string key = ServerKey(host, port);
+  std::map<std::string, server_state*>::iterator iter = servers.find(key);
+  if (iter != servers.end()) return iter->second;
+
+  server_state *server = new server_state;
+  server->scheme = "ldap";
+  server->scheme_known = false;
+  server->host = host;
+  server->port = port;
+  server->in_flight = 0;
+  server->breaker = BREAKER_CLOSED;
+  server->consecutive_failures = 0;
+  server->open_until = 0;
+  server->trial_started = 0;
+  server->latency_ms = 0;
+  server->successes = 0;
+  server->failures = 0;
+  server->probed = false;
+  server->probe_ok = false;
+  server->sample_count = 0;
+  server->sample_next = 0;
+  server->interval_requests = 0;
+  server->interval_failures = 0;
+  server->p95_ms = 0;
+  server->ejected_until = 0;
+  server->ejections = 0;
+  servers.insert(std::pair<std::string, server_state*>(key, server));
+  return server;
+}
+
+// Moves an open breaker to half-open once its cooldown has passed, and
+// forgets half-open trials that never reported back.
+static void AgeBreaker(server_state *server, uint64_t now)
+{
+  if (server->breaker == BREAKER_OPEN && now >= server->open_until) {
+    server->breaker = BREAKER_HALF_OPEN;
+    server->trial_started = 0;
+  } else if (server->breaker == BREAKER_HALF_OPEN && server->trial_started != 0
+             && now - server->trial_started > cooldown_ns) {
+    server->trial_started = 0;
+  }
+}
+
+static int CompareFloats(const void *a, const void *b)
+{
+  float x = *(const float*)a, y = *(const float*)b;
+  return x < y ? -1 : x > y ? 1 : 0;
+}
+
+static double Median(std::vector<double> values)
+{
+  std::sort(values.begin(), values.end());
+  size_t n = values.size();
+  return n % 2 ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2;
+}
+
+// Ejects servers that are much slower than their peers, or failing
+// much more often, for an exponentially growing time. Runs at most once
+// per outlier interval. Called with servers_lock held.
+static void DetectOutliers(uint64_t now)
+{
+  if (outlier_interval_ns == 0 || now - last_evaluation < outlier_interval_ns) return;
+  last_evaluation = now;
+
+  std::vector<server_state*> measured;
+  int ejected = 0;
+  for (std::map<std::string, server_state*>::iterator iter = servers.begin(); iter != servers.end(); ++iter)
+  {
+    server_state *server = iter->second;
+    if (server->ejected_until > now) {
+      ejected++;
+    } else if (server->ejected_until != 0) {
+      // Back from ejection; the backoff resets once it has stayed clean
+      // for a full ejection period.
+      if (now - server->ejected_until > ejection_base_ns << std::min(server->ejections, 16)) server->ejections = 0;
+    }
+
+    float recent[LATENCY_SAMPLES];
+    int count = 0;
+    for (int sample = 0; sample < server->sample_count; sample++)
+    {
+      if (server->samples[sample].at + outlier_interval_ns >= now) recent[count++] = server->samples[sample].ms;
+    }
+    if (count > 0) {
+      qsort(recent, count, sizeof(float), CompareFloats);
+      server->p95_ms = recent[(count * 95) / 100];
+    } else {
+      server->p95_ms = 0;
+    }
+    if (server->interval_requests >= outlier_min_requests && server->ejected_until <= now) {
+      measured.push_back(server);
+    }
+  }
+
+  for (size_t idx = 0; idx < measured.size(); idx++)
+  {
+    server_state *server = measured[idx];
+
+    bool outlier = (double)server->interval_failures / server->interval_requests >= outlier_error_rate;
+
+    std::vector<double> peers;
+    for (size_t peer = 0; peer < measured.size(); peer++)
+    {
+      if (peer != idx) peers.push_back(measured[peer]->p95_ms);
+    }
+    if (!peers.empty() && server->p95_ms > outlier_latency_factor * Median(peers)) {
+      outlier = true;
+    }
+
+    // Never eject so many that the rest would be overwhelmed.
+    if (outlier && (ejected + 1) * 100 <= max_ejected_percent * (int)servers.size()) {
+      uint64_t duration = ejection_base_ns << std::min(server->ejections, 16);
+      server->ejected_until = now + std::min(duration, ejection_max_ns);
+      server->ejections++;
+      ejected++;
+    }
+  }
+
+  for (std::map<std::string, server_state*>::iterator iter = servers.begin(); iter != servers.end(); ++iter)
+  {
+    iter->second->interval_requests = 0;
+    iter->second->interval_failures = 0;
+  }
+}
+
+#define RANK_HEALTHY 0
+#define RANK_SATURATED 1
+#define RANK_TRIAL 2
+#define RANK_LAST_RESORT 3
+
+static int Rank(server_state *server, uint64_t now)
+{
+  if (server->ejected_until > now) return RANK_LAST_RESORT;
+  if (server->breaker == BREAKER_CLOSED) {
+    return max_in_flight > 0 && server->in_flight >= max_in_flight ? RANK_SATURATED : RANK_HEALTHY;
+  }
+  if (server->breaker == BREAKER_HALF_OPEN && server->trial_started == 0) return RANK_TRIAL;
+  return RANK_LAST_RESORT;
+}
+
+struct ranked_server
+{
+  int rank;
+  bool remote;
+  int position;
+  server_state *server;
+};
+
+// Health first; then local before remote, so a remote server is only
+// used when every local one is unhealthy or saturated; then the least
+// busy; then the caller's order.
+static bool RankedBefore(const ranked_server &a, const ranked_server &b)
+{
+  if (a.rank != b.rank) return a.rank < b.rank;
+  if (a.remote != b.remote) return b.remote;
+  if (a.server->in_flight != b.server->in_flight) return a.server->in_flight < b.server->in_flight;
+  return a.position < b.position;
+}
+
+static void SplitHosts(const char *hosts, int default_port, std::vector<server_addr> *candidates)
+{
+  const char *cursor = hosts;
+  while (*cursor)
+  {
+    while (*cursor == ' ' || *cursor == '\t') cursor++;
+    const char *end = cursor;
+    while (*end && *end != ' ' && *end != '\t') end++;
+    if (end == cursor) break;
+
+    server_addr addr;
+    addr.host.assign(cursor, end - cursor);
+    addr.port = default_port;
+    size_t colon = addr.host.rfind(':');
+    if (colon != std::string::npos && addr.host.find(':') == colon) {
+      addr.port = atoi(addr.host.c_str() + colon + 1);
+      addr.host.erase(colon);
+    }
+    candidates->push_back(addr);
+    cursor = end;
+  }
+}
+
+static bool AddrBefore(const server_addr &a, const server_addr &b)
+{
+  return a.host < b.host || (a.host == b.host && a.port < b.port);
+}
+
+std::string ServersKey(const char *hosts, int default_port)
+{
+  std::vector<server_addr> candidates;
+  SplitHosts(hosts, default_port, &candidates);
+  std::sort(candidates.begin(), candidates.end(), AddrBefore);
+
+  std::string key;
+  for (size_t idx = 0; idx < candidates.size(); idx++)
+  {
+    char port[16];
+    sprintf(port, ":%d ", candidates[idx].port);
+    key += candidates[idx].host + port;
+  }
+  return key;
+}
+
+void ServersSelect(const char *hosts, int default_port, std::vector<server_addr> *order)
+{
+  uv_once(&servers_once, InitServers);
+
+  std::vector<server_addr> candidates;
+  SplitHosts(hosts, default_port, &candidates);
+
+  uint64_t now = uv_hrtime();
+  std::vector<ranked_server> ranked;
+
+  uv_mutex_lock(&servers_lock);
+  DetectOutliers(now);
+  for (size_t idx = 0; idx < candidates.size(); idx++)
+  {
+    ranked_server entry;
+    entry.server = Lookup(candidates[idx].host, candidates[idx].port);
+    AgeBreaker(entry.server, now);
+    entry.rank = Rank(entry.server, now);
+    entry.remote = !local_locality.empty() && entry.server->locality != local_locality;
+    entry.position = idx;
+    ranked.push_back(entry);
+  }
+
+  std::stable_sort(ranked.begin(), ranked.end(), RankedBefore);
+
+  // A half-open server's trial is marked by ServersStart(), if the
+  // caller gets as far as trying it.
+  order->clear();
+  for (size_t idx = 0; idx < ranked.size(); idx++)
+  {
+    server_state *server = ranked[idx].server;
+    server_addr addr;
+    addr.host = server->host;
+    addr.port = server->port;
+    addr.scheme = server->scheme;
+    order->push_back(addr);
+  }
+  uv_mutex_unlock(&servers_lock);
+}
+
+bool ServersUnreachable(int rc)
+{
+  return rc == LDAP_SERVER_DOWN || rc == LDAP_CONNECT_ERROR || rc == LDAP_TIMEOUT
+      || rc == LDAP_UNAVAILABLE || rc == LDAP_BUSY;
+}
+
+// Answers that say the server is in trouble, rather than the request
+// being refused: these count towards its outlier error rate.
+static bool ServerError(int rc)
+{
+  return rc == LDAP_OPERATIONS_ERROR || rc == LDAP_PROTOCOL_ERROR || rc == LDAP_TIMELIMIT_EXCEEDED
+      || rc == LDAP_LOOP_DETECT || rc == LDAP_OTHER || rc == LDAP_DECODING_ERROR;
+}
+
+// Probes feed the breaker and the moving average, but not the outlier
+// statistics, which are for what requests see. Called with
+// servers_lock held.
+static void Record(server_state *server, bool ok, bool errored, bool probe, uint64_t latency_ns)
+{
+  double latency_ms = (double)latency_ns / NS_PER_MS;
+  if (server->successes + server->failures == 0) {
+    server->latency_ms = latency_ms;
+  } else {
+    server->latency_ms += LATENCY_ALPHA * (latency_ms - server->latency_ms);
+  }
+
+  if (!probe) {
+    server->interval_requests++;
+    if (ok && !errored) {
+      server->samples[server->sample_next].ms = (float)latency_ms;
+      server->samples[server->sample_next].at = uv_hrtime();
+      server->sample_next = (server->sample_next + 1) % LATENCY_SAMPLES;
+      if (server->sample_count < LATENCY_SAMPLES) server->sample_count++;
+    } else {
+      server->interval_failures++;
+    }
+  }
+
+  if (ok) {
+    server->successes++;
+    server->consecutive_failures = 0;
+    server->breaker = BREAKER_CLOSED;
+    server->trial_started = 0;
+  } else {
+    server->failures++;
+    server->consecutive_failures++;
+    if (server->breaker == BREAKER_HALF_OPEN || server->consecutive_failures >= failure_threshold) {
+      server->breaker = BREAKER_OPEN;
+      server->open_until = uv_hrtime() + cooldown_ns;
+      server->trial_started = 0;
+    }
+  }
+}
+
+void ServersStart(const server_addr &addr)
+{
+  uv_once(&servers_once, InitServers);
+
+  uv_mutex_lock(&servers_lock);
+  server_state *server = Lookup(addr.host, addr.port);
+  server->in_flight++;
+  // The first attempt on a half-open server is its trial; others rank
+  // it last until the trial reports.
+  if (server->breaker == BREAKER_HALF_OPEN && server->trial_started == 0) {
+    server->trial_started = uv_hrtime();
+  }
+  uv_mutex_unlock(&servers_lock);
+}
+
+void ServersReport(const server_addr &addr, int rc, uint64_t latency_ns)
+{
+  uv_once(&servers_once, InitServers);
+
+  uv_mutex_lock(&servers_lock);
+  server_state *server = Lookup(addr.host, addr.port);
+  if (server->in_flight > 0) server->in_flight--;
+  Record(server, !ServersUnreachable(rc), ServerError(rc), false, latency_ns);
+  uv_mutex_unlock(&servers_lock);
+}
+
+void ServersAdd(const char *scheme, const char *host, int port, const char *locality)
+{
+  uv_once(&servers_once, InitServers);
+
+  uv_mutex_lock(&servers_lock);
+  server_state *server = Lookup(host, port);
+  server->scheme = scheme;
+  server->scheme_known = true;
+  server->locality = locality;
+  uv_mutex_unlock(&servers_lock);
+}
+
+void ServersConfigureLocality(const char *locality, int in_flight_limit)
+{
+  uv_once(&servers_once, InitServers);
+
+  uv_mutex_lock(&servers_lock);
+  if (locality != NULL) local_locality = locality;
+  if (in_flight_limit >= 0) max_in_flight = in_flight_limit;
+  uv_mutex_unlock(&servers_lock);
+}
+
+void ServersSetScheme(const server_addr &addr, const char *scheme)
+{
+  uv_once(&servers_once, InitServers);
+
+  uv_mutex_lock(&servers_lock);
+  server_state *server = Lookup(addr.host, addr.port);
+  if (!server->scheme_known) {
+    server->scheme = scheme;
+    server->scheme_known = true;
+  }
+  uv_mutex_unlock(&servers_lock);
+}
+
+void ServersConfigureBreaker(int threshold, int cooldown_ms)
+{
+  if (threshold > 0) failure_threshold = threshold;
+  if (cooldown_ms > 0) cooldown_ns = cooldown_ms * NS_PER_MS;
+}
+
+void ServersConfigureOutliers(int interval_ms, double latency_factor, double error_rate,
+                              int min_requests, int ejection_ms, int max_ejection_ms,
+                              int max_percent)
+{
+  if (interval_ms >= 0) outlier_interval_ns = interval_ms * NS_PER_MS;
+  if (latency_factor > 0) outlier_latency_factor = latency_factor;
+  if (error_rate > 0) outlier_error_rate = error_rate;
+  if (min_requests > 0) outlier_min_requests = min_requests;
+  if (ejection_ms > 0) ejection_base_ns = ejection_ms * NS_PER_MS;
+  if (max_ejection_ms > 0) ejection_max_ns = max_ejection_ms * NS_PER_MS;
+  if (max_percent >= 0) max_ejected_percent = max_percent;
+}
+
+void ServersConfigureConnectTimeout(int timeout_ms)
+{
+  if (timeout_ms > 0) connect_timeout_ms = timeout_ms;
+}
+
+void ServersConnectTimeout(struct timeval *timeout)
+{
+  timeout->tv_sec = connect_timeout_ms / 1000;
+  timeout->tv_usec = (connect_timeout_ms % 1000) * 1000;
+}
+
+LDAP *ServersConnect(const char *hosts, int default_port, const char *binddn, const char *password,
+                     int *rc)
+{
+  std::vector<server_addr> order;
+  ServersSelect(hosts, default_port, &order);
+
+  *rc = LDAP_SERVER_DOWN;
+  for (size_t idx = 0; idx < order.size(); idx++)
+  {
+    char uri[order[idx].scheme.size() + order[idx].host.size() + 32];
+    snprintf(uri, sizeof(uri), "%s://%s:%d/", order[idx].scheme.c_str(), order[idx].host.c_str(), order[idx].port);
+
+    LDAP *ldap = NULL;
+    if (ldap_initialize(&ldap, uri) != LDAP_SUCCESS || ldap == NULL) continue;
+
+    int version = LDAP_VERSION3;
+    struct timeval timeout;
+    ServersConnectTimeout(&timeout);
+    ldap_set_option(ldap, LDAP_OPT_PROTOCOL_VERSION, &version);
+    ldap_set_option(ldap, LDAP_OPT_REFERRALS, LDAP_OPT_OFF);
+    ldap_set_option(ldap, LDAP_OPT_NETWORK_TIMEOUT, &timeout);
+
+    ServersStart(order[idx]);
+    uint64_t started = uv_hrtime();
+    *rc = ldap_simple_bind_s(ldap, binddn, password);
+    ServersReport(order[idx], *rc, uv_hrtime() - started);
+    if (*rc == LDAP_SUCCESS) return ldap;
+
+    ldap_unbind_ext(ldap, NULL, NULL);
+    if (!ServersUnreachable(*rc)) break;
+  }
+  return NULL;
+}
+
+int ServersPagedSearch(LDAP *ldap, const char *base, const char *filter, char **attrs,
+                       servers_page_cb page_cb, void *arg)
+{
+  int rc;
+  struct berval *cookie = NULL;
+  do {
+    LDAPControl *page = NULL;
+    rc = ldap_create_page_control(ldap, PAGE_SIZE, cookie, 1, &page);
+    if (rc != LDAP_SUCCESS) break;
+
+    LDAPControl *controls[2] = { page, NULL };
+    LDAPMessage *result = NULL;
+    rc = ldap_search_ext_s(ldap, base, LDAP_SCOPE_SUBTREE, filter, attrs, 0, controls,
+                           NULL, NULL, LDAP_NO_LIMIT, &result);
+    ldap_control_free(page);
+    ber_bvfree(cookie);
+    cookie = NULL;
+
+    if (rc == LDAP_SUCCESS) rc = page_cb(ldap, result, arg);
+    if (rc == LDAP_SUCCESS) {
+      LDAPControl **returned = NULL;
+      int result_code;
+      ldap_parse_result(ldap, result, &result_code, NULL, NULL, NULL, &returned, 0);
+      LDAPControl *response = ldap_control_find(LDAP_CONTROL_PAGEDRESULTS, returned, NULL);
+      if (response != NULL) {
+        ber_int_t estimate;
+        struct berval next;
+        if (ldap_parse_pageresponse_control(ldap, response, &estimate, &next) == LDAP_SUCCESS) {
+          if (next.bv_len > 0) cookie = ber_bvdup(&next);
+          ber_memfree(next.bv_val);
+        }
+      }
+      ldap_controls_free(returned);
+    }
+    ldap_msgfree(result);
+  } while (cookie != NULL);
+
+  return rc;
+}
+
+// A cheap round trip: bind as the probe account, or read the rootDSE.
+static bool Probe(const std::string &uri, const std::string &binddn, const std::string &password)
+{
+  LDAP *ldap = NULL;
+  if (ldap_initialize(&ldap, uri.c_str()) != LDAP_SUCCESS || ldap == NULL) return false;
+
+  int version = LDAP_VERSION3;
+  struct timeval timeout;
+  ServersConnectTimeout(&timeout);
+  ldap_set_option(ldap, LDAP_OPT_PROTOCOL_VERSION, &version);
+  ldap_set_option(ldap, LDAP_OPT_NETWORK_TIMEOUT, &timeout);
+
+  int rc;
+  if (!binddn.empty()) {
+    rc = ldap_simple_bind_s(ldap, binddn.c_str(), password.c_str());
+  } else {
+    const char *attrs[] = { "namingContexts", NULL };
+    LDAPMessage *result = NULL;
+    rc = ldap_search_ext_s(ldap, "", LDAP_SCOPE_BASE, "(objectClass=*)", (char**)attrs, 0,
+                           NULL, NULL, &timeout, 0, &result);
+    ldap_msgfree(result);
+  }
+  ldap_unbind_ext(ldap, NULL, NULL);
+
+  return !ServersUnreachable(rc);
+}
+
+static void ProberThread(void *arg)
+{
+  uv_mutex_lock(&servers_lock);
+  while (probe_interval_ms > 0)
+  {
+    // Probe a snapshot, without holding the lock across the network.
+    std::vector<server_addr> targets;
+    std::vector<std::string> uris;
+    for (std::map<std::string, server_state*>::iterator iter = servers.begin(); iter != servers.end(); ++iter)
+    {
+      server_addr addr;
+      addr.host = iter->second->host;
+      addr.port = iter->second->port;
+      targets.push_back(addr);
+      uris.push_back(iter->second->scheme + "://" + iter->first + "/");
+    }
+    std::string binddn = probe_binddn;
+    std::string password = probe_password;
+    uv_mutex_unlock(&servers_lock);
+
+    for (size_t idx = 0; idx < targets.size(); idx++)
+    {
+      uint64_t started = uv_hrtime();
+      bool ok = Probe(uris[idx], binddn, password);
+      uint64_t elapsed = uv_hrtime() - started;
+
+      uv_mutex_lock(&servers_lock);
+      server_state *server = Lookup(targets[idx].host, targets[idx].port);
+      server->probed = true;
+      server->probe_ok = ok;
+      Record(server, ok, false, true, elapsed);
+      uv_mutex_unlock(&servers_lock);
+    }
+
+    uv_mutex_lock(&servers_lock);
+    if (probe_interval_ms > 0) {
+      uv_cond_timedwait(&prober_cond, &servers_lock, probe_interval_ms * NS_PER_MS);
+    }
+  }
+  prober_running = false;
+  uv_mutex_unlock(&servers_lock);
+}
+
+void ServersConfigureProbe(int interval_ms, const char *binddn, const char *password)
+{
+  uv_once(&servers_once, InitServers);
+
+  uv_mutex_lock(&servers_lock);
+  probe_interval_ms = interval_ms > 0 ? interval_ms : 0;
+  probe_binddn = binddn;
+  probe_password = password;
+
+  bool start = probe_interval_ms > 0 && !prober_running;
+  if (start) prober_running = true;
+  uv_cond_signal(&prober_cond);
+  uv_mutex_unlock(&servers_lock);
+
+  if (start) {
+    uv_thread_create(&prober, ProberThread, NULL);
+  }
+}
+
+void ServersList(std::vector<server_info> *list)
+{
+  uv_once(&servers_once, InitServers);
+
+  uint64_t now = uv_hrtime();
+  list->clear();
+
+  uv_mutex_lock(&servers_lock);
+  for (std::map<std::string, server_state*>::iterator iter = servers.begin(); iter != servers.end(); ++iter)
+  {
+    server_state *server = iter->second;
+    AgeBreaker(server, now);
+
+    server_info info;
+    info.host = server->host;
+    info.port = server->port;
+    info.locality = server->locality;
+    info.in_flight = server->in_flight;
+    info.state = server->breaker == BREAKER_CLOSED ? "closed"
+               : server->breaker == BREAKER_OPEN ? "open" : "half-open";
+    info.latency_ms = server->latency_ms;
+    info.p95_ms = server->p95_ms;
+    info.ejected = server->ejected_until > now;
+    info.ejections = server->ejections;
+    info.successes = server->successes;
+    info.failures = server->failures;
+    info.probed = server->probed;
+    info.probe_ok = server->probe_ok;
+    list->push_back(info);
+  }
+  uv_mutex_unlock(&servers_lock);
+}
@@ -0,0 +1,141 @@
+// Directory server table: health, circuit breaking and selection.
+
+/*
+The host argument to authenticate() and search() may name several
+servers, separated by spaces as for ldap_init() ("dc1 dc2:3268 dc3").
+Every server seen that way, or listed with configure({ servers: [...] }),
+gets an entry in the server table. Requests try candidates in the order
+ServersSelect() returns, bracketing each attempt with ServersStart() and
+ServersReport().
+
+Servers listed in configure() may carry a locality label (e.g. a data
+center). When configure({ locality }) names this process's locality,
+servers with that label are preferred; others are only used while every
+local server is unhealthy, or saturated with maxInFlight requests.
+
+Circuit breaker per server:
+
+   closed --(failureThreshold consecutive failures)--> open
+   open   --(breakerCooldown elapsed)----------------> half-open
+   half-open: one trial request; success closes, failure re-opens
+
+Open servers are only tried once every other candidate is, too.
+
+Breakers only see connection failures. Outlier detection also catches a
+server that answers, but slowly or badly: every outlierInterval, a
+server whose p95 latency over that interval's requests exceeds
+outlierLatencyFactor times the median p95 of its peers, or whose error
+rate reaches outlierErrorRate, is
+ejected (ranked like an open server) for ejectionTime, doubling with
+each consecutive ejection up to maxEjectionTime. At most
+maxEjectedPercent of the table is ejected at once. Errors are failures
+to reach the server and answers such as operationsError or other that
+mean it is in trouble; a rejected password or a missing entry is not.
+
+An optional background prober (probeInterval) connects to every server
+in the table, reads the rootDSE or binds as probeBindDn, and reports the
+result to the breaker like a real request, so dead servers are found
+before users are sent to them. Probes are left out of outlier detection.
+*/
+
+#ifndef LDAPAUTH_SERVERS_H
+#define LDAPAUTH_SERVERS_H
+
+#include <ldap.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+#include <string>
+#include <vector>
+
+struct server_addr
+{
+  std::string host;
+  int port;
+  std::string scheme;     // from ServersSelect(): configured or first seen
+};
+
+struct server_info
+{
+  std::string host;
+  int port;
+  std::string locality;
+  int in_flight;          // attempts started and not yet reported
+  const char *state;      // "closed", "open" or "half-open"
+  double latency_ms;      // moving average over requests and probes
+  double p95_ms;          // over recent successful requests
+  bool ejected;           // as a latency or error-rate outlier
+  int ejections;          // consecutive ejections so far
+  uint64_t successes;
+  uint64_t failures;
+  bool probed;            // has been probed at least once
+  bool probe_ok;          // outcome of the last probe
+};
+
+// Splits a host argument and orders its servers best first.
+void ServersSelect(const char *hosts, int default_port, std::vector<server_addr> *order);
+
+// The servers a host argument names, in a canonical order: the same for
+// "dc1 dc2" and "dc2:389 dc1".
+std::string ServersKey(const char *hosts, int default_port);
+
+// True for result codes meaning the server could not be reached, as
+// opposed to it answering with an error.
+bool ServersUnreachable(int rc);
+
+// Counts a request attempt against a server until its ServersReport().
+void ServersStart(const server_addr &server);
+
+// Records the result code of a request. Only failures to reach the
+// server trip its breaker: a rejected password is a success here.
+void ServersReport(const server_addr &server, int rc, uint64_t latency_ns);
+
+// Adds a server to the table, so the prober covers it before first use.
+void ServersAdd(const char *scheme, const char *host, int port, const char *locality);
+
+// This process's locality (NULL keeps it) and the in-flight count at
+// which a server counts as saturated (0 for no limit, negative keeps it).
+void ServersConfigureLocality(const char *locality, int max_in_flight);
+
+// Remembers the scheme requests use for a server, for the prober and
+// for connections made without one (searches, pools, ServersConnect()):
+// the configured one if any, else the first seen, so that ldap and ldaps
+// callers of one host do not flip it back and forth.
+void ServersSetScheme(const server_addr &server, const char *scheme);
+
+void ServersConfigureBreaker(int failure_threshold, int cooldown_ms);
+
+// Negative or zero arguments keep the current setting, except that an
+// interval of 0 turns outlier detection off.
+void ServersConfigureOutliers(int interval_ms, double latency_factor, double error_rate,
+                              int min_requests, int ejection_ms, int max_ejection_ms,
+                              int max_percent);
+
+// How long libldap waits for a TCP connect before failing over.
+void ServersConfigureConnectTimeout(int timeout_ms);
+void ServersConnectTimeout(struct timeval *timeout);
+
+// A connection of its own, outside the pools, bound as binddn to the
+// first of hosts' servers that answers, over its scheme. NULL, with the
+// last result code in *rc, if none does. Unbind with ldap_unbind_ext().
+// Worker threads.
+LDAP *ServersConnect(const char *hosts, int default_port, const char *binddn, const char *password,
+                     int *rc);
+
+// Called with each page ServersPagedSearch() reads; other than
+// LDAP_SUCCESS stops the search and is returned from it.
+typedef int (*servers_page_cb)(LDAP *ldap, LDAPMessage *page, void *arg);
+
+// Searches the subtree under base for every entry matching filter, with
+// attrs (NULL for all), a page at a time through the paged results
+// control.
+int ServersPagedSearch(LDAP *ldap, const char *base, const char *filter, char **attrs,
+                       servers_page_cb page_cb, void *arg);
+
+// interval_ms of 0 stops the prober. An empty bind DN reads the rootDSE
+// anonymously instead of binding.
+void ServersConfigureProbe(int interval_ms, const char *binddn, const char *password);
+
+void ServersList(std::vector<server_info> *servers);
+
+#endif
@@ -0,0 +1,234 @@
+// Streaming sketches of who is generating load. See sketch.h.
+
+#include "sketch.h"
+#include "hash.h"
+
+#include <uv.h>
+#include <math.h>
+#include <string.h>
+
+#include <map>
+#include <algorithm>
+
+#define HLL_BITS 12
+#define HLL_REGISTERS (1 << HLL_BITS)
+
+static int top_k = 32;
+static uint64_t window_ms = 60000;
+
+// Space-Saving: k counters, kept as a min-heap on count so the least
+// frequent key is the one evicted when a new key arrives.
+struct space_saving
+{
+  std::vector<heavy_hitter> counters;
+  std::vector<int> heap;               // counter indexes, min count first
+  std::vector<int> position;           // counter index -> heap slot
+  std::map<std::string, int> index;    // key -> counter index
+
+  void Clear()
+  {
+    counters.clear();
+    heap.clear();
+    position.clear();
+    index.clear();
+  }
+
+  bool Less(int a, int b) const
+  {
+    return counters[heap[a]].count < counters[heap[b]].count;
+  }
+
+  void Swap(int a, int b)
+  {
+    std::swap(heap[a], heap[b]);
+    position[heap[a]] = a;
+    position[heap[b]] = b;
+  }
+
+  void SiftUp(int slot)
+  {
+    while (slot > 0 && Less(slot, (slot - 1) / 2))
+    {
+      Swap(slot, (slot - 1) / 2);
+      slot = (slot - 1) / 2;
+    }
+  }
+
+  void SiftDown(int slot)
+  {
+    int size = heap.size();
+    for (;;)
+    {
+      int smallest = slot, left = 2 * slot + 1, right = left + 1;
+      if (left < size && Less(left, smallest)) smallest = left;
+      if (right < size && Less(right, smallest)) smallest = right;
+      if (smallest == slot) return;
+      Swap(slot, smallest);
+      slot = smallest;
+    }
+  }
+
+  void Add(const char *key)
+  {
+    std::map<std::string, int>::iterator found = index.find(key);
+    if (found != index.end()) {
+      counters[found->second].count++;
+      SiftDown(position[found->second]);
+      return;
+    }
+
+    if ((int)counters.size() < top_k) {
+      heavy_hitter counter;
+      counter.key = key;
+      counter.count = 1;
+      counter.error = 0;
+      int idx = counters.size();
+      counters.push_back(counter);
+      heap.push_back(idx);
+      position.push_back(idx);
+      index[key] = idx;
+      SiftUp(idx);
+      return;
+    }
+
+    // Take over the least frequent counter; its count bounds how often
+    // the new key may have been seen before.
+    int idx = heap[0];
+    heavy_hitter &counter = counters[idx];
+    index.erase(counter.key);
+    counter.key = key;
+    counter.error = counter.count;
+    counter.count++;
+    index[key] = idx;
+    SiftDown(0);
+  }
+};
+
+struct hyperloglog
+{
+  uint8_t registers[HLL_REGISTERS];
+
+  void Clear()
+  {
+    memset(registers, 0, sizeof(registers));
+  }
+
+  void Add(uint64_t hash)
+  {
+    int idx = hash >> (64 - HLL_BITS);
+    // Guard bit so an all-zero remainder still ranks.
+    uint64_t rest = (hash << HLL_BITS) | ((uint64_t)1 << (HLL_BITS - 1));
+    uint8_t rank = __builtin_clzll(rest) + 1;
+    if (rank > registers[idx]) registers[idx] = rank;
+  }
+
+  double Estimate() const
+  {
+    double m = HLL_REGISTERS;
+    double sum = 0;
+    int zeros = 0;
+    for (int idx = 0; idx < HLL_REGISTERS; idx++)
+    {
+      sum += ldexp(1.0, -registers[idx]);
+      if (registers[idx] == 0) zeros++;
+    }
+
+    double estimate = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+    // Linear counting is more accurate while many registers are empty.
+    if (estimate <= 2.5 * m && zeros > 0) {
+      estimate = m * log(m / zeros);
+    }
+    return estimate;
+  }
+};
+
+static space_saving users;
+static space_saving sources;
+static hyperloglog distinct_users;
+static uint64_t window_started = 0;
+static uint64_t window_requests = 0;
+static sketch_window previous_window;
+static bool started = false;
+
+static bool MoreFrequent(const heavy_hitter &a, const heavy_hitter &b)
+{
+  return a.count > b.count;
+}
+
+static void Summarize(sketch_window *window)
+{
+  window->started = window_started;
+  window->requests = window_requests;
+  window->distinct_users = distinct_users.Estimate();
+  window->users = users.counters;
+  window->sources = sources.counters;
+  std::sort(window->users.begin(), window->users.end(), MoreFrequent);
+  std::sort(window->sources.begin(), window->sources.end(), MoreFrequent);
+}
+
+static void Reset(uint64_t now)
+{
+  users.Clear();
+  sources.Clear();
+  distinct_users.Clear();
+  window_started = now;
+  window_requests = 0;
+}
+
+static void EmptyWindow(sketch_window *window, uint64_t started)
+{
+  window->started = started;
+  window->requests = 0;
+  window->distinct_users = 0;
+  window->users.clear();
+  window->sources.clear();
+}
+
+// Moves to a new window if the current one is over.
+static void Rotate()
+{
+  uint64_t now = uv_now(uv_default_loop());
+  if (!started) {
+    started = true;
+    EmptyWindow(&previous_window, now);
+    Reset(now);
+    return;
+  }
+  if (now - window_started < window_ms) return;
+
+  if (now - window_started < 2 * window_ms) {
+    Summarize(&previous_window);
+  } else {
+    // Nothing was recorded during the window just before now.
+    EmptyWindow(&previous_window, now - window_ms);
+  }
+  Reset(now);
+}
+
+void SketchRecord(const char *username, const char *source)
+{
+  Rotate();
+  window_requests++;
+  users.Add(username);
+  distinct_users.Add(HashBytes(username, strlen(username)));
+  if (source != NULL) sources.Add(source);
+}
+
+void SketchConfigure(int k, int window)
+{
+  if (k <= 0 && window <= 0) return;
+  if (k > 0) top_k = k;
+  if (window > 0) window_ms = window;
+
+  uint64_t now = uv_now(uv_default_loop());
+  started = true;
+  EmptyWindow(&previous_window, now);
+  Reset(now);
+}
+
+void SketchSnapshot(sketch_window *current, sketch_window *previous)
+{
+  Rotate();
+  Summarize(current);
+  *previous = previous_window;
+}
@@ -0,0 +1,54 @@
+// Streaming sketches of who is generating load.
+
+/*
+Every authenticate() and search() is counted, on the main thread, into
+fixed-size sketches:
+
+  - Space-Saving top-k of usernames, and of client sources when the
+    caller passes one. Each tracked key has a count, which overestimates
+    its true count by at most its error. Any key seen more often than
+    1/k of the window's requests is guaranteed to be tracked.
+
+  - A HyperLogLog of distinct usernames (4096 registers, ~1.6% error).
+
+Sketches cover a window (sketchWindow ms); when it ends they become the
+previous window and counting starts over, so heavyHitters() always has
+one complete window to report. Memory stays constant however many
+distinct keys arrive.
+*/
+
+#ifndef LDAPAUTH_SKETCH_H
+#define LDAPAUTH_SKETCH_H
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+struct heavy_hitter
+{
+  std::string key;
+  uint64_t count;   // upper bound
+  uint64_t error;   // count - error is a lower bound
+};
+
+struct sketch_window
+{
+  uint64_t started;               // ms, loop time
+  uint64_t requests;
+  double distinct_users;          // estimate
+  std::vector<heavy_hitter> users;    // most frequent first
+  std::vector<heavy_hitter> sources;
+};
+
+// Counts one request. source may be NULL. Main thread only.
+void SketchRecord(const char *username, const char *source);
+
+// Tracked keys per sketch (0 keeps it) and window length in ms (0 keeps
+// it). Changing either starts a new window.
+void SketchConfigure(int top_k, int window_ms);
+
+// The window in progress and the last complete one.
+void SketchSnapshot(sketch_window *current, sketch_window *previous);
+
+#endif
@@ -0,0 +1,205 @@
+// ASCII case folding, comparison and hashing. See strcase.h.
+
+#include "strcase.h"
+#include "hash.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define STRCASE_X86 1
+#endif
+
+// Folded a chunk at a time for hashing.
+#define HASH_CHUNK 256
+
+struct strcase_kernel
+{
+  const char *name;
+  void (*fold)(char *dst, const char *src, size_t length);
+  bool (*equal)(const char *a, const char *b, size_t length);
+};
+
+static inline char FoldByte(char c)
+{
+  return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+static void FoldScalar(char *dst, const char *src, size_t length)
+{
+  for (size_t idx = 0; idx < length; idx++) dst[idx] = FoldByte(src[idx]);
+}
+
+static bool EqualScalar(const char *a, const char *b, size_t length)
+{
+  for (size_t idx = 0; idx < length; idx++)
+  {
+    if (FoldByte(a[idx]) != FoldByte(b[idx])) return false;
+  }
+  return true;
+}
+
+#ifdef STRCASE_X86
+
+__attribute__((target("sse2")))
+static inline __m128i Fold16(__m128i v)
+{
+  __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A' - 1)),
+                                _mm_cmplt_epi8(v, _mm_set1_epi8('Z' + 1)));
+  return _mm_or_si128(v, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+
+__attribute__((target("sse2")))
+static void FoldSse2(char *dst, const char *src, size_t length)
+{
+  size_t idx = 0;
+  for (; idx + 16 <= length; idx += 16)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i*)(src + idx));
+    _mm_storeu_si128((__m128i*)(dst + idx), Fold16(v));
+  }
+  FoldScalar(dst + idx, src + idx, length - idx);
+}
+
+__attribute__((target("sse2")))
+static bool EqualSse2(const char *a, const char *b, size_t length)
+{
+  size_t idx = 0;
+  for (; idx + 16 <= length; idx += 16)
+  {
+    __m128i va = Fold16(_mm_loadu_si128((const __m128i*)(a + idx)));
+    __m128i vb = Fold16(_mm_loadu_si128((const __m128i*)(b + idx)));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) != 0xffff) return false;
+  }
+  return EqualScalar(a + idx, b + idx, length - idx);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i Fold32(__m256i v)
+{
+  __m256i upper = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('A' - 1)),
+                                   _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), v));
+  return _mm256_or_si256(v, _mm256_and_si256(upper, _mm256_set1_epi8(0x20)));
+}
+
+__attribute__((target("avx2")))
+static void FoldAvx2(char *dst, const char *src, size_t length)
+{
+  size_t idx = 0;
+  for (; idx + 32 <= length; idx += 32)
+  {
+    __m256i v = _mm256_loadu_si256((const __m256i*)(src + idx));
+    _mm256_storeu_si256((__m256i*)(dst + idx), Fold32(v));
+  }
+  // Not through FoldSse2(): mixing in non-VEX SSE code stalls.
+  if (idx + 16 <= length) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(src + idx));
+    _mm_storeu_si128((__m128i*)(dst + idx), Fold16(v));
+    idx += 16;
+  }
+  FoldScalar(dst + idx, src + idx, length - idx);
+}
+
+__attribute__((target("avx2")))
+static bool EqualAvx2(const char *a, const char *b, size_t length)
+{
+  size_t idx = 0;
+  for (; idx + 32 <= length; idx += 32)
+  {
+    __m256i va = Fold32(_mm256_loadu_si256((const __m256i*)(a + idx)));
+    __m256i vb = Fold32(_mm256_loadu_si256((const __m256i*)(b + idx)));
+    if ((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb)) != 0xffffffffU) return false;
+  }
+  if (idx + 16 <= length) {
+    __m128i va = Fold16(_mm_loadu_si128((const __m128i*)(a + idx)));
+    __m128i vb = Fold16(_mm_loadu_si128((const __m128i*)(b + idx)));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) != 0xffff) return false;
+    idx += 16;
+  }
+  return EqualScalar(a + idx, b + idx, length - idx);
+}
+
+#endif
+
+static const strcase_kernel kernels[] =
+{
+#ifdef STRCASE_X86
+  { "avx2", FoldAvx2, EqualAvx2 },
+  { "sse2", FoldSse2, EqualSse2 },
+#endif
+  { "scalar", FoldScalar, EqualScalar }
+};
+
+#define KERNEL_COUNT (sizeof(kernels) / sizeof(kernels[0]))
+
+static bool Supported(const strcase_kernel *kernel)
+{
+#ifdef STRCASE_X86
+  if (strcmp(kernel->name, "avx2") == 0) return __builtin_cpu_supports("avx2");
+  if (strcmp(kernel->name, "sse2") == 0) return __builtin_cpu_supports("sse2");
+#endif
+  return true;
+}
+
+// The best the CPU supports, picked while the module loads.
+static const strcase_kernel *Select()
+{
+#ifdef STRCASE_X86
+  __builtin_cpu_init();
+#endif
+  for (size_t idx = 0; idx < KERNEL_COUNT; idx++)
+  {
+    if (Supported(&kernels[idx])) return &kernels[idx];
+  }
+  return &kernels[KERNEL_COUNT - 1];
+}
+
+static const strcase_kernel *kernel = Select();
+
+void StrFold(char *dst, const char *src, size_t length)
+{
+  kernel->fold(dst, src, length);
+}
+
+std::string StrLower(const std::string &text)
+{
+  std::string lower(text);
+  if (!lower.empty()) kernel->fold(&lower[0], lower.data(), lower.size());
+  return lower;
+}
+
+bool StrEqualFold(const char *a, const char *b, size_t length)
+{
+  return kernel->equal(a, b, length);
+}
+
+uint64_t StrHashFold(uint64_t hash, const char *data, size_t length)
+{
+  char folded[HASH_CHUNK];
+  while (length > 0)
+  {
+    size_t chunk = length < HASH_CHUNK ? length : HASH_CHUNK;
+    kernel->fold(folded, data, chunk);
+    hash = HashUpdate(hash, folded, chunk);
+    data += chunk;
+    length -= chunk;
+  }
+  return hash;
+}
+
+const char *StrCaseKernel()
+{
+  return kernel->name;
+}
+
+bool StrCaseUse(const char *name)
+{
+  for (size_t idx = 0; idx < KERNEL_COUNT; idx++)
+  {
+    if (strcmp(kernels[idx].name, name) == 0 && Supported(&kernels[idx])) {
+      kernel = &kernels[idx];
+      return true;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,48 @@
+// ASCII case folding, comparison and hashing, vectorized.
+
+/*
+Attribute descriptions, DNs and most matching rules compare ASCII
+case-insensitively, and cache keys, the filter canonicalizer (filter.h),
+the account index and the replica (replica.h) all fold case first. These
+do it 16 (SSE2) or 32 (AVX2) bytes at a time:
+
+  mask = (v > '@') & (v < '[')       signed compares, so bytes >= 0x80,
+  v   |= mask & 0x20                 UTF-8 included, are left alone
+
+with the tail done a byte at a time. The kernel is picked once, when the
+module loads, from what the CPU supports; elsewhere than x86 it is always
+the scalar one. bench/strcase.cc checks each kernel against the scalar
+one and times them.
+*/
+
+#ifndef LDAPAUTH_STRCASE_H
+#define LDAPAUTH_STRCASE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <string>
+
+// Writes length bytes of src to dst, A-Z lowercased. dst may be src.
+void StrFold(char *dst, const char *src, size_t length);
+
+std::string StrLower(const std::string &text);
+
+// Whether a and b are equal but for the case of A-Z.
+bool StrEqualFold(const char *a, const char *b, size_t length);
+
+static inline bool StrEqualFold(const std::string &a, const std::string &b)
+{
+  return a.size() == b.size() && StrEqualFold(a.data(), b.data(), a.size());
+}
+
+// HashUpdate() (hash.h) of data lowercased, without a lowercased copy.
+uint64_t StrHashFold(uint64_t hash, const char *data, size_t length);
+
+// The kernel in use: "avx2", "sse2" or "scalar".
+const char *StrCaseKernel();
+
+// Switches to the named kernel, for benchmarks; false if this CPU lacks it.
+bool StrCaseUse(const char *kernel);
+
+#endif
@@ -0,0 +1,605 @@
+// Change subscriptions. See subscribe.h.
+
+#include "subscribe.h"
+#include "servers.h"
+
+#include <ldap.h>
+#include <lber.h>
+#include <uv.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <map>
+
+#define NS_PER_MS 1000000ULL
+
+// How long the connection thread waits for a notification before looking
+// at its queued starts and stops.
+#define READ_TIMEOUT_MS 200
+#define RECONNECT_MIN_MS 1000
+#define RECONNECT_MAX_MS 60000
+
+#define OID_PERSISTENT_SEARCH "2.16.840.1.113730.3.4.3"
+#define OID_ENTRY_CHANGE "2.16.840.1.113730.3.4.7"
+#define OID_NOTIFICATION "1.2.840.113556.1.4.528"
+#define OID_SYNC_REQUEST "1.3.6.1.4.1.4203.1.9.1.1"
+#define OID_SYNC_STATE "1.3.6.1.4.1.4203.1.9.1.2"
+
+// Persistent search changeTypes; all of them.
+#define PSEARCH_CHANGES (SUBSCRIBE_ADD | SUBSCRIBE_DELETE | SUBSCRIBE_MODIFY | SUBSCRIBE_MODDN)
+
+// Sync Request mode and Sync State states (RFC 4533).
+#define SYNC_REFRESH_AND_PERSIST 3
+#define SYNC_PRESENT 0
+#define SYNC_ADD 1
+#define SYNC_MODIFY 2
+#define SYNC_DELETE 3
+
+// Sync Info choices (RFC 4533 2.5): context tags, constructed.
+#define SYNC_INFO_REFRESH_DELETE 0xa1
+#define SYNC_INFO_REFRESH_PRESENT 0xa2
+
+// A search as the connection thread sees it.
+struct sub_search
+{
+  int id;
+  std::string base;
+  int scope;
+  std::string filter;
+  int msgid;                    // -1 while not issued
+  bool refreshing;              // sync: still in the refresh phase
+};
+
+// One dedicated connection, and the thread that owns it.
+struct sub_conn
+{
+  std::string host;
+  int port;
+  std::string binddn;
+  std::string password;
+  int control;
+
+  uv_thread_t thread;
+  uv_mutex_t lock;
+  uv_cond_t cond;
+  std::vector<sub_search> starts;       // under lock
+  std::vector<int> stops;               // under lock
+
+  // Connection thread only.
+  LDAP *ldap;
+  std::vector<sub_search> searches;
+};
+
+// A notification, or a search's end, on its way to the main loop.
+struct sub_notice
+{
+  int id;
+  int rc;
+  subscribe_event event;
+};
+
+// Main thread.
+struct subscription
+{
+  int id;
+  sub_conn *conn;
+  subscribe_cb cb;
+  void *arg;
+  int coalesce_ms;
+  std::map<std::string, int> pending;   // DN to change bits
+  uint64_t due;                         // uv_hrtime() to deliver at, 0 if none
+};
+
+static uv_once_t subscribe_once = UV_ONCE_INIT;
+static uv_mutex_t notices_lock;
+static std::vector<sub_notice> notices;   // under notices_lock
+static uv_async_t notices_async;
+static uv_timer_t deliver_timer;
+
+static std::map<std::string, sub_conn*> connections;    // main thread
+static std::map<int, subscription*> subscriptions;      // main thread
+static int next_id = 1;
+
+static uint64_t connected = 0;
+static uint64_t notifications = 0;
+static uint64_t deliveries = 0;
+static uint64_t reconnects = 0;
+
+static void Post(int id, int rc, const std::string &dn, int change)
+{
+  sub_notice notice;
+  notice.id = id;
+  notice.rc = rc;
+  notice.event.dn = dn;
+  notice.event.change = change;
+
+  uv_mutex_lock(&notices_lock);
+  notices.push_back(notice);
+  uv_mutex_unlock(&notices_lock);
+  uv_async_send(&notices_async);
+}
+
+static void Disconnect(sub_conn *conn)
+{
+  ldap_unbind_ext(conn->ldap, NULL, NULL);
+  conn->ldap = NULL;
+  __atomic_fetch_sub(&connected, 1, __ATOMIC_RELAXED);
+  for (size_t idx = 0; idx < conn->searches.size(); idx++)
+  {
+    conn->searches[idx].msgid = -1;
+  }
+}
+
+// The request control for conn's mechanism.
+static int CreateControl(int control, LDAPControl **ctrl)
+{
+  if (control == SUBSCRIBE_NOTIFICATION) {
+    return ldap_control_create(OID_NOTIFICATION, 1, NULL, 0, ctrl);
+  }
+
+  BerElement *ber = ber_alloc_t(LBER_USE_DER);
+  if (ber == NULL) return LDAP_NO_MEMORY;
+  int printed;
+  if (control == SUBSCRIBE_SYNC) {
+    printed = ber_printf(ber, "{e}", (ber_int_t)SYNC_REFRESH_AND_PERSIST);
+  } else {
+    // changeTypes, changesOnly, returnECs
+    printed = ber_printf(ber, "{ibb}", (ber_int_t)PSEARCH_CHANGES, 1, 1);
+  }
+
+  struct berval value;
+  int rc = LDAP_ENCODING_ERROR;
+  if (printed != -1 && ber_flatten2(ber, &value, 0) == 0) {
+    rc = ldap_control_create(control == SUBSCRIBE_SYNC ? OID_SYNC_REQUEST : OID_PERSISTENT_SEARCH,
+                             1, &value, 1, ctrl);
+  }
+  ber_free(ber, 1);
+  return rc;
+}
+
+static int Issue(sub_conn *conn, sub_search *search)
+{
+  LDAPControl *ctrl = NULL;
+  int rc = CreateControl(conn->control, &ctrl);
+  if (rc != LDAP_SUCCESS) return rc;
+
+  // Only the DN matters, so ask for no attributes.
+  char noattrs[] = LDAP_NO_ATTRS;
+  char *attrs[] = { noattrs, NULL };
+  LDAPControl *ctrls[] = { ctrl, NULL };
+  rc = ldap_search_ext(conn->ldap, search->base.c_str(), search->scope, search->filter.c_str(),
+                       attrs, 0, ctrls, NULL, NULL, 0, &search->msgid);
+  ldap_control_free(ctrl);
+  if (rc != LDAP_SUCCESS) search->msgid = -1;
+  search->refreshing = conn->control == SUBSCRIBE_SYNC;
+  return rc;
+}
+
+// The first enumerated value of entry's control oid, or -1.
+static int ControlEnum(LDAP *ldap, LDAPMessage *entry, const char *oid)
+{
+  LDAPControl **ctrls = NULL;
+  if (ldap_get_entry_controls(ldap, entry, &ctrls) != LDAP_SUCCESS || ctrls == NULL) return -1;
+
+  int value = -1;
+  LDAPControl *ctrl = ldap_control_find(oid, ctrls, NULL);
+  if (ctrl != NULL) {
+    BerElement *ber = ber_init(&ctrl->ldctl_value);
+    ber_int_t scanned;
+    if (ber != NULL && ber_scanf(ber, "{e", &scanned) != LBER_ERROR) value = scanned;
+    if (ber != NULL) ber_free(ber, 1);
+  }
+  ldap_controls_free(ctrls);
+  return value;
+}
+
+// The kind of change an entry notifies, or 0 to ignore it.
+static int EntryChange(sub_conn *conn, sub_search *search, LDAPMessage *entry)
+{
+  if (conn->control == SUBSCRIBE_NOTIFICATION) return SUBSCRIBE_MODIFY;
+
+  if (conn->control == SUBSCRIBE_SYNC) {
+    if (search->refreshing) return 0;
+    switch (ControlEnum(conn->ldap, entry, OID_SYNC_STATE))
+    {
+      case SYNC_ADD: return SUBSCRIBE_ADD;
+      case SYNC_MODIFY: return SUBSCRIBE_MODIFY;
+      case SYNC_DELETE: return SUBSCRIBE_DELETE;
+      default: return 0;
+    }
+  }
+
+  // Without the entry change notification, the server did not say.
+  int change = ControlEnum(conn->ldap, entry, OID_ENTRY_CHANGE);
+  return change > 0 ? (change & PSEARCH_CHANGES) : SUBSCRIBE_MODIFY;
+}
+
+// Whether a Sync Info message ends the refresh phase: a refreshDelete or
+// refreshPresent whose refreshDone is true, its default.
+static bool RefreshDone(LDAP *ldap, LDAPMessage *msg)
+{
+  char *oid = NULL;
+  struct berval *data = NULL;
+  if (ldap_parse_intermediate(ldap, msg, &oid, &data, NULL, 0) != LDAP_SUCCESS) return false;
+
+  bool done = false;
+  BerElement *ber = data != NULL ? ber_init(data) : NULL;
+  if (ber != NULL) {
+    ber_len_t len;
+    ber_tag_t tag = ber_peek_tag(ber, &len);
+    if ((tag == SYNC_INFO_REFRESH_DELETE || tag == SYNC_INFO_REFRESH_PRESENT)
+        && ber_scanf(ber, "{") != LBER_ERROR) {
+      done = true;
+      tag = ber_peek_tag(ber, &len);
+      if (tag == LBER_OCTETSTRING) {
+        ber_scanf(ber, "x");
+        tag = ber_peek_tag(ber, &len);
+      }
+      ber_int_t flag;
+      if (tag == LBER_BOOLEAN && ber_scanf(ber, "b", &flag) != LBER_ERROR) done = flag != 0;
+    }
+    ber_free(ber, 1);
+  }
+  ldap_memfree(oid);
+  ber_bvfree(data);
+  return done;
+}
+
+static sub_search *FindSearch(sub_conn *conn, int msgid)
+{
+  for (size_t idx = 0; idx < conn->searches.size(); idx++)
+  {
+    if (conn->searches[idx].msgid == msgid) return &conn->searches[idx];
+  }
+  return NULL;
+}
+
+static void RemoveSearch(sub_conn *conn, int id)
+{
+  for (size_t idx = 0; idx < conn->searches.size(); idx++)
+  {
+    if (conn->searches[idx].id == id) {
+      conn->searches.erase(conn->searches.begin() + idx);
+      return;
+    }
+  }
+}
+
+static void HandleMessage(sub_conn *conn, LDAPMessage *msg)
+{
+  sub_search *search = FindSearch(conn, ldap_msgid(msg));
+  if (search == NULL) return;
+
+  switch (ldap_msgtype(msg))
+  {
+    case LDAP_RES_SEARCH_ENTRY: {
+      int change = EntryChange(conn, search, msg);
+      char *dn = ldap_get_dn(conn->ldap, msg);
+      if (change != 0 && dn != NULL) {
+        __atomic_fetch_add(&notifications, 1, __ATOMIC_RELAXED);
+        Post(search->id, LDAP_SUCCESS, dn, change);
+      }
+      ldap_memfree(dn);
+      break;
+    }
+
+    case LDAP_RES_INTERMEDIATE:
+      if (search->refreshing && RefreshDone(conn->ldap, msg)) search->refreshing = false;
+      break;
+
+    case LDAP_RES_SEARCH_RESULT: {
+      int rc = LDAP_OTHER;
+      ldap_parse_result(conn->ldap, msg, &rc, NULL, NULL, NULL, NULL, 0);
+      if (rc == LDAP_SUCCESS) {
+        // Ended without error, as some servers do at a size or time
+        // limit: search again, and say that changes may have been missed.
+        search->msgid = -1;
+        Post(search->id, LDAP_SUCCESS, "", SUBSCRIBE_RESYNC);
+      } else {
+        Post(search->id, rc, "", 0);
+        RemoveSearch(conn, search->id);
+      }
+      break;
+    }
+  }
+}
+
+// Takes queued starts and stops; waits for some while there is nothing to
+// do, or up to wait_ms when reconnecting.
+static void TakeQueued(sub_conn *conn, int wait_ms)
+{
+  uv_mutex_lock(&conn->lock);
+  if (conn->searches.empty()) {
+    while (conn->starts.empty() && conn->stops.empty())
+    {
+      uv_cond_wait(&conn->cond, &conn->lock);
+    }
+  } else if (wait_ms > 0 && conn->stops.empty()) {
+    uv_cond_timedwait(&conn->cond, &conn->lock, wait_ms * NS_PER_MS);
+  }
+  std::vector<sub_search> starts;
+  std::vector<int> stops;
+  starts.swap(conn->starts);
+  stops.swap(conn->stops);
+  uv_mutex_unlock(&conn->lock);
+
+  conn->searches.insert(conn->searches.end(), starts.begin(), starts.end());
+  for (size_t idx = 0; idx < stops.size(); idx++)
+  {
+    for (size_t search = 0; search < conn->searches.size(); search++)
+    {
+      if (conn->searches[search].id != stops[idx]) continue;
+      if (conn->ldap != NULL && conn->searches[search].msgid != -1) {
+        ldap_abandon_ext(conn->ldap, conn->searches[search].msgid, NULL, NULL);
+      }
+      conn->searches.erase(conn->searches.begin() + search);
+      break;
+    }
+  }
+}
+
+static void ConnectionThread(void *arg)
+{
+  sub_conn *conn = (sub_conn*)arg;
+  int backoff_ms = 0;
+  bool lost = false;            // a connection went since searches were issued
+
+  for (;;)
+  {
+    if (conn->searches.empty()) {
+      // Idle: hold no connection until subscribed to again.
+      if (conn->ldap != NULL) Disconnect(conn);
+      backoff_ms = 0;
+      lost = false;
+    }
+
+    TakeQueued(conn, backoff_ms);
+    if (conn->searches.empty()) continue;
+
+    if (conn->ldap == NULL) {
+      int rc;
+      conn->ldap = ServersConnect(conn->host.c_str(), conn->port, conn->binddn.c_str(),
+                                  conn->password.c_str(), &rc);
+      if (conn->ldap == NULL) {
+        if (!ServersUnreachable(rc)) {
+          // Refused, say for bad credentials: retrying will not help.
+          for (size_t idx = 0; idx < conn->searches.size(); idx++)
+          {
+            Post(conn->searches[idx].id, rc, "", 0);
+          }
+          conn->searches.clear();
+          continue;
+        }
+        backoff_ms = backoff_ms == 0 ? RECONNECT_MIN_MS : std::min(backoff_ms * 2, RECONNECT_MAX_MS);
+        continue;
+      }
+      __atomic_fetch_add(&connected, 1, __ATOMIC_RELAXED);
+      backoff_ms = 0;
+    }
+
+    for (size_t idx = 0; idx < conn->searches.size(); )
+    {
+      sub_search *search = &conn->searches[idx];
+      if (search->msgid != -1) {
+        idx++;
+        continue;
+      }
+      int rc = Issue(conn, search);
+      if (rc == LDAP_SUCCESS) {
+        if (lost) Post(search->id, LDAP_SUCCESS, "", SUBSCRIBE_RESYNC);
+        idx++;
+      } else if (ServersUnreachable(rc)) {
+        Disconnect(conn);
+        __atomic_fetch_add(&reconnects, 1, __ATOMIC_RELAXED);
+        lost = true;
+        break;
+      } else {
+        Post(search->id, rc, "", 0);
+        conn->searches.erase(conn->searches.begin() + idx);
+      }
+    }
+    if (conn->ldap == NULL) continue;
+    lost = false;
+
+    struct timeval timeout = { 0, READ_TIMEOUT_MS * 1000 };
+    for (;;)
+    {
+      LDAPMessage *msg = NULL;
+      int type = ldap_result(conn->ldap, LDAP_RES_ANY, LDAP_MSG_ONE, &timeout, &msg);
+      if (type == 0) break;
+      if (type == -1) {
+        if (msg != NULL) ldap_msgfree(msg);
+        Disconnect(conn);
+        __atomic_fetch_add(&reconnects, 1, __ATOMIC_RELAXED);
+        lost = true;
+        break;
+      }
+      HandleMessage(conn, msg);
+      ldap_msgfree(msg);
+      // Drain whatever else has arrived without waiting.
+      timeout.tv_usec = 0;
+    }
+  }
+}
+
+static void Deliver(subscription *sub)
+{
+  std::vector<subscribe_event> events;
+  events.reserve(sub->pending.size());
+  for (std::map<std::string, int>::iterator it = sub->pending.begin(); it != sub->pending.end(); ++it)
+  {
+    subscribe_event event;
+    event.dn = it->first;
+    event.change = it->second;
+    events.push_back(event);
+  }
+  sub->pending.clear();
+  sub->due = 0;
+
+  deliveries++;
+  sub->cb(sub->id, LDAP_SUCCESS, events, sub->arg);
+}
+
+static void AfterTimer(uv_timer_t *handle, int status);
+
+static void ArmTimer()
+{
+  uint64_t due = 0;
+  for (std::map<int, subscription*>::iterator it = subscriptions.begin(); it != subscriptions.end(); ++it)
+  {
+    if (it->second->due != 0 && (due == 0 || it->second->due < due)) due = it->second->due;
+  }
+
+  uv_timer_stop(&deliver_timer);
+  if (due == 0) return;
+  uint64_t now = uv_hrtime();
+  uv_timer_start(&deliver_timer, AfterTimer, due > now ? (due - now + NS_PER_MS - 1) / NS_PER_MS : 0, 0);
+}
+
+// Main loop: delivers the subscriptions whose window has closed.
+static void AfterTimer(uv_timer_t *handle, int status)
+{
+  uint64_t now = uv_hrtime();
+  std::vector<int> due;
+  for (std::map<int, subscription*>::iterator it = subscriptions.begin(); it != subscriptions.end(); ++it)
+  {
+    if (it->second->due != 0 && it->second->due <= now) due.push_back(it->first);
+  }
+
+  // A callback may unsubscribe any of them.
+  for (size_t idx = 0; idx < due.size(); idx++)
+  {
+    std::map<int, subscription*>::iterator it = subscriptions.find(due[idx]);
+    if (it != subscriptions.end()) Deliver(it->second);
+  }
+  ArmTimer();
+}
+
+static void Release(subscription *sub)
+{
+  subscriptions.erase(sub->id);
+  delete sub;
+}
+
+// Main loop: coalesces notifications into their subscriptions.
+static void AfterNotices(uv_async_t *handle, int status)
+{
+  std::vector<sub_notice> received;
+  uv_mutex_lock(&notices_lock);
+  received.swap(notices);
+  uv_mutex_unlock(&notices_lock);
+
+  uint64_t now = uv_hrtime();
+  for (size_t idx = 0; idx < received.size(); idx++)
+  {
+    std::map<int, subscription*>::iterator it = subscriptions.find(received[idx].id);
+    if (it == subscriptions.end()) continue;
+    subscription *sub = it->second;
+
+    if (received[idx].rc != LDAP_SUCCESS) {
+      subscribe_cb cb = sub->cb;
+      void *arg = sub->arg;
+      int id = sub->id;
+      Release(sub);
+      cb(id, received[idx].rc, std::vector<subscribe_event>(), arg);
+      continue;
+    }
+
+    sub->pending[received[idx].event.dn] |= received[idx].event.change;
+    if (sub->due == 0) sub->due = now + (uint64_t)sub->coalesce_ms * NS_PER_MS;
+  }
+  ArmTimer();
+}
+
+static void InitSubscribe()
+{
+  uv_mutex_init(&notices_lock);
+  uv_async_init(uv_default_loop(), &notices_async, AfterNotices);
+  uv_timer_init(uv_default_loop(), &deliver_timer);
+  // Subscriptions keep the loop alive from the JavaScript side, if at all.
+  uv_unref((uv_handle_t*)&notices_async);
+  uv_unref((uv_handle_t*)&deliver_timer);
+}
+
+static sub_conn *Connection(const subscribe_spec &spec)
+{
+  char suffix[32];
+  sprintf(suffix, "%d", spec.control);
+  std::string key = ServersKey(spec.host.c_str(), spec.port);
+  key += '\0';
+  key += spec.binddn;
+  key += '\0';
+  key += spec.password;
+  key += '\0';
+  key += suffix;
+
+  std::map<std::string, sub_conn*>::iterator it = connections.find(key);
+  if (it != connections.end()) return it->second;
+
+  sub_conn *conn = new sub_conn;
+  conn->host = spec.host;
+  conn->port = spec.port;
+  conn->binddn = spec.binddn;
+  conn->password = spec.password;
+  conn->control = spec.control;
+  conn->ldap = NULL;
+  uv_mutex_init(&conn->lock);
+  uv_cond_init(&conn->cond);
+  uv_thread_create(&conn->thread, ConnectionThread, conn);
+  connections[key] = conn;
+  return conn;
+}
+
+int SubscribeStart(const subscribe_spec &spec, subscribe_cb cb, void *arg)
+{
+  uv_once(&subscribe_once, InitSubscribe);
+
+  subscription *sub = new subscription;
+  sub->id = next_id++;
+  sub->conn = Connection(spec);
+  sub->cb = cb;
+  sub->arg = arg;
+  sub->coalesce_ms = spec.coalesce_ms > 0 ? spec.coalesce_ms : 0;
+  sub->due = 0;
+  subscriptions[sub->id] = sub;
+
+  sub_search search;
+  search.id = sub->id;
+  search.base = spec.base;
+  search.scope = spec.scope;
+  search.filter = spec.filter.empty() ? "(objectClass=*)" : spec.filter;
+  search.msgid = -1;
+  search.refreshing = false;
+
+  uv_mutex_lock(&sub->conn->lock);
+  sub->conn->starts.push_back(search);
+  uv_cond_signal(&sub->conn->cond);
+  uv_mutex_unlock(&sub->conn->lock);
+  return sub->id;
+}
+
+void SubscribeStop(int id)
+{
+  uv_once(&subscribe_once, InitSubscribe);
+
+  std::map<int, subscription*>::iterator it = subscriptions.find(id);
+  if (it == subscriptions.end()) return;
+  sub_conn *conn = it->second->conn;
+  Release(it->second);
+
+  uv_mutex_lock(&conn->lock);
+  conn->stops.push_back(id);
+  uv_cond_signal(&conn->cond);
+  uv_mutex_unlock(&conn->lock);
+  ArmTimer();
+}
+
+void SubscribeStats(subscribe_stats *stats)
+{
+  stats->connections = __atomic_load_n(&connected, __ATOMIC_RELAXED);
+  stats->subscriptions = subscriptions.size();
+  stats->notifications = __atomic_load_n(&notifications, __ATOMIC_RELAXED);
+  stats->deliveries = deliveries;
+  stats->reconnects = __atomic_load_n(&reconnects, __ATOMIC_RELAXED);
+}
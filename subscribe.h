@@ -0,0 +1,92 @@
+// Change subscriptions: persistent searches whose notifications are
+// delivered to the main loop, coalesced.
+
+/*
+Polling search() to notice changes costs a search per session per
+interval whether anything changed or not. A subscription instead leaves
+one search outstanding on the directory, which then sends an entry each
+time one matching it changes. Three controls do this, depending on the
+server:
+
+  SUBSCRIBE_PSEARCH       persistent search (draft-ietf-ldapext-psearch;
+                          389 DS, Oracle, eDirectory), changes only, with
+                          entry change notifications giving the kind
+  SUBSCRIBE_NOTIFICATION  Active Directory's change notification control;
+                          base or one-level scope only, and every change
+                          is reported as a modification
+  SUBSCRIBE_SYNC          content synchronization (RFC 4533, OpenLDAP's
+                          syncprov) in refreshAndPersist mode; the initial
+                          refresh is skipped, persist-phase changes kept
+
+Subscriptions sharing servers, bind identity and control share one
+dedicated connection, kept outside the search pools (pool.h) since its
+searches never complete. A thread per connection connects, issues and
+abandons searches, and reads notifications. When the connection drops,
+it reconnects with backoff, reissues every search and reports a
+SUBSCRIBE_RESYNC event: changes made meanwhile were missed.
+
+Notifications are coalesced on the main loop: the first change to a
+subscription opens a window of coalesce_ms, and when it closes the
+callback gets each changed DN once, the kinds of change or'ed together.
+*/
+
+#ifndef LDAPAUTH_SUBSCRIBE_H
+#define LDAPAUTH_SUBSCRIBE_H
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#define SUBSCRIBE_PSEARCH 0
+#define SUBSCRIBE_NOTIFICATION 1
+#define SUBSCRIBE_SYNC 2
+
+// Kinds of change; the psearch changeTypes bits.
+#define SUBSCRIBE_ADD 1
+#define SUBSCRIBE_DELETE 2
+#define SUBSCRIBE_MODIFY 4
+#define SUBSCRIBE_MODDN 8
+#define SUBSCRIBE_RESYNC 16     // dn empty: reconnected, changes may be lost
+
+struct subscribe_event
+{
+  std::string dn;
+  int change;
+};
+
+// Main loop. rc is an LDAP result code; if it is not LDAP_SUCCESS the
+// search was refused or ended and the subscription is gone.
+typedef void (*subscribe_cb)(int id, int rc, const std::vector<subscribe_event> &events, void *arg);
+
+struct subscribe_spec
+{
+  std::string host;             // may list several servers, see servers.h
+  int port;
+  std::string binddn;
+  std::string password;
+  int control;                  // SUBSCRIBE_*
+  std::string base;
+  int scope;                    // LDAP_SCOPE_*
+  std::string filter;
+  int coalesce_ms;
+};
+
+// Main thread. Returns the subscription's id.
+int SubscribeStart(const subscribe_spec &spec, subscribe_cb cb, void *arg);
+
+// Main thread. cb is not called for id again.
+void SubscribeStop(int id);
+
+struct subscribe_stats
+{
+  uint64_t connections;
+  uint64_t subscriptions;
+  uint64_t notifications;       // entries received
+  uint64_t deliveries;          // callbacks made
+  uint64_t reconnects;
+};
+
+void SubscribeStats(subscribe_stats *stats);
+
+#endif
@@ -0,0 +1,106 @@
+// Group closure flattening (groups.h): allGroups lists each group once,
+// depth first in the directory's memberOf order, whichever node the
+// parallel expansion happened to claim for a group reached twice.
+//
+//   g++ -I. test/groups.cc groups.cc strcase.cc -o groups-test && ./groups-test
+
+#include "groups.h"
+#include "strcase.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+static int failures = 0;
+
+// Claims node's DN the way ExpandGroups() does; false if already taken.
+static bool Claim(group_index *expanded, group_node *node, const char *name)
+{
+  if (!expanded->insert(std::make_pair(StrLower(node->dn), node)).second) return false;
+  node->name = strdup(name);
+  return true;
+}
+
+static group_node *Parent(group_node *node, const char *dn)
+{
+  node->parents.push_back(NewGroup(dn));
+  return node->parents.back();
+}
+
+static void Check(const char *test, std::vector<group_node*> *roots, const group_index &expanded,
+                  const char *expected)
+{
+  std::vector<char*> names;
+  FlattenGroups(*roots, expanded, &names);
+  std::string got;
+  for (size_t idx = 0; idx < names.size(); idx++)
+  {
+    if (idx > 0) got += ' ';
+    got += names[idx];
+    free(names[idx]);
+  }
+  FreeGroups(roots);
+
+  if (got != expected) {
+    printf("FAIL %s: got \"%s\", expected \"%s\"\n", test, got.c_str(), expected);
+    failures++;
+  } else {
+    printf("ok   %s: %s\n", test, got.c_str());
+  }
+}
+
+// The user is in A; A is in B and C, both in D (memberOf of A lists B
+// first). D is claimed under B or under C, as the sub-tasks race.
+static void Diamond(bool d_under_c)
+{
+  std::vector<group_node*> roots;
+  group_index expanded;
+  roots.push_back(NewGroup("CN=A,DC=example"));
+  Claim(&expanded, roots[0], "A");
+  group_node *b = Parent(roots[0], "CN=B,DC=example");
+  group_node *c = Parent(roots[0], "cn=C,dc=example");
+  Claim(&expanded, b, "B");
+  Claim(&expanded, c, "C");
+  group_node *d_b = Parent(b, "CN=D,DC=example");
+  group_node *d_c = Parent(c, "cn=d,dc=example");
+  group_node *d = d_under_c ? d_c : d_b;
+  Claim(&expanded, d, "D");
+  if (Claim(&expanded, d_under_c ? d_b : d_c, "D")) failures++;
+  Parent(d, "CN=E,DC=example");
+  Claim(&expanded, d->parents[0], "E");
+
+  Check(d_under_c ? "diamond, D claimed under C" : "diamond, D claimed under B", &roots, expanded,
+        "A B D E C");
+}
+
+// The user is in A and C; A is in B, B in A (a loop), and C in B.
+static void Cycle(bool b_under_c)
+{
+  std::vector<group_node*> roots;
+  group_index expanded;
+  roots.push_back(NewGroup("CN=A,DC=example"));
+  roots.push_back(NewGroup("CN=C,DC=example"));
+  Claim(&expanded, roots[0], "A");
+  Claim(&expanded, roots[1], "C");
+  group_node *b_a = Parent(roots[0], "CN=B,DC=example");
+  group_node *b_c = Parent(roots[1], "CN=B,DC=example");
+  group_node *b = b_under_c ? b_c : b_a;
+  Claim(&expanded, b, "B");
+  group_node *a = Parent(b, "CN=A,DC=example");
+  if (Claim(&expanded, a, "A")) failures++;
+
+  Check(b_under_c ? "cycle, B claimed under C" : "cycle, B claimed under A", &roots, expanded,
+        "A B C");
+}
+
+int main()
+{
+  Diamond(false);
+  Diamond(true);
+  Cycle(false);
+  Cycle(true);
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,411 @@
+// Cold cache tier in memory-mapped files. See tier.h.
+
+#include "tier.h"
+#include "hash.h"
+
+#include <uv.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TIER_MAGIC 0x4c445431   // "LDT1"
+
+#define SLOT_EMPTY 0
+#define SLOT_LIVE 1
+#define SLOT_DELETED 2
+
+// Slots sampled for the entry to drop when the table is full.
+#define EVICTION_SAMPLES 8
+
+struct tier_header
+{
+  uint32_t magic;
+  uint32_t unused;
+  uint64_t slots;           // power of two
+  uint64_t max_bytes;
+  uint64_t log_end;         // next record goes here
+  uint64_t live;
+  uint64_t deleted;
+  uint64_t live_bytes;      // of records live slots point at
+  uint64_t padding;
+};
+
+struct tier_slot
+{
+  uint64_t hash;
+  uint32_t state;
+  uint32_t length;          // of the whole record
+  uint64_t offset;
+  int64_t expires;
+};
+
+struct tier_record
+{
+  uint32_t key_length;
+  uint32_t value_length;
+  int64_t expires;
+  // key, value, then padding to 8 bytes
+};
+
+struct tier
+{
+  uv_mutex_t lock;
+  std::string path;
+  size_t capacity;          // entries
+  int index_fd;
+  tier_header *header;      // mapped index file
+  tier_slot *slots;
+  size_t index_size;
+  char *log;                // mapped log file, max_bytes long
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t demotions;
+  uint64_t compactions;
+};
+
+static int64_t WallClockMs()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static size_t RecordLength(size_t key_length, size_t value_length)
+{
+  return (sizeof(tier_record) + key_length + value_length + 7) & ~(size_t)7;
+}
+
+// Maps fd at length bytes, resizing it as needed. *fresh says whether it
+// was (re)sized and so holds only zeroes.
+static void *MapFd(int fd, size_t length, bool reset, bool *fresh)
+{
+  struct stat st;
+  if (fstat(fd, &st) != 0) return NULL;
+  *fresh = reset || st.st_size != (off_t)length;
+  // Sparse: only pages written take disk space.
+  if (*fresh && (ftruncate(fd, 0) != 0 || ftruncate(fd, length) != 0)) return NULL;
+
+  void *mapped = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  return mapped != MAP_FAILED ? mapped : NULL;
+}
+
+static void *MapFile(const std::string &path, size_t length, bool reset, bool *fresh)
+{
+  int fd = open(path.c_str(), O_RDWR | O_CREAT, 0600);
+  if (fd < 0) return NULL;
+  void *mapped = MapFd(fd, length, reset, fresh);
+  close(fd);
+  return mapped;
+}
+
+static size_t SlotCount(size_t entries)
+{
+  // At most half full, so probes stay short.
+  size_t slots = 16;
+  while (slots < entries * 2) slots <<= 1;
+  return slots;
+}
+
+static uint64_t KeyHash(const std::string &key)
+{
+  uint64_t hash = HashBytes(key.data(), key.size());
+  return hash != 0 ? hash : 1;
+}
+
+static tier_record *Record(tier *t, tier_slot *slot)
+{
+  if (slot->offset + slot->length > t->header->max_bytes || slot->length < sizeof(tier_record)) return NULL;
+  tier_record *record = (tier_record*)(t->log + slot->offset);
+  if (RecordLength(record->key_length, record->value_length) != slot->length) return NULL;
+  return record;
+}
+
+static bool RecordHasKey(tier_record *record, const std::string &key)
+{
+  return record->key_length == key.size() && memcmp(record + 1, key.data(), key.size()) == 0;
+}
+
+// The live slot holding key, or NULL.
+static tier_slot *Find(tier *t, const std::string &key, uint64_t hash)
+{
+  size_t mask = t->header->slots - 1;
+  for (size_t probe = 0; probe < t->header->slots; probe++)
+  {
+    tier_slot *slot = &t->slots[(hash + probe) & mask];
+    if (slot->state == SLOT_EMPTY) return NULL;
+    if (slot->state != SLOT_LIVE || slot->hash != hash) continue;
+    tier_record *record = Record(t, slot);
+    if (record != NULL && RecordHasKey(record, key)) return slot;
+  }
+  return NULL;
+}
+
+static void Remove(tier *t, tier_slot *slot)
+{
+  slot->state = SLOT_DELETED;
+  t->header->live_bytes -= slot->length;
+  t->header->live--;
+  t->header->deleted++;
+}
+
+// Slots again holding only live entries, tombstones gone. Rehashes in
+// place through a copy of the live slots.
+static void Rehash(tier *t)
+{
+  size_t count = t->header->slots;
+  tier_slot *live = (tier_slot*)malloc(sizeof(tier_slot) * (t->header->live + 1));
+  size_t kept = 0;
+  for (size_t idx = 0; idx < count; idx++)
+  {
+    if (t->slots[idx].state == SLOT_LIVE) live[kept++] = t->slots[idx];
+  }
+
+  memset(t->slots, 0, sizeof(tier_slot) * count);
+  for (size_t idx = 0; idx < kept; idx++)
+  {
+    size_t pos = live[idx].hash & (count - 1);
+    while (t->slots[pos].state != SLOT_EMPTY) pos = (pos + 1) & (count - 1);
+    t->slots[pos] = live[idx];
+  }
+  free(live);
+  t->header->live = kept;
+  t->header->deleted = 0;
+}
+
+// Copies live, unexpired records into a fresh log which then replaces
+// the old one. If the process dies halfway, slots may point into the
+// wrong log; gets then miss (see tier.h).
+static bool Compact(tier *t)
+{
+  std::string next_path = t->path + ".log.new";
+  bool fresh;
+  char *next = (char*)MapFile(next_path, t->header->max_bytes, true, &fresh);
+  if (next == NULL) return false;
+
+  int64_t now = WallClockMs();
+  uint64_t end = 0;
+  for (size_t idx = 0; idx < t->header->slots; idx++)
+  {
+    tier_slot *slot = &t->slots[idx];
+    if (slot->state != SLOT_LIVE) continue;
+    if (slot->expires <= now || Record(t, slot) == NULL) {
+      Remove(t, slot);
+      continue;
+    }
+    memcpy(next + end, t->log + slot->offset, slot->length);
+    slot->offset = end;
+    end += slot->length;
+  }
+
+  msync(next, end, MS_SYNC);
+  rename(next_path.c_str(), (t->path + ".log").c_str());
+  munmap(t->log, t->header->max_bytes);
+  t->log = next;
+  t->header->log_end = end;
+  Rehash(t);
+  t->compactions++;
+  return true;
+}
+
+// Makes room for one more entry by dropping the sampled entry expiring
+// soonest.
+static void EvictOne(tier *t)
+{
+  tier_slot *victim = NULL;
+  size_t mask = t->header->slots - 1;
+  size_t start = rand() & mask;
+  for (size_t probe = 0, sampled = 0; probe < t->header->slots && sampled < EVICTION_SAMPLES; probe++)
+  {
+    tier_slot *slot = &t->slots[(start + probe) & mask];
+    if (slot->state != SLOT_LIVE) continue;
+    sampled++;
+    if (victim == NULL || slot->expires < victim->expires) victim = slot;
+  }
+  if (victim != NULL) Remove(t, victim);
+}
+
+tier *TierOpen(const char *path, size_t entries, size_t max_bytes)
+{
+  if (entries == 0 || max_bytes < 4096) return NULL;
+
+  tier *t = new tier;
+  t->path = path;
+  t->capacity = entries;
+  t->hits = t->misses = t->demotions = t->compactions = 0;
+
+  size_t slots = SlotCount(entries);
+  t->index_size = sizeof(tier_header) + slots * sizeof(tier_slot);
+
+  // Locked before anything is touched: another process may be using it.
+  t->index_fd = open((t->path + ".idx").c_str(), O_RDWR | O_CREAT, 0600);
+  if (t->index_fd < 0) {
+    delete t;
+    return NULL;
+  }
+  bool fresh;
+  if (flock(t->index_fd, LOCK_EX | LOCK_NB) != 0
+      || (t->header = (tier_header*)MapFd(t->index_fd, t->index_size, false, &fresh)) == NULL) {
+    close(t->index_fd);
+    delete t;
+    return NULL;
+  }
+
+  // Another layout or size: start over, log included.
+  bool reset = fresh || t->header->magic != TIER_MAGIC || t->header->slots != slots
+    || t->header->max_bytes != max_bytes || t->header->log_end > max_bytes;
+  bool log_fresh;
+  t->log = (char*)MapFile(t->path + ".log", max_bytes, reset, &log_fresh);
+  if (t->log == NULL) {
+    munmap(t->header, t->index_size);
+    close(t->index_fd);
+    delete t;
+    return NULL;
+  }
+
+  if (reset || log_fresh) {
+    memset(t->header, 0, t->index_size);
+    t->header->magic = TIER_MAGIC;
+    t->header->slots = slots;
+    t->header->max_bytes = max_bytes;
+  }
+
+  t->slots = (tier_slot*)(t->header + 1);
+  uv_mutex_init(&t->lock);
+  return t;
+}
+
+void TierClose(tier *t)
+{
+  uv_mutex_lock(&t->lock);
+  msync(t->header, t->index_size, MS_ASYNC);
+  munmap(t->log, t->header->max_bytes);
+  munmap(t->header, t->index_size);
+  close(t->index_fd);   // and with it the lock
+  uv_mutex_unlock(&t->lock);
+  uv_mutex_destroy(&t->lock);
+  delete t;
+}
+
+bool TierGet(tier *t, const std::string &key, std::string *value, int64_t *expires)
+{
+  bool hit = false;
+  uint64_t hash = KeyHash(key);
+
+  uv_mutex_lock(&t->lock);
+  tier_slot *slot = Find(t, key, hash);
+  if (slot != NULL) {
+    if (slot->expires > WallClockMs()) {
+      tier_record *record = Record(t, slot);
+      value->assign((const char*)(record + 1) + record->key_length, record->value_length);
+      *expires = slot->expires;
+      hit = true;
+    } else {
+      Remove(t, slot);
+    }
+  }
+  if (hit) t->hits++; else t->misses++;
+  uv_mutex_unlock(&t->lock);
+
+  return hit;
+}
+
+void TierPut(tier *t, const std::string &key, const std::string &value, int64_t expires)
+{
+  uint64_t hash = KeyHash(key);
+  size_t length = RecordLength(key.size(), value.size());
+
+  uv_mutex_lock(&t->lock);
+  if (length > t->header->max_bytes / 2) {
+    // Would not leave room for anything else.
+    uv_mutex_unlock(&t->lock);
+    return;
+  }
+
+  tier_slot *old = Find(t, key, hash);
+  if (old != NULL) Remove(t, old);
+
+  if (t->header->log_end + length > t->header->max_bytes) {
+    // Compacting a log that is mostly live would only buy a few puts
+    // before the next compaction; first make it at most half live.
+    while (t->header->live > 0 && t->header->live_bytes + length > t->header->max_bytes / 2) EvictOne(t);
+    if (!Compact(t) || t->header->log_end + length > t->header->max_bytes) {
+      uv_mutex_unlock(&t->lock);
+      return;
+    }
+  }
+  if (t->header->live >= t->capacity) EvictOne(t);
+  // live stays under slots / 2; rehashing only once tombstones take
+  // another quarter keeps probes short without rehashing on every put.
+  if (t->header->deleted >= t->header->slots / 4) Rehash(t);
+
+  tier_record *record = (tier_record*)(t->log + t->header->log_end);
+  record->key_length = key.size();
+  record->value_length = value.size();
+  record->expires = expires;
+  memcpy(record + 1, key.data(), key.size());
+  memcpy((char*)(record + 1) + key.size(), value.data(), value.size());
+
+  size_t mask = t->header->slots - 1;
+  size_t pos = hash & mask;
+  while (t->slots[pos].state == SLOT_LIVE) pos = (pos + 1) & mask;
+  tier_slot *slot = &t->slots[pos];
+  if (slot->state == SLOT_DELETED) t->header->deleted--;
+  slot->hash = hash;
+  slot->offset = t->header->log_end;
+  slot->length = length;
+  slot->expires = expires;
+  // Last, so that a crash before here leaves the slot as it was.
+  __atomic_store_n(&slot->state, SLOT_LIVE, __ATOMIC_RELEASE);
+
+  t->header->log_end += length;
+  t->header->live_bytes += length;
+  t->header->live++;
+  t->demotions++;
+  uv_mutex_unlock(&t->lock);
+}
+
+size_t TierRemove(tier *t, bool (*match)(const std::string &key, void *arg), void *arg)
+{
+  size_t removed = 0;
+
+  uv_mutex_lock(&t->lock);
+  for (size_t idx = 0; idx < t->header->slots; idx++)
+  {
+    tier_slot *slot = &t->slots[idx];
+    if (slot->state != SLOT_LIVE) continue;
+    if (match != NULL) {
+      tier_record *record = Record(t, slot);
+      if (record != NULL && !match(std::string((const char*)(record + 1), record->key_length), arg)) continue;
+    }
+    Remove(t, slot);
+    removed++;
+  }
+  if (t->header->live == 0) {
+    // Everything gone: start the log over, too.
+    memset(t->slots, 0, sizeof(tier_slot) * t->header->slots);
+    t->header->deleted = 0;
+    t->header->live_bytes = 0;
+    t->header->log_end = 0;
+  }
+  uv_mutex_unlock(&t->lock);
+
+  return removed;
+}
+
+void TierStats(tier *t, tier_stats *stats)
+{
+  uv_mutex_lock(&t->lock);
+  stats->entries = t->header->live;
+  stats->log_bytes = t->header->log_end;
+  stats->max_bytes = t->header->max_bytes;
+  stats->hits = t->hits;
+  stats->misses = t->misses;
+  stats->demotions = t->demotions;
+  stats->compactions = t->compactions;
+  uv_mutex_unlock(&t->lock);
+}
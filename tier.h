@@ -0,0 +1,70 @@
+// Cold cache tier: a memory-mapped hash file on local disk.
+
+/*
+Entries evicted from an in-memory cache (cache.h) for lack of room are
+demoted here, so that a cold user costs a page fault rather than a round
+trip to the directory. The tier is two files, kept across restarts:
+
+  <path>.idx   header, then a fixed table of slots (open addressing,
+               linear probing): key hash, state, value offset and length,
+               and expiry as unix ms so that it means the same after a
+               restart
+  <path>.log   append-only records: key length, value length, expiry,
+               key, value
+
+Both are mapped. A put appends a record and points the key's slot at it;
+the record before it becomes garbage. When the log is full it is
+compacted: live, unexpired records are copied to a new log, which then
+replaces the old one. When the table holds its capacity, the entry
+expiring soonest of a few sampled ones makes room.
+
+Records carry their key, and a get checks it, so a hash collision or a
+slot left pointing at the wrong record by a crash is only ever a miss.
+One process uses a tier at a time (the index is flock()ed).
+
+Keys are stored as given. The search cache's carry the password only as
+a keyed hash (hash.h), under a key ldapauth.cc keeps in <path>.key, mode
+0600, so that they are hit again after a restart. Whoever can read that
+file can test guesses against the hashes in the tier: it is as private
+as the cached results themselves.
+*/
+
+#ifndef LDAPAUTH_TIER_H
+#define LDAPAUTH_TIER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <string>
+
+struct tier;
+
+// Opens the tier at path, or creates it holding up to entries entries in
+// a log of max_bytes. Existing files of another size are started over.
+// Returns NULL if they cannot be opened, mapped or locked.
+tier *TierOpen(const char *path, size_t entries, size_t max_bytes);
+
+void TierClose(tier *t);
+
+// All thread-safe. expires is unix ms.
+bool TierGet(tier *t, const std::string &key, std::string *value, int64_t *expires);
+void TierPut(tier *t, const std::string &key, const std::string &value, int64_t expires);
+
+// Removes the entries whose key match() accepts, all if match is NULL.
+// Returns how many.
+size_t TierRemove(tier *t, bool (*match)(const std::string &key, void *arg), void *arg);
+
+struct tier_stats
+{
+  uint64_t entries;
+  uint64_t log_bytes;       // appended since the last compaction
+  uint64_t max_bytes;
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t demotions;       // puts
+  uint64_t compactions;
+};
+
+void TierStats(tier *t, tier_stats *stats);
+
+#endif